@@ -1540,13 +1540,18 @@ void bx_dbg_tlb_lookup(bx_lin_address laddr)
 {
   char cpu_param_name[16];
 
+  // show all ways of the TLB set the address maps to
   Bit32u index = BX_CPU(dbg_cpu)->ITLB.get_index_of(laddr);
-  sprintf(cpu_param_name, "ITLB.entry%d", index);
-  bx_dbg_show_param_command(cpu_param_name, 0);
+  for (unsigned n=0; n < BX_TLB_WAYS; n++) {
+    sprintf(cpu_param_name, "ITLB.entry%d", index + n);
+    bx_dbg_show_param_command(cpu_param_name, 0);
+  }
 
   index = BX_CPU(dbg_cpu)->DTLB.get_index_of(laddr);
-  sprintf(cpu_param_name, "DTLB.entry%d", index);
-  bx_dbg_show_param_command(cpu_param_name, 0);
+  for (unsigned n=0; n < BX_TLB_WAYS; n++) {
+    sprintf(cpu_param_name, "DTLB.entry%d", index + n);
+    bx_dbg_show_param_command(cpu_param_name, 0);
+  }
 }
 
 unsigned dbg_show_mask = 0;
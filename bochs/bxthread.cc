@@ -19,7 +19,13 @@
 //  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 /////////////////////////////////////////////////////////////////////////
 
+#ifdef BXIMAGE
+#include "config.h"
+#include "misc/bxcompat.h"
+#include "osdep.h"
+#else
 #include "bochs.h"
+#endif
 #include "bxthread.h"
 
 // Bochs multi-threading support
@@ -108,3 +114,15 @@ void BOCHSAPI_MSVCONLY bx_set_sem(bx_thread_sem_t *thread_sem)
   sem_post(&thread_sem->sem);
 #endif
 }
+
+#if !defined(WIN32)
+void BOCHSAPI_MSVCONLY bx_init_recursive_mutex(pthread_mutex_t *mutex)
+{
+  pthread_mutexattr_t attr;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+#endif
@@ -36,6 +36,7 @@
 #define BX_UNLOCK(mutex) LeaveCriticalSection(&(mutex))
 #define BX_MUTEX(mutex) CRITICAL_SECTION mutex
 #define BX_INIT_MUTEX(mutex) InitializeCriticalSection(&(mutex))
+#define BX_INIT_RECURSIVE_MUTEX(mutex) InitializeCriticalSection(&(mutex))
 #define BX_FINI_MUTEX(mutex) DeleteCriticalSection(&(mutex))
 #define BX_MSLEEP(val) Sleep(val)
 
@@ -55,11 +56,73 @@
 #define BX_UNLOCK(mutex) pthread_mutex_unlock(&(mutex));
 #define BX_MUTEX(mutex) pthread_mutex_t mutex
 #define BX_INIT_MUTEX(mutex) pthread_mutex_init(&(mutex),NULL)
+#define BX_INIT_RECURSIVE_MUTEX(mutex) bx_init_recursive_mutex(&(mutex))
 #define BX_FINI_MUTEX(mutex) pthread_mutex_destroy(&(mutex))
 #define BX_MSLEEP(val) usleep(val*1000)
 
 #endif
 
+// Atomic operations on values shared between host threads. The 64-bit
+// and 128-bit compare and exchange are used on guest memory.
+
+#if defined(_MSC_VER)
+
+BX_CPP_INLINE Bit32u bx_atomic_load32(volatile Bit32u *ptr)
+{
+  Bit32u val = *ptr;
+  MemoryBarrier();
+  return val;
+}
+BX_CPP_INLINE void bx_atomic_store32(volatile Bit32u *ptr, Bit32u val)
+{
+  MemoryBarrier();
+  *ptr = val;
+}
+#define bx_atomic_or32(ptr, val) InterlockedOr((volatile LONG*)(ptr), (LONG)(val))
+#define bx_atomic_and32(ptr, val) InterlockedAnd((volatile LONG*)(ptr), (LONG)(val))
+#define bx_atomic_xchg32(ptr, val) ((Bit32u) InterlockedExchange((volatile LONG*)(ptr), (LONG)(val)))
+#define bx_atomic_cas32(ptr, expected, val) \
+    ((Bit32u) InterlockedCompareExchange((volatile LONG*)(ptr), (LONG)(val), (LONG)(expected)) == (Bit32u)(expected))
+// returns the previous value
+#define bx_atomic_cas64_val(ptr, expected, val) \
+    ((Bit64u) InterlockedCompareExchange64((volatile LONG64*)(ptr), (LONG64)(val), (LONG64)(expected)))
+#if defined(_M_X64)
+#define BX_HAVE_ATOMIC_CAS128 1
+BX_CPP_INLINE bool bx_atomic_cas128(volatile Bit64u *ptr, Bit64u exp_lo, Bit64u exp_hi, Bit64u lo, Bit64u hi)
+{
+  __int64 comparand[2] = { (__int64) exp_lo, (__int64) exp_hi };
+  return _InterlockedCompareExchange128((volatile __int64*)(ptr), (__int64) hi, (__int64) lo, comparand) != 0;
+}
+#endif
+
+#else
+
+#define bx_atomic_load32(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define bx_atomic_store32(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define bx_atomic_or32(ptr, val) __atomic_fetch_or((ptr), (val), __ATOMIC_SEQ_CST)
+#define bx_atomic_and32(ptr, val) __atomic_fetch_and((ptr), (val), __ATOMIC_SEQ_CST)
+#define bx_atomic_xchg32(ptr, val) __atomic_exchange_n((ptr), (val), __ATOMIC_SEQ_CST)
+#define bx_atomic_cas32(ptr, expected, val) \
+    __sync_bool_compare_and_swap((ptr), (expected), (val))
+// returns the previous value
+#define bx_atomic_cas64_val(ptr, expected, val) \
+    __sync_val_compare_and_swap((volatile Bit64u*)(ptr), (Bit64u)(expected), (Bit64u)(val))
+#if defined(__x86_64__)
+// cmpxchg16b is available on all x86-64 hosts except the very first ones
+#define BX_HAVE_ATOMIC_CAS128 1
+BX_CPP_INLINE bool bx_atomic_cas128(volatile Bit64u *ptr, Bit64u exp_lo, Bit64u exp_hi, Bit64u lo, Bit64u hi)
+{
+  bool ok;
+  __asm__ __volatile__("lock; cmpxchg16b %1\n\tsetz %0"
+      : "=q"(ok), "+m"(*ptr), "+a"(exp_lo), "+d"(exp_hi)
+      : "b"(lo), "c"(hi)
+      : "cc", "memory");
+  return ok;
+}
+#endif
+
+#endif
+
 typedef struct
 {
 #if defined(WIN32)
@@ -87,5 +150,8 @@ bool BOCHSAPI_MSVCONLY bx_create_sem(bx_thread_sem_t *thread_sem);
 void BOCHSAPI_MSVCONLY bx_destroy_sem(bx_thread_sem_t *thread_sem);
 void BOCHSAPI_MSVCONLY bx_wait_sem(bx_thread_sem_t *thread_sem);
 void BOCHSAPI_MSVCONLY bx_set_sem(bx_thread_sem_t *thread_sem);
+#if !defined(WIN32)
+void BOCHSAPI_MSVCONLY bx_init_recursive_mutex(pthread_mutex_t *mutex);
+#endif
 
 #endif
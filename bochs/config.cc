@@ -582,6 +582,15 @@ void bx_init_options()
       "Maximum amount of instructions allowed to execute before returning control to another CPU.",
       BX_SMP_QUANTUM_MIN, BX_SMP_QUANTUM_MAX,
       16);
+  new bx_param_bool_c(cpu_param,
+      "host_threads", "Run each CPU on its own host thread",
+      "Run each emulated CPU on its own host thread in SMP simulation",
+      0);
+  new bx_param_num_c(cpu_param,
+      "thread_quantum", "Quantum ticks in threaded SMP simulation",
+      "Amount of instructions each CPU executes between synchronization points when running on host threads.",
+      BX_SMP_THREAD_QUANTUM_MIN, BX_SMP_THREAD_QUANTUM_MAX,
+      1000);
 #endif
   new bx_param_bool_c(cpu_param,
       "reset_on_triple_fault", "Enable CPU reset on triple fault",
@@ -603,6 +612,25 @@ void bx_init_options()
       "Don't put CPU to sleep state by MWAIT",
       0);
 #endif
+  new bx_param_num_c(cpu_param,
+      "icache_entries", "Trace cache entries",
+      "Number of trace cache entries (power of 2)",
+      4096, 1024*1024,
+      64*1024);
+  new bx_param_num_c(cpu_param,
+      "icache_ways", "Trace cache associativity",
+      "Trace cache associativity: 1 (direct mapped), 2 or 4 ways",
+      1, 4,
+      1);
+  new bx_param_num_c(cpu_param,
+      "icache_pool", "Trace cache instruction pool size (K)",
+      "Amount of decoded instructions kept by the trace cache, in units of 1024",
+      64, 8192,
+      576);
+  new bx_param_filename_c(cpu_param,
+      "icache_file", "Trace cache file",
+      "Path to the file keeping decoded traces between sessions",
+      "", BX_PATHNAME_LEN);
 #if BX_CONFIGURE_MSRS
   new bx_param_filename_c(cpu_param,
       "msrs",
@@ -867,6 +895,21 @@ void bx_init_options()
       4, 8192,
       128);
   mem_block_size->set_ask_format("Enter memory block size (KB): [%d] ");
+  static const char *mem_backing_names[] = { "heap", "mmap", "thp", "hugetlb", "file", NULL };
+  bx_param_enum_c *mem_backing = new bx_param_enum_c(ram,
+      "backing",
+      "Host memory backing",
+      "Host allocation method of guest RAM (heap, anonymous mapping, transparent or hugetlbfs huge pages, shared file mapping)",
+      mem_backing_names,
+      BX_MEM_BACKING_HEAP,
+      BX_MEM_BACKING_HEAP);
+  mem_backing->set_ask_format("Enter host memory backing: [%s] ");
+  path = new bx_param_filename_c(ram,
+      "file",
+      "RAM backing file",
+      "Pathname of the file guest RAM is mapped from with 'file' backing",
+      "", BX_PATHNAME_LEN);
+  path->set_ask_format("Enter RAM backing file: [%s] ");
   ram->set_options(ram->SERIES_ASK);
 
   path = new bx_param_filename_c(rom,
@@ -1553,6 +1596,21 @@ void bx_init_options()
         BX_ATA_TRANSLATION_NONE);
       translation->set_ask_format("Enter translation type: [%s]");
 
+      bx_param_bool_c *async = new bx_param_bool_c(menu,
+        "async",
+        "Asynchronous image I/O",
+        "Perform disk image I/O on a worker thread",
+        0);
+      async->set_ask_format("Use asynchronous image I/O? [%s] ");
+
+      bx_param_num_c *cache = new bx_param_num_c(menu,
+        "cache",
+        "Block cache size (MB)",
+        "Size of the in-memory block cache with write-back (0 = disabled)",
+        0, 1024,
+        0);
+      cache->set_ask_format("Enter block cache size in MB (0 = disabled): [%d] ");
+
       // the master/slave menu depends on the ATA channel's enabled flag
       enabled->get_dependent_list()->add(menu);
       // the type selector depends on the ATA channel's enabled flag
@@ -1560,7 +1618,7 @@ void bx_init_options()
 
       // all items depend on the drive type
       type->set_dependent_list(menu->clone(), 0);
-      type->set_dependent_bitmap(BX_ATA_DEVICE_DISK, 0xfe6);
+      type->set_dependent_bitmap(BX_ATA_DEVICE_DISK, 0x3fe6);
       type->set_dependent_bitmap(BX_ATA_DEVICE_CDROM, 0x60a);
 
       type->set_handler(bx_param_handler);
@@ -2893,6 +2951,12 @@ static int parse_line_formatted(const char *context, int num_params, char *param
         SIM->get_param_num(BXPN_MEM_SIZE)->set(atol(&params[i][6]));
       } else if (!strncmp(params[i], "block_size=", 11)) {
         SIM->get_param_num(BXPN_MEM_BLOCK_SIZE)->set(atol(&params[i][11]));
+      } else if (!strncmp(params[i], "backing=", 8)) {
+        if (!SIM->get_param_enum(BXPN_MEM_BACKING)->set_by_name(&params[i][8])) {
+          PARSE_ERR(("%s: memory directive: unknown backing '%s'.", context, &params[i][8]));
+        }
+      } else if (!strncmp(params[i], "file=", 5)) {
+        SIM->get_param_string(BXPN_MEM_FILE)->set(&params[i][5]);
       } else {
         PARSE_ERR(("%s: memory directive malformed.", context));
       }
@@ -3536,10 +3600,16 @@ int bx_write_configuration(const char *rc, int overwrite)
     fprintf(fp, ", options=\"%s\"\n", sparam->getptr());
   else
     fprintf(fp, "\n");
-  fprintf(fp, "memory: host=%d, guest=%d, block_size=%d\n",
+  fprintf(fp, "memory: host=%d, guest=%d, block_size=%d, backing=%s",
     SIM->get_param_num(BXPN_HOST_MEM_SIZE)->get(),
     SIM->get_param_num(BXPN_MEM_SIZE)->get(),
-    SIM->get_param_num(BXPN_MEM_BLOCK_SIZE)->get());
+    SIM->get_param_num(BXPN_MEM_BLOCK_SIZE)->get(),
+    SIM->get_param_enum(BXPN_MEM_BACKING)->get_selected());
+  sparam = SIM->get_param_string(BXPN_MEM_FILE);
+  if (!sparam->isempty())
+    fprintf(fp, ", file=\"%s\"\n", sparam->getptr());
+  else
+    fprintf(fp, "\n");
 
   bx_write_param_list(fp, (bx_list_c*) SIM->get_param(BXPN_ROMIMAGE), "romimage", 0);
   bx_write_param_list(fp, (bx_list_c*) SIM->get_param(BXPN_VGA_ROMIMAGE), "vgaromimage", 0);
@@ -3601,10 +3671,12 @@ int bx_write_configuration(const char *rc, int overwrite)
   }
   fprintf(fp, "\n");
 #if BX_SUPPORT_SMP
-  fprintf(fp, "cpu: count=%u:%u:%u, ips=%u, quantum=%d, ",
+  fprintf(fp, "cpu: count=%u:%u:%u, ips=%u, quantum=%d, host_threads=%d, thread_quantum=%d, ",
     SIM->get_param_num(BXPN_CPU_NPROCESSORS)->get(), SIM->get_param_num(BXPN_CPU_NCORES)->get(),
     SIM->get_param_num(BXPN_CPU_NTHREADS)->get(), SIM->get_param_num(BXPN_IPS)->get(),
-    SIM->get_param_num(BXPN_SMP_QUANTUM)->get());
+    SIM->get_param_num(BXPN_SMP_QUANTUM)->get(),
+    SIM->get_param_bool(BXPN_SMP_HOST_THREADS)->get(),
+    SIM->get_param_num(BXPN_SMP_THREAD_QUANTUM)->get());
 #else
   fprintf(fp, "cpu: count=1, ips=%u, ", SIM->get_param_num(BXPN_IPS)->get());
 #endif
@@ -3618,6 +3690,13 @@ int bx_write_configuration(const char *rc, int overwrite)
 #if BX_SUPPORT_MONITOR_MWAIT
   fprintf(fp, ", mwait_is_nop=%d", SIM->get_param_bool(BXPN_MWAIT_IS_NOP)->get());
 #endif
+  fprintf(fp, ", icache_entries=%u, icache_ways=%u, icache_pool=%u",
+    SIM->get_param_num(BXPN_ICACHE_ENTRIES)->get(),
+    SIM->get_param_num(BXPN_ICACHE_WAYS)->get(),
+    SIM->get_param_num(BXPN_ICACHE_POOL)->get());
+  sparam = SIM->get_param_string(BXPN_ICACHE_FILE);
+  if (!sparam->isempty())
+    fprintf(fp, ", icache_file=\"%s\"", sparam->getptr());
 #if BX_CONFIGURE_MSRS
   sparam = SIM->get_param_string(BXPN_CONFIGURABLE_MSRS_PATH);
   if (!sparam->isempty())
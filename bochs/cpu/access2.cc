@@ -26,6 +26,15 @@
 #include "cpu.h"
 #define LOG_THIS BX_CPU_THIS_PTR
 
+#if BX_SUPPORT_SMP
+#include "pc_system.h"
+#include "bxthread.h"
+// the value read is compared with the memory by write_RMW_linear_atomic()
+#define BX_RMW_SAVE_DATA(data) BX_CPU_THIS_PTR address_xlation.rmw_data[0] = (data)
+#else
+#define BX_RMW_SAVE_DATA(data)
+#endif
+
   void BX_CPP_AttrRegparmN(3)
 BX_CPU_C::write_linear_byte(unsigned s, bx_address laddr, Bit8u data)
 {
@@ -636,6 +645,7 @@ BX_CPU_C::read_RMW_linear_byte(unsigned s, bx_address laddr)
       BX_CPU_THIS_PTR address_xlation.memtype1 = tlbEntry->get_memtype();
 #endif
       BX_NOTIFY_LIN_MEMORY_ACCESS(laddr, pAddr, 1, tlbEntry->get_memtype(), BX_RW, (Bit8u*) &data);
+      BX_RMW_SAVE_DATA(data);
       return data;
     }
   }
@@ -643,6 +653,7 @@ BX_CPU_C::read_RMW_linear_byte(unsigned s, bx_address laddr)
   if (access_read_linear(laddr, 1, CPL, BX_RW, 0x0, (void *) &data) < 0)
     exception(int_number(s), 0);
 
+  BX_RMW_SAVE_DATA(data);
   return data;
 }
 
@@ -671,6 +682,7 @@ BX_CPU_C::read_RMW_linear_word(unsigned s, bx_address laddr)
       BX_CPU_THIS_PTR address_xlation.memtype1 = tlbEntry->get_memtype();
 #endif
       BX_NOTIFY_LIN_MEMORY_ACCESS(laddr, pAddr, 2, tlbEntry->get_memtype(), BX_RW, (Bit8u*) &data);
+      BX_RMW_SAVE_DATA(data);
       return data;
     }
   }
@@ -678,6 +690,7 @@ BX_CPU_C::read_RMW_linear_word(unsigned s, bx_address laddr)
   if (access_read_linear(laddr, 2, CPL, BX_RW, 0x1, (void *) &data) < 0)
     exception(int_number(s), 0);
 
+  BX_RMW_SAVE_DATA(data);
   return data;
 }
 
@@ -706,6 +719,7 @@ BX_CPU_C::read_RMW_linear_dword(unsigned s, bx_address laddr)
       BX_CPU_THIS_PTR address_xlation.memtype1 = tlbEntry->get_memtype();
 #endif
       BX_NOTIFY_LIN_MEMORY_ACCESS(laddr, pAddr, 4, tlbEntry->get_memtype(), BX_RW, (Bit8u*) &data);
+      BX_RMW_SAVE_DATA(data);
       return data;
     }
   }
@@ -713,6 +727,7 @@ BX_CPU_C::read_RMW_linear_dword(unsigned s, bx_address laddr)
   if (access_read_linear(laddr, 4, CPL, BX_RW, 0x3, (void *) &data) < 0)
     exception(int_number(s), 0);
 
+  BX_RMW_SAVE_DATA(data);
   return data;
 }
 
@@ -741,6 +756,7 @@ BX_CPU_C::read_RMW_linear_qword(unsigned s, bx_address laddr)
       BX_CPU_THIS_PTR address_xlation.memtype1 = tlbEntry->get_memtype();
 #endif
       BX_NOTIFY_LIN_MEMORY_ACCESS(laddr, pAddr, 8, tlbEntry->get_memtype(), BX_RW, (Bit8u*) &data);
+      BX_RMW_SAVE_DATA(data);
       return data;
     }
   }
@@ -748,12 +764,20 @@ BX_CPU_C::read_RMW_linear_qword(unsigned s, bx_address laddr)
   if (access_read_linear(laddr, 8, CPL, BX_RW, 0x7, (void *) &data) < 0)
     exception(int_number(s), 0);
 
+  BX_RMW_SAVE_DATA(data);
   return data;
 }
 
   void BX_CPP_AttrRegparmN(1)
 BX_CPU_C::write_RMW_linear_byte(Bit8u val8)
 {
+#if BX_SUPPORT_SMP
+  if (bx_pc_system.smp_parallel) {
+    write_RMW_linear_atomic(val8, 1);
+    return;
+  }
+#endif
+
   BX_DBG_PHY_MEMORY_ACCESS(BX_CPU_ID,
     BX_CPU_THIS_PTR address_xlation.paddress1, 1, MEMTYPE(BX_CPU_THIS_PTR address_xlation.memtype1), BX_WRITE, 0, (Bit8u*) &val8);
 
@@ -771,6 +795,13 @@ BX_CPU_C::write_RMW_linear_byte(Bit8u val8)
   void BX_CPP_AttrRegparmN(1)
 BX_CPU_C::write_RMW_linear_word(Bit16u val16)
 {
+#if BX_SUPPORT_SMP
+  if (bx_pc_system.smp_parallel) {
+    write_RMW_linear_atomic(val16, 2);
+    return;
+  }
+#endif
+
   if (BX_CPU_THIS_PTR address_xlation.pages > 2) {
     // Pages > 2 means it stores a host address for direct access.
     Bit16u *hostAddr = (Bit16u *) BX_CPU_THIS_PTR address_xlation.pages;
@@ -811,6 +842,13 @@ BX_CPU_C::write_RMW_linear_word(Bit16u val16)
   void BX_CPP_AttrRegparmN(1)
 BX_CPU_C::write_RMW_linear_dword(Bit32u val32)
 {
+#if BX_SUPPORT_SMP
+  if (bx_pc_system.smp_parallel) {
+    write_RMW_linear_atomic(val32, 4);
+    return;
+  }
+#endif
+
   if (BX_CPU_THIS_PTR address_xlation.pages > 2) {
     // Pages > 2 means it stores a host address for direct access.
     Bit32u *hostAddr = (Bit32u *) BX_CPU_THIS_PTR address_xlation.pages;
@@ -861,6 +899,13 @@ BX_CPU_C::write_RMW_linear_dword(Bit32u val32)
   void BX_CPP_AttrRegparmN(1)
 BX_CPU_C::write_RMW_linear_qword(Bit64u val64)
 {
+#if BX_SUPPORT_SMP
+  if (bx_pc_system.smp_parallel) {
+    write_RMW_linear_atomic(val64, 8);
+    return;
+  }
+#endif
+
   if (BX_CPU_THIS_PTR address_xlation.pages > 2) {
     // Pages > 2 means it stores a host address for direct access.
     Bit64u *hostAddr = (Bit64u *) BX_CPU_THIS_PTR address_xlation.pages;
@@ -931,6 +976,10 @@ void BX_CPU_C::read_RMW_linear_dqword_aligned_64(unsigned s, bx_address laddr, B
 #endif
       BX_NOTIFY_LIN_MEMORY_ACCESS(laddr,     pAddr,     8, tlbEntry->get_memtype(), BX_RW, (Bit8u*) lo);
       BX_NOTIFY_LIN_MEMORY_ACCESS(laddr + 8, pAddr + 8, 8, tlbEntry->get_memtype(), BX_RW, (Bit8u*) hi);
+#if BX_SUPPORT_SMP
+      BX_CPU_THIS_PTR address_xlation.rmw_data[0] = *lo;
+      BX_CPU_THIS_PTR address_xlation.rmw_data[1] = *hi;
+#endif
       return;
     }
   }
@@ -946,10 +995,21 @@ void BX_CPU_C::read_RMW_linear_dqword_aligned_64(unsigned s, bx_address laddr, B
 
   *lo = data.xmm64u(0);
   *hi = data.xmm64u(1);
+#if BX_SUPPORT_SMP
+  BX_CPU_THIS_PTR address_xlation.rmw_data[0] = *lo;
+  BX_CPU_THIS_PTR address_xlation.rmw_data[1] = *hi;
+#endif
 }
 
 void BX_CPU_C::write_RMW_linear_dqword(Bit64u hi, Bit64u lo)
 {
+#if BX_SUPPORT_SMP
+  if (bx_pc_system.smp_parallel) {
+    write_RMW_linear_dqword_atomic(hi, lo);
+    return;
+  }
+#endif
+
   write_RMW_linear_qword(lo);
 
   BX_CPU_THIS_PTR address_xlation.paddress1 += 8;
@@ -966,6 +1026,216 @@ void BX_CPU_C::write_RMW_linear_dqword(Bit64u hi, Bit64u lo)
 
 #endif
 
+#if BX_SUPPORT_SMP
+
+// When the CPUs run on separate host threads another CPU may write the
+// memory between the read and the write of a Read-Modify-Write instruction.
+// The result is stored only if the memory still holds the value read, with
+// a host compare and exchange. Otherwise the instruction is restarted and
+// reads the memory again, like a LOCK prefixed instruction would do it.
+
+// Compares and exchanges 'len' bytes at 'hostAddr' which must not cross an
+// 8 byte boundary. The values are in guest byte order. The bits set in
+// 'keep_mask' are not compared and they are kept if set in the memory.
+bool bx_cmpxchg_guest_memory(Bit8u *hostAddr, unsigned len, Bit64u expected, Bit64u val, Bit64u keep_mask)
+{
+  volatile Bit64u *qword = (volatile Bit64u *)((bx_ptr_equiv_t) hostAddr & ~(bx_ptr_equiv_t) 7);
+  unsigned shift = (unsigned)((bx_ptr_equiv_t) hostAddr & 7) * 8;
+  Bit64u mask = (len == 8) ? BX_CONST64(0xffffffffffffffff) : ((BX_CONST64(1) << (len * 8)) - 1);
+  Bit64u old_host = *qword, new_host, prev, old_val, cur;
+
+  for (;;) {
+    old_val = ReadHostQWordFromLittleEndian(&old_host);
+    cur = (old_val >> shift) & mask;
+    if ((cur & ~keep_mask) != (expected & mask & ~keep_mask))
+      return false;
+    WriteHostQWordToLittleEndian(&new_host,
+        (old_val & ~(mask << shift)) | (((val & mask) | (cur & keep_mask)) << shift));
+    prev = bx_atomic_cas64_val(qword, old_host, new_host);
+    if (prev == old_host)
+      return true;
+    // the other bytes of the qword may have changed, check again
+    old_host = prev;
+  }
+}
+
+BX_CPP_INLINE Bit64u rmw_buffer_value(const Bit64u *buf, unsigned len)
+{
+  switch(len) {
+    case 1: return *(const Bit8u *) buf;
+    case 2: return *(const Bit16u *) buf;
+    case 4: return *(const Bit32u *) buf;
+  }
+  return *buf;
+}
+
+BX_CPP_INLINE void rmw_buffer_set(Bit64u *buf, unsigned len, Bit64u val)
+{
+  switch(len) {
+    case 1: *(Bit8u *) buf = (Bit8u) val; break;
+    case 2: *(Bit16u *) buf = (Bit16u) val; break;
+    case 4: *(Bit32u *) buf = (Bit32u) val; break;
+    default: *buf = val;
+  }
+}
+
+// read or write the memory of the current RMW access through the physical
+// access methods, page split accesses are handled like access_read_linear()
+void BX_CPU_C::rmw_physical_access(Bit64u *buf, unsigned len, bool write)
+{
+  Bit8u *data = (Bit8u *) buf;
+
+  if (BX_CPU_THIS_PTR address_xlation.pages != 2) {
+    if (write)
+      access_write_physical(BX_CPU_THIS_PTR address_xlation.paddress1, len, data);
+    else
+      access_read_physical(BX_CPU_THIS_PTR address_xlation.paddress1, len, data);
+    return;
+  }
+
+  unsigned len1 = BX_CPU_THIS_PTR address_xlation.len1;
+  unsigned len2 = BX_CPU_THIS_PTR address_xlation.len2;
+#ifdef BX_LITTLE_ENDIAN
+  Bit8u *data1 = data, *data2 = data + len1;
+#else
+  Bit8u *data1 = data + (len - len1), *data2 = data;
+#endif
+  if (write) {
+    access_write_physical(BX_CPU_THIS_PTR address_xlation.paddress1, len1, data1);
+    access_write_physical(BX_CPU_THIS_PTR address_xlation.paddress2, len2, data2);
+  }
+  else {
+    access_read_physical(BX_CPU_THIS_PTR address_xlation.paddress1, len1, data1);
+    access_read_physical(BX_CPU_THIS_PTR address_xlation.paddress2, len2, data2);
+  }
+}
+
+// true if the memory of the current RMW access can be read again without
+// side effects (no device memory)
+bool BX_CPU_C::rmw_plain_memory(void)
+{
+  if (! getHostMemAddr(PPFOf(BX_CPU_THIS_PTR address_xlation.paddress1), BX_READ))
+    return false;
+  if (BX_CPU_THIS_PTR address_xlation.pages == 2) {
+    if (! getHostMemAddr(PPFOf(BX_CPU_THIS_PTR address_xlation.paddress2), BX_READ))
+      return false;
+  }
+  return true;
+}
+
+// host pointer for a direct atomic access to the memory of the current RMW
+// access or NULL
+Bit8u *BX_CPU_C::rmw_host_address(unsigned len)
+{
+  if (BX_CPU_THIS_PTR address_xlation.pages > 2) {
+    // the write stamp was checked when the memory was read
+    return (Bit8u *) BX_CPU_THIS_PTR address_xlation.pages;
+  }
+
+  if (BX_CPU_THIS_PTR address_xlation.pages == 1) {
+    bx_phy_address paddr = BX_CPU_THIS_PTR address_xlation.paddress1;
+    Bit8u *hostPageAddr = (Bit8u *) getHostMemAddr(PPFOf(paddr), BX_WRITE);
+    if (hostPageAddr) {
+      pageWriteStampTable.decWriteStamp(A20ADDR(paddr), len);
+      return hostPageAddr + PAGE_OFFSET(paddr);
+    }
+  }
+
+  return NULL;
+}
+
+void BX_CPU_C::write_RMW_linear_atomic(Bit64u val64, unsigned len)
+{
+  Bit64u expected = BX_CPU_THIS_PTR address_xlation.rmw_data[0];
+  Bit8u *hostAddr = rmw_host_address(len);
+
+  if (hostAddr != NULL && (((bx_ptr_equiv_t) hostAddr & 7) + len) <= 8) {
+    if (! bx_cmpxchg_guest_memory(hostAddr, len, expected, val64, 0))
+      restart_instruction();
+  }
+  else {
+    // page split and misaligned accesses or device memory, these are
+    // serialized with the device lock only
+    Bit64u buf = 0;
+    bx_pc_system.smp_lock();
+    if (rmw_plain_memory()) {
+      rmw_physical_access(&buf, len, false);
+      if (rmw_buffer_value(&buf, len) != expected) {
+        bx_pc_system.smp_unlock();
+        restart_instruction();
+      }
+    }
+    rmw_buffer_set(&buf, len, val64);
+    rmw_physical_access(&buf, len, true);
+    bx_pc_system.smp_unlock();
+  }
+
+  BX_DBG_PHY_MEMORY_ACCESS(BX_CPU_ID,
+      BX_CPU_THIS_PTR address_xlation.paddress1, len, MEMTYPE(BX_CPU_THIS_PTR address_xlation.memtype1),
+      BX_WRITE, 0, (Bit8u*) &val64);
+}
+
+#if BX_SUPPORT_X86_64
+
+void BX_CPU_C::write_RMW_linear_dqword_atomic(Bit64u hi, Bit64u lo)
+{
+  Bit64u expected_lo = BX_CPU_THIS_PTR address_xlation.rmw_data[0];
+  Bit64u expected_hi = BX_CPU_THIS_PTR address_xlation.rmw_data[1];
+  bx_phy_address paddr = BX_CPU_THIS_PTR address_xlation.paddress1;
+
+#if BX_HAVE_ATOMIC_CAS128 && defined(BX_LITTLE_ENDIAN)
+  // the access is 16 byte aligned
+  Bit8u *hostAddr = rmw_host_address(16);
+  if (hostAddr != NULL) {
+    if (! bx_atomic_cas128((volatile Bit64u *) hostAddr, expected_lo, expected_hi, lo, hi))
+      restart_instruction();
+  }
+  else
+#endif
+  {
+    Bit64u cur_lo, cur_hi;
+    bx_pc_system.smp_lock();
+    if (rmw_plain_memory()) {
+      access_read_physical(paddr,     8, &cur_lo);
+      access_read_physical(paddr + 8, 8, &cur_hi);
+      if (cur_lo != expected_lo || cur_hi != expected_hi) {
+        bx_pc_system.smp_unlock();
+        restart_instruction();
+      }
+    }
+    access_write_physical(paddr,     8, &lo);
+    access_write_physical(paddr + 8, 8, &hi);
+    bx_pc_system.smp_unlock();
+  }
+
+  BX_DBG_PHY_MEMORY_ACCESS(BX_CPU_ID, paddr, 8, MEMTYPE(BX_CPU_THIS_PTR address_xlation.memtype1),
+      BX_WRITE, 0, (Bit8u*) &lo);
+  BX_DBG_PHY_MEMORY_ACCESS(BX_CPU_ID, paddr + 8, 8, MEMTYPE(BX_CPU_THIS_PTR address_xlation.memtype1),
+      BX_WRITE, 0, (Bit8u*) &hi);
+}
+
+#endif
+
+// Executes the current instruction again, the memory operand of a RMW
+// instruction was changed by another CPU
+void BX_CPU_C::restart_instruction(void)
+{
+  RIP = BX_CPU_THIS_PTR prev_rip;
+  if (BX_CPU_THIS_PTR speculative_rsp) {
+    RSP = BX_CPU_THIS_PTR prev_rsp;
+#if BX_SUPPORT_CET
+    SSP = BX_CPU_THIS_PTR prev_ssp;
+#endif
+  }
+  BX_CPU_THIS_PTR speculative_rsp = false;
+  // the longjmp destination counts an instruction
+  BX_CPU_THIS_PTR icount--;
+
+  longjmp(BX_CPU_THIS_PTR jmp_buf_env, 1); // go back to main decode loop
+}
+
+#endif
+
 //
 // Write data to new stack, these methods are required for emulation
 // correctness but not performance critical.
@@ -146,21 +146,41 @@ bool apic_bus_broadcast_interrupt(Bit8u vector, Bit8u delivery_mode, bool trig_m
 
 static void apic_bus_broadcast_eoi(Bit8u vector)
 {
+  bx_pc_system.smp_lock();
   DEV_ioapic_receive_eoi(vector);
+  bx_pc_system.smp_unlock();
 }
 
 #endif
 
+#if BX_SUPPORT_SMP
+static void apic_bus_deliver_smi_deferred(void *this_ptr, Bit64u param1, Bit64u param2)
+{
+  ((BX_CPU_C *) this_ptr)->deliver_SMI();
+}
+#endif
+
+static void apic_bus_send_smi(BX_CPU_C *cpu)
+{
+#if BX_SUPPORT_SMP
+  if (bx_pc_system.smp_cpu_is_remote(cpu)) {
+    bx_pc_system.smp_defer(apic_bus_deliver_smi_deferred, cpu, 0, 0);
+    return;
+  }
+#endif
+  cpu->deliver_SMI();
+}
+
 // available even if APIC is not compiled in
 BOCHSAPI_MSVCONLY void apic_bus_deliver_smi(void)
 {
-  BX_CPU(0)->deliver_SMI();
+  apic_bus_send_smi(BX_CPU(0));
 }
 
 void apic_bus_broadcast_smi(void)
 {
   for (unsigned i=0; i<BX_SMP_PROCESSORS; i++)
-    BX_CPU(i)->deliver_SMI();
+    apic_bus_send_smi(BX_CPU(i));
 }
 
 #if BX_SUPPORT_APIC
@@ -823,8 +843,25 @@ void bx_local_apic_c::service_local_apic(void)
   cpu->signal_event(BX_EVENT_PENDING_LAPIC_INTR);
 }
 
+#if BX_SUPPORT_SMP
+void bx_local_apic_c::deliver_deferred(void *this_ptr, Bit64u vector, Bit64u mode)
+{
+  ((bx_local_apic_c *) this_ptr)->deliver((Bit8u) vector, (Bit8u)(mode >> 8), (Bit8u) mode);
+}
+#endif
+
 bool bx_local_apic_c::deliver(Bit8u vector, Bit8u delivery_mode, Bit8u trig_mode)
 {
+#if BX_SUPPORT_SMP
+  if (bx_pc_system.smp_cpu_is_remote(cpu)) {
+    // the destination CPU runs on another host thread, the message is
+    // accepted now and delivered when the CPUs synchronize
+    if (delivery_mode == APIC_DM_RESERVED) return 0;
+    bx_pc_system.smp_defer(deliver_deferred, this, vector, (delivery_mode << 8) | trig_mode);
+    return 1;
+  }
+#endif
+
   switch(delivery_mode) {
   case APIC_DM_FIXED:
   case APIC_DM_LOWPRI:
@@ -254,6 +254,9 @@ public:
   void print_status(void);
   bool match_logical_addr(apic_dest_t address);
   bool deliver(Bit8u vector, Bit8u delivery_mode, Bit8u trig_mode);
+#if BX_SUPPORT_SMP
+  static void deliver_deferred(void *this_ptr, Bit64u vector, Bit64u mode);
+#endif
   Bit8u get_tpr(void) { return task_priority; }
   void  set_tpr(Bit8u tpr);
   Bit8u get_ppr(void);
@@ -47,7 +47,11 @@
 
 #endif
 
+#if BX_SUPPORT_SMP
+thread_local jmp_buf BX_CPU_C::jmp_buf_env;
+#else
 jmp_buf BX_CPU_C::jmp_buf_env;
+#endif
 
 void BX_CPU_C::cpu_loop(void)
 {
@@ -209,6 +213,12 @@ void BX_CPU_C::cpu_run_trace(void)
 
 bxICacheEntry_c* BX_CPU_C::getICacheEntry(void)
 {
+#if BX_SUPPORT_SMP
+  // pick up the code modifications made by the other CPU threads
+  if (BX_CPU_THIS_PTR iCache.smcQueue.pending())
+    BX_CPU_THIS_PTR iCache.drainSMCQueue();
+#endif
+
   bx_address eipBiased = RIP + BX_CPU_THIS_PTR eipPageBias;
 
   if (eipBiased >= BX_CPU_THIS_PTR eipPageWindowSize) {
@@ -219,16 +229,36 @@ bxICacheEntry_c* BX_CPU_C::getICacheEntry(void)
   INC_ICACHE_STAT(iCacheLookups);
 
   bx_phy_address pAddr = BX_CPU_THIS_PTR pAddrFetchPage + eipBiased;
-  bxICacheEntry_c *entry = BX_CPU_THIS_PTR iCache.find_entry(pAddr, BX_CPU_THIS_PTR fetchModeMask);
 
-  if (entry == NULL)
-  {
-    // iCache miss. No validated instruction with matching fetch parameters
-    // is in the iCache.
-    INC_ICACHE_STAT(iCacheMisses);
-    entry = serveICacheMiss((Bit32u) eipBiased, pAddr);
+  // try the successors cached in the previous trace first, hot loops and
+  // straight branch chains are resolved without the hash lookup
+  bxICacheEntry_c *prev = BX_CPU_THIS_PTR iCache.lastTrace;
+  bxICacheEntry_c *entry = prev->findSuccessor(pAddr, BX_CPU_THIS_PTR fetchModeMask);
+
+  if (entry != NULL) {
+    INC_ICACHE_STAT(iCacheSuccessorHits);
+    BX_CPU_THIS_PTR iCache.touch(entry);
+  }
+  else {
+    entry = BX_CPU_THIS_PTR iCache.find_entry(pAddr, BX_CPU_THIS_PTR fetchModeMask);
+
+    if (entry == NULL)
+    {
+      // iCache miss. No validated instruction with matching fetch parameters
+      // is in the iCache.
+      INC_ICACHE_STAT(iCacheMisses);
+      // look up the code page in the trace cache file first
+      if (! bx_trace_file.empty() && ! BX_CPU_THIS_PTR iCache.preloaded(BX_CPU_THIS_PTR pAddrFetchPage))
+        entry = preloadTraces(pAddr);
+      if (entry == NULL)
+        entry = serveICacheMiss((Bit32u) eipBiased, pAddr);
+    }
+
+    prev->setSuccessor(pAddr, BX_CPU_THIS_PTR fetchModeMask, entry);
   }
 
+  BX_CPU_THIS_PTR iCache.lastTrace = entry;
+
 #if BX_SUPPORT_CET
   if (WaitingForEndbranch(CPL)) {
     bxInstruction_c *i = entry->i;
@@ -249,6 +279,15 @@ bxICacheEntry_c* BX_CPU_C::getICacheEntry(void)
 // The function is called after taken branch instructions and tries to link the branch to the next trace
 void BX_CPP_AttrRegparmN(1) BX_CPU_C::linkTrace(bxInstruction_c *i)
 {
+  bxInstruction_c *next = i->getNextTrace(BX_CPU_THIS_PTR iCache.traceLinkTimeStamp);
+
+  // direct jump inlined into the trace (super-block), continue with the
+  // next instruction of the trace like BX_NEXT_INSTR
+  if (next == i + 1) {
+    if (BX_CPU_THIS_PTR async_event) return;
+    BX_EXECUTE_INSTRUCTION(next);
+  }
+
 #if BX_SUPPORT_SMP
   if (BX_SMP_PROCESSORS > 1)
     return;
@@ -271,7 +310,6 @@ void BX_CPP_AttrRegparmN(1) BX_CPU_C::linkTrace(bxInstruction_c *i)
     return;
   }
 
-  bxInstruction_c *next = i->getNextTrace(BX_CPU_THIS_PTR iCache.traceLinkTimeStamp);
   if (next) {
     BX_EXECUTE_INSTRUCTION(next);
     return;
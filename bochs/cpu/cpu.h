@@ -353,6 +353,11 @@ const unsigned BX_MSR_MAX_INDEX = 0x1000;
 
 extern const char* cpu_mode_string(unsigned cpu_mode);
 
+#if BX_SUPPORT_SMP
+// host atomic compare and exchange of guest memory (see access2.cc)
+extern bool bx_cmpxchg_guest_memory(Bit8u *hostAddr, unsigned len, Bit64u expected, Bit64u val, Bit64u keep_mask);
+#endif
+
 #if BX_SUPPORT_X86_64
 BX_CPP_INLINE bool IsCanonical(bx_address offset)
 {
@@ -1136,7 +1141,12 @@ public: // for now...
 #endif
 
   // for exceptions
+#if BX_SUPPORT_SMP
+  // every host thread running CPUs has its own cpu loop to return to
+  static thread_local jmp_buf jmp_buf_env;
+#else
   static jmp_buf jmp_buf_env;
+#endif
   unsigned last_exception_type;
 
   // Boundaries of current code page, based on EIP
@@ -1202,10 +1212,11 @@ public: // for now...
 #define BX_INSTR_FAR_BRANCH_ORIGIN()
 #endif
 
-#define BX_DTLB_SIZE 2048
-#define BX_ITLB_SIZE 1024
-  TLB<BX_DTLB_SIZE> DTLB BX_CPP_AlignN(32);
-  TLB<BX_ITLB_SIZE> ITLB BX_CPP_AlignN(32);
+#define BX_DTLB_SIZE 4096
+#define BX_ITLB_SIZE 2048
+#define BX_TLB_WAYS  4 // must be power of 2
+  TLB<BX_DTLB_SIZE, BX_TLB_WAYS> DTLB BX_CPP_AlignN(32);
+  TLB<BX_ITLB_SIZE, BX_TLB_WAYS> ITLB BX_CPP_AlignN(32);
 
 #if BX_CPU_LEVEL >= 6
   struct {
@@ -1213,6 +1224,10 @@ public: // for now...
   } PDPTR_CACHE;
 #endif
 
+#if BX_SUPPORT_X86_64
+  bx_paging_structure_cache PSC;
+#endif
+
   // An instruction cache.  Each entry should be exactly 32 bytes, and
   // this structure should be aligned on a 32-byte boundary to be friendly
   // with the host cache lines.
@@ -1236,6 +1251,11 @@ public: // for now...
 #if BX_SUPPORT_MEMTYPE
     BxMemtype memtype1;       // memory type of the page 1
     BxMemtype memtype2;       // memory type of the page 2
+#endif
+#if BX_SUPPORT_SMP
+    Bit64u rmw_data[2];       // data read by the R-M-W instruction, compared
+                              // with the memory before the result is written
+                              // when the CPUs run on separate host threads
 #endif
   } address_xlation;
 
@@ -4100,6 +4120,7 @@ public: // for now...
   BX_SMF void boundaryFetch(const Bit8u *fetchPtr, unsigned remainingInPage, bxInstruction_c *);
 
   BX_SMF bxICacheEntry_c *serveICacheMiss(Bit32u eipBiased, bx_phy_address pAddr);
+  BX_SMF bxICacheEntry_c *preloadTraces(bx_phy_address pAddr);
   BX_SMF bxICacheEntry_c* getICacheEntry(void);
   BX_SMF bool mergeTraces(bxICacheEntry_c *entry, bxInstruction_c *i, bx_phy_address pAddr);
 #if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS && BX_ENABLE_TRACE_LINKING
@@ -4222,10 +4243,20 @@ public: // for now...
   BX_SMF void write_RMW_linear_word(Bit16u val16) BX_CPP_AttrRegparmN(1);
   BX_SMF void write_RMW_linear_dword(Bit32u val32) BX_CPP_AttrRegparmN(1);
   BX_SMF void write_RMW_linear_qword(Bit64u val64) BX_CPP_AttrRegparmN(1);
+#if BX_SUPPORT_SMP
+  BX_SMF void write_RMW_linear_atomic(Bit64u val64, unsigned len);
+  BX_SMF Bit8u *rmw_host_address(unsigned len);
+  BX_SMF bool rmw_plain_memory(void);
+  BX_SMF void rmw_physical_access(Bit64u *buf, unsigned len, bool write);
+  BX_SMF void restart_instruction(void) BX_CPP_AttrNoReturn();
+#endif
 
 #if BX_SUPPORT_X86_64
   BX_SMF void read_RMW_linear_dqword_aligned_64(unsigned seg, bx_address laddr, Bit64u *hi, Bit64u *lo);
   BX_SMF void write_RMW_linear_dqword(Bit64u hi, Bit64u lo);
+#if BX_SUPPORT_SMP
+  BX_SMF void write_RMW_linear_dqword_atomic(Bit64u hi, Bit64u lo);
+#endif
 #endif
 
   // write of word/dword to new stack could happen only in legacy mode
@@ -4311,6 +4342,7 @@ public: // for now...
   BX_SMF void access_write_physical(bx_phy_address paddr, unsigned len, void *data);
 
   BX_SMF bx_hostpageaddr_t getHostMemAddr(bx_phy_address addr, unsigned rw);
+  BX_SMF void update_entry_AD(bx_phy_address entry_addr, unsigned len, void *entry, Bit32u ad_mask);
 
   // linear address for translate_linear expected to be canonical !
   BX_SMF bx_phy_address translate_linear(bx_TLB_entry *entry, bx_address laddr, unsigned user, unsigned rw);
@@ -4346,6 +4378,10 @@ public: // for now...
 
 #if BX_CPU_LEVEL >= 6
   BX_SMF void TLB_flushNonGlobal(void);
+#endif
+#if BX_SUPPORT_X86_64
+  BX_SMF void TLB_switchPCID(bool noflush);
+  BX_SMF void TLB_flushPCID(Bit32u pcid);
 #endif
   BX_SMF void TLB_flush(void);
   BX_SMF void TLB_invlpg(bx_address laddr);
@@ -4365,7 +4401,7 @@ public: // for now...
 
   BX_SMF bool SetCR0(bxInstruction_c *i, bx_address val);
   BX_SMF bool check_CR0(bx_address val) BX_CPP_AttrRegparmN(1);
-  BX_SMF bool SetCR3(bx_address val) BX_CPP_AttrRegparmN(1);
+  BX_SMF bool SetCR3(bx_address val, bool noflush = false) BX_CPP_AttrRegparmN(2);
 #if BX_CPU_LEVEL >= 5
   BX_SMF bool SetCR4(bxInstruction_c *i, bx_address val);
   BX_SMF bool check_CR4(bx_address val) BX_CPP_AttrRegparmN(1);
@@ -4644,6 +4680,7 @@ public: // for now...
   BX_SMF BX_CPP_INLINE bool protected_mode(void);
   BX_SMF BX_CPP_INLINE bool v8086_mode(void);
   BX_SMF BX_CPP_INLINE bool long_mode(void);
+  BX_SMF BX_CPP_INLINE Bit32u get_PCID(void);
   BX_SMF BX_CPP_INLINE bool long64_mode(void);
   BX_SMF BX_CPP_INLINE unsigned get_cpu_mode(void);
 
@@ -5342,6 +5379,16 @@ BX_CPP_INLINE bool BX_CPU_C::long_mode(void)
 #endif
 }
 
+// PCID the TLB entries of the current translation context are tagged with
+BX_CPP_INLINE Bit32u BX_CPU_C::get_PCID(void)
+{
+#if BX_SUPPORT_X86_64
+  if (BX_CPU_THIS_PTR cr4.get_PCIDE())
+    return Bit32u(BX_CPU_THIS_PTR cr3) & 0xfff;
+#endif
+  return 0;
+}
+
 BX_CPP_INLINE bool BX_CPU_C::long64_mode(void)
 {
 #if BX_SUPPORT_X86_64
@@ -39,6 +39,10 @@ struct bx_cpu_statistics
   Bit64u iCacheLookups;
   Bit64u iCachePrefetch;
   Bit64u iCacheMisses;
+  Bit64u iCacheSuccessorHits; // lookups resolved by previous trace successor pointers
+  Bit64u iCacheInlinedJumps;  // direct jumps followed inside a trace (super-blocks)
+  Bit64u iCacheEvictions;     // trace allocations evicted older traces from the pool
+  Bit64u iCachePreloads;      // traces loaded from the trace cache file
 
   // tlb lookup statistics
   Bit64u tlbLookups;
@@ -47,10 +51,13 @@ struct bx_cpu_statistics
   Bit64u tlbMisses;
   Bit64u tlbExecuteMisses;
   Bit64u tlbWriteMisses;
+  Bit64u tlbPagingCacheHits; // page walks resumed from paging-structure cache
 
   // tlb flush statistics
   Bit64u tlbGlobalFlushes;
   Bit64u tlbNonGlobalFlushes;
+  Bit64u tlbContextSwitches; // CR3 loads switching PCID without full flush
+  Bit64u tlbPCIDFlushes;     // invalidations of a single PCID
 
   // stack prefetch statistics
   Bit64u stackPrefetch;
@@ -59,10 +66,10 @@ struct bx_cpu_statistics
   Bit64u smc;
 
   bx_cpu_statistics():
-      iCacheLookups(0), iCachePrefetch(0), iCacheMisses(0),
+      iCacheLookups(0), iCachePrefetch(0), iCacheMisses(0), iCacheSuccessorHits(0), iCacheInlinedJumps(0), iCacheEvictions(0), iCachePreloads(0),
       tlbLookups(0), tlbExecuteLookups(0), tlbWriteLookups(0),
-      tlbMisses(0), tlbExecuteMisses(0), tlbWriteMisses(0),
-      tlbGlobalFlushes(0), tlbNonGlobalFlushes(0),
+      tlbMisses(0), tlbExecuteMisses(0), tlbWriteMisses(0), tlbPagingCacheHits(0),
+      tlbGlobalFlushes(0), tlbNonGlobalFlushes(0), tlbContextSwitches(0), tlbPCIDFlushes(0),
       stackPrefetch(0), smc(0) {}
 
 };
@@ -708,12 +708,14 @@ void BX_CPP_AttrRegparmN(1) BX_CPU_C::MOV_CR3Rq(bxInstruction_c *i)
 #endif
 
   // allow bit 63 (hint that TLB doesn't need to be cleared) to be set when
-  // PCIDE is set, but ignore the hint if given
+  // PCIDE is set, TLB entries are tagged with PCID so the hint is honored
+  bool noflush = false;
   if (BX_CPU_THIS_PTR cr4.get_PCIDE()) {
+    noflush = (val_64 >> 63) & 1;
     val_64 &= ~(BX_CONST64(1)<<63);
   }
 
-  if (! SetCR3(val_64))
+  if (! SetCR3(val_64, noflush))
     exception(BX_GP_EXCEPTION, 0);
 
   BX_INSTR_TLB_CNTRL(BX_CPU_ID, BX_INSTR_MOV_CR3, val_64);
@@ -1365,6 +1367,12 @@ bool BX_CPU_C::SetCR4(bxInstruction_c *i, bx_address val)
 
   BX_CPU_THIS_PTR cr4.set32((Bit32u) val);
 
+#if BX_SUPPORT_X86_64
+  // CR4.PCIDE change flushed the TLB above, retag it for the new mode
+  BX_CPU_THIS_PTR DTLB.set_tag(get_PCID());
+  BX_CPU_THIS_PTR ITLB.set_tag(get_PCID());
+#endif
+
 #if BX_CPU_LEVEL >= 6
   handleSseModeChange();
 #if BX_SUPPORT_AVX
@@ -1381,7 +1389,7 @@ bool BX_CPU_C::SetCR4(bxInstruction_c *i, bx_address val)
 }
 #endif // BX_CPU_LEVEL >= 5
 
-bool BX_CPP_AttrRegparmN(1) BX_CPU_C::SetCR3(bx_address val)
+bool BX_CPP_AttrRegparmN(2) BX_CPU_C::SetCR3(bx_address val, bool noflush)
 {
 #if BX_SUPPORT_X86_64
   if (long_mode()) {
@@ -1394,6 +1402,13 @@ bool BX_CPP_AttrRegparmN(1) BX_CPU_C::SetCR3(bx_address val)
 
   BX_CPU_THIS_PTR cr3 = val;
 
+#if BX_SUPPORT_X86_64
+  if (BX_CPU_THIS_PTR cr4.get_PCIDE()) {
+    TLB_switchPCID(noflush);
+    return 1;
+  }
+#endif
+
   // flush TLB even if value does not change
 #if BX_CPU_LEVEL >= 6
   if (BX_CPU_THIS_PTR cr4.get_PGE())
@@ -72,7 +72,9 @@ bool BX_CPU_C::handleWaitForEvent(void)
 
     if (BX_HRQ && BX_DBG_ASYNC_DMA) {
       // handle DMA also when CPU is halted
+      bx_pc_system.smp_lock();
       DEV_dma_raise_hlda();
+      bx_pc_system.smp_unlock();
     }
 
     // for multiprocessor simulation, even if this CPU is halted we still
@@ -99,7 +101,12 @@ bool BX_CPU_C::handleWaitForEvent(void)
       return 1; // Return to caller of cpu_loop.
     }
 
-    BX_TICKN(10); // when in HLT run time faster for single CPU
+    // when in HLT run time faster for single CPU, nothing can wake it up
+    // before the next timer fires unless a DMA transfer is in progress
+    if (BX_HRQ)
+      BX_TICKN(10);
+    else
+      bx_pc_system.idle_fast_forward();
   }
 
   return 0;
@@ -135,8 +142,12 @@ void BX_CPU_C::InterruptAcknowledge(void)
     vector = BX_CPU_THIS_PTR lapic.acknowledge_int();
   else
 #endif
+  {
     // if no local APIC, always acknowledge the PIC.
+    bx_pc_system.smp_lock();
     vector = DEV_pic_iac(); // may set INTR with next interrupt
+    bx_pc_system.smp_unlock();
+  }
 
   BX_CPU_THIS_PTR EXT = 1; /* external event */
 #if BX_SUPPORT_VMX
@@ -339,7 +350,9 @@ bool BX_CPU_C::handleAsyncEvent(void)
   else if (BX_HRQ && BX_DBG_ASYNC_DMA) {
     // NOTE: similar code in ::take_dma()
     // assert Hold Acknowledge (HLDA) and go into a bus hold state
+    bx_pc_system.smp_lock();
     DEV_dma_raise_hlda();
+    bx_pc_system.smp_unlock();
   }
 
   if (BX_CPU_THIS_PTR get_TF())
@@ -28,6 +28,7 @@
 
 #include "gui/siminterface.h"
 #include "param_names.h"
+#include "pc_system.h"
 #include "cpustats.h"
 
 #include "decoder/ia_opcodes.h"
@@ -40,21 +41,69 @@ extern int fetchDecode64(const Bit8u *fetchPtr, bxInstruction_c *i, unsigned rem
 #endif
 extern int assignHandler(bxInstruction_c *i, Bit32u fetchModeMask);
 
+void bxICache_c::init(unsigned entries, unsigned ways, unsigned poolSize)
+{
+  delete [] entry;
+  delete [] mpool;
+  delete [] mpoolOwner;
+
+  numEntries = entries;
+  waysShift = 0;
+  while ((1U << waysShift) < ways) waysShift++;
+  setMask = (entries >> waysShift) - 1;
+
+  entry = new bxICacheEntry_c[numEntries];
+  mpoolSize = poolSize;
+  mpool = new bxInstruction_c[mpoolSize];
+  mpoolOwner = new bxICacheEntry_c*[mpoolSize];
+  for (unsigned n=0; n < mpoolSize; n++)
+    mpoolOwner[n] = NULL;
+
+  flushICacheEntries();
+  flushCount = 0;
+}
+
 void flushICaches(void)
 {
   for (unsigned i=0; i<BX_SMP_PROCESSORS; i++) {
+#if BX_SUPPORT_SMP
+    if (bx_pc_system.smp_cpu_is_remote(BX_CPU(i))) {
+      // the CPU is running on another host thread, it will flush its
+      // trace cache at the next trace boundary
+      BX_CPU(i)->iCache.smcQueue.postFlush();
+      continue;
+    }
+#endif
     BX_CPU(i)->iCache.flushICacheEntries();
     BX_CPU(i)->async_event |= BX_ASYNC_EVENT_STOP_TRACE;
   }
 
-  pageWriteStampTable.resetWriteStamps();
+  // the other CPU threads could mark new traces meanwhile, keep the stale
+  // write stamps, they only cause extra invalidation checks
+#if BX_SUPPORT_SMP
+  if (! bx_pc_system.smp_parallel)
+#endif
+    pageWriteStampTable.resetWriteStamps();
 }
 
 void handleSMC(bx_phy_address pAddr, Bit32u mask)
 {
   INC_SMC_STAT(smc);
 
+  // clear the write stamps before invalidation, a trace built concurrently
+  // by another CPU thread keeps its mark or gets invalidated
+  pageWriteStampTable.clearICacheMask(pAddr, mask);
+
   for (unsigned i=0; i<BX_SMP_PROCESSORS; i++) {
+#if BX_SUPPORT_SMP
+    if (bx_pc_system.smp_cpu_is_remote(BX_CPU(i))) {
+      // the CPU is running on another host thread, it is allowed to finish
+      // its current trace (cross-modifying code) and picks up the request
+      // at the next trace boundary
+      BX_CPU(i)->iCache.smcQueue.post(pAddr, mask);
+      continue;
+    }
+#endif
     BX_CPU(i)->async_event |= BX_ASYNC_EVENT_STOP_TRACE;
     BX_CPU(i)->iCache.handleSMC(pAddr, mask);
   }
@@ -76,11 +125,67 @@ void genDummyICacheEntry(bxInstruction_c *i)
 
 #endif
 
+#if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS && BX_ENABLE_TRACE_LINKING
+
+// Super-blocks: a trace continues at the target of a direct unconditional
+// jump if it is in the same code page, so the write stamps and the SMC
+// invalidation of the page cover the whole trace.
+
+BX_CPP_INLINE bool isDirectJump(const bxInstruction_c *i)
+{
+  switch(i->getIaOpcode()) {
+  case BX_IA_JMP_Jw:
+  case BX_IA_JMP_Jbw:
+  case BX_IA_JMP_Jd:
+  case BX_IA_JMP_Jbd:
+#if BX_SUPPORT_X86_64
+  case BX_IA_JMP_Jq:
+  case BX_IA_JMP_Jbq:
+#endif
+    return true;
+  default:
+    return false;
+  }
+}
+
+// offset of the jump target from the next instruction, rip is the
+// instruction pointer after the jump
+static Bit64s directJumpDelta(const bxInstruction_c *i, bx_address rip)
+{
+  switch(i->getIaOpcode()) {
+  case BX_IA_JMP_Jw:
+  case BX_IA_JMP_Jbw:
+    return (Bit64s) (Bit16u)(rip + i->Iw()) - (Bit64s) (Bit32u) rip;
+  case BX_IA_JMP_Jd:
+  case BX_IA_JMP_Jbd:
+    return (Bit64s) (Bit32u)(rip + i->Id()) - (Bit64s) (Bit32u) rip;
+  default: // 64-bit jumps
+    return (Bit32s) i->Id();
+  }
+}
+
+// A direct jump followed by another instruction of the trace was inlined,
+// link it to the next instruction permanently. Called again after the
+// instructions were copied, the link points into the trace memory.
+void linkInlinedJumps(bxInstruction_c *i, unsigned tlen)
+{
+  for (unsigned n=1; n < tlen; n++, i++) {
+    if (isDirectJump(i) && i[1].getIaOpcode() != BX_INSERTED_OPCODE)
+      i->setNextTrace(i + 1, 0xffffffff);
+  }
+}
+
+#endif
+
 bxICacheEntry_c* BX_CPU_C::serveICacheMiss(Bit32u eipBiased, bx_phy_address pAddr)
 {
   bxICacheEntry_c *entry = BX_CPU_THIS_PTR iCache.get_entry(pAddr, BX_CPU_THIS_PTR fetchModeMask);
 
-  BX_CPU_THIS_PTR iCache.alloc_trace(entry);
+  if (BX_CPU_THIS_PTR iCache.alloc_trace(entry)) {
+    // older traces were evicted from the memory pool
+    INC_ICACHE_STAT(iCacheEvictions);
+  }
+  BX_CPU_THIS_PTR iCache.touch(entry);
 
   // Cache miss. We weren't so lucky, but let's be optimistic - try to build
   // trace from incoming instruction bytes stream !
@@ -108,8 +213,25 @@ bxICacheEntry_c* BX_CPU_C::serveICacheMiss(Bit32u eipBiased, bx_phy_address pAdd
 #endif
     BX_MAX_TRACE_LENGTH;
 
+  // The cache lines are marked in the write stamp table before their bytes
+  // are fetched, a store from another CPU thread racing with the decoding
+  // then either is seen by the decoder or finds the mark and invalidates
+  // the trace.
+  Bit32u markedMask = 0;
+
+#if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS && BX_ENABLE_TRACE_LINKING
+  bx_address rip = RIP;
+#endif
+
   for (unsigned n=0;n < quantum;n++)
   {
+    Bit32u fetchMask  = 1 << (pageOffset >> 7);
+           fetchMask |= 1 << ((pageOffset + BX_MIN(remainingInPage, 15U) - 1) >> 7);
+    if (fetchMask & ~markedMask) {
+      markedMask |= fetchMask;
+      pageWriteStampTable.markICacheMask(pAddr, fetchMask);
+    }
+
 #if BX_SUPPORT_X86_64
     if (BX_CPU_THIS_PTR cpu_mode == BX_MODE_LONG_64)
       ret = fetchDecode64(fetchPtr, i, remainingInPage);
@@ -134,8 +256,6 @@ bxICacheEntry_c* BX_CPU_C::serveICacheMiss(Bit32u eipBiased, bx_phy_address pAdd
       // Add the instruction to trace cache
       entry->pAddr = ~entry->pAddr;
       entry->traceMask = 0x80000000; /* last line in page */
-      pageWriteStampTable.markICacheMask(entry->pAddr, entry->traceMask);
-      pageWriteStampTable.markICacheMask(BX_CPU_THIS_PTR pAddrFetchPage, 0x1);
 
 #if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS
       entry->tlen++; /* Add the inserted end of trace opcode */
@@ -165,16 +285,37 @@ bxICacheEntry_c* BX_CPU_C::serveICacheMiss(Bit32u eipBiased, bx_phy_address pAdd
 
     // continue to the next instruction
     remainingInPage -= iLen;
-    if (ret != 0 /* stop trace indication */ || remainingInPage == 0) break;
-    pAddr += iLen;
-    pageOffset += iLen;
-    fetchPtr += iLen;
+#if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS && BX_ENABLE_TRACE_LINKING
+    rip += iLen;
+    if (ret != 0 /* stop trace indication */ && isDirectJump(i-1)) {
+      // continue at the jump target if it is in the current page window
+      Bit64s delta = directJumpDelta(i-1, rip);
+      Bit64s target = (Bit64s) eipBiased + (Bit64s) (rip - RIP) + delta;
+      if (target < 0 || target >= (Bit64s) BX_CPU_THIS_PTR eipPageWindowSize) break;
+      INC_ICACHE_STAT(iCacheInlinedJumps);
+      rip += delta;
+      remainingInPage = BX_CPU_THIS_PTR eipPageWindowSize - (Bit32u) target;
+      pAddr = BX_CPU_THIS_PTR pAddrFetchPage + (Bit32u) target;
+      pageOffset = PAGE_OFFSET((Bit32u) pAddr);
+      fetchPtr = BX_CPU_THIS_PTR eipFetchPtr + (Bit32u) target;
+    }
+    else
+#endif
+    {
+      if (ret != 0 /* stop trace indication */ || remainingInPage == 0) break;
+      pAddr += iLen;
+      pageOffset += iLen;
+      fetchPtr += iLen;
+    }
 
     // try to find a trace starting from current pAddr and merge
     if (remainingInPage >= 15) { // avoid merging with page split trace
       if (mergeTraces(entry, i, pAddr)) {
           entry->traceMask |= traceMask;
           pageWriteStampTable.markICacheMask(pAddr, entry->traceMask);
+#if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS && BX_ENABLE_TRACE_LINKING
+          linkInlinedJumps(entry->i, entry->tlen);
+#endif
           BX_CPU_THIS_PTR iCache.commit_trace(entry->tlen);
           return entry;
       }
@@ -185,13 +326,15 @@ bxICacheEntry_c* BX_CPU_C::serveICacheMiss(Bit32u eipBiased, bx_phy_address pAdd
 
   entry->traceMask |= traceMask;
 
-  pageWriteStampTable.markICacheMask(pAddr, entry->traceMask);
-
 #if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS
   entry->tlen++; /* Add the inserted end of trace opcode */
   genDummyICacheEntry(i);
 #endif
 
+#if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS && BX_ENABLE_TRACE_LINKING
+  linkInlinedJumps(entry->i, entry->tlen);
+#endif
+
   BX_CPU_THIS_PTR iCache.commit_trace(entry->tlen);
 
   return entry;
@@ -238,6 +381,10 @@ void BX_CPU_C::boundaryFetch(const Bit8u *fetchPtr, unsigned remainingInPage, bx
     exception(BX_GP_EXCEPTION, 0);
   }
 
+  // Mark both sides of the page split in the write stamp table before the
+  // instruction bytes are read
+  pageWriteStampTable.markICacheMask(BX_CPU_THIS_PTR pAddrFetchPage, 0x80000000);
+
   // Read all leftover bytes in current page up to boundary.
   for (j=0; j<remainingInPage; j++) {
     fetchBuffer[j] = *fetchPtr++;
@@ -258,6 +405,7 @@ void BX_CPU_C::boundaryFetch(const Bit8u *fetchPtr, unsigned remainingInPage, bx
 
   // We can fetch straight from the 0th byte, which is eipFetchPtr;
   fetchPtr = BX_CPU_THIS_PTR eipFetchPtr;
+  pageWriteStampTable.markICacheMask(BX_CPU_THIS_PTR pAddrFetchPage, 0x1);
 
   // read leftover bytes in next page
   for (k=0; k<fetchBufferLimit; k++, j++) {
@@ -24,19 +24,22 @@
 #ifndef BX_ICACHE_H
 #define BX_ICACHE_H
 
+#include "bxthread.h"
+
 extern void handleSMC(bx_phy_address pAddr, Bit32u mask);
 
 class bxPageWriteStampTable
 {
   const Bit32u PHY_MEM_PAGES = 1024*1024;
-  Bit32u *fineGranularityMapping;
+  // updated concurrently by CPUs running on different host threads
+  volatile Bit32u *fineGranularityMapping;
 
 public:
   bxPageWriteStampTable() {
     fineGranularityMapping = new Bit32u[PHY_MEM_PAGES];
     resetWriteStamps();
   }
- ~bxPageWriteStampTable() { delete [] fineGranularityMapping; }
+ ~bxPageWriteStampTable() { delete [] (Bit32u *) fineGranularityMapping; }
 
   BX_CPP_INLINE static Bit32u hash(bx_phy_address pAddr) {
     // can share writeStamps between multiple pages if >32 bit phy address
@@ -53,12 +56,17 @@ public:
     Bit32u mask  = 1 << (PAGE_OFFSET((Bit32u) pAddr) >> 7);
            mask |= 1 << (PAGE_OFFSET((Bit32u) pAddr + len - 1) >> 7);
 
-    fineGranularityMapping[hash(pAddr)] |= mask;
+    bx_atomic_or32(&fineGranularityMapping[hash(pAddr)], mask);
   }
 
   BX_CPP_INLINE void markICacheMask(bx_phy_address pAddr, Bit32u mask)
   {
-    fineGranularityMapping[hash(pAddr)] |= mask;
+    bx_atomic_or32(&fineGranularityMapping[hash(pAddr)], mask);
+  }
+
+  BX_CPP_INLINE void clearICacheMask(bx_phy_address pAddr, Bit32u mask)
+  {
+    bx_atomic_and32(&fineGranularityMapping[hash(pAddr)], ~mask);
   }
 
   // whole page is being altered
@@ -68,7 +76,6 @@ public:
 
     if (fineGranularityMapping[index]) {
       handleSMC(pAddr, 0xffffffff); // one of the CPUs might be running trace from this page
-      fineGranularityMapping[index] = 0;
     }
   }
 
@@ -84,7 +91,6 @@ public:
        if (fineGranularityMapping[index] & mask) {
           // one of the CPUs might be running trace from this page
           handleSMC(pAddr, mask);
-          fineGranularityMapping[index] &= ~mask;
        }
     }
   }
@@ -101,8 +107,14 @@ BX_CPP_INLINE void bxPageWriteStampTable::resetWriteStamps(void)
 
 extern bxPageWriteStampTable pageWriteStampTable;
 
-#define BxICacheEntries (64  * 1024)  // Must be a power of 2.
-#define BxICacheMemPool (576 * 1024)
+// The trace cache geometry is configured with cpu: icache_entries (64K by
+// default, must be a power of 2), icache_ways (1, 2 or 4) and icache_pool
+// (576K instructions by default) options.
+
+// the SMC handler scans all the sets of 4K page
+#define BX_ICACHE_MIN_SETS 4096
+
+#define BX_ICACHE_TRACE_SUCCESSORS 2
 
 struct bxICacheEntry_c
 {
@@ -111,10 +123,109 @@ struct bxICacheEntry_c
 
   Bit32u tlen;          // Trace length in instructions
   bxInstruction_c *i;
+
+  Bit32u lruStamp;      // last access time, for set associative icache
+
+  // Traces recently executed right after this one (taken and fall-through
+  // paths of the branch ending the trace), most recent first. A successor
+  // is valid while its entry still holds the same trace, no timestamps
+  // needed.
+  struct traceSuccessor {
+    bx_phy_address pAddr;
+    Bit32u fetchModeMask;
+    bxICacheEntry_c *e;
+  } succ[BX_ICACHE_TRACE_SUCCESSORS];
+
+  BX_CPP_INLINE bxICacheEntry_c* findSuccessor(bx_phy_address pAddr, Bit32u fetchModeMask)
+  {
+    for (unsigned n=0; n < BX_ICACHE_TRACE_SUCCESSORS; n++) {
+      if (succ[n].pAddr == pAddr && succ[n].fetchModeMask == fetchModeMask && succ[n].e->pAddr == pAddr)
+        return succ[n].e;
+    }
+    return NULL;
+  }
+
+  BX_CPP_INLINE void setSuccessor(bx_phy_address pAddr, Bit32u fetchModeMask, bxICacheEntry_c *e)
+  {
+    for (unsigned n=BX_ICACHE_TRACE_SUCCESSORS-1; n > 0; n--)
+      succ[n] = succ[n-1];
+
+    succ[0].pAddr = pAddr;
+    succ[0].fetchModeMask = fetchModeMask;
+    succ[0].e = e;
+  }
 };
 
 #define BX_MAX_TRACE_LENGTH 32
 
+// the trace memory pool is evicted in 1/BX_ICACHE_EVICT_CHUNKS parts
+#define BX_ICACHE_EVICT_CHUNKS 8
+
+#if BX_SUPPORT_SMP
+
+#define BX_SMC_QUEUE_SIZE 64 /* must be power of two */
+
+// Invalidation requests posted to a CPU running on another host thread.
+// Any thread can post a request, only the owner CPU drains the queue at
+// trace boundary. When the queue is full the whole trace cache is flushed.
+class bxSMCQueue {
+  struct smcRequest {
+    volatile Bit32u seq; // set to position+1 when the request is ready
+    bx_phy_address pAddr;
+    Bit32u mask;
+  } req[BX_SMC_QUEUE_SIZE];
+
+  volatile Bit32u head;
+  volatile Bit32u tail;
+  volatile Bit32u flushAll;
+
+public:
+  bxSMCQueue() {
+    head = tail = flushAll = 0;
+    for (unsigned n=0; n < BX_SMC_QUEUE_SIZE; n++)
+      req[n].seq = 0;
+  }
+
+  BX_CPP_INLINE bool pending() const { return (head != tail) || flushAll; }
+
+  BX_CPP_INLINE void post(bx_phy_address pAddr, Bit32u mask)
+  {
+    Bit32u pos;
+    do {
+      pos = bx_atomic_load32(&tail);
+      if ((pos - bx_atomic_load32(&head)) >= BX_SMC_QUEUE_SIZE) {
+        postFlush();
+        return;
+      }
+    } while (! bx_atomic_cas32(&tail, pos, pos + 1));
+
+    smcRequest *r = &req[pos & (BX_SMC_QUEUE_SIZE-1)];
+    r->pAddr = pAddr;
+    r->mask = mask;
+    bx_atomic_store32(&r->seq, pos + 1);
+  }
+
+  BX_CPP_INLINE void postFlush(void) { bx_atomic_store32(&flushAll, 1); }
+
+  BX_CPP_INLINE bool getFlush(void) { return flushAll && bx_atomic_xchg32(&flushAll, 0); }
+
+  BX_CPP_INLINE bool get(bx_phy_address *pAddr, Bit32u *mask)
+  {
+    Bit32u pos = head;
+    smcRequest *r = &req[pos & (BX_SMC_QUEUE_SIZE-1)];
+    // the request could be not completely written yet, pick it up later
+    if (bx_atomic_load32(&r->seq) != pos + 1)
+      return false;
+
+    *pAddr = r->pAddr;
+    *mask = r->mask;
+    bx_atomic_store32(&head, pos + 1);
+    return true;
+  }
+};
+
+#endif
+
 static const bx_phy_address BX_ICACHE_INVALID_PHY_ADDRESS = bx_phy_address(-1);
 
 BX_CPP_INLINE void flushSMC(bxICacheEntry_c *e)
@@ -132,11 +243,21 @@ BX_CPP_INLINE void flushSMC(bxICacheEntry_c *e)
 
 class BOCHSAPI bxICache_c {
 public:
-  bxICacheEntry_c entry[BxICacheEntries];
-  bxInstruction_c mpool[BxICacheMemPool];
+  bxICacheEntry_c *entry;
+  bxInstruction_c *mpool;
+  // icache entry of the trace starting at every mpool index (if any)
+  bxICacheEntry_c **mpoolOwner;
   unsigned mpindex;
+  unsigned mpfree;   // the pool is free from mpindex up to here
+
+  unsigned numEntries;
+  unsigned setMask;
+  unsigned waysShift;
+  unsigned mpoolSize;
+  Bit32u lruClock;
 
   Bit32u traceLinkTimeStamp;
+  Bit32u flushCount; // number of the complete trace cache flushes
 
 #define BX_ICACHE_PAGE_SPLIT_ENTRIES 8 /* must be power of two */
   struct pageSplitEntryIndex {
@@ -145,23 +266,80 @@ public:
   } pageSplitIndex[BX_ICACHE_PAGE_SPLIT_ENTRIES];
   int nextPageSplitIndex;
 
+  bxICacheEntry_c *lastTrace; // the trace fetched most recently
+
+#define BX_ICACHE_PRELOAD_PAGES 512 /* must be power of two */
+  // physical pages already looked up in the persistent trace file
+  bx_phy_address preloadPage[BX_ICACHE_PRELOAD_PAGES];
+
+#if BX_SUPPORT_SMP
+  bxSMCQueue smcQueue;
+#endif
+
 public:
-  bxICache_c() { flushICacheEntries(); }
+  bxICache_c(): entry(NULL), mpool(NULL), mpoolOwner(NULL), flushCount(0) {}
+ ~bxICache_c() {
+    delete [] entry;
+    delete [] mpool;
+    delete [] mpoolOwner;
+  }
 
-  BX_CPP_INLINE static unsigned hash(bx_phy_address pAddr, unsigned fetchModeMask)
+  // entries and ways must be power of two, entries/ways >= BX_ICACHE_MIN_SETS
+  void init(unsigned entries, unsigned ways, unsigned poolSize);
+
+  BX_CPP_INLINE unsigned hash(bx_phy_address pAddr, unsigned fetchModeMask) const
   {
-//  return ((pAddr + (pAddr << 2) + (pAddr>>6)) & (BxICacheEntries-1)) ^ fetchModeMask;
-    return ((pAddr) & (BxICacheEntries-1)) ^ fetchModeMask;
+//  return ((pAddr + (pAddr << 2) + (pAddr>>6)) & setMask) ^ fetchModeMask;
+    return ((pAddr) & setMask) ^ fetchModeMask;
   }
 
-  BX_CPP_INLINE void alloc_trace(bxICacheEntry_c *e)
+  BX_CPP_INLINE unsigned ways(void) const { return 1 << waysShift; }
+
+  // returns the number of traces evicted from the memory pool
+  BX_CPP_INLINE unsigned alloc_trace(bxICacheEntry_c *e)
   {
+    unsigned evicted = 0;
+
     // took +1 garbend for instruction chaining speedup (end-of-trace opcode)
-    if ((mpindex + BX_MAX_TRACE_LENGTH + 1) > BxICacheMemPool) {
-      flushICacheEntries();
+    if ((mpindex + BX_MAX_TRACE_LENGTH + 1) > mpoolSize) {
+      // wrap around the memory pool, the tail of the pool is already free
+      mpindex = mpfree = 0;
+    }
+    if ((mpindex + BX_MAX_TRACE_LENGTH + 1) > mpfree) {
+      // Evict the oldest traces in large chunks: other traces could be
+      // linked into the evicted ones and all the links are broken.
+      unsigned chunk = mpoolSize / BX_ICACHE_EVICT_CHUNKS;
+      if (chunk < BX_MAX_TRACE_LENGTH + 1)
+        chunk = BX_MAX_TRACE_LENGTH + 1;
+      unsigned end = mpfree + chunk;
+      if (end > mpoolSize)
+        end = mpoolSize;
+      evicted = evict_traces(mpfree, end);
+      mpfree = end;
+      if (evicted)
+        breakLinks();
     }
+
     e->i = &mpool[mpindex];
     e->tlen = 0;
+    mpoolOwner[mpindex] = e;
+    return evicted;
+  }
+
+  BX_CPP_INLINE unsigned evict_traces(unsigned from, unsigned to)
+  {
+    unsigned evicted = 0;
+    for (unsigned n=from; n < to; n++) {
+      bxICacheEntry_c *e = mpoolOwner[n];
+      if (e) {
+        mpoolOwner[n] = NULL;
+        if (e->i == &mpool[n] && e->pAddr != BX_ICACHE_INVALID_PHY_ADDRESS) {
+          e->pAddr = BX_ICACHE_INVALID_PHY_ADDRESS;
+          evicted++;
+        }
+      }
+    }
+    return evicted;
   }
 
   BX_CPP_INLINE void commit_trace(unsigned len) { mpindex += len; }
@@ -184,18 +362,54 @@ public:
 
   BX_CPP_INLINE void flushICacheEntries(void);
 
+#if BX_SUPPORT_SMP
+  BX_CPP_INLINE void drainSMCQueue(void);
+#endif
+
+  BX_CPP_INLINE bxICacheEntry_c* get_set(bx_phy_address pAddr, unsigned fetchModeMask)
+  {
+    return &(entry[hash(pAddr, fetchModeMask) << waysShift]);
+  }
+
+  BX_CPP_INLINE void touch(bxICacheEntry_c *e) { e->lruStamp = lruClock++; }
+
+  // select the entry to hold new trace: invalid or least recently used one
   BX_CPP_INLINE bxICacheEntry_c* get_entry(bx_phy_address pAddr, unsigned fetchModeMask)
   {
-    return &(entry[hash(pAddr, fetchModeMask)]);
+    bxICacheEntry_c *e = get_set(pAddr, fetchModeMask), *victim = e;
+
+    for (unsigned n=0; n < ways(); n++, e++) {
+      if (e->pAddr == BX_ICACHE_INVALID_PHY_ADDRESS)
+        return e;
+      if ((lruClock - e->lruStamp) > (lruClock - victim->lruStamp))
+        victim = e;
+    }
+
+    return victim;
   }
 
   BX_CPP_INLINE bxICacheEntry_c* find_entry(bx_phy_address pAddr, unsigned fetchModeMask)
   {
-    bxICacheEntry_c* e = get_entry(pAddr, fetchModeMask);
-    if (e->pAddr != pAddr)
-       return NULL;
+    bxICacheEntry_c* e = get_set(pAddr, fetchModeMask);
 
-    return e;
+    for (unsigned n=0; n < ways(); n++, e++) {
+      if (e->pAddr == pAddr) {
+        touch(e);
+        return e;
+      }
+    }
+
+    return NULL;
+  }
+
+  BX_CPP_INLINE bool preloaded(bx_phy_address ppf) const
+  {
+    return preloadPage[bxPageWriteStampTable::hash(ppf) & (BX_ICACHE_PRELOAD_PAGES-1)] == ppf;
+  }
+
+  BX_CPP_INLINE void setPreloaded(bx_phy_address ppf)
+  {
+    preloadPage[bxPageWriteStampTable::hash(ppf) & (BX_ICACHE_PRELOAD_PAGES-1)] = ppf;
   }
 
   BX_CPP_INLINE bool breakLinks()
@@ -214,18 +428,31 @@ BX_CPP_INLINE void bxICache_c::flushICacheEntries(void)
   bxICacheEntry_c* e = entry;
   unsigned i;
 
-  for (i=0; i<BxICacheEntries; i++, e++) {
+  for (i=0; i<numEntries; i++, e++) {
     e->pAddr = BX_ICACHE_INVALID_PHY_ADDRESS;
     e->traceMask = 0;
+    e->lruStamp = 0;
+    for (unsigned n=0; n < BX_ICACHE_TRACE_SUCCESSORS; n++) {
+      e->succ[n].pAddr = BX_ICACHE_INVALID_PHY_ADDRESS;
+      e->succ[n].e = e;
+    }
   }
 
+  lastTrace = entry;
+
+  for (i=0;i<BX_ICACHE_PRELOAD_PAGES;i++)
+    preloadPage[i] = BX_ICACHE_INVALID_PHY_ADDRESS;
+
   nextPageSplitIndex = 0;
   for (i=0;i<BX_ICACHE_PAGE_SPLIT_ENTRIES;i++)
     pageSplitIndex[i].ppf = BX_ICACHE_INVALID_PHY_ADDRESS;
 
   mpindex = 0;
+  mpfree = mpoolSize;
+  lruClock = 0;
 
   traceLinkTimeStamp = 0;
+  flushCount++;
 }
 
 BX_CPP_INLINE void bxICache_c::handleSMC(bx_phy_address pAddr, Bit32u mask)
@@ -235,6 +462,9 @@ BX_CPP_INLINE void bxICache_c::handleSMC(bx_phy_address pAddr, Bit32u mask)
   // break all links bewteen traces
   if (breakLinks()) return;
 
+  // the page content changed, look it up in the trace file again
+  preloadPage[pAddrIndex & (BX_ICACHE_PRELOAD_PAGES-1)] = BX_ICACHE_INVALID_PHY_ADDRESS;
+
   // Need to invalidate all traces in the trace cache that might include an
   // instruction that was modified.  But this is not enough, it is possible
   // that some another trace is linked into  invalidated trace and it won't
@@ -258,13 +488,13 @@ BX_CPP_INLINE void bxICache_c::handleSMC(bx_phy_address pAddr, Bit32u mask)
     }
   }
 
-  bxICacheEntry_c *e = get_entry(LPFOf(pAddr), 0);
+  bxICacheEntry_c *e = get_set(LPFOf(pAddr), 0);
 
   // go over 32 "cache lines" of 128 byte each
   for (unsigned n=0; n < 32; n++) {
     Bit32u line_mask = (1 << n);
     if (line_mask > mask) break;
-    for (unsigned index=0; index < 128; index++, e++) {
+    for (unsigned index=0; index < (128U << waysShift); index++, e++) {
       if (pAddrIndex == bxPageWriteStampTable::hash(e->pAddr) && (e->traceMask & mask) != 0) {
         flushSMC(e);
       }
@@ -272,6 +502,86 @@ BX_CPP_INLINE void bxICache_c::handleSMC(bx_phy_address pAddr, Bit32u mask)
   }
 }
 
+#if BX_SUPPORT_SMP
+
+BX_CPP_INLINE void bxICache_c::drainSMCQueue(void)
+{
+  bool flushed = smcQueue.getFlush();
+  if (flushed)
+    flushICacheEntries();
+
+  bx_phy_address pAddr;
+  Bit32u mask;
+  while (smcQueue.get(&pAddr, &mask)) {
+    if (! flushed) handleSMC(pAddr, mask);
+  }
+}
+
+#endif
+
 extern void flushICaches(void);
 
+// Persistent decoded trace cache (cpu: icache_file option). Traces are
+// saved at exit keyed by hash of the physical page content and fetch mode
+// and preloaded into the trace cache when the same code page is executed
+// in the next session.
+class bxTraceFile_c : public logfunctions {
+  // the whole trace file is kept in memory, records are never modified
+  Bit8u *data;
+  Bit32u numRecords;
+  Bit32u *recordOffset;
+  // hash chains of records indexed by page content hash
+  Bit32u *bucket, *nextRecord;
+  Bit32u bucketMask;
+
+public:
+  struct record {
+    Bit64u pageHash;
+    Bit32u traceMask;
+    Bit16u pageOffset;
+    Bit8u  fetchModeMask;
+    Bit8u  tlen;          // followed by tlen instructions
+  };
+
+  bxTraceFile_c();
+ ~bxTraceFile_c();
+
+  void load(const char *path);
+  void save(const char *path);
+
+  BX_CPP_INLINE bool empty() const { return numRecords == 0; }
+
+  static Bit64u hashPage(const Bit8u *page);
+
+  // iterate records with matching page hash, returns -1 at the end of chain
+  BX_CPP_INLINE int lookup(Bit64u pageHash) const
+  {
+    Bit32u n = bucket[Bit32u(pageHash) & bucketMask];
+    while (n != 0xffffffff && get_record(n)->pageHash != pageHash)
+      n = nextRecord[n];
+    return (n == 0xffffffff) ? -1 : int(n);
+  }
+
+  BX_CPP_INLINE int next(int n) const
+  {
+    Bit64u pageHash = get_record(n)->pageHash;
+    Bit32u next = nextRecord[n];
+    while (next != 0xffffffff && get_record(next)->pageHash != pageHash)
+      next = nextRecord[next];
+    return (next == 0xffffffff) ? -1 : int(next);
+  }
+
+  BX_CPP_INLINE const record* get_record(Bit32u n) const
+  {
+    return (const record*) (data + recordOffset[n]);
+  }
+
+  BX_CPP_INLINE const Bit8u* get_instructions(Bit32u n) const
+  {
+    return data + recordOffset[n] + sizeof(record);
+  }
+};
+
+extern bxTraceFile_c bx_trace_file;
+
 #endif
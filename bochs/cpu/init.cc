@@ -122,6 +122,15 @@ void BX_CPU_C::initialize(void)
 
   init_FetchDecodeTables(); // must be called after init_isa_features_bitmask()
 
+  unsigned icache_entries = SIM->get_param_num(BXPN_ICACHE_ENTRIES)->get();
+  unsigned icache_ways = SIM->get_param_num(BXPN_ICACHE_WAYS)->get();
+  if ((icache_entries & (icache_entries - 1)) != 0 || (icache_ways & (icache_ways - 1)) != 0)
+    BX_PANIC(("cpu: icache_entries and icache_ways must be power of 2"));
+  if ((icache_entries / icache_ways) < BX_ICACHE_MIN_SETS)
+    BX_PANIC(("cpu: icache_entries must be at least %d * icache_ways", BX_ICACHE_MIN_SETS));
+  BX_CPU_THIS_PTR iCache.init(icache_entries, icache_ways,
+      SIM->get_param_num(BXPN_ICACHE_POOL)->get() * 1024);
+
 #if BX_CPU_LEVEL >= 6
   xsave_xrestor_init();
 #endif
@@ -160,6 +169,11 @@ void BX_CPU_C::init_statistics(void)
   new bx_shadow_num_c(cpu, "iCacheLookups", &stats->iCacheLookups);
   new bx_shadow_num_c(cpu, "iCachePrefetch", &stats->iCachePrefetch);
   new bx_shadow_num_c(cpu, "iCacheMisses", &stats->iCacheMisses);
+  new bx_shadow_num_c(cpu, "iCacheSuccessorHits", &stats->iCacheSuccessorHits);
+  new bx_shadow_num_c(cpu, "iCacheInlinedJumps", &stats->iCacheInlinedJumps);
+  new bx_shadow_num_c(cpu, "iCacheEvictions", &stats->iCacheEvictions);
+  new bx_shadow_num_c(cpu, "iCachePreloads", &stats->iCachePreloads);
+  new bx_shadow_num_c(cpu, "iCacheFlushes", &iCache.flushCount);
 #endif
 
 #if InstrumentTLB
@@ -169,11 +183,18 @@ void BX_CPU_C::init_statistics(void)
   new bx_shadow_num_c(cpu, "tlbMisses", &stats->tlbMisses);
   new bx_shadow_num_c(cpu, "tlbExecuteMisses", &stats->tlbExecuteMisses);
   new bx_shadow_num_c(cpu, "tlbWriteMisses", &stats->tlbWriteMisses);
+#if BX_SUPPORT_X86_64
+  new bx_shadow_num_c(cpu, "tlbPagingCacheHits", &stats->tlbPagingCacheHits);
+#endif
 #endif
 
 #if InstrumentTLBFlush
   new bx_shadow_num_c(cpu, "tlbGlobalFlushes", &stats->tlbGlobalFlushes);
   new bx_shadow_num_c(cpu, "tlbNonGlobalFlushes", &stats->tlbNonGlobalFlushes);
+#if BX_SUPPORT_X86_64
+  new bx_shadow_num_c(cpu, "tlbContextSwitches", &stats->tlbContextSwitches);
+  new bx_shadow_num_c(cpu, "tlbPCIDFlushes", &stats->tlbPCIDFlushes);
+#endif
 #endif
 
 #if InstrumentStackPrefetch
@@ -518,11 +539,13 @@ void BX_CPU_C::register_state(void)
 #if BX_CPU_LEVEL >= 5
   BXRS_PARAM_BOOL(dtlb, split_large, DTLB.split_large);
 #endif
+  BXRS_HEX_PARAM_FIELD(dtlb, tag, DTLB.tag);
   for (n=0; n<BX_DTLB_SIZE; n++) {
     sprintf(name, "entry%u", n);
     bx_list_c *tlb_entry = new bx_list_c(dtlb, name);
     BXRS_HEX_PARAM_FIELD(tlb_entry, lpf, DTLB.entry[n].lpf);
     BXRS_HEX_PARAM_FIELD(tlb_entry, lpf_mask, DTLB.entry[n].lpf_mask);
+    BXRS_HEX_PARAM_FIELD(tlb_entry, tag, DTLB.entry[n].tag);
     BXRS_HEX_PARAM_FIELD(tlb_entry, ppf, DTLB.entry[n].ppf);
     BXRS_HEX_PARAM_FIELD(tlb_entry, accessBits, DTLB.entry[n].accessBits);
 #if BX_SUPPORT_PKEYS
@@ -537,11 +560,13 @@ void BX_CPU_C::register_state(void)
 #if BX_CPU_LEVEL >= 5
   BXRS_PARAM_BOOL(itlb, split_large, ITLB.split_large);
 #endif
+  BXRS_HEX_PARAM_FIELD(itlb, tag, ITLB.tag);
   for (n=0; n<BX_ITLB_SIZE; n++) {
     sprintf(name, "entry%u", n);
     bx_list_c *tlb_entry = new bx_list_c(itlb, name);
     BXRS_HEX_PARAM_FIELD(tlb_entry, lpf, ITLB.entry[n].lpf);
     BXRS_HEX_PARAM_FIELD(tlb_entry, lpf_mask, ITLB.entry[n].lpf_mask);
+    BXRS_HEX_PARAM_FIELD(tlb_entry, tag, ITLB.entry[n].tag);
     BXRS_HEX_PARAM_FIELD(tlb_entry, ppf, ITLB.entry[n].ppf);
     BXRS_HEX_PARAM_FIELD(tlb_entry, accessBits, ITLB.entry[n].accessBits);
 #if BX_SUPPORT_PKEYS
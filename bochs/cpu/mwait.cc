@@ -176,6 +176,14 @@ void BX_CPP_AttrRegparmN(1) BX_CPU_C::MWAIT(bxInstruction_c *i)
     BX_NEXT_TRACE(i);
   }
 
+#if BX_SUPPORT_SMP
+  // stores from the other CPU threads are not tracked by the monitor,
+  // treat MWAIT as spurious wakeup when CPUs run on host threads
+  if (bx_pc_system.smp_parallel) {
+    BX_NEXT_TRACE(i);
+  }
+#endif
+
   // stops instruction execution and places the processor in a optimized
   // state.  Events that cause exit from MWAIT state are:
   // A store from another processor to monitored range, any unmasked
@@ -390,6 +390,12 @@ void BX_CPU_C::TLB_flush(void)
 
   BX_CPU_THIS_PTR DTLB.flush();
   BX_CPU_THIS_PTR ITLB.flush();
+  // full flush is done on every translation context change, pick up the new PCID
+  BX_CPU_THIS_PTR DTLB.set_tag(get_PCID());
+  BX_CPU_THIS_PTR ITLB.set_tag(get_PCID());
+#if BX_SUPPORT_X86_64
+  BX_CPU_THIS_PTR PSC.flush();
+#endif
 
 #if BX_SUPPORT_MONITOR_MWAIT
   // invalidating of the TLB might change translation for monitored page
@@ -411,6 +417,9 @@ void BX_CPU_C::TLB_flushNonGlobal(void)
 
   BX_CPU_THIS_PTR DTLB.flushNonGlobal();
   BX_CPU_THIS_PTR ITLB.flushNonGlobal();
+#if BX_SUPPORT_X86_64
+  BX_CPU_THIS_PTR PSC.flush(); // paging-structure caches hold no global entries
+#endif
 
 #if BX_SUPPORT_MONITOR_MWAIT
   // invalidating of the TLB might change translation for monitored page
@@ -423,6 +432,57 @@ void BX_CPU_C::TLB_flushNonGlobal(void)
 }
 #endif
 
+#if BX_SUPPORT_X86_64
+// CR3 load with CR4.PCIDE=1: TLB entries of other PCIDs are kept, only
+// the entries of the new PCID are invalidated unless NOFLUSH hint is set
+void BX_CPU_C::TLB_switchPCID(bool noflush)
+{
+  Bit32u pcid = get_PCID();
+
+  INC_TLBFLUSH_STAT(tlbContextSwitches);
+
+  invalidate_prefetch_q();
+  invalidate_stack_cache();
+
+  BX_CPU_THIS_PTR DTLB.set_tag(pcid);
+  BX_CPU_THIS_PTR ITLB.set_tag(pcid);
+  if (! noflush) {
+    INC_TLBFLUSH_STAT(tlbPCIDFlushes);
+    BX_CPU_THIS_PTR DTLB.flushTag(pcid);
+    BX_CPU_THIS_PTR ITLB.flushTag(pcid);
+  }
+
+  // paging-structure caches are not tagged, they belong to the old CR3
+  BX_CPU_THIS_PTR PSC.flush();
+
+#if BX_SUPPORT_MONITOR_MWAIT
+  BX_CPU_THIS_PTR wakeup_monitor();
+#endif
+
+  // break all links bewteen traces
+  BX_CPU_THIS_PTR iCache.breakLinks();
+}
+
+void BX_CPU_C::TLB_flushPCID(Bit32u pcid)
+{
+  INC_TLBFLUSH_STAT(tlbPCIDFlushes);
+
+  invalidate_prefetch_q();
+  invalidate_stack_cache();
+
+  BX_CPU_THIS_PTR DTLB.flushTag(pcid);
+  BX_CPU_THIS_PTR ITLB.flushTag(pcid);
+  BX_CPU_THIS_PTR PSC.flush();
+
+#if BX_SUPPORT_MONITOR_MWAIT
+  BX_CPU_THIS_PTR wakeup_monitor();
+#endif
+
+  // break all links bewteen traces
+  BX_CPU_THIS_PTR iCache.breakLinks();
+}
+#endif
+
 void BX_CPU_C::TLB_invlpg(bx_address laddr)
 {
   invalidate_prefetch_q();
@@ -431,6 +491,10 @@ void BX_CPU_C::TLB_invlpg(bx_address laddr)
   BX_DEBUG(("TLB_invlpg(0x" FMT_ADDRX "): invalidate TLB entry", laddr));
   BX_CPU_THIS_PTR DTLB.invlpg(laddr);
   BX_CPU_THIS_PTR ITLB.invlpg(laddr);
+#if BX_SUPPORT_X86_64
+  // INVLPG invalidates all the paging-structure caches
+  BX_CPU_THIS_PTR PSC.flush();
+#endif
 
 #if BX_SUPPORT_MONITOR_MWAIT
   // invalidating of the TLB entry might change translation for monitored
@@ -692,19 +756,41 @@ bx_phy_address BX_CPU_C::translate_linear_long_mode(bx_address laddr, Bit32u &lp
   Bit64u entry[4];
   BxMemtype entry_memtype[4] = { 0 };
 
+  // combined access and Execute-Disable of the walked non-leaf levels
+  Bit32u level_access[4];
+  Bit32u level_nx[4];
+
   bool nx_fault = false;
-  int leaf;
+  int leaf, start_leaf = BX_LEVEL_PML4;
 
   Bit64u offset_mask = BX_CONST64(0x0000ffffffffffff);
   lpf_mask = 0xfff;
   Bit32u combined_access = (BX_COMBINED_ACCESS_WRITE | BX_COMBINED_ACCESS_USER);
   Bit64u curr_entry = BX_CPU_THIS_PTR cr3;
+  Bit32u nx = 0;
 
   Bit64u reserved = PAGING_PAE_RESERVED_BITS;
   if (! BX_CPU_THIS_PTR efer.get_NXE())
     reserved |= PAGE_DIRECTORY_NX_BIT;
 
-  for (leaf = BX_LEVEL_PML4;; --leaf) {
+  // resume the page walk from the deepest level found in paging-structure cache
+  for (unsigned level = BX_LEVEL_PDE; level <= BX_LEVEL_PML4; level++) {
+    bx_PSC_entry *psc = BX_CPU_THIS_PTR PSC.lookup(laddr, level);
+    if (psc) {
+      INC_TLB_STAT(tlbPagingCacheHits);
+      curr_entry = psc->entry;
+      ppf = curr_entry & BX_CONST64(0x000ffffffffff000);
+      combined_access = psc->combined_access;
+      nx = psc->nx;
+      if (nx && rw == BX_EXECUTE)
+        nx_fault = true;
+      offset_mask >>= 9 * (BX_LEVEL_PML4 + 1 - level);
+      start_leaf = level - 1;
+      break;
+    }
+  }
+
+  for (leaf = start_leaf;; --leaf) {
     entry_addr[leaf] = ppf + ((laddr >> (9 + 9*leaf)) & 0xff8);
 #if BX_SUPPORT_VMX >= 2
     if (BX_CPU_THIS_PTR in_vmx_guest) {
@@ -752,6 +838,10 @@ bx_phy_address BX_CPU_C::translate_linear_long_mode(bx_address laddr, Bit32u &lp
     }
 
     combined_access &= curr_entry; // U/S and R/W
+
+    if (curr_entry & PAGE_DIRECTORY_NX_BIT) nx = 1;
+    level_access[leaf] = combined_access;
+    level_nx[leaf] = nx;
   }
 
   bool isWrite = (rw & 1); // write or r-m-w
@@ -851,7 +941,16 @@ bx_phy_address BX_CPU_C::translate_linear_long_mode(bx_address laddr, Bit32u &lp
 #endif
 
   // Update A/D bits if needed
-  update_access_dirty_PAE(entry_addr, entry, entry_memtype, BX_LEVEL_PML4, leaf, isWrite);
+  update_access_dirty_PAE(entry_addr, entry, entry_memtype, start_leaf, leaf, isWrite);
+
+  // cache the walked non-leaf entries, their accessed bits are set now
+  for (int level = start_leaf; level > leaf; level--) {
+    bx_PSC_entry *psc = BX_CPU_THIS_PTR PSC.get_entry_of(laddr, level);
+    psc->tag = bx_paging_structure_cache::tag_of(laddr, level);
+    psc->entry = entry[level];
+    psc->combined_access = level_access[level];
+    psc->nx = level_nx[level];
+  }
 
   return (ppf | combined_access);
 }
@@ -864,7 +963,7 @@ void BX_CPU_C::update_access_dirty_PAE(bx_phy_address *entry_addr, Bit64u *entry
   for (unsigned level=max_level; level > leaf; level--) {
     if (!(entry[level] & 0x20)) {
       entry[level] |= 0x20;
-      access_write_physical(entry_addr[level], 8, &entry[level]);
+      update_entry_AD(entry_addr[level], 8, &entry[level], 0x60);
       BX_NOTIFY_PHY_MEMORY_ACCESS(entry_addr[level], 8, entry_memtype[level], BX_WRITE,
             (BX_PTE_ACCESS + level), (Bit8u*)(&entry[level]));
     }
@@ -873,7 +972,7 @@ void BX_CPU_C::update_access_dirty_PAE(bx_phy_address *entry_addr, Bit64u *entry
   // Update A/D bits if needed
   if (!(entry[leaf] & 0x20) || (write && !(entry[leaf] & 0x40))) {
     entry[leaf] |= (0x20 | (write<<6)); // Update A and possibly D bits
-    access_write_physical(entry_addr[leaf], 8, &entry[leaf]);
+    update_entry_AD(entry_addr[leaf], 8, &entry[leaf], 0x60);
     BX_NOTIFY_PHY_MEMORY_ACCESS(entry_addr[leaf], 8, entry_memtype[leaf], BX_WRITE,
             (BX_PTE_ACCESS + leaf), (Bit8u*)(&entry[leaf]));
   }
@@ -1261,7 +1360,7 @@ void BX_CPU_C::update_access_dirty(bx_phy_address *entry_addr, Bit32u *entry, Bx
     // Update PDE A bit if needed
     if (!(entry[BX_LEVEL_PDE] & 0x20)) {
       entry[BX_LEVEL_PDE] |= 0x20;
-      access_write_physical(entry_addr[BX_LEVEL_PDE], 4, &entry[BX_LEVEL_PDE]);
+      update_entry_AD(entry_addr[BX_LEVEL_PDE], 4, &entry[BX_LEVEL_PDE], 0x60);
       BX_NOTIFY_PHY_MEMORY_ACCESS(entry_addr[BX_LEVEL_PDE], 4, entry_memtype[BX_LEVEL_PDE], BX_WRITE, BX_PDE_ACCESS, (Bit8u*)(&entry[BX_LEVEL_PDE]));
     }
   }
@@ -1269,7 +1368,7 @@ void BX_CPU_C::update_access_dirty(bx_phy_address *entry_addr, Bit32u *entry, Bx
   // Update A/D bits if needed
   if (!(entry[leaf] & 0x20) || (write && !(entry[leaf] & 0x40))) {
     entry[leaf] |= (0x20 | (write<<6)); // Update A and possibly D bits
-    access_write_physical(entry_addr[leaf], 4, &entry[leaf]);
+    update_entry_AD(entry_addr[leaf], 4, &entry[leaf], 0x60);
     BX_NOTIFY_PHY_MEMORY_ACCESS(entry_addr[leaf], 4, entry_memtype[leaf], BX_WRITE, (BX_PTE_ACCESS + leaf), (Bit8u*)(&entry[leaf]));
   }
 }
@@ -1396,6 +1495,7 @@ bx_phy_address BX_CPU_C::translate_linear(bx_TLB_entry *tlbEntry, bx_address lad
   // direct memory access is NOT allowed by default
   tlbEntry->lpf = lpf | TLB_NoHostPtr;
   tlbEntry->lpf_mask = lpf_mask;
+  tlbEntry->tag = isExecute ? BX_CPU_THIS_PTR ITLB.tag : BX_CPU_THIS_PTR DTLB.tag;
 #if BX_SUPPORT_PKEYS
   tlbEntry->pkey = pkey;
 #endif
@@ -1431,8 +1531,14 @@ bx_phy_address BX_CPU_C::translate_linear(bx_TLB_entry *tlbEntry, bx_address lad
     ) {
     if (isExecute)
       tlbEntry->accessBits |= TLB_UserExecuteOK;
-    else
-      tlbEntry->accessBits |= TLB_UserReadOK | TLB_UserWriteOK;
+    else {
+      // as with paging, writes are allowed only by a write fill: the host
+      // pointer of a read fill is not vetted for writes and doesn't mark
+      // the guest RAM block dirty
+      tlbEntry->accessBits |= TLB_UserReadOK;
+      if (isWrite)
+        tlbEntry->accessBits |= TLB_UserWriteOK;
+    }
   }
   else {
     if ((combined_access & BX_COMBINED_ACCESS_USER) != 0) {
@@ -2127,7 +2233,7 @@ void BX_CPU_C::update_ept_access_dirty(bx_phy_address *entry_addr, Bit64u *entry
   for (unsigned level=BX_LEVEL_PML4; level > leaf; level--) {
     if (!(entry[level] & 0x100)) {
       entry[level] |= 0x100;
-      access_write_physical(entry_addr[level], 8, &entry[level]);
+      update_entry_AD(entry_addr[level], 8, &entry[level], 0x300);
       BX_NOTIFY_PHY_MEMORY_ACCESS(entry_addr[level], 8, MEMTYPE(eptptr_memtype), BX_WRITE, (BX_EPT_PTE_ACCESS + level), (Bit8u*)(&entry[level]));
     }
   }
@@ -2135,7 +2241,7 @@ void BX_CPU_C::update_ept_access_dirty(bx_phy_address *entry_addr, Bit64u *entry
   // Update A/D bits if needed
   if (!(entry[leaf] & 0x100) || (write && !(entry[leaf] & 0x200))) {
     entry[leaf] |= (0x100 | (write<<9)); // Update A and possibly D bits
-    access_write_physical(entry_addr[leaf], 8, &entry[leaf]);
+    update_entry_AD(entry_addr[leaf], 8, &entry[leaf], 0x300);
     BX_NOTIFY_PHY_MEMORY_ACCESS(entry_addr[leaf], 8, MEMTYPE(eptptr_memtype), BX_WRITE, (BX_EPT_PTE_ACCESS + leaf), (Bit8u*)(&entry[leaf]));
   }
 }
@@ -2759,6 +2865,33 @@ void BX_CPU_C::access_read_physical(bx_phy_address paddr, unsigned len, void *da
   BX_MEM(0)->readPhysicalPage(BX_CPU_THIS, paddr, len, data);
 }
 
+// Writes back a paging structure entry after the accessed and dirty bits
+// ('ad_mask') were set. When the CPUs run on separate host threads the bits
+// are set with a host atomic operation. If another CPU changed the entry
+// since it was read by the page walk, the entry is left alone and the walk
+// result is used like it had completed before the change.
+void BX_CPU_C::update_entry_AD(bx_phy_address entry_addr, unsigned len, void *entry, Bit32u ad_mask)
+{
+#if BX_SUPPORT_SMP
+  if (bx_pc_system.smp_parallel) {
+    Bit64u val = (len == 8) ? *(Bit64u *) entry : *(Bit32u *) entry;
+    Bit8u *hostPageAddr = (Bit8u *) getHostMemAddr(PPFOf(entry_addr), BX_WRITE);
+    if (hostPageAddr) {
+      pageWriteStampTable.decWriteStamp(A20ADDR(entry_addr), len);
+      bx_cmpxchg_guest_memory(hostPageAddr + PAGE_OFFSET(entry_addr), len, val, val, ad_mask);
+    }
+    else {
+      bx_pc_system.smp_lock();
+      access_write_physical(entry_addr, len, entry);
+      bx_pc_system.smp_unlock();
+    }
+    return;
+  }
+#endif
+
+  access_write_physical(entry_addr, len, entry);
+}
+
 bx_hostpageaddr_t BX_CPU_C::getHostMemAddr(bx_phy_address paddr, unsigned rw)
 {
 #if BX_SUPPORT_VMX && BX_SUPPORT_X86_64
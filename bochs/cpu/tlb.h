@@ -51,10 +51,10 @@ BX_CPP_INLINE bx_address AlignedAccessLPFOf(bx_address laddr, unsigned alignment
 
 // BX_TLB_INDEX_OF(lpf): This macro is passed the linear page frame
 //   (top bits of the linear address).  It must map these bits to
-//   one of the TLB cache slots, given the size of BX_TLB_SIZE.
-//   There will be a many-to-one mapping to each TLB cache slot.
-//   When there are collisions, the old entry is overwritten with
-//   one for the newest access.
+//   one of the TLB cache sets, given the size of BX_TLB_SIZE and the
+//   number of ways.  There will be a many-to-one mapping to each set.
+//   When all ways of the set are in use, one of them is overwritten
+//   with the entry for the newest access.
 #define BX_DTLB_ENTRY_OF(lpf, len) (BX_CPU_THIS_PTR DTLB.get_entry_of((lpf), (len)))
 #define BX_DTLB_INDEX_OF(lpf, len) (BX_CPU_THIS_PTR DTLB.get_index_of((lpf), (len)))
 
@@ -159,11 +159,12 @@ struct bx_TLB_entry
   Bit32u pkey;
 #endif
   Bit32u lpf_mask;      // linear address mask of the page size
+  Bit32u tag;           // PCID the entry was created for
 #if BX_SUPPORT_MEMTYPE
   Bit32u memtype;       // keep it Bit32u for alignment
 #endif
 
-  bx_TLB_entry() { invalidate(); }
+  bx_TLB_entry(): tag(0) { invalidate(); }
 
   BX_CPP_INLINE bool valid() const { return lpf != BX_INVALID_TLB_ENTRY; }
 
@@ -175,27 +176,64 @@ struct bx_TLB_entry
   BX_CPP_INLINE Bit32u get_memtype() const { return MEMTYPE(memtype); }
 };
 
-template <unsigned size>
+// The TLB is split into size/ways sets indexed by the low bits of the
+// linear page frame. Entries are tagged with the PCID they were created
+// for; global entries match any PCID. A lookup returns the matching way
+// or, on a miss, the way to be refilled by translate_linear.
+template <unsigned size, unsigned ways>
 struct TLB {
   bx_TLB_entry entry[size];
+  Bit32u tag;           // PCID of the current translation context
+  Bit32u victim;        // round robin replacement counter
 #if BX_CPU_LEVEL >= 5
   bool split_large;
 #endif
 
 public:
-  TLB() { flush(); }
+  TLB(): tag(0), victim(0) { flush(); }
 
+  // returns index of the first way of the set
   BX_CPP_INLINE unsigned get_index_of(bx_address lpf, unsigned len = 0)
   {
-    const Bit32u tlb_mask = ((size-1) << 12);
-    return (((unsigned(lpf) + len) & tlb_mask) >> 12);
+    const Bit32u tlb_mask = ((size/ways-1) << 12);
+    return (((unsigned(lpf) + len) & tlb_mask) >> 12) * ways;
+  }
+
+  BX_CPP_INLINE bool tag_match(const bx_TLB_entry *tlbEntry) const
+  {
+    return tlbEntry->tag == tag || (tlbEntry->accessBits & TLB_GlobalPage) != 0;
   }
 
   BX_CPP_INLINE bx_TLB_entry *get_entry_of(bx_address lpf, unsigned len = 0)
   {
-    return &entry[get_index_of(lpf, len)];
+    bx_TLB_entry *set = &entry[get_index_of(lpf, len)];
+    bx_address page = LPFOf(lpf + len);
+
+    for (unsigned n=0; n < ways; n++) {
+      if (LPFOf(set[n].lpf) == page && tag_match(&set[n]))
+        return &set[n];
+    }
+
+    return get_victim_of(set, page);
   }
 
+  // select the way to be replaced, the returned entry never matches the page
+  bx_TLB_entry *get_victim_of(bx_TLB_entry *set, bx_address page)
+  {
+    for (unsigned n=0; n < ways; n++) {
+      if (! set[n].valid())
+        return &set[n];
+    }
+
+    bx_TLB_entry *tlbEntry = &set[(++victim) & (ways-1)];
+    // the page could be cached for another PCID, caller compares lpf only
+    if (LPFOf(tlbEntry->lpf) == page)
+      tlbEntry->invalidate();
+    return tlbEntry;
+  }
+
+  BX_CPP_INLINE void set_tag(Bit32u new_tag) { tag = new_tag; }
+
   BX_CPP_INLINE void flush(void)
   {
     for (unsigned n=0; n < size; n++)
@@ -223,8 +261,27 @@ public:
 
     split_large = (lpf_mask > 0xfff);
   }
+
+  // invalidate all non-global entries tagged with the PCID
+  void flushTag(Bit32u pcid)
+  {
+    Bit32u lpf_mask = 0;
+
+    for (unsigned n=0; n<size; n++) {
+      bx_TLB_entry *tlbEntry = &entry[n];
+      if (tlbEntry->valid()) {
+        if (tlbEntry->tag == pcid && !(tlbEntry->accessBits & TLB_GlobalPage))
+          tlbEntry->invalidate();
+        else
+          lpf_mask |= tlbEntry->lpf_mask;
+      }
+    }
+
+    split_large = (lpf_mask > 0xfff);
+  }
 #endif
 
+  // invalidates the page for all PCIDs
   BX_CPP_INLINE void invlpg(bx_address laddr)
   {
 #if BX_CPU_LEVEL >= 5
@@ -250,11 +307,72 @@ public:
     else
 #endif
     {
-      bx_TLB_entry *tlbEntry = get_entry_of(laddr);
-      if (LPFOf(tlbEntry->lpf) == LPFOf(laddr))
-        tlbEntry->invalidate();
+      bx_TLB_entry *set = &entry[get_index_of(laddr)];
+      for (unsigned n=0; n < ways; n++) {
+        if (LPFOf(set[n].lpf) == LPFOf(laddr))
+          set[n].invalidate();
+      }
     }
   }
 };
 
+#if BX_SUPPORT_X86_64
+
+// Paging-structure cache of the long mode page walk. Keeps the non-leaf
+// paging structure entries, so a TLB miss resumes the page walk from the
+// deepest cached level instead of reading all 4 levels from memory (and
+// translating them through EPT or nested paging tables).
+//
+//   level 1 (PDE):   laddr[47:21] -> page table
+//   level 2 (PDPTE): laddr[47:30] -> page directory
+//   level 3 (PML4E): laddr[47:39] -> page directory pointer table
+//
+// Only entries which passed all the page walk checks and have their
+// accessed bit set are cached. Like on real hardware the cache is not
+// snooped, it is invalidated by TLB flush and INVLPG.
+
+#define BX_PSC_SIZE 32 /* entries per paging structure level, must be power of two */
+
+const Bit64u BX_INVALID_PSC_TAG = BX_CONST64(0xffffffffffffffff);
+
+struct bx_PSC_entry
+{
+  Bit64u tag;             // linear address bits translated by this and upper levels
+  Bit64u entry;           // paging structure entry pointing to the next level table
+  Bit32u combined_access; // U/S and R/W combined from this and upper levels
+  Bit32u nx;              // Execute-Disable set in this or upper levels
+};
+
+struct bx_paging_structure_cache {
+  bx_PSC_entry entry[3][BX_PSC_SIZE];
+
+public:
+  bx_paging_structure_cache() { flush(); }
+
+  BX_CPP_INLINE static Bit64u tag_of(bx_address laddr, unsigned level)
+  {
+    return (laddr & BX_CONST64(0x0000ffffffffffff)) >> (12 + 9*level);
+  }
+
+  BX_CPP_INLINE bx_PSC_entry *get_entry_of(bx_address laddr, unsigned level)
+  {
+    return &entry[level-1][tag_of(laddr, level) & (BX_PSC_SIZE-1)];
+  }
+
+  BX_CPP_INLINE bx_PSC_entry *lookup(bx_address laddr, unsigned level)
+  {
+    bx_PSC_entry *e = get_entry_of(laddr, level);
+    return (e->tag == tag_of(laddr, level)) ? e : NULL;
+  }
+
+  BX_CPP_INLINE void flush(void)
+  {
+    for (unsigned level=0; level < 3; level++)
+      for (unsigned n=0; n < BX_PSC_SIZE; n++)
+        entry[level][n].tag = BX_INVALID_PSC_TAG;
+  }
+};
+
+#endif
+
 #endif
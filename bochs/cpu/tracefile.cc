@@ -0,0 +1,457 @@
+/////////////////////////////////////////////////////////////////////////
+// $Id$
+/////////////////////////////////////////////////////////////////////////
+//
+//  Copyright (C) 2024  The Bochs Project
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA B 02110-1301 USA
+//
+/////////////////////////////////////////////////////////////////////////
+
+#define NEED_CPU_REG_SHORTCUTS 1
+#include "bochs.h"
+#include "bxversion.h"
+#include "cpu.h"
+#define LOG_THIS bx_trace_file.
+
+#include "gui/siminterface.h"
+#include "param_names.h"
+#include "pc_system.h"
+#include "memory/memory-bochs.h"
+#include "cpustats.h"
+#include "decoder/ia_opcodes.h"
+
+#include <stddef.h>
+
+// Persistent decoded trace cache file layout (host endianness):
+//
+//   bxTraceFileHeader
+//   record 0: bxTraceFile_c::record + tlen x bxInstruction_c
+//   record 1: ...
+//
+// The decoded instructions are saved as is with the handler pointers
+// cleared, so the file can be used only by a Bochs binary with the same
+// decoder and the same CPU model. Both are checked by the header: the
+// decoder fingerprint covers the Bochs version, the configure options that
+// change the decoder output, the opcode numbering and the bxInstruction_c
+// layout.
+
+#define BX_TRACE_FILE_MAGIC "BXTRACE2"
+
+struct bxTraceFileHeader {
+  char magic[8];
+  Bit64u records;
+  Bit32u instrSize;
+  Bit32u isaWords;
+  Bit64u decoder;
+  Bit32u isa[BX_ISA_EXTENSIONS_ARRAY_SIZE];
+};
+
+bxTraceFile_c bx_trace_file;
+
+extern int assignHandler(bxInstruction_c *i, Bit32u fetchModeMask);
+#if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS
+extern void genDummyICacheEntry(bxInstruction_c *i);
+#endif
+#if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS && BX_ENABLE_TRACE_LINKING
+extern void linkInlinedJumps(bxInstruction_c *i, unsigned tlen);
+#endif
+
+#define BX_STRINGIFY(x) #x
+#define BX_CONFIG_STRING(x) #x "=" BX_STRINGIFY(x) " "
+
+// configure options that change what the decoder produces
+static const char decoder_config[] =
+  BX_CONFIG_STRING(BX_CPU_LEVEL)
+  BX_CONFIG_STRING(BX_SUPPORT_X86_64)
+  BX_CONFIG_STRING(BX_SUPPORT_FPU)
+  BX_CONFIG_STRING(BX_SUPPORT_3DNOW)
+  BX_CONFIG_STRING(BX_SUPPORT_PKEYS)
+  BX_CONFIG_STRING(BX_SUPPORT_CET)
+  BX_CONFIG_STRING(BX_SUPPORT_MONITOR_MWAIT)
+  BX_CONFIG_STRING(BX_SUPPORT_SVM)
+  BX_CONFIG_STRING(BX_SUPPORT_VMX)
+  BX_CONFIG_STRING(BX_SUPPORT_AVX)
+  BX_CONFIG_STRING(BX_SUPPORT_EVEX)
+  BX_CONFIG_STRING(BX_SUPPORT_REPEAT_SPEEDUPS)
+  BX_CONFIG_STRING(BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS)
+  BX_CONFIG_STRING(BX_ENABLE_TRACE_LINKING);
+
+static Bit64u fnv1a(Bit64u hash, const void *data, unsigned len)
+{
+  const Bit8u *p = (const Bit8u *) data;
+  while (len--) {
+    hash ^= *p++;
+    hash *= BX_CONST64(0x100000001b3);
+  }
+  return hash;
+}
+
+static Bit64u decoder_fingerprint(void)
+{
+  Bit64u hash = BX_CONST64(0xcbf29ce484222325);
+
+  hash = fnv1a(hash, VERSION, sizeof(VERSION));
+  hash = fnv1a(hash, decoder_config, sizeof(decoder_config));
+
+  // opcode numbering, stored in every decoded instruction
+  for (Bit16u n=0; n < BX_IA_LAST; n++) {
+    const char *name = get_bx_opcode_name(n);
+    hash = fnv1a(hash, name, strlen(name) + 1);
+  }
+
+  // instruction layout
+  Bit32u layout[] = {
+    (Bit32u) sizeof(bxInstruction_c),
+    (Bit32u) offsetof(bxInstruction_c, metaInfo),
+    (Bit32u) offsetof(bxInstruction_c, metaData),
+    (Bit32u) offsetof(bxInstruction_c, modRMForm),
+    (Bit32u) BX_IA_LAST
+  };
+  return fnv1a(hash, layout, sizeof(layout));
+}
+
+static void init_header(bxTraceFileHeader *hdr)
+{
+  memset(hdr, 0, sizeof(bxTraceFileHeader));
+  memcpy(hdr->magic, BX_TRACE_FILE_MAGIC, 8);
+  hdr->instrSize = sizeof(bxInstruction_c);
+  hdr->isaWords = BX_ISA_EXTENSIONS_ARRAY_SIZE;
+  hdr->decoder = decoder_fingerprint();
+  for (unsigned n=0; n < BX_ISA_EXTENSIONS_ARRAY_SIZE; n++)
+    hdr->isa[n] = BX_CPU(0)->ia_extensions_bitmask[n];
+}
+
+bxTraceFile_c::bxTraceFile_c(): data(NULL), numRecords(0), recordOffset(NULL),
+  bucket(NULL), nextRecord(NULL), bucketMask(0)
+{
+  put("TRACEF");
+}
+
+bxTraceFile_c::~bxTraceFile_c()
+{
+  delete [] data;
+  delete [] recordOffset;
+  delete [] bucket;
+  delete [] nextRecord;
+}
+
+// FNV-1a hash of the 4K page content
+Bit64u bxTraceFile_c::hashPage(const Bit8u *page)
+{
+  Bit64u hash = BX_CONST64(0xcbf29ce484222325);
+  for (unsigned n=0; n < 4096; n++) {
+    hash ^= page[n];
+    hash *= BX_CONST64(0x100000001b3);
+  }
+  return hash;
+}
+
+void bxTraceFile_c::load(const char *path)
+{
+#if BX_INSTRUMENTATION
+  // instrumentation callbacks are issued when the instruction is decoded
+  BX_INFO(("trace cache file is not supported with instrumentation, ignored"));
+  return;
+#endif
+
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    BX_INFO(("trace cache file '%s' not found, will be created at exit", path));
+    return;
+  }
+
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+
+  bxTraceFileHeader hdr, expected;
+  init_header(&expected);
+
+  if (size < (long) sizeof(hdr) || fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      memcmp(hdr.magic, expected.magic, 8) != 0 ||
+      hdr.instrSize != expected.instrSize || hdr.isaWords != expected.isaWords ||
+      hdr.decoder != expected.decoder ||
+      memcmp(hdr.isa, expected.isa, sizeof(hdr.isa)) != 0)
+  {
+    BX_ERROR(("trace cache file '%s' was written by another Bochs decoder or CPU model, ignored", path));
+    fclose(fp);
+    return;
+  }
+
+  size -= sizeof(hdr);
+  data = new Bit8u[size];
+  if (fread(data, 1, size, fp) != (size_t) size) {
+    BX_ERROR(("failed to read trace cache file '%s'", path));
+    fclose(fp);
+    delete [] data;
+    data = NULL;
+    return;
+  }
+  fclose(fp);
+
+  // don't load traces longer than cpu_loop can execute
+  unsigned maxTraceLength = BX_MAX_TRACE_LENGTH;
+#if BX_SUPPORT_SMP
+  if (BX_SMP_PROCESSORS > 1) {
+    Bit32u quantum = (Bit32u) SIM->get_param_num(BXPN_SMP_QUANTUM)->get();
+    if (quantum < maxTraceLength)
+      maxTraceLength = quantum;
+  }
+#endif
+
+  if (hdr.records > size / sizeof(record))
+    hdr.records = size / sizeof(record);
+
+  recordOffset = new Bit32u[(Bit32u) hdr.records];
+  Bit32u offset = 0;
+  for (Bit32u n=0; n < hdr.records; n++) {
+    if (offset + sizeof(record) > (Bit32u) size) break;
+    const record *r = (const record*) (data + offset);
+    Bit32u len = sizeof(record) + r->tlen * sizeof(bxInstruction_c);
+    if (offset + len > (Bit32u) size) break;
+    if (r->tlen > 0 && r->tlen <= maxTraceLength)
+      recordOffset[numRecords++] = offset;
+    offset += len;
+  }
+
+  for (bucketMask = 1; bucketMask < numRecords; bucketMask <<= 1);
+  bucket = new Bit32u[bucketMask];
+  nextRecord = new Bit32u[numRecords];
+  bucketMask--;
+
+  for (Bit32u n=0; n <= bucketMask; n++)
+    bucket[n] = 0xffffffff;
+
+  for (Bit32u n=0; n < numRecords; n++) {
+    Bit32u index = Bit32u(get_record(n)->pageHash) & bucketMask;
+    nextRecord[n] = bucket[index];
+    bucket[index] = n;
+  }
+
+  BX_INFO(("loaded %u traces from trace cache file '%s'", numRecords, path));
+}
+
+// the traces already written into the file, keyed by page hash, offset and fetch mode
+struct bxTraceFileSavedSet {
+  Bit64u *key;
+  Bit32u mask;
+
+  bxTraceFileSavedSet(Bit32u maxRecords) {
+    for (mask = 1; mask < maxRecords * 2; mask <<= 1);
+    key = new Bit64u[mask];
+    memset(key, 0, sizeof(Bit64u) * mask);
+    mask--;
+  }
+ ~bxTraceFileSavedSet() { delete [] key; }
+
+  bool insert(const bxTraceFile_c::record *r) {
+    Bit64u k = (r->pageHash * 31 + r->pageOffset) ^ (Bit64u(r->fetchModeMask) << 56);
+    if (k == 0) k = 1;
+    Bit32u index = Bit32u(k ^ (k >> 32)) & mask;
+    while (key[index] != 0) {
+      if (key[index] == k) return false;
+      index = (index + 1) & mask;
+    }
+    key[index] = k;
+    return true;
+  }
+};
+
+static bool write_record(FILE *fp, const bxTraceFile_c::record *r, const bxInstruction_c *i)
+{
+  if (fwrite(r, sizeof(bxTraceFile_c::record), 1, fp) != 1) return false;
+
+  for (unsigned n=0; n < r->tlen; n++) {
+    bxInstruction_c instr = i[n];
+    // the handlers are assigned again when the trace is loaded
+    instr.execute1 = NULL;
+    instr.handlers.execute2 = NULL;
+    if (fwrite(&instr, sizeof(bxInstruction_c), 1, fp) != 1) return false;
+  }
+
+  return true;
+}
+
+void bxTraceFile_c::save(const char *path)
+{
+#if BX_INSTRUMENTATION
+  return;
+#endif
+
+  char tmppath[BX_PATHNAME_LEN+8];
+  snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+  FILE *fp = fopen(tmppath, "wb");
+  if (fp == NULL) {
+    BX_ERROR(("failed to create trace cache file '%s'", tmppath));
+    return;
+  }
+
+  bxTraceFileHeader hdr;
+  init_header(&hdr);
+  bool ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+
+  Bit32u maxRecords = numRecords;
+  for (unsigned cpu=0; cpu < BX_SMP_PROCESSORS; cpu++) {
+#if BX_SUPPORT_SMP
+    if (BX_CPU(cpu) == NULL) continue;
+#endif
+    maxRecords += BX_CPU(cpu)->iCache.numEntries;
+  }
+
+  bxTraceFileSavedSet saved(maxRecords);
+
+  for (unsigned cpu=0; cpu < BX_SMP_PROCESSORS && ok; cpu++) {
+    BX_CPU_C *c = BX_CPU(cpu);
+#if BX_SUPPORT_SMP
+    if (c == NULL) continue;
+    // pick up code modifications not yet seen by the CPU thread
+    if (c->iCache.smcQueue.pending())
+      c->iCache.drainSMCQueue();
+#endif
+    bxICache_c *ic = &c->iCache;
+
+    for (unsigned n=0; n < ic->numEntries && ok; n++) {
+      bxICacheEntry_c *e = &ic->entry[n];
+      if (e->pAddr == BX_ICACHE_INVALID_PHY_ADDRESS) continue;
+
+      unsigned tlen = e->tlen;
+#if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS
+      tlen--; // drop the inserted end of trace opcode
+#endif
+      if (tlen == 0 || tlen > 255) continue;
+
+      // the trace must not cross the page, skip page split traces
+      Bit32u pageOffset = PAGE_OFFSET((Bit32u) e->pAddr), end = pageOffset;
+      for (unsigned k=0; k < tlen; k++)
+        end += e->i[k].ilen();
+      if (end > 4096) continue;
+
+      const Bit8u *page = BX_MEM(0)->getHostMemAddr(c, PPFOf(e->pAddr), BX_EXECUTE);
+      if (page == NULL) continue;
+
+      record r;
+      r.pageHash = hashPage(page);
+      r.traceMask = e->traceMask;
+      r.pageOffset = (Bit16u) pageOffset;
+      // the set index was computed as (pAddr & setMask) ^ fetchModeMask
+      r.fetchModeMask = (Bit8u) (((e - ic->entry) >> ic->waysShift) ^ (e->pAddr & ic->setMask));
+      r.tlen = (Bit8u) tlen;
+
+      if (saved.insert(&r)) {
+        ok = write_record(fp, &r, e->i);
+        hdr.records++;
+      }
+    }
+  }
+
+  // keep the traces loaded from the previous sessions which were not executed this time
+  for (Bit32u n=0; n < numRecords && ok; n++) {
+    if (saved.insert(get_record(n))) {
+      ok = write_record(fp, get_record(n), (const bxInstruction_c*) get_instructions(n));
+      hdr.records++;
+    }
+  }
+
+  if (ok) {
+    fseek(fp, 0, SEEK_SET);
+    ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+  }
+  if (fclose(fp) != 0) ok = false;
+
+  if (! ok) {
+    BX_ERROR(("failed to write trace cache file '%s'", tmppath));
+    remove(tmppath);
+    return;
+  }
+
+#if defined(WIN32)
+  remove(path); // rename() doesn't replace existing file on win32
+#endif
+  if (rename(tmppath, path) != 0) {
+    BX_ERROR(("failed to rename trace cache file '%s' to '%s'", tmppath, path));
+    return;
+  }
+
+  BX_INFO(("saved " FMT_LL "u traces to trace cache file '%s'", hdr.records, path));
+}
+
+// Look up the current code page in the trace file and preload its traces into
+// the trace cache. Returns the trace starting at pAddr if it was preloaded.
+bxICacheEntry_c* BX_CPU_C::preloadTraces(bx_phy_address pAddr)
+{
+  bxICache_c *ic = &BX_CPU_THIS_PTR iCache;
+  bx_phy_address ppf = BX_CPU_THIS_PTR pAddrFetchPage;
+
+  ic->setPreloaded(ppf);
+
+#if BX_SUPPORT_SMP
+  // the preloaded traces depend on the content of the whole page, mark it
+  // before hashing so a store from another CPU thread is not missed
+  if (bx_pc_system.smp_parallel)
+    pageWriteStampTable.markICacheMask(ppf, 0xffffffff);
+#endif
+
+  Bit64u pageHash = bxTraceFile_c::hashPage(BX_CPU_THIS_PTR eipFetchPtr);
+  int n = bx_trace_file.lookup(pageHash);
+  if (n < 0) return NULL;
+
+#if BX_SUPPORT_SMP == 0
+  if (ppf == BX_CPU_THIS_PTR pAddrStackPage)
+    invalidate_stack_cache();
+#endif
+
+  Bit32u pageMask = 0;
+
+  for (; n >= 0; n = bx_trace_file.next(n)) {
+    const bxTraceFile_c::record *r = bx_trace_file.get_record(n);
+    bx_phy_address traceAddr = ppf + r->pageOffset;
+
+    if (ic->find_entry(traceAddr, r->fetchModeMask) != NULL) continue;
+
+    bxICacheEntry_c *entry = ic->get_entry(traceAddr, r->fetchModeMask);
+    if (ic->alloc_trace(entry)) {
+      // older traces were evicted from the memory pool
+      INC_ICACHE_STAT(iCacheEvictions);
+    }
+    ic->touch(entry);
+    INC_ICACHE_STAT(iCachePreloads);
+
+    bxInstruction_c *i = entry->i;
+    memcpy(i, bx_trace_file.get_instructions(n), sizeof(bxInstruction_c) * r->tlen);
+    for (unsigned k=0; k < r->tlen; k++)
+      assignHandler(i + k, r->fetchModeMask);
+
+    entry->tlen = r->tlen;
+#if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS
+    entry->tlen++; /* Add the inserted end of trace opcode */
+    genDummyICacheEntry(i + r->tlen);
+#endif
+#if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS && BX_ENABLE_TRACE_LINKING
+    linkInlinedJumps(i, entry->tlen);
+#endif
+    entry->pAddr = traceAddr;
+    entry->traceMask = r->traceMask;
+    pageMask |= r->traceMask;
+
+    ic->commit_trace(entry->tlen);
+  }
+
+  if (pageMask)
+    pageWriteStampTable.markICacheMask(ppf, pageMask);
+
+  return ic->find_entry(pAddr, BX_CPU_THIS_PTR fetchModeMask);
+}
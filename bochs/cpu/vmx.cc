@@ -3906,7 +3906,13 @@ void BX_CPP_AttrRegparmN(1) BX_CPU_C::INVPCID(bxInstruction_c *i)
       BX_ERROR(("INVPCID: invalid PCID"));
       exception(BX_GP_EXCEPTION, 0);
     }
+#if BX_SUPPORT_X86_64
+    // Invalidate all mappings for LADDR tagged with PCID except globals,
+    // the page is invalidated for all PCIDs and also if global
+    TLB_invlpg(long_mode() ? invpcid_desc.xmm64u(1) : (Bit32u) invpcid_desc.xmm64u(1));
+#else
     TLB_flushNonGlobal(); // Invalidate all mappings for LADDR tagged with PCID except globals
+#endif
     break;
 
   case BX_INVPCID_SINGLE_CONTEXT_NON_GLOBAL_INVALIDATION:
@@ -3914,7 +3920,11 @@ void BX_CPP_AttrRegparmN(1) BX_CPU_C::INVPCID(bxInstruction_c *i)
       BX_ERROR(("INVPCID: invalid PCID"));
       exception(BX_GP_EXCEPTION, 0);
     }
+#if BX_SUPPORT_X86_64
+    TLB_flushPCID(pcid); // Invalidate all mappings tagged with PCID except globals
+#else
     TLB_flushNonGlobal(); // Invalidate all mappings tagged with PCID except globals
+#endif
     break;
 
   case BX_INVPCID_ALL_CONTEXT_INVALIDATION:
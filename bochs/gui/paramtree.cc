@@ -1060,6 +1060,9 @@ bx_shadow_data_c::bx_shadow_data_c(bx_param_c *parent,
   this->data_ptr = ptr_to_data;
   this->data_size = data_size;
   this->is_text = is_text;
+  this->sr_devptr = NULL;
+  this->save_handler = NULL;
+  this->restore_handler = NULL;
   if (parent) {
     BX_ASSERT(parent->get_type() == BXT_LIST);
     this->parent = (bx_list_c *)parent;
@@ -1083,14 +1086,38 @@ void bx_shadow_data_c::set(Bit32u index, Bit8u value)
   }
 }
 
+void bx_shadow_data_c::set_sr_handlers(void *devptr, data_sr_handler save, data_sr_handler restore)
+{
+  this->sr_devptr = devptr;
+  this->save_handler = save;
+  this->restore_handler = restore;
+}
+
+bool bx_shadow_data_c::save(const char *path)
+{
+  if (save_handler)
+    return (*save_handler)(sr_devptr, path);
+  return 0;
+}
+
+bool bx_shadow_data_c::restore(const char *path)
+{
+  if (restore_handler)
+    return (*restore_handler)(sr_devptr, path);
+  return 0;
+}
+
 bx_shadow_filedata_c::bx_shadow_filedata_c(bx_param_c *parent,
     const char *name, FILE **scratch_file_ptr_ptr)
   : bx_param_c(SIM->gen_param_id(), name, "")
 {
   set_type(BXT_PARAM_FILEDATA);
   this->scratch_fpp = scratch_file_ptr_ptr;
+  this->sr_devptr = NULL;
   this->save_handler = NULL;
   this->restore_handler = NULL;
+  this->save_path_handler = NULL;
+  this->restore_path_handler = NULL;
   if (parent) {
     BX_ASSERT(parent->get_type() == BXT_LIST);
     this->parent = (bx_list_c *)parent;
@@ -1106,6 +1133,26 @@ void bx_shadow_filedata_c::set_sr_handlers(void *devptr, filedata_save_handler s
   this->restore_handler = restore;
 }
 
+void bx_shadow_filedata_c::set_sr_path_handlers(data_sr_handler save, data_sr_handler restore)
+{
+  this->save_path_handler = save;
+  this->restore_path_handler = restore;
+}
+
+bool bx_shadow_filedata_c::save(const char *path)
+{
+  if (save_path_handler)
+    return (*save_path_handler)(sr_devptr, path);
+  return 0;
+}
+
+bool bx_shadow_filedata_c::restore(const char *path)
+{
+  if (restore_path_handler)
+    return (*restore_path_handler)(sr_devptr, path);
+  return 0;
+}
+
 void bx_shadow_filedata_c::save(FILE *save_fp)
 {
   if (save_handler)
@@ -447,10 +447,17 @@ public:
   void set_extension(const char *newext) {ext = newext;}
 };
 
+// save / restore binary data directly from / to the file at 'path',
+// returns false if the data must be written / read by the generic code
+typedef bool (*data_sr_handler)(void *devptr, const char *path);
+
 class BOCHSAPI bx_shadow_data_c : public bx_param_c {
   Bit32u data_size;
   Bit8u *data_ptr;
   bool is_text;
+  void *sr_devptr;
+  data_sr_handler save_handler;
+  data_sr_handler restore_handler;
 public:
   bx_shadow_data_c(bx_param_c *parent,
       const char *name,
@@ -462,6 +469,9 @@ public:
   bool is_text_format() const {return is_text;}
   Bit8u get(Bit32u index);
   void set(Bit32u index, Bit8u value);
+  void set_sr_handlers(void *devptr, data_sr_handler save, data_sr_handler restore);
+  bool save(const char *path);
+  bool restore(const char *path);
 };
 
 typedef void (*filedata_save_handler)(void *devptr, FILE *save_fp);
@@ -473,14 +483,19 @@ protected:
   void *sr_devptr;
   filedata_save_handler    save_handler;
   filedata_restore_handler restore_handler;
+  data_sr_handler save_path_handler;
+  data_sr_handler restore_path_handler;
 
 public:
   bx_shadow_filedata_c(bx_param_c *parent,
       const char *name, FILE **scratch_file_ptr_ptr);
   void set_sr_handlers(void *devptr, filedata_save_handler save, filedata_restore_handler restore);
+  void set_sr_path_handlers(data_sr_handler save, data_sr_handler restore);
   FILE **get_fpp() {return scratch_fpp;}
   void save(FILE *save_file);
   void restore(FILE *save_file);
+  bool save(const char *path);
+  bool restore(const char *path);
 };
 
 typedef struct _bx_listitem_t {
@@ -1279,6 +1279,8 @@ bool bx_real_sim_c::restore_bochs_param(bx_list_c *root, const char *sr_path, co
                     bx_shadow_data_c *dparam = (bx_shadow_data_c*)param;
                     if (!dparam->is_text_format()) {
                       sprintf(devdata, "%s/%s", sr_path, ptr);
+                      if (dparam->restore(devdata))
+                        break;
                       fp2 = fopen(devdata, "rb");
                       if (fp2 != NULL) {
                         fread(dparam->getptr(), 1, dparam->get_size(), fp2);
@@ -1306,6 +1308,8 @@ bool bx_real_sim_c::restore_bochs_param(bx_list_c *root, const char *sr_path, co
                   break;
                 case BXT_PARAM_FILEDATA:
                   sprintf(devdata, "%s/%s", sr_path, ptr);
+                  if (((bx_shadow_filedata_c*)param)->restore(devdata))
+                    break;
                   fp2 = fopen(devdata, "rb");
                   if (fp2 != NULL) {
                     FILE **fpp = ((bx_shadow_filedata_c*)param)->get_fpp();
@@ -1396,6 +1400,8 @@ bool bx_real_sim_c::save_sr_param(FILE *fp, bx_param_c *node, const char *sr_pat
             sprintf(tmpstr, "%s/%s", sr_path, pname);
           else
             strcpy(tmpstr, pname);
+          if (dparam->save(tmpstr))
+            break;
           fp2 = fopen(tmpstr, "wb");
           if (fp2 != NULL) {
             fwrite(dparam->getptr(), 1, dparam->get_size(), fp2);
@@ -1429,6 +1435,8 @@ bool bx_real_sim_c::save_sr_param(FILE *fp, bx_param_c *node, const char *sr_pat
         sprintf(tmpstr, "%s/%s.%s", sr_path, node->get_parent()->get_name(), node->get_name());
       else
         sprintf(tmpstr, "%s.%s", node->get_parent()->get_name(), node->get_name());
+      if (((bx_shadow_filedata_c*)node)->save(tmpstr))
+        break;
       fp2 = fopen(tmpstr, "wb");
       if (fp2 != NULL) {
         FILE **fpp = ((bx_shadow_filedata_c*)node)->get_fpp();
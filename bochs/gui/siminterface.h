@@ -516,6 +516,14 @@ enum {
 };
 #define BX_CLOCK_SYNC_LAST       BX_CLOCK_SYNC_BOTH
 
+enum {
+  BX_MEM_BACKING_HEAP,
+  BX_MEM_BACKING_MMAP,
+  BX_MEM_BACKING_THP,
+  BX_MEM_BACKING_HUGETLB,
+  BX_MEM_BACKING_FILE
+};
+
 enum {
   BX_PCI_CHIPSET_I430FX,
   BX_PCI_CHIPSET_I440FX,
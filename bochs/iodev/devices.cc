@@ -51,8 +51,8 @@ bx_devices_c::bx_devices_c()
 {
   put("devices", "DEV");
 
-  read_port_to_handler = NULL;
-  write_port_to_handler = NULL;
+  io_read_port = NULL;
+  io_write_port = NULL;
   io_read_handlers.next = NULL;
   io_read_handlers.handler_name = NULL;
   io_write_handlers.next = NULL;
@@ -129,17 +129,17 @@ void bx_devices_c::init(BX_MEM_C *newmem)
   io_write_handlers.prev = &io_write_handlers;
   io_write_handlers.usage_count = 0; // not used with the default handler
 
-  if (read_port_to_handler)
-    delete [] read_port_to_handler;
-  if (write_port_to_handler)
-    delete [] write_port_to_handler;
-  read_port_to_handler = new struct io_handler_struct *[PORTS];
-  write_port_to_handler = new struct io_handler_struct *[PORTS];
+  if (io_read_port)
+    delete [] io_read_port;
+  if (io_write_port)
+    delete [] io_write_port;
+  io_read_port = new io_read_port_t[PORTS];
+  io_write_port = new io_write_port_t[PORTS];
 
   /* set handlers to the default one */
   for (i=0; i < PORTS; i++) {
-    read_port_to_handler[i] = &io_read_handlers;
-    write_port_to_handler[i] = &io_write_handlers;
+    set_io_read_port(i, &io_read_handlers);
+    set_io_write_port(i, &io_write_handlers);
   }
 
   for (i=0; i < BX_MAX_IRQS; i++) {
@@ -671,12 +671,12 @@ bool bx_devices_c::register_io_read_handler(void *this_ptr, bx_read_handler_t f,
     return 0;
 
   /* first check if the port already has a handlers != the default handler */
-  if (read_port_to_handler[addr] &&
-      read_port_to_handler[addr] != &io_read_handlers) { // the default
+  if (io_read_port[addr].handler &&
+      io_read_port[addr].handler != &io_read_handlers) { // the default
     BX_ERROR(("IO device address conflict(read) at IO address %Xh",
               (unsigned) addr));
     BX_ERROR(("  conflicting devices: %s & %s",
-              read_port_to_handler[addr]->handler_name, name));
+              io_read_port[addr].handler->handler_name, name));
     return 0;
   }
 
@@ -710,7 +710,7 @@ bool bx_devices_c::register_io_read_handler(void *this_ptr, bx_read_handler_t f,
   }
 
   io_read_handler->usage_count++;
-  read_port_to_handler[addr] = io_read_handler;
+  set_io_read_port(addr, io_read_handler);
   return 1; // address mapped successfully
 }
 
@@ -723,12 +723,12 @@ bool bx_devices_c::register_io_write_handler(void *this_ptr, bx_write_handler_t
     return 0;
 
   /* first check if the port already has a handlers != the default handler */
-  if (write_port_to_handler[addr] &&
-      write_port_to_handler[addr] != &io_write_handlers) { // the default
+  if (io_write_port[addr].handler &&
+      io_write_port[addr].handler != &io_write_handlers) { // the default
     BX_ERROR(("IO device address conflict(write) at IO address %Xh",
               (unsigned) addr));
     BX_ERROR(("  conflicting devices: %s & %s",
-              write_port_to_handler[addr]->handler_name, name));
+              io_write_port[addr].handler->handler_name, name));
     return 0;
   }
 
@@ -762,7 +762,7 @@ bool bx_devices_c::register_io_write_handler(void *this_ptr, bx_write_handler_t
   }
 
   io_write_handler->usage_count++;
-  write_port_to_handler[addr] = io_write_handler;
+  set_io_write_port(addr, io_write_handler);
   return 1; // address mapped successfully
 }
 
@@ -786,12 +786,12 @@ bool bx_devices_c::register_io_read_handler_range(void *this_ptr, bx_read_handle
 
   /* first check if the port already has a handlers != the default handler */
   for (addr = begin_addr; addr <= end_addr; addr++)
-    if (read_port_to_handler[addr] &&
-        read_port_to_handler[addr] != &io_read_handlers) { // the default
+    if (io_read_port[addr].handler &&
+        io_read_port[addr].handler != &io_read_handlers) { // the default
       BX_ERROR(("IO device address conflict(read) at IO address %Xh",
                 (unsigned) addr));
       BX_ERROR(("  conflicting devices: %s & %s",
-                read_port_to_handler[addr]->handler_name, name));
+                io_read_port[addr].handler->handler_name, name));
       return 0;
   }
 
@@ -826,7 +826,7 @@ bool bx_devices_c::register_io_read_handler_range(void *this_ptr, bx_read_handle
 
   io_read_handler->usage_count += end_addr - begin_addr + 1;
   for (addr = begin_addr; addr <= end_addr; addr++)
-	  read_port_to_handler[addr] = io_read_handler;
+	  set_io_read_port(addr, io_read_handler);
   return 1; // address mapped successfully
 }
 
@@ -850,12 +850,12 @@ bool bx_devices_c::register_io_write_handler_range(void *this_ptr, bx_write_hand
 
   /* first check if the port already has a handlers != the default handler */
   for (addr = begin_addr; addr <= end_addr; addr++)
-    if (write_port_to_handler[addr] &&
-        write_port_to_handler[addr] != &io_write_handlers) { // the default
+    if (io_write_port[addr].handler &&
+        io_write_port[addr].handler != &io_write_handlers) { // the default
       BX_ERROR(("IO device address conflict(read) at IO address %Xh",
                 (unsigned) addr));
       BX_ERROR(("  conflicting devices: %s & %s",
-                write_port_to_handler[addr]->handler_name, name));
+                io_write_port[addr].handler->handler_name, name));
       return 0;
     }
 
@@ -890,7 +890,7 @@ bool bx_devices_c::register_io_write_handler_range(void *this_ptr, bx_write_hand
 
   io_write_handler->usage_count += end_addr - begin_addr + 1;
   for (addr = begin_addr; addr <= end_addr; addr++)
-	  write_port_to_handler[addr] = io_write_handler;
+	  set_io_write_port(addr, io_write_handler);
   return 1; // address mapped successfully
 }
 
@@ -907,6 +907,13 @@ bool bx_devices_c::register_default_io_read_handler(void *this_ptr, bx_read_hand
   io_read_handlers.handler_name = new char[strlen(name)+1];
   strcpy(io_read_handlers.handler_name, name);
   io_read_handlers.mask = mask;
+  // update the ports using the default handler
+  if (io_read_port) {
+    for (unsigned addr = 0; addr < PORTS; addr++) {
+      if (io_read_port[addr].handler == &io_read_handlers)
+        set_io_read_port(addr, &io_read_handlers);
+    }
+  }
 
   return 1;
 }
@@ -922,6 +929,13 @@ bool bx_devices_c::register_default_io_write_handler(void *this_ptr, bx_write_ha
   io_write_handlers.handler_name = new char[strlen(name)+1];
   strcpy(io_write_handlers.handler_name, name);
   io_write_handlers.mask = mask;
+  // update the ports using the default handler
+  if (io_write_port) {
+    for (unsigned addr = 0; addr < PORTS; addr++) {
+      if (io_write_port[addr].handler == &io_write_handlers)
+        set_io_write_port(addr, &io_write_handlers);
+    }
+  }
 
   return 1;
 }
@@ -931,7 +945,7 @@ bool bx_devices_c::unregister_io_read_handler(void *this_ptr, bx_read_handler_t
 {
   addr &= 0xffff;
 
-  struct io_handler_struct *io_read_handler = read_port_to_handler[addr];
+  struct io_handler_struct *io_read_handler = io_read_port[addr].handler;
 
   //BX_INFO(("Unregistering I/O read handler at %#x", addr));
 
@@ -960,7 +974,7 @@ bool bx_devices_c::unregister_io_read_handler(void *this_ptr, bx_read_handler_t
     return 0;
   }
 
-  read_port_to_handler[addr] = &io_read_handlers; // reset to default
+  set_io_read_port(addr, &io_read_handlers); // reset to default
   io_read_handler->usage_count--;
 
   if (!io_read_handler->usage_count) { // kill this handler entry
@@ -977,7 +991,7 @@ bool bx_devices_c::unregister_io_write_handler(void *this_ptr, bx_write_handler_
 {
   addr &= 0xffff;
 
-  struct io_handler_struct *io_write_handler = write_port_to_handler[addr];
+  struct io_handler_struct *io_write_handler = io_write_port[addr].handler;
 
   if (!io_write_handler)
     return 0;
@@ -994,7 +1008,7 @@ bool bx_devices_c::unregister_io_write_handler(void *this_ptr, bx_write_handler_
   if (io_write_handler->mask != mask)
     return 0;
 
-  write_port_to_handler[addr] = &io_write_handlers; // reset to default
+  set_io_write_port(addr, &io_write_handlers); // reset to default
   io_write_handler->usage_count--;
 
   if (!io_write_handler->usage_count) { // kill this handler entry
@@ -1043,55 +1057,65 @@ bool bx_devices_c::unregister_io_write_handler_range(void *this_ptr, bx_write_ha
 }
 
 
-/*
- * Read a byte of data from the IO memory address space
- */
+void bx_devices_c::set_io_read_port(Bit32u addr, struct io_handler_struct *handler)
+{
+  io_read_port[addr].funct = (bx_read_handler_t)handler->funct;
+  io_read_port[addr].this_ptr = handler->this_ptr;
+  io_read_port[addr].mask = handler->mask;
+  io_read_port[addr].handler = handler;
+}
+
+void bx_devices_c::set_io_write_port(Bit32u addr, struct io_handler_struct *handler)
+{
+  io_write_port[addr].funct = (bx_write_handler_t)handler->funct;
+  io_write_port[addr].this_ptr = handler->this_ptr;
+  io_write_port[addr].mask = handler->mask;
+  io_write_port[addr].handler = handler;
+}
 
+#if BX_INSTRUMENTATION
   Bit32u BX_CPP_AttrRegparmN(2)
 bx_devices_c::inp(Bit16u addr, unsigned io_len)
 {
-  struct io_handler_struct *io_read_handler;
-  Bit32u ret;
-
   BX_INSTR_INP(addr, io_len);
-
-  io_read_handler = read_port_to_handler[addr];
-  if (io_read_handler->mask & io_len) {
-    ret = ((bx_read_handler_t)io_read_handler->funct)(io_read_handler->this_ptr, (Bit32u)addr, io_len);
-  } else {
-    switch (io_len) {
-      case 1: ret = 0xff; break;
-      case 2: ret = 0xffff; break;
-      default: ret = 0xffffffff; break;
-    }
-    if (addr != 0x0cf8) { // don't flood the logfile when probing PCI
-      BX_ERROR(("read from port 0x%04x with len %d returns 0x%x", addr, io_len, ret));
-    }
-  }
-
+  Bit32u ret = port_read(addr, io_len);
   BX_INSTR_INP2(addr, io_len, ret);
-  BX_DBG_IO_REPORT(addr, io_len, BX_READ, ret);
-
   return(ret);
 }
 
+  void BX_CPP_AttrRegparmN(3)
+bx_devices_c::outp(Bit16u addr, Bit32u value, unsigned io_len)
+{
+  BX_INSTR_OUTP(addr, io_len, value);
+  port_write(addr, value, io_len);
+}
+#endif
 
 /*
- * Write a byte of data to the IO memory address space.
+ * I/O access with a length not supported by the port handler (see
+ * port_read() and port_write() in iodev.h)
  */
 
-  void BX_CPP_AttrRegparmN(3)
-bx_devices_c::outp(Bit16u addr, Bit32u value, unsigned io_len)
+  Bit32u BX_CPP_AttrRegparmN(2)
+bx_devices_c::unmapped_inp(Bit16u addr, unsigned io_len)
 {
-  struct io_handler_struct *io_write_handler;
+  Bit32u ret;
 
-  BX_INSTR_OUTP(addr, io_len, value);
-  BX_DBG_IO_REPORT(addr, io_len, BX_WRITE, value);
+  switch (io_len) {
+    case 1: ret = 0xff; break;
+    case 2: ret = 0xffff; break;
+    default: ret = 0xffffffff; break;
+  }
+  if (addr != 0x0cf8) { // don't flood the logfile when probing PCI
+    BX_ERROR(("read from port 0x%04x with len %d returns 0x%x", addr, io_len, ret));
+  }
+  return ret;
+}
 
-  io_write_handler = write_port_to_handler[addr];
-  if (io_write_handler->mask & io_len) {
-    ((bx_write_handler_t)io_write_handler->funct)(io_write_handler->this_ptr, (Bit32u)addr, value, io_len);
-  } else if (addr != 0x0cf8) { // don't flood the logfile when probing PCI
+  void BX_CPP_AttrRegparmN(2)
+bx_devices_c::unmapped_outp(Bit16u addr, unsigned io_len)
+{
+  if (addr != 0x0cf8) { // don't flood the logfile when probing PCI
     BX_ERROR(("write to port 0x%04x with len %d ignored", addr, io_len));
   }
 }
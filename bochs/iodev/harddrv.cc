@@ -149,6 +149,9 @@ bx_hard_drive_c::~bx_hard_drive_c()
   for (Bit8u channel=0; channel<BX_MAX_ATA_CHANNEL; channel++) {
     for (Bit8u device=0; device<2; device ++) {
       if (channels[channel].drives[device].hdimage != NULL) {
+        if (channels[channel].drives[device].hdimage->async_io != NULL) {
+          delete channels[channel].drives[device].hdimage->async_io;
+        }
         channels[channel].drives[device].hdimage->close();
         delete channels[channel].drives[device].hdimage;
         channels[channel].drives[device].hdimage = NULL;
@@ -366,6 +369,16 @@ void bx_hard_drive_c::init(void)
         BX_HD_THIS channels[channel].drives[device].controller.buffer_total_size =
           MAX_MULTIPLE_SECTORS * sect_size;
         BX_HD_THIS channels[channel].drives[device].sect_size = sect_size;
+        Bit32u cache_size = (Bit32u)SIM->get_param_num("cache", base)->get();
+        if (cache_size > 0) {
+          BX_HD_THIS channels[channel].drives[device].hdimage =
+            new cached_image_t(BX_HD_THIS channels[channel].drives[device].hdimage, cache_size);
+          BX_INFO(("ata%d-%d: using %d MB block cache", channel, device, cache_size));
+        }
+        if (SIM->get_param_bool("async", base)->get()) {
+          new async_image_io_c(BX_HD_THIS channels[channel].drives[device].hdimage);
+          BX_INFO(("ata%d-%d: using asynchronous image I/O", channel, device));
+        }
       } else if (SIM->get_param_enum("type", base)->get() == BX_ATA_DEVICE_CDROM) {
         bx_list_c *cdrom_rt = (bx_list_c*)SIM->get_param(BXPN_MENU_RUNTIME_CDROM);
         sprintf(pname, "cdrom%d", BX_HD_THIS cdrom_count + 1);
@@ -662,12 +675,22 @@ void bx_hard_drive_c::seek_timer()
   Bit8u device = param & 1;
   controller_t *controller = &BX_CONTROLLER(channel, device);
   if (BX_DRIVE_IS_HD(channel, device)) {
+    if (async_io_busy(channel, device)) {
+      // host I/O not complete yet, check again later
+      bx_pc_system.activate_timer(BX_DRIVE(channel, device).seek_timer_index,
+                                  BX_HD_ASYNC_POLL_USEC, 0);
+      return;
+    }
     switch (controller->current_command) {
       case 0x24: // READ SECTORS EXT
       case 0x29: // READ MULTIPLE EXT
       case 0x20: // READ SECTORS, with retries
       case 0x21: // READ SECTORS, without retries
       case 0xC4: // READ MULTIPLE SECTORS
+        if ((BX_DRIVE(channel, device).hdimage->async_io != NULL) &&
+            !ide_read_sector(channel, controller->buffer, controller->buffer_size)) {
+          break;
+        }
         controller->error_register = 0;
         controller->status.busy  = 0;
         controller->status.drive_ready = 1;
@@ -702,6 +725,12 @@ void bx_hard_drive_c::seek_timer()
           BX_SLAVE_SELECTED(channel), controller->control.disable_irq?"dis":"en"));
         raise_interrupt(channel);
         break;
+#if BX_SUPPORT_PCI
+      case 0x35: // WRITE DMA EXT
+      case 0xCA: // WRITE DMA
+        BX_HD_THIS bmdma_complete(channel);
+        break;
+#endif
       default:
         BX_ERROR(("seek_timer(): ATA command 0x%02x not supported",
                   controller->current_command));
@@ -1259,7 +1288,16 @@ void bx_hard_drive_c::write(Bit32u address, Bit32u value, unsigned io_len)
                 controller->status.drq = 1;
                 controller->status.corrected_data = 0;
                 controller->status.err = 0;
+              } else if ((BX_SELECTED_DRIVE(channel).hdimage->async_io != NULL) &&
+                         BX_SELECTED_DRIVE(channel).hdimage->async_io->write_failed()) {
+                /* an earlier queued write has failed */
+                command_aborted(channel, controller->current_command);
+                break;
               } else { /* no more sectors to write */
+                /* queued writes complete in the background like a write cache */
+                if (BX_SELECTED_DRIVE(channel).hdimage->async_io != NULL) {
+                  BX_SELECTED_DRIVE(channel).hdimage->async_io->flush();
+                }
                 controller->status.busy = 0;
                 controller->status.drive_ready = 1;
                 controller->status.drq = 0;
@@ -2085,8 +2123,12 @@ void bx_hard_drive_c::write(Bit32u address, Bit32u value, unsigned io_len)
           controller->status.corrected_data = 0;
           controller->buffer_index = 0;
           start_seek(channel);
-          if (!ide_read_sector(channel, controller->buffer,
-                                  controller->buffer_size)) {
+          if (BX_SELECTED_DRIVE(channel).hdimage->async_io != NULL) {
+            // first block is transferred when the seek is complete
+            BX_SELECTED_DRIVE(channel).hdimage->async_io->prefetch(logical_sector * sect_size,
+              (Bit64u)controller->num_sectors * sect_size);
+          } else if (!ide_read_sector(channel, controller->buffer,
+                                      controller->buffer_size)) {
             bx_pc_system.deactivate_timer(
               BX_SELECTED_DRIVE(channel).seek_timer_index);
             command_aborted(channel, value);
@@ -2434,6 +2476,19 @@ void bx_hard_drive_c::write(Bit32u address, Bit32u value, unsigned io_len)
         case 0xE1: // IDLE IMMEDIATE
         case 0xE7: // FLUSH CACHE
         case 0xEA: // FLUSH CACHE EXT
+          if (BX_SELECTED_IS_HD(channel)) {
+            if (BX_SELECTED_DRIVE(channel).hdimage->async_io != NULL) {
+              BX_SELECTED_DRIVE(channel).hdimage->async_io->drain();
+              if (BX_SELECTED_DRIVE(channel).hdimage->async_io->write_failed()) {
+                command_aborted(channel, value);
+                break;
+              }
+            }
+            if (!BX_SELECTED_DRIVE(channel).hdimage->flush()) {
+              command_aborted(channel, value);
+              break;
+            }
+          }
           controller->status.busy = 0;
           controller->status.drive_ready = 1;
           controller->status.write_fault = 0;
@@ -2490,6 +2545,10 @@ void bx_hard_drive_c::write(Bit32u address, Bit32u value, unsigned io_len)
             controller->status.drq   = 0;
             controller->status.corrected_data = 0;
             start_seek(channel);
+            if (BX_SELECTED_DRIVE(channel).hdimage->async_io != NULL) {
+              BX_SELECTED_DRIVE(channel).hdimage->async_io->prefetch(logical_sector * sect_size,
+                (Bit64u)controller->num_sectors * sect_size);
+            }
           } else {
             BX_ERROR(("write cmd 0x%02x (READ DMA) not supported", value));
             command_aborted(channel, value);
@@ -3401,9 +3460,17 @@ bool bx_hard_drive_c::bmdma_read_sector(Bit8u channel, Bit8u *buffer, Bit32u *se
 
   if ((controller->current_command == 0xC8) ||
       (controller->current_command == 0x25)) {
-    *sector_size = BX_SELECTED_DRIVE(channel).hdimage->sect_size;
+    // transfer as many sectors as the caller can take in one request
+    Bit32u sect_size = BX_SELECTED_DRIVE(channel).hdimage->sect_size;
+    Bit32u count = *sector_size / sect_size;
     if (controller->num_sectors == 0)
       return 0;
+    if (count == 0) {
+      count = 1;
+    } else if (count > controller->num_sectors) {
+      count = controller->num_sectors;
+    }
+    *sector_size = count * sect_size;
     if (!ide_read_sector(channel, buffer, *sector_size)) {
       return 0;
     }
@@ -3455,7 +3522,7 @@ bool bx_hard_drive_c::bmdma_read_sector(Bit8u channel, Bit8u *buffer, Bit32u *se
   return 1;
 }
 
-bool bx_hard_drive_c::bmdma_write_sector(Bit8u channel, Bit8u *buffer)
+bool bx_hard_drive_c::bmdma_write_sector(Bit8u channel, Bit8u *buffer, Bit32u *sector_size)
 {
   controller_t *controller = &BX_SELECTED_CONTROLLER(channel);
 
@@ -3467,7 +3534,16 @@ bool bx_hard_drive_c::bmdma_write_sector(Bit8u channel, Bit8u *buffer)
   }
   if (controller->num_sectors == 0)
     return 0;
-  if (!ide_write_sector(channel, buffer, BX_SELECTED_DRIVE(channel).sect_size)) {
+  // transfer as many sectors as the caller has data for in one request
+  Bit32u sect_size = BX_SELECTED_DRIVE(channel).sect_size;
+  Bit32u count = *sector_size / sect_size;
+  if (count == 0) {
+    count = 1;
+  } else if (count > controller->num_sectors) {
+    count = controller->num_sectors;
+  }
+  *sector_size = count * sect_size;
+  if (!ide_write_sector(channel, buffer, *sector_size)) {
     return 0;
   }
   return 1;
@@ -3477,6 +3553,20 @@ void bx_hard_drive_c::bmdma_complete(Bit8u channel)
 {
   controller_t *controller = &BX_SELECTED_CONTROLLER(channel);
 
+  if (BX_SELECTED_IS_HD(channel) &&
+      (BX_SELECTED_DRIVE(channel).hdimage->async_io != NULL) &&
+      ((controller->current_command == 0xCA) || (controller->current_command == 0x35))) {
+    if (BX_SELECTED_DRIVE(channel).hdimage->async_io->write_pending()) {
+      // raise the interrupt when the queued writes are done
+      bx_pc_system.activate_timer(BX_SELECTED_DRIVE(channel).seek_timer_index,
+                                  BX_HD_ASYNC_POLL_USEC, 0);
+      return;
+    }
+    if (BX_SELECTED_DRIVE(channel).hdimage->async_io->write_failed()) {
+      command_aborted(channel, controller->current_command);
+      return;
+    }
+  }
   controller->status.busy = 0;
   controller->status.drive_ready = 1;
   controller->status.drq = 0;
@@ -3516,7 +3606,8 @@ bool bx_hard_drive_c::ide_read_sector(Bit8u channel, Bit8u *buffer, Bit32u buffe
   controller_t *controller = &BX_SELECTED_CONTROLLER(channel);
 
   Bit64s logical_sector = 0;
-  Bit64s ret;
+  Bit64s run_start = 0;
+  Bit32u run_size = 0;
 
   unsigned sect_size = BX_SELECTED_DRIVE(channel).sect_size;
   int sector_count = (buffer_size / sect_size);
@@ -3526,26 +3617,22 @@ bool bx_hard_drive_c::ide_read_sector(Bit8u channel, Bit8u *buffer, Bit32u buffe
       command_aborted(channel, controller->current_command);
       return 0;
     }
-    ret = BX_SELECTED_DRIVE(channel).hdimage->lseek(logical_sector * sect_size, SEEK_SET);
-    if (ret < 0) {
-      BX_ERROR(("could not lseek() hard drive image file"));
-      command_aborted(channel, controller->current_command);
-      return 0;
+    // consecutive sectors are read from the image with a single request
+    if ((run_size > 0) && (logical_sector != (run_start + run_size / sect_size))) {
+      if (!ide_read_image(channel, run_start * sect_size, bufptr - run_size, run_size))
+        return 0;
+      run_size = 0;
     }
-    /* set status bar conditions for device */
-    bx_gui->statusbar_setitem(BX_SELECTED_DRIVE(channel).statusbar_id, 1);
-    ret = BX_SELECTED_DRIVE(channel).hdimage->read((bx_ptr_t)bufptr, sect_size);
-    if (ret < sect_size) {
-      BX_ERROR(("could not read() hard drive image file at byte %lu", (unsigned long)logical_sector*sect_size));
-      command_aborted(channel, controller->current_command);
-      return 0;
+    if (run_size == 0) {
+      run_start = logical_sector;
     }
+    run_size += sect_size;
     increment_address(channel, &logical_sector);
     BX_SELECTED_DRIVE(channel).next_lsector = logical_sector;
     bufptr += sect_size;
   } while (--sector_count > 0);
 
-  return 1;
+  return ide_read_image(channel, run_start * sect_size, bufptr - run_size, run_size);
 }
 
 bool bx_hard_drive_c::ide_write_sector(Bit8u channel, Bit8u *buffer, Bit32u buffer_size)
@@ -3553,7 +3640,8 @@ bool bx_hard_drive_c::ide_write_sector(Bit8u channel, Bit8u *buffer, Bit32u buff
   controller_t *controller = &BX_SELECTED_CONTROLLER(channel);
 
   Bit64s logical_sector = 0;
-  Bit64s ret;
+  Bit64s run_start = 0;
+  Bit32u run_size = 0;
 
   unsigned sect_size = BX_SELECTED_DRIVE(channel).sect_size;
   int sector_count = (buffer_size / sect_size);
@@ -3563,28 +3651,94 @@ bool bx_hard_drive_c::ide_write_sector(Bit8u channel, Bit8u *buffer, Bit32u buff
       command_aborted(channel, controller->current_command);
       return 0;
     }
-    ret = BX_SELECTED_DRIVE(channel).hdimage->lseek(logical_sector * sect_size, SEEK_SET);
-    if (ret < 0) {
-      BX_ERROR(("could not lseek() hard drive image file at byte %lu", (unsigned long)logical_sector * sect_size));
-      command_aborted(channel, controller->current_command);
-      return 0;
+    // consecutive sectors are written to the image with a single request
+    if ((run_size > 0) && (logical_sector != (run_start + run_size / sect_size))) {
+      if (!ide_write_image(channel, run_start * sect_size, bufptr - run_size, run_size))
+        return 0;
+      run_size = 0;
     }
-    /* set status bar conditions for device */
-    bx_gui->statusbar_setitem(BX_SELECTED_DRIVE(channel).statusbar_id, 1, 1 /* write */);
-    ret = BX_SELECTED_DRIVE(channel).hdimage->write((bx_ptr_t)bufptr, sect_size);
-    if (ret < sect_size) {
-      BX_ERROR(("could not write() hard drive image file at byte %lu", (unsigned long)logical_sector*sect_size));
-      command_aborted(channel, controller->current_command);
-      return 0;
+    if (run_size == 0) {
+      run_start = logical_sector;
     }
+    run_size += sect_size;
     increment_address(channel, &logical_sector);
     BX_SELECTED_DRIVE(channel).next_lsector = logical_sector;
     bufptr += sect_size;
   } while (--sector_count > 0);
 
+  return ide_write_image(channel, run_start * sect_size, bufptr - run_size, run_size);
+}
+
+bool bx_hard_drive_c::ide_read_image(Bit8u channel, Bit64s offset, Bit8u *buffer, Bit32u count)
+{
+  controller_t *controller = &BX_SELECTED_CONTROLLER(channel);
+  device_image_t *hdimage = BX_SELECTED_DRIVE(channel).hdimage;
+  bx_iovec_t iov;
+
+  /* set status bar conditions for device */
+  bx_gui->statusbar_setitem(BX_SELECTED_DRIVE(channel).statusbar_id, 1);
+  if (hdimage->async_io != NULL) {
+    if (hdimage->async_io->read(offset, buffer, count))
+      return 1;
+    hdimage->async_io->drain();
+  }
+  iov.iov_base = buffer;
+  iov.iov_len = count;
+  if (hdimage->readv(offset, &iov, 1) < (ssize_t)count) {
+    BX_ERROR(("could not read() hard drive image file at byte %lu", (unsigned long)offset));
+    command_aborted(channel, controller->current_command);
+    return 0;
+  }
+  return 1;
+}
+
+bool bx_hard_drive_c::ide_write_image(Bit8u channel, Bit64s offset, Bit8u *buffer, Bit32u count)
+{
+  controller_t *controller = &BX_SELECTED_CONTROLLER(channel);
+  device_image_t *hdimage = BX_SELECTED_DRIVE(channel).hdimage;
+  bx_iovec_t iov;
+
+  /* set status bar conditions for device */
+  bx_gui->statusbar_setitem(BX_SELECTED_DRIVE(channel).statusbar_id, 1, 1 /* write */);
+  if (hdimage->async_io != NULL) {
+    /* write errors are reported when the command completes */
+    hdimage->async_io->write(offset, buffer, count);
+    return 1;
+  }
+  iov.iov_base = buffer;
+  iov.iov_len = count;
+  if (hdimage->writev(offset, &iov, 1) < (ssize_t)count) {
+    BX_ERROR(("could not write() hard drive image file at byte %lu", (unsigned long)offset));
+    command_aborted(channel, controller->current_command);
+    return 0;
+  }
   return 1;
 }
 
+bool bx_hard_drive_c::async_io_busy(Bit8u channel, Bit8u device)
+{
+  async_image_io_c *async_io = BX_DRIVE(channel, device).hdimage->async_io;
+
+  if (async_io == NULL)
+    return 0;
+  switch (BX_CONTROLLER(channel, device).current_command) {
+    case 0x24: // READ SECTORS EXT
+    case 0x29: // READ MULTIPLE EXT
+    case 0x20: // READ SECTORS, with retries
+    case 0x21: // READ SECTORS, without retries
+    case 0xC4: // READ MULTIPLE SECTORS
+    case 0x25: // READ DMA EXT
+    case 0xC8: // READ DMA
+      return !async_io->read_ready(BX_DRIVE(channel, device).next_lsector *
+                                   BX_DRIVE(channel, device).sect_size);
+    case 0x35: // WRITE DMA EXT
+    case 0xCA: // WRITE DMA
+      return async_io->write_pending();
+    default:
+      return 0;
+  }
+}
+
 void bx_hard_drive_c::lba48_transform(controller_t *controller, bool lba48)
 {
   controller->lba48 = lba48;
@@ -23,6 +23,9 @@
 
 #define MAX_MULTIPLE_SECTORS 16
 
+// interval for checking the completion of asynchronous image I/O
+#define BX_HD_ASYNC_POLL_USEC 50
+
 typedef enum _sense {
   SENSE_NONE = 0, SENSE_NOT_READY = 2,
   SENSE_ILLEGAL_REQUEST = 5,
@@ -172,7 +175,7 @@ public:
   virtual void     reset(unsigned type);
 #if BX_SUPPORT_PCI
   virtual bool     bmdma_read_sector(Bit8u channel, Bit8u *buffer, Bit32u *sector_size);
-  virtual bool     bmdma_write_sector(Bit8u channel, Bit8u *buffer);
+  virtual bool     bmdma_write_sector(Bit8u channel, Bit8u *buffer, Bit32u *sector_size);
   virtual void     bmdma_complete(Bit8u channel);
 #endif
   virtual void     register_state(void);
@@ -218,8 +221,11 @@ private:
   BX_HD_SMF void set_signature(Bit8u channel, Bit8u id);
   BX_HD_SMF bool ide_read_sector(Bit8u channel, Bit8u *buffer, Bit32u buffer_size);
   BX_HD_SMF bool ide_write_sector(Bit8u channel, Bit8u *buffer, Bit32u buffer_size);
+  BX_HD_SMF bool ide_read_image(Bit8u channel, Bit64s offset, Bit8u *buffer, Bit32u count);
+  BX_HD_SMF bool ide_write_image(Bit8u channel, Bit64s offset, Bit8u *buffer, Bit32u count);
   BX_HD_SMF void lba48_transform(controller_t *controller, bool lba48);
   BX_HD_SMF void start_seek(Bit8u channel);
+  BX_HD_SMF bool async_io_busy(Bit8u channel, Bit8u device);
 
   BX_HD_SMF bool set_cd_media_status(Bit32u handle, bool status);
 
@@ -56,10 +56,11 @@
 
 bx_hdimage_ctl_c bx_hdimage_ctl;
 
-const Bit8u n_hdimage_builtin_modes = 7;
+const Bit8u n_hdimage_builtin_modes = 8;
 
 const char *builtin_mode_names[n_hdimage_builtin_modes] = {
   "flat",
+  "mmap",
   "concat",
   "sparse",
   "dll",
@@ -146,6 +147,8 @@ device_image_t* bx_hdimage_ctl_c::init_image(const char *image_mode, Bit64u disk
   // instantiate the right class
   if (!strcmp(image_mode, "flat")) {
     hdimage = new flat_image_t();
+  } else if (!strcmp(image_mode, "mmap")) {
+    hdimage = new flat_image_t(1);
   } else if (!strcmp(image_mode, "concat")) {
     hdimage = new concat_image_t();
 #ifdef WIN32
@@ -490,6 +493,9 @@ Bit64s hdimage_save_handler(void *class_ptr, bx_param_c *param)
     return 0;
   }
   sprintf(path, "%s/%s", SIM->get_param_string(BXPN_RESTORE_PATH)->getptr(), imgname);
+  if (((device_image_t*)class_ptr)->async_io != NULL) {
+    ((device_image_t*)class_ptr)->async_io->drain();
+  }
   return ((device_image_t*)class_ptr)->save_state(path);
 }
 
@@ -626,6 +632,9 @@ device_image_t::device_image_t()
   cylinders = 0;
   hd_size = 0;
   sect_size = 512;
+#ifndef BXIMAGE
+  async_io = NULL;
+#endif
 }
 
 int device_image_t::open(const char* _pathname)
@@ -633,6 +642,38 @@ int device_image_t::open(const char* _pathname)
   return open(_pathname, O_RDWR);
 }
 
+ssize_t device_image_t::readv(Bit64s offset, const bx_iovec_t *iov, int iovcnt)
+{
+  ssize_t total = 0;
+
+  if (lseek(offset, SEEK_SET) < 0) {
+    return -1;
+  }
+  for (int i = 0; i < iovcnt; i++) {
+    if (read(iov[i].iov_base, iov[i].iov_len) != (ssize_t)iov[i].iov_len) {
+      return -1;
+    }
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+
+ssize_t device_image_t::writev(Bit64s offset, const bx_iovec_t *iov, int iovcnt)
+{
+  ssize_t total = 0;
+
+  if (lseek(offset, SEEK_SET) < 0) {
+    return -1;
+  }
+  for (int i = 0; i < iovcnt; i++) {
+    if (write(iov[i].iov_base, iov[i].iov_len) != (ssize_t)iov[i].iov_len) {
+      return -1;
+    }
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+
 Bit32u device_image_t::get_capabilities()
 {
   return (cylinders == 0) ? HDIMAGE_AUTO_GEOMETRY : 0;
@@ -651,8 +692,724 @@ void device_image_t::register_state(bx_list_c *parent)
 }
 #endif
 
+#ifndef BXIMAGE
+/*** async_image_io_c function definitions ***/
+
+BX_THREAD_FUNC(async_image_io_thread, indata)
+{
+  ((async_image_io_c*)indata)->worker();
+  BX_THREAD_EXIT;
+}
+
+async_image_io_c::async_image_io_c(device_image_t *_image)
+{
+  image = _image;
+  image->async_io = this;
+  for (int i = 0; i < BX_ASYNC_IO_SLOTS; i++) {
+    slot[i].state = SLOT_FREE;
+    slot[i].buffer = new Bit8u[BX_ASYNC_IO_WINDOW];
+  }
+  submit_seq = 0;
+  ra_next = 0;
+  ra_end = 0;
+  open_slot = -1;
+  failed = 0;
+  stop = 0;
+  running = 1;
+  BX_INIT_MUTEX(lock);
+  bx_create_sem(&request_sem);
+  bx_create_sem(&done_sem);
+  BX_THREAD_CREATE(async_image_io_thread, this, worker_thread);
+}
+
+async_image_io_c::~async_image_io_c()
+{
+  drain();
+  BX_LOCK(lock);
+  stop = 1;
+  BX_UNLOCK(lock);
+  bx_set_sem(&request_sem);
+  BX_LOCK(lock);
+  while (running) {
+    BX_UNLOCK(lock);
+    bx_wait_sem(&done_sem);
+    BX_LOCK(lock);
+  }
+  BX_UNLOCK(lock);
+  BX_THREAD_JOIN(worker_thread);
+  bx_destroy_sem(&request_sem);
+  bx_destroy_sem(&done_sem);
+  BX_FINI_MUTEX(lock);
+  for (int i = 0; i < BX_ASYNC_IO_SLOTS; i++) {
+    delete [] slot[i].buffer;
+  }
+  image->async_io = NULL;
+}
+
+// Worker thread: process the queued requests in submission order
+void async_image_io_c::worker()
+{
+  BX_LOCK(lock);
+  while (!stop) {
+    int next = -1;
+    for (int i = 0; i < BX_ASYNC_IO_SLOTS; i++) {
+      if ((slot[i].state == SLOT_QUEUED) &&
+          ((next < 0) || ((Bit32s)(slot[i].seq - slot[next].seq) < 0))) {
+        next = i;
+      }
+    }
+    if (next < 0) {
+      BX_UNLOCK(lock);
+      bx_wait_sem(&request_sem);
+      BX_LOCK(lock);
+      continue;
+    }
+    Bit64s offset = slot[next].offset;
+    Bit32u len = slot[next].len;
+    Bit8u *buf = slot[next].buffer;
+    bool write = slot[next].write;
+    BX_UNLOCK(lock);
+    bx_iovec_t iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    bool ok;
+    if (write) {
+      ok = (image->writev(offset, &iov, 1) == (ssize_t)len);
+    } else {
+      ok = (image->readv(offset, &iov, 1) == (ssize_t)len);
+    }
+    BX_LOCK(lock);
+    if (write) {
+      if (!ok) failed = 1;
+      slot[next].state = SLOT_FREE;
+    } else if (slot[next].discard) {
+      slot[next].state = SLOT_FREE;
+    } else {
+      slot[next].state = ok ? SLOT_DONE : SLOT_FAILED;
+    }
+    bx_set_sem(&done_sem);
+  }
+  running = 0;
+  BX_UNLOCK(lock);
+  bx_set_sem(&done_sem);
+}
+
+// The following helpers are called with the lock held
+
+void async_image_io_c::submit(int i)
+{
+  slot[i].seq = submit_seq++;
+  slot[i].discard = 0;
+  slot[i].state = SLOT_QUEUED;
+  if (i == open_slot) {
+    open_slot = -1;
+  }
+  bx_set_sem(&request_sem);
+}
+
+void async_image_io_c::wait_for_slot(int i)
+{
+  while (slot[i].state == SLOT_QUEUED) {
+    BX_UNLOCK(lock);
+    bx_wait_sem(&done_sem);
+    BX_LOCK(lock);
+  }
+}
+
+int async_image_io_c::find_free_slot()
+{
+  int i, oldest;
+
+  while (1) {
+    oldest = -1;
+    for (i = 0; i < BX_ASYNC_IO_SLOTS; i++) {
+      if (slot[i].state == SLOT_FREE) {
+        return i;
+      } else if (((slot[i].state == SLOT_DONE) || (slot[i].state == SLOT_FAILED)) &&
+                 ((oldest < 0) || ((Bit32s)(slot[i].seq - slot[oldest].seq) < 0))) {
+        oldest = i;
+      }
+    }
+    if (oldest >= 0) {
+      // drop the oldest read ahead data
+      slot[oldest].state = SLOT_FREE;
+      return oldest;
+    }
+    BX_UNLOCK(lock);
+    bx_wait_sem(&done_sem);
+    BX_LOCK(lock);
+  }
+}
+
+int async_image_io_c::find_read_slot(Bit64s offset)
+{
+  for (int i = 0; i < BX_ASYNC_IO_SLOTS; i++) {
+    if (!slot[i].write && (slot[i].state >= SLOT_QUEUED) && !slot[i].discard &&
+        (offset >= slot[i].offset) && (offset < (Bit64s)(slot[i].offset + slot[i].len))) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Drop read ahead data overlapping the given range
+void async_image_io_c::invalidate(Bit64s offset, Bit64u count)
+{
+  for (int i = 0; i < BX_ASYNC_IO_SLOTS; i++) {
+    if (!slot[i].write && (slot[i].state >= SLOT_QUEUED) &&
+        (offset < (Bit64s)(slot[i].offset + slot[i].len)) &&
+        ((Bit64s)(offset + count) > slot[i].offset)) {
+      if (slot[i].state == SLOT_QUEUED) {
+        slot[i].discard = 1;
+      } else {
+        slot[i].state = SLOT_FREE;
+      }
+    }
+  }
+}
+
+// Keep up to two read ahead windows in flight
+void async_image_io_c::read_ahead()
+{
+  int i, active = 0;
+
+  for (i = 0; i < BX_ASYNC_IO_SLOTS; i++) {
+    if (!slot[i].write && !slot[i].discard &&
+        ((slot[i].state == SLOT_QUEUED) || (slot[i].state == SLOT_DONE))) {
+      active++;
+    }
+  }
+  while ((ra_next < ra_end) && (active < 2)) {
+    i = -1;
+    for (int j = 0; j < BX_ASYNC_IO_SLOTS; j++) {
+      if (slot[j].state == SLOT_FREE) {
+        i = j;
+        break;
+      }
+    }
+    if (i < 0) break;
+    slot[i].write = 0;
+    slot[i].offset = ra_next;
+    slot[i].len = ((ra_end - ra_next) > BX_ASYNC_IO_WINDOW) ? BX_ASYNC_IO_WINDOW : (Bit32u)(ra_end - ra_next);
+    ra_next += slot[i].len;
+    submit(i);
+    active++;
+  }
+}
+
+void async_image_io_c::prefetch(Bit64s offset, Bit64u count)
+{
+  BX_LOCK(lock);
+  // queued writes must be performed before the reads
+  if (open_slot >= 0) {
+    submit(open_slot);
+  }
+  // drop the read ahead data of the previous request
+  invalidate(0, BX_MAX_BIT64S);
+  ra_next = offset;
+  ra_end = offset + count;
+  read_ahead();
+  BX_UNLOCK(lock);
+}
+
+bool async_image_io_c::read(Bit64s offset, void *buf, unsigned count)
+{
+  Bit8u *cbuf = (Bit8u*)buf;
+
+  BX_LOCK(lock);
+  // the requested range may span several read ahead windows
+  while (count > 0) {
+    int i = find_read_slot(offset);
+    if (i < 0) {
+      BX_UNLOCK(lock);
+      return 0;
+    }
+    wait_for_slot(i);
+    if (slot[i].state != SLOT_DONE) {
+      // let the caller retry synchronously and report the error
+      slot[i].state = SLOT_FREE;
+      BX_UNLOCK(lock);
+      return 0;
+    }
+    Bit64s slot_end = slot[i].offset + slot[i].len;
+    unsigned len = (unsigned)(slot_end - offset);
+    if (len > count) {
+      len = count;
+    }
+    memcpy(cbuf, slot[i].buffer + (offset - slot[i].offset), len);
+    offset += len;
+    cbuf += len;
+    count -= len;
+    if (offset == slot_end) {
+      // window consumed, reuse it for the next one
+      slot[i].state = SLOT_FREE;
+      read_ahead();
+    }
+  }
+  BX_UNLOCK(lock);
+  return 1;
+}
+
+void async_image_io_c::write(Bit64s offset, const void *buf, unsigned count)
+{
+  const Bit8u *cbuf = (const Bit8u*)buf;
+
+  BX_LOCK(lock);
+  invalidate(offset, count);
+  if ((open_slot >= 0) &&
+      (offset != (Bit64s)(slot[open_slot].offset + slot[open_slot].len))) {
+    submit(open_slot);
+  }
+  while (count > 0) {
+    if (open_slot < 0) {
+      open_slot = find_free_slot();
+      slot[open_slot].state = SLOT_OPEN;
+      slot[open_slot].write = 1;
+      slot[open_slot].offset = offset;
+      slot[open_slot].len = 0;
+    }
+    unsigned len = BX_ASYNC_IO_WINDOW - slot[open_slot].len;
+    if (len > count) {
+      len = count;
+    }
+    memcpy(slot[open_slot].buffer + slot[open_slot].len, cbuf, len);
+    slot[open_slot].len += len;
+    if (slot[open_slot].len == BX_ASYNC_IO_WINDOW) {
+      submit(open_slot);
+    }
+    offset += len;
+    cbuf += len;
+    count -= len;
+  }
+  BX_UNLOCK(lock);
+}
+
+bool async_image_io_c::read_ready(Bit64s offset)
+{
+  BX_LOCK(lock);
+  int i = find_read_slot(offset);
+  bool ready = (i < 0) || (slot[i].state != SLOT_QUEUED);
+  BX_UNLOCK(lock);
+  return ready;
+}
+
+void async_image_io_c::flush()
+{
+  BX_LOCK(lock);
+  if (open_slot >= 0) {
+    submit(open_slot);
+  }
+  BX_UNLOCK(lock);
+}
+
+bool async_image_io_c::write_pending()
+{
+  bool pending = 0;
+
+  flush();
+  BX_LOCK(lock);
+  for (int i = 0; i < BX_ASYNC_IO_SLOTS; i++) {
+    if (slot[i].write && (slot[i].state == SLOT_QUEUED)) {
+      pending = 1;
+    }
+  }
+  BX_UNLOCK(lock);
+  return pending;
+}
+
+bool async_image_io_c::write_failed()
+{
+  BX_LOCK(lock);
+  bool ret = failed;
+  failed = 0;
+  BX_UNLOCK(lock);
+  return ret;
+}
+
+void async_image_io_c::drain()
+{
+  BX_LOCK(lock);
+  if (open_slot >= 0) {
+    submit(open_slot);
+  }
+  for (int i = 0; i < BX_ASYNC_IO_SLOTS; i++) {
+    wait_for_slot(i);
+  }
+  // the caller accesses the image directly now
+  invalidate(0, BX_MAX_BIT64S);
+  ra_next = ra_end;
+  BX_UNLOCK(lock);
+}
+
+/*** cached_image_t function definitions ***/
+
+// Mask of the sectors [first, first+count) of a cache block
+static inline Bit64u hdcache_sector_mask(unsigned first, unsigned count)
+{
+  Bit64u mask = (count >= 64) ? BX_CONST64(0xffffffffffffffff) : ((BX_CONST64(1) << count) - 1);
+  return mask << first;
+}
+
+cached_image_t::cached_image_t(device_image_t *_image, Bit32u size_mb)
+{
+  int i;
+
+  image = _image;
+  cylinders = image->cylinders;
+  heads = image->heads;
+  spt = image->spt;
+  sect_size = image->sect_size;
+  hd_size = image->hd_size;
+  pos = 0;
+  num_entries = (int)(((Bit64u)size_mb << 20) / BX_HDCACHE_BLOCK_SIZE);
+  if (num_entries < 1) {
+    num_entries = 1;
+  }
+  for (i = 1; i < num_entries; i <<= 1);
+  hash_mask = i - 1;
+  hash = new int[i];
+  for (i = 0; i <= hash_mask; i++) {
+    hash[i] = -1;
+  }
+  entries = new cache_entry_t[num_entries];
+  buffers = new Bit8u[(Bit64u)num_entries * BX_HDCACHE_BLOCK_SIZE];
+  for (i = 0; i < num_entries; i++) {
+    entries[i].block = -1;
+    entries[i].valid = 0;
+    entries[i].dirty = 0;
+    entries[i].buffer = buffers + (Bit64u)i * BX_HDCACHE_BLOCK_SIZE;
+    entries[i].hash_next = -1;
+    entries[i].lru_prev = i - 1;
+    entries[i].lru_next = (i < (num_entries - 1)) ? (i + 1) : -1;
+  }
+  lru_head = 0;
+  lru_tail = num_entries - 1;
+  write_error = 0;
+}
+
+cached_image_t::~cached_image_t()
+{
+  delete image;
+  delete [] buffers;
+  delete [] entries;
+  delete [] hash;
+}
+
+int cached_image_t::open(const char* pathname, int flags)
+{
+  int ret = image->open(pathname, flags);
+
+  cylinders = image->cylinders;
+  heads = image->heads;
+  spt = image->spt;
+  sect_size = image->sect_size;
+  hd_size = image->hd_size;
+  return ret;
+}
+
+void cached_image_t::close()
+{
+  if (!flush()) {
+    BX_ERROR(("block cache: could not write back all modified data"));
+  }
+  discard();
+  image->close();
+}
+
+Bit64s cached_image_t::lseek(Bit64s offset, int whence)
+{
+  if (whence == SEEK_SET) {
+    pos = offset;
+  } else if (whence == SEEK_CUR) {
+    pos += offset;
+  } else if (whence == SEEK_END) {
+    pos = (Bit64s)hd_size + offset;
+  } else {
+    return -1;
+  }
+  return pos;
+}
+
+ssize_t cached_image_t::read(void* buf, size_t count)
+{
+  ssize_t ret = transfer(pos, (Bit8u*)buf, count, 0);
+  if (ret > 0) pos += ret;
+  return ret;
+}
+
+ssize_t cached_image_t::write(const void* buf, size_t count)
+{
+  ssize_t ret = transfer(pos, (Bit8u*)buf, count, 1);
+  if (ret > 0) pos += ret;
+  return ret;
+}
+
+ssize_t cached_image_t::readv(Bit64s offset, const bx_iovec_t *iov, int iovcnt)
+{
+  ssize_t total = 0;
+
+  for (int i = 0; i < iovcnt; i++) {
+    if (transfer(offset + total, (Bit8u*)iov[i].iov_base, iov[i].iov_len, 0) != (ssize_t)iov[i].iov_len) {
+      return -1;
+    }
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+
+ssize_t cached_image_t::writev(Bit64s offset, const bx_iovec_t *iov, int iovcnt)
+{
+  ssize_t total = 0;
+
+  for (int i = 0; i < iovcnt; i++) {
+    if (transfer(offset + total, (Bit8u*)iov[i].iov_base, iov[i].iov_len, 1) != (ssize_t)iov[i].iov_len) {
+      return -1;
+    }
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+
+bool cached_image_t::flush()
+{
+  bool ret = 1;
+
+  for (int i = 0; i < num_entries; i++) {
+    if (entries[i].dirty && !write_back(i)) {
+      ret = 0;
+    }
+  }
+  return ret && image->flush();
+}
+
+Bit32u cached_image_t::get_capabilities()
+{
+  return image->get_capabilities();
+}
+
+Bit32u cached_image_t::get_timestamp()
+{
+  return image->get_timestamp();
+}
+
+bool cached_image_t::save_state(const char *backup_fname)
+{
+  if (!flush()) {
+    return 0;
+  }
+  return image->save_state(backup_fname);
+}
+
+void cached_image_t::restore_state(const char *backup_fname)
+{
+  // the cached data doesn't match the restored image
+  discard();
+  image->restore_state(backup_fname);
+}
+
+ssize_t cached_image_t::transfer(Bit64s offset, Bit8u *buf, size_t count, bool write)
+{
+  size_t done = 0;
+
+  if ((offset & 0x1ff) || (count & 0x1ff)) {
+    // not sector aligned: pass it through with the cache written back
+    bx_iovec_t iov;
+    if (!flush()) {
+      return -1;
+    }
+    discard();
+    iov.iov_base = buf;
+    iov.iov_len = count;
+    return write ? image->writev(offset, &iov, 1) : image->readv(offset, &iov, 1);
+  }
+  while (done < count) {
+    Bit64s block = offset / BX_HDCACHE_BLOCK_SIZE;
+    unsigned block_offset = (unsigned)(offset % BX_HDCACHE_BLOCK_SIZE);
+    unsigned len = BX_HDCACHE_BLOCK_SIZE - block_offset;
+    if (len > (count - done)) {
+      len = (unsigned)(count - done);
+    }
+    Bit64u mask = hdcache_sector_mask(block_offset >> 9, len >> 9);
+    int i = lookup(block);
+    if (i < 0) {
+      i = get_entry(block);
+      if (i < 0) {
+        return -1;
+      }
+    }
+    if (write) {
+      memcpy(entries[i].buffer + block_offset, buf + done, len);
+      entries[i].valid |= mask;
+      entries[i].dirty |= mask;
+    } else {
+      if (((entries[i].valid & mask) != mask) && !fill(i, mask)) {
+        return -1;
+      }
+      memcpy(buf + done, entries[i].buffer + block_offset, len);
+    }
+    touch(i);
+    offset += len;
+    done += len;
+  }
+  return (ssize_t)done;
+}
+
+int cached_image_t::lookup(Bit64s block)
+{
+  int i = hash[block & hash_mask];
+
+  while ((i >= 0) && (entries[i].block != block)) {
+    i = entries[i].hash_next;
+  }
+  return i;
+}
+
+// Reuse the least recently used entry for the given block. An entry that
+// can't be written back keeps its data and is moved to the head, so the
+// next entry is tried and later misses don't fail on the same block.
+int cached_image_t::get_entry(Bit64s block)
+{
+  int i = lru_tail, tries;
+
+  for (tries = 0; tries < num_entries; tries++) {
+    if (!entries[i].dirty || write_back(i)) break;
+    touch(i);
+    i = lru_tail;
+  }
+  if (tries == num_entries) {
+    return -1;
+  }
+  if (entries[i].block >= 0) {
+    unlink_hash(i);
+  }
+  entries[i].block = block;
+  entries[i].valid = 0;
+  entries[i].dirty = 0;
+  entries[i].hash_next = hash[block & hash_mask];
+  hash[block & hash_mask] = i;
+  return i;
+}
+
+// Read the missing sectors of an entry. The whole block is read, so the
+// following sequential requests are served from the cache.
+bool cached_image_t::fill(int i, Bit64u mask)
+{
+  Bit64s start = entries[i].block * BX_HDCACHE_BLOCK_SIZE;
+  unsigned sectors = BX_HDCACHE_BLOCK_SECTORS;
+  unsigned first, last;
+  bx_iovec_t iov;
+
+  if (start >= (Bit64s)hd_size) {
+    sectors = 0;
+  } else if ((Bit64u)(start + BX_HDCACHE_BLOCK_SIZE) > hd_size) {
+    sectors = (unsigned)((hd_size - start) >> 9);
+  }
+  if ((mask & ~hdcache_sector_mask(0, sectors)) != 0) {
+    // request beyond the end of the image
+    return 0;
+  }
+  Bit64u missing = hdcache_sector_mask(0, sectors) & ~entries[i].valid;
+  for (first = 0; first < sectors; first = last) {
+    if (!((missing >> first) & 1)) {
+      last = first + 1;
+      continue;
+    }
+    for (last = first + 1; (last < sectors) && ((missing >> last) & 1); last++);
+    iov.iov_base = entries[i].buffer + (first << 9);
+    iov.iov_len = (last - first) << 9;
+    if (image->readv(start + (first << 9), &iov, 1) != (ssize_t)iov.iov_len) {
+      BX_ERROR(("block cache: could not read image at byte " FMT_LL "d", start + (first << 9)));
+      return 0;
+    }
+  }
+  entries[i].valid |= missing;
+  return 1;
+}
+
+bool cached_image_t::write_back(int i)
+{
+  Bit64s start = entries[i].block * BX_HDCACHE_BLOCK_SIZE;
+  Bit64u dirty = entries[i].dirty;
+  unsigned first, last;
+  bx_iovec_t iov;
+
+  for (first = 0; first < BX_HDCACHE_BLOCK_SECTORS; first = last) {
+    if (!((dirty >> first) & 1)) {
+      last = first + 1;
+      continue;
+    }
+    for (last = first + 1; (last < BX_HDCACHE_BLOCK_SECTORS) && ((dirty >> last) & 1); last++);
+    iov.iov_base = entries[i].buffer + (first << 9);
+    iov.iov_len = (last - first) << 9;
+    if (image->writev(start + (first << 9), &iov, 1) != (ssize_t)iov.iov_len) {
+      if (!write_error) {
+        BX_ERROR(("block cache: could not write image at byte " FMT_LL "d", start + (first << 9)));
+        write_error = 1;
+      }
+      return 0;
+    }
+  }
+  entries[i].dirty = 0;
+  write_error = 0;
+  return 1;
+}
+
+// Make an entry the most recently used one
+void cached_image_t::touch(int i)
+{
+  if (i == lru_head) return;
+  // unlink (i has a predecessor, since it isn't the head)
+  entries[entries[i].lru_prev].lru_next = entries[i].lru_next;
+  if (entries[i].lru_next >= 0) {
+    entries[entries[i].lru_next].lru_prev = entries[i].lru_prev;
+  } else {
+    lru_tail = entries[i].lru_prev;
+  }
+  entries[i].lru_prev = -1;
+  entries[i].lru_next = lru_head;
+  entries[lru_head].lru_prev = i;
+  lru_head = i;
+}
+
+void cached_image_t::unlink_hash(int i)
+{
+  int *link = &hash[entries[i].block & hash_mask];
+
+  while (*link != i) {
+    link = &entries[*link].hash_next;
+  }
+  *link = entries[i].hash_next;
+  entries[i].hash_next = -1;
+}
+
+// Drop all cached data without writing it back
+void cached_image_t::discard()
+{
+  for (int i = 0; i < num_entries; i++) {
+    if (entries[i].block >= 0) {
+      unlink_hash(i);
+    }
+    entries[i].block = -1;
+    entries[i].valid = 0;
+    entries[i].dirty = 0;
+  }
+}
+#endif
+
 /*** flat_image_t function definitions ***/
 
+flat_image_t::flat_image_t(bool use_mmap) : device_image_t()
+{
+  fd = -1;
+  pathname = NULL;
+  this->use_mmap = use_mmap;
+#ifdef _POSIX_MAPPED_FILES
+  mmap_data = NULL;
+  mmap_dirty = 0;
+  mmap_pos = 0;
+#endif
+}
+
 int flat_image_t::open(const char* _pathname, int flags)
 {
   pathname = _pathname;
@@ -664,11 +1421,50 @@ int flat_image_t::open(const char* _pathname, int flags)
   if ((hd_size % sect_size) != 0) {
     BX_PANIC(("size of disk image must be multiple of %d bytes", sect_size));
   }
+#ifdef _POSIX_MAPPED_FILES
+  if (use_mmap) map_image(flags);
+#else
+  if (use_mmap) BX_INFO(("memory mapped files not supported - using conventional file access"));
+#endif
   return fd;
 }
 
+#ifdef _POSIX_MAPPED_FILES
+void flat_image_t::map_image(int flags)
+{
+  struct stat stat_buf;
+  int prot = PROT_READ;
+
+  mmap_data = NULL;
+  mmap_dirty = 0;
+  mmap_pos = 0;
+  // devices are accessed conventionally and 32-bit hosts have no address
+  // space to spare for large images
+  if ((fstat(fd, &stat_buf) != 0) || !S_ISREG(stat_buf.st_mode) ||
+      ((sizeof(void*) < 8) && (hd_size > (256 << 20)))) {
+    return;
+  }
+  if ((flags & O_ACCMODE) != O_RDONLY) {
+    prot |= PROT_WRITE;
+  }
+  void *ptr = mmap(NULL, (size_t)hd_size, prot, MAP_SHARED, fd, 0);
+  if (ptr == MAP_FAILED) {
+    BX_INFO(("failed to mmap flat disk image - using conventional file access"));
+  } else {
+    mmap_data = (Bit8u*)ptr;
+  }
+}
+#endif
+
 void flat_image_t::close()
 {
+#ifdef _POSIX_MAPPED_FILES
+  if (mmap_data != NULL) {
+    if (munmap(mmap_data, (size_t)hd_size) != 0)
+      BX_INFO(("failed to un-memory map flat disk image"));
+    mmap_data = NULL;
+  }
+#endif
   if (fd > -1) {
     bx_close_image(fd, pathname);
   }
@@ -676,19 +1472,124 @@ void flat_image_t::close()
 
 Bit64s flat_image_t::lseek(Bit64s offset, int whence)
 {
+#ifdef _POSIX_MAPPED_FILES
+  if (mmap_data != NULL) {
+    if (whence == SEEK_SET) {
+      mmap_pos = offset;
+    } else if (whence == SEEK_CUR) {
+      mmap_pos += offset;
+    } else if (whence == SEEK_END) {
+      mmap_pos = (Bit64s)hd_size + offset;
+    } else {
+      return -1;
+    }
+    return mmap_pos;
+  }
+#endif
   return (Bit64s)::lseek(fd, (off_t)offset, whence);
 }
 
 ssize_t flat_image_t::read(void* buf, size_t count)
 {
+#ifdef _POSIX_MAPPED_FILES
+  if (mmap_data != NULL) {
+    bx_iovec_t iov;
+    iov.iov_base = buf;
+    iov.iov_len = count;
+    ssize_t ret = readv(mmap_pos, &iov, 1);
+    if (ret > 0) mmap_pos += ret;
+    return ret;
+  }
+#endif
   return ::read(fd, (char*) buf, count);
 }
 
 ssize_t flat_image_t::write(const void* buf, size_t count)
 {
+#ifdef _POSIX_MAPPED_FILES
+  if (mmap_data != NULL) {
+    bx_iovec_t iov;
+    iov.iov_base = (void*)buf;
+    iov.iov_len = count;
+    ssize_t ret = writev(mmap_pos, &iov, 1);
+    if (ret > 0) mmap_pos += ret;
+    return ret;
+  }
+#endif
   return ::write(fd, (char*) buf, count);
 }
 
+ssize_t flat_image_t::readv(Bit64s offset, const bx_iovec_t *iov, int iovcnt)
+{
+#ifdef _POSIX_MAPPED_FILES
+  if (mmap_data != NULL) {
+    ssize_t total = 0;
+    if (offset < 0) {
+      return -1;
+    }
+    for (int i = 0; (i < iovcnt) && (offset < (Bit64s)hd_size); i++) {
+      size_t len = iov[i].iov_len;
+      // like read(), stop at the end of the file
+      if ((Bit64u)(offset + len) > hd_size) {
+        len = (size_t)(hd_size - offset);
+      }
+      memcpy(iov[i].iov_base, mmap_data + offset, len);
+      offset += len;
+      total += len;
+    }
+    return total;
+  }
+#endif
+#if BX_HAVE_PREADV
+  return ::preadv(fd, iov, iovcnt, (off_t)offset);
+#else
+  return device_image_t::readv(offset, iov, iovcnt);
+#endif
+}
+
+ssize_t flat_image_t::writev(Bit64s offset, const bx_iovec_t *iov, int iovcnt)
+{
+#ifdef _POSIX_MAPPED_FILES
+  if (mmap_data != NULL) {
+    ssize_t total = 0;
+    if (offset < 0) {
+      return -1;
+    }
+    for (int i = 0; (i < iovcnt) && (offset < (Bit64s)hd_size); i++) {
+      size_t len = iov[i].iov_len;
+      // the mapping can't grow the file
+      if ((Bit64u)(offset + len) > hd_size) {
+        len = (size_t)(hd_size - offset);
+      }
+      memcpy(mmap_data + offset, iov[i].iov_base, len);
+      offset += len;
+      total += len;
+    }
+    mmap_dirty = 1;
+    return total;
+  }
+#endif
+#if BX_HAVE_PREADV
+  return ::pwritev(fd, iov, iovcnt, (off_t)offset);
+#else
+  return device_image_t::writev(offset, iov, iovcnt);
+#endif
+}
+
+bool flat_image_t::flush()
+{
+#ifdef _POSIX_MAPPED_FILES
+  if ((mmap_data != NULL) && mmap_dirty) {
+    if (msync(mmap_data, (size_t)hd_size, MS_SYNC) != 0) {
+      BX_ERROR(("failed to sync flat disk image"));
+      return 0;
+    }
+    mmap_dirty = 0;
+  }
+#endif
+  return 1;
+}
+
 int flat_image_t::check_format(int fd, Bit64u imgsize)
 {
   char buffer[512];
@@ -2103,63 +3004,51 @@ int redolog_t::check_format(int fd, const char *subtype)
 }
 
 #ifdef BXIMAGE
-int redolog_t::commit(device_image_t *base_image)
+Bit32u redolog_t::get_extent_count()
 {
-  int ret = 0;
-  Bit32u i;
-  Bit8u buffer[512];
-
-  printf("\nCommitting changes to base image file: [  0%%]");
-
-  for (i = 0; i < dtoh32(header.specific.catalog); i++) {
-    printf("\x8\x8\x8\x8\x8%3d%%]", (i+1)*100/dtoh32(header.specific.catalog));
-    fflush(stdout);
-
-    if (dtoh32(catalog[i]) != REDOLOG_PAGE_NOT_ALLOCATED) {
-      Bit64s bitmap_offset;
-      Bit32u bitmap_size, j;
-
-      bitmap_offset  = (Bit64s)STANDARD_HEADER_SIZE + (dtoh32(header.specific.catalog) * sizeof(Bit32u));
-      bitmap_offset += (Bit64s)512 * dtoh32(catalog[i]) * (extent_blocks + bitmap_blocks);
-
-      // Read bitmap
-      bitmap_size = dtoh32(header.specific.bitmap);
-      if ((Bit32u)bx_read_image(fd, (off_t)bitmap_offset, bitmap, bitmap_size) != bitmap_size) {
-        ret = -1;
-        break;
-      }
-
-      for (j = 0; j < dtoh32(header.specific.bitmap); j++) {
-        Bit32u bit;
-
-        for (bit = 0; bit < 8; bit++) {
-          if ( (bitmap[j] & (1 << bit)) != 0) {
-            Bit64s base_offset, block_offset;
+  return dtoh32(header.specific.catalog);
+}
 
-            block_offset = bitmap_offset + ((Bit64s)512 * (bitmap_blocks + ((j * 8) + bit)));
+Bit32u redolog_t::get_extent_size()
+{
+  return dtoh32(header.specific.extent);
+}
 
-            if (bx_read_image(fd, (off_t)block_offset, buffer, 512) != 512) {
-              ret = -1;
-              break;
-            }
+// Read the sectors of extent 'index' present in the redolog into 'buf' and
+// set their entries in 'sector_map' (one byte per sector). Returns 1 if the
+// extent is allocated, 0 if not and -1 on error.
+int redolog_t::read_extent(Bit32u index, void *buf, Bit8u *sector_map)
+{
+  Bit8u *cbuf = (Bit8u*)buf;
+  Bit64s bitmap_offset, block_offset;
+  Bit32u bitmap_size, i, n;
 
-            base_offset  = (Bit64s)i * (dtoh32(header.specific.extent));
-            base_offset += (Bit64s)512 * ((j * 8) + bit);
+  memset(sector_map, 0, extent_blocks);
+  if (dtoh32(catalog[index]) == REDOLOG_PAGE_NOT_ALLOCATED) {
+    return 0;
+  }
 
-            if (base_image->lseek(base_offset, SEEK_SET) < 0) {
-              ret = -1;
-              break;
-            }
-            if (base_image->write(buffer, 512) < 0) {
-              ret = -1;
-              break;
-            }
-          }
-        }
+  bitmap_offset  = (Bit64s)STANDARD_HEADER_SIZE + (dtoh32(header.specific.catalog) * sizeof(Bit32u));
+  bitmap_offset += (Bit64s)512 * dtoh32(catalog[index]) * (extent_blocks + bitmap_blocks);
+  bitmap_size = dtoh32(header.specific.bitmap);
+  if ((Bit32u)bx_read_image(fd, (off_t)bitmap_offset, bitmap, bitmap_size) != bitmap_size) {
+    return -1;
+  }
+  bitmap_update = 1;
+  for (i = 0; i < extent_blocks; i++) {
+    sector_map[i] = (bitmap[i / 8] >> (i % 8)) & 0x01;
+  }
+  // read each run of present sectors with a single call
+  for (i = 0; i < extent_blocks; i += n) {
+    for (n = 0; ((i + n) < extent_blocks) && (sector_map[i + n] == sector_map[i]); n++);
+    if (sector_map[i]) {
+      block_offset = bitmap_offset + ((Bit64s)512 * (bitmap_blocks + i));
+      if (bx_read_image(fd, (off_t)block_offset, cbuf + i * 512, n * 512) != (int)(n * 512)) {
+        return -1;
       }
     }
   }
-  return ret;
+  return 1;
 }
 #endif
 
@@ -2211,6 +3100,10 @@ ssize_t growing_image_t::read(void* buf, size_t count)
   while (n < count) {
     ret = redolog->read(cbuf, 512);
     if (ret < 0) break;
+    if (ret != 512) {
+      // sector not in redolog: skip it
+      redolog->lseek(512, SEEK_CUR);
+    }
     cbuf += 512;
     n += 512;
   }
@@ -2408,9 +3301,13 @@ ssize_t undoable_image_t::read(void* buf, size_t count)
   ssize_t ret = 0;
 
   while (n < count) {
+    // keep the positions of both images in sync for multi-sector reads
     if ((size_t)redolog->read(cbuf, 512) != 512) {
+      redolog->lseek(512, SEEK_CUR);
       ret = ro_disk->read(cbuf, 512);
       if (ret < 0) break;
+    } else {
+      ro_disk->lseek(512, SEEK_CUR);
     }
     cbuf += 512;
     n += 512;
@@ -2582,9 +3479,13 @@ ssize_t volatile_image_t::read(void* buf, size_t count)
   ssize_t ret = 0;
 
   while (n < count) {
+    // keep the positions of both images in sync for multi-sector reads
     if ((size_t)redolog->read(cbuf, 512) != 512) {
+      redolog->lseek(512, SEEK_CUR);
       ret = ro_disk->read(cbuf, 512);
       if (ret < 0) break;
+    } else {
+      ro_disk->lseek(512, SEEK_CUR);
     }
     cbuf += 512;
     n += 512;
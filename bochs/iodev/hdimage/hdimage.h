@@ -21,6 +21,13 @@
 #ifndef BX_HDIMAGE_H
 #define BX_HDIMAGE_H
 
+#ifndef BXIMAGE
+#include "bxthread.h"
+#endif
+#if BX_HAVE_PREADV
+#include <sys/uio.h>
+#endif
+
 // required for access() checks
 #ifndef F_OK
 #define F_OK 0
@@ -138,9 +145,22 @@
 #define dtoh64(val) htod64(val)
 #endif
 
+// I/O vector element for scatter/gather transfers
+#if BX_HAVE_PREADV
+typedef struct iovec bx_iovec_t;
+#else
+typedef struct {
+  void   *iov_base;
+  size_t  iov_len;
+} bx_iovec_t;
+#endif
+
 class device_image_t;
 class redolog_t;
 class cdrom_base_c;
+#ifndef BXIMAGE
+class async_image_io_c;
+#endif
 
 #ifdef BXIMAGE
 int bx_create_image_file(const char *filename);
@@ -192,6 +212,18 @@ class BOCHSAPI_MSVCONLY device_image_t
       // written (count).
       virtual ssize_t write(const void* buf, size_t count) = 0;
 
+      // Read the buffers of the I/O vector starting at 'offset'. Return
+      // the number of bytes read (the total length of the vector). The
+      // default implementation seeks once and reads each buffer with read().
+      virtual ssize_t readv(Bit64s offset, const bx_iovec_t *iov, int iovcnt);
+
+      // Write the buffers of the I/O vector starting at 'offset'. Return
+      // the number of bytes written (the total length of the vector).
+      virtual ssize_t writev(Bit64s offset, const bx_iovec_t *iov, int iovcnt);
+
+      // Write data buffered by the image to the file. Returns false on error.
+      virtual bool flush() {return 1;}
+
       // Get image capabilities
       virtual Bit32u get_capabilities();
 
@@ -216,6 +248,10 @@ class BOCHSAPI_MSVCONLY device_image_t
       unsigned spt;
       unsigned sect_size;
       Bit64u   hd_size;
+#ifndef BXIMAGE
+      // asynchronous request layer attached to this image (or NULL)
+      async_image_io_c *async_io;
+#endif
   protected:
 #ifndef WIN32
       time_t mtime;
@@ -224,10 +260,174 @@ class BOCHSAPI_MSVCONLY device_image_t
 #endif
 };
 
+#ifndef BXIMAGE
+// ASYNCHRONOUS REQUEST LAYER
+// Reads ahead and writes behind on a worker thread, so that host disk I/O
+// overlaps with the emulation. The image is not thread safe, so all requests
+// of an image are processed in order by its own worker and the caller must
+// use drain() before accessing the image directly.
+
+#define BX_ASYNC_IO_SLOTS   4
+#define BX_ASYNC_IO_WINDOW  (128 * 1024)
+
+class async_image_io_c
+{
+  public:
+      async_image_io_c(device_image_t *_image);
+      ~async_image_io_c();
+
+      // Start reading 'count' bytes at 'offset' in the background.
+      void prefetch(Bit64s offset, Bit64u count);
+
+      // Copy prefetched data to the buffer, waiting for the read to
+      // complete if necessary. Returns false if the data is not available.
+      bool read(Bit64s offset, void *buf, unsigned count);
+
+      // Queue a write of 'count' bytes at 'offset'. The data is copied, so
+      // the buffer can be reused immediately.
+      void write(Bit64s offset, const void *buf, unsigned count);
+
+      // Returns true if the prefetch covering 'offset' is complete (or
+      // there is none).
+      bool read_ready(Bit64s offset);
+
+      // Start the queued writes still collecting data.
+      void flush();
+
+      // Returns true if queued writes are not completed yet.
+      bool write_pending();
+
+      // Returns true if a queued write has failed since the last call.
+      bool write_failed();
+
+      // Complete all queued requests.
+      void drain();
+
+      void worker();
+
+  private:
+      enum { SLOT_FREE, SLOT_OPEN, SLOT_QUEUED, SLOT_DONE, SLOT_FAILED };
+
+      struct {
+        int    state;
+        bool   write;
+        bool   discard;  // read data became stale while queued
+        Bit64s offset;
+        Bit32u len;
+        Bit32u seq;
+        Bit8u  *buffer;
+      } slot[BX_ASYNC_IO_SLOTS];
+
+      void submit(int i);
+      void wait_for_slot(int i);
+      int  find_free_slot();
+      int  find_read_slot(Bit64s offset);
+      void invalidate(Bit64s offset, Bit64u count);
+      void read_ahead();
+
+      device_image_t *image;
+      Bit32u submit_seq;
+      Bit64s ra_next, ra_end;  // range still to be read ahead
+      int    open_slot;        // write slot collecting data (or -1)
+      bool   failed;
+      bool   stop;
+      bool   running;
+
+      BX_MUTEX(lock);
+      bx_thread_sem_t request_sem;
+      bx_thread_sem_t done_sem;
+      BX_THREAD_VAR(worker_thread);
+};
+
+// BLOCK CACHE
+// Keeps recently used blocks of an image in memory and replaces the least
+// recently used one. Writes are delayed until the block is replaced or
+// flush() is called. Validity is tracked per 512 byte sector, so partial
+// block writes don't need to read the block first.
+
+#define BX_HDCACHE_BLOCK_SIZE    (32 * 1024)
+#define BX_HDCACHE_BLOCK_SECTORS (BX_HDCACHE_BLOCK_SIZE / 512)
+
+class cached_image_t : public device_image_t
+{
+  public:
+      cached_image_t(device_image_t *_image, Bit32u size_mb);
+      virtual ~cached_image_t();
+
+      // Open the underlying image. Returns non-negative if successful.
+      int open(const char* pathname, int flags);
+
+      // Write back the dirty blocks and close the image.
+      void close();
+
+      // Position ourselves. Return the resulting offset from the
+      // beginning of the file.
+      Bit64s lseek(Bit64s offset, int whence);
+
+      // Read count bytes to the buffer buf. Return the number of
+      // bytes read (count).
+      ssize_t read(void* buf, size_t count);
+
+      // Write count bytes from buf. Return the number of bytes
+      // written (count).
+      ssize_t write(const void* buf, size_t count);
+
+      ssize_t readv(Bit64s offset, const bx_iovec_t *iov, int iovcnt);
+      ssize_t writev(Bit64s offset, const bx_iovec_t *iov, int iovcnt);
+
+      // Write back all dirty blocks
+      bool flush();
+
+      Bit32u get_capabilities();
+      Bit32u get_timestamp();
+
+      // Save/restore support
+      bool save_state(const char *backup_fname);
+      void restore_state(const char *backup_fname);
+
+  private:
+      typedef struct {
+        Bit64s block;      // block number or -1 if unused
+        Bit64u valid;      // sectors present in the buffer
+        Bit64u dirty;      // sectors not written to the image yet
+        Bit8u  *buffer;
+        int    hash_next;
+        int    lru_prev;
+        int    lru_next;
+      } cache_entry_t;
+
+      ssize_t transfer(Bit64s offset, Bit8u *buf, size_t count, bool write);
+      int  lookup(Bit64s block);
+      int  get_entry(Bit64s block);
+      bool fill(int i, Bit64u mask);
+      bool write_back(int i);
+      void touch(int i);
+      void unlink_hash(int i);
+      void discard();
+
+      device_image_t *image;
+      cache_entry_t *entries;
+      Bit8u  *buffers;
+      int    *hash;
+      int    num_entries;
+      int    hash_mask;
+      int    lru_head;  // most recently used entry
+      int    lru_tail;  // least recently used entry
+      Bit64s pos;
+      bool   write_error; // last write back failed, don't log again
+};
+#endif
+
 // FLAT MODE
+// Regular image files are memory mapped if possible, so that requests
+// are served with memcpy() instead of system calls.
 class flat_image_t : public device_image_t
 {
   public:
+      // Default constructor. With use_mmap set the image is memory mapped
+      // ("mmap" mode), otherwise it is accessed with system calls.
+      flat_image_t(bool use_mmap = 0);
+
       // Open an image with specific flags. Returns non-negative if successful.
       int open(const char* pathname, int flags);
 
@@ -246,6 +446,13 @@ class flat_image_t : public device_image_t
       // written (count).
       ssize_t write(const void* buf, size_t count);
 
+      // Scatter/gather transfers from the mapping or with a single system call
+      ssize_t readv(Bit64s offset, const bx_iovec_t *iov, int iovcnt);
+      ssize_t writev(Bit64s offset, const bx_iovec_t *iov, int iovcnt);
+
+      // Write modified pages of the mapping to the file
+      bool flush();
+
       // Check image format
       static int check_format(int fd, Bit64u imgsize);
 
@@ -258,6 +465,14 @@ class flat_image_t : public device_image_t
   private:
       int fd;
       const char *pathname;
+      bool use_mmap;
+#ifdef _POSIX_MAPPED_FILES
+      void map_image(int flags);
+
+      Bit8u *mmap_data;  // mapping of the whole image or NULL
+      bool   mmap_dirty;
+      Bit64s mmap_pos;
+#endif
 };
 
 // CONCAT MODE
@@ -453,7 +668,9 @@ class BOCHSAPI_MSVCONLY redolog_t
       static int check_format(int fd, const char *subtype);
 
 #ifdef BXIMAGE
-      int commit(device_image_t *base_image);
+      Bit32u get_extent_count();
+      Bit32u get_extent_size();
+      int read_extent(Bit32u index, void *buf, Bit8u *sector_map);
 #else
       bool save_state(const char *backup_fname);
 #endif
@@ -0,0 +1,856 @@
+/////////////////////////////////////////////////////////////////////////
+// $Id$
+/////////////////////////////////////////////////////////////////////////
+//
+//  QEMU copy-on-write disk image format version 2 and 3 (qcow2)
+//
+//  Copyright (C) 2021  The Bochs Project
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+/////////////////////////////////////////////////////////////////////////
+
+// The guest visible disk is split into clusters. A two level table (L1 and
+// L2) maps each cluster to its location in the image file. Clusters that are
+// not allocated yet are read from the backing file (if present) or as zeros.
+// All clusters are reference counted: a cluster with the COPIED flag is only
+// used once and can be written in place, all others are copied to a newly
+// allocated cluster first (copy-on-write). New clusters are always appended
+// to the end of the image file. Table updates are written through to the
+// file, so the image is consistent after each completed request.
+//
+// Not supported: compressed clusters, encryption, external data files,
+// extended L2 entries and refcount widths other than 16 bits. Internal
+// snapshots are preserved, but the active state is always used.
+
+// Define BX_PLUGGABLE in files that can be compiled into plugins.  For
+// platforms that require a special tag on exported symbols, BX_PLUGGABLE
+// is used to know when we are exporting symbols and when we are importing.
+#define BX_PLUGGABLE
+
+#ifdef BXIMAGE
+#include "config.h"
+#include "misc/bxcompat.h"
+#include "osdep.h"
+#include "misc/bswap.h"
+#else
+#include "bochs.h"
+#include "plugin.h"
+#endif
+#include "hdimage.h"
+#include "qcow2.h"
+
+#define LOG_THIS bx_hdimage_ctl.
+
+#ifndef O_ACCMODE
+#define O_ACCMODE (O_WRONLY | O_RDWR)
+#endif
+
+// convert table entries between disk (big) and host endianness
+#if defined (BX_LITTLE_ENDIAN)
+#define qcow2_be16(val) bx_bswap16(val)
+#define qcow2_be64(val) bx_bswap64(val)
+#else
+#define qcow2_be16(val) (val)
+#define qcow2_be64(val) (val)
+#endif
+
+#ifndef BXIMAGE
+
+// disk image plugin entry point
+
+PLUGIN_ENTRY_FOR_IMG_MODULE(qcow2)
+{
+  if (mode == PLUGIN_PROBE) {
+    return (int)PLUGTYPE_IMG;
+  }
+  return 0; // Success
+}
+
+#endif
+
+//
+// Define the static class that registers the derived device image class,
+// and allocates one on request.
+//
+class bx_qcow2_locator_c : public hdimage_locator_c {
+public:
+  bx_qcow2_locator_c(void) : hdimage_locator_c("qcow2") {}
+protected:
+  device_image_t *allocate(Bit64u disk_size, const char *journal) {
+    return (new qcow2_image_t());
+  }
+  int check_format(int fd, Bit64u disk_size) {
+    return (qcow2_image_t::check_format(fd, disk_size));
+  }
+} bx_qcow2_match;
+
+static Bit32u qcow2_get_be32(const Bit8u *buf)
+{
+  return ((Bit32u)buf[0] << 24) | ((Bit32u)buf[1] << 16) |
+         ((Bit32u)buf[2] << 8) | buf[3];
+}
+
+static Bit64u qcow2_get_be64(const Bit8u *buf)
+{
+  return ((Bit64u)qcow2_get_be32(buf) << 32) | qcow2_get_be32(buf + 4);
+}
+
+#ifdef BXIMAGE
+static void qcow2_put_be32(Bit8u *buf, Bit32u value)
+{
+  buf[0] = (Bit8u)(value >> 24);
+  buf[1] = (Bit8u)(value >> 16);
+  buf[2] = (Bit8u)(value >> 8);
+  buf[3] = (Bit8u)value;
+}
+
+static void qcow2_put_be64(Bit8u *buf, Bit64u value)
+{
+  qcow2_put_be32(buf, (Bit32u)(value >> 32));
+  qcow2_put_be32(buf + 4, (Bit32u)value);
+}
+#endif
+
+qcow2_image_t::qcow2_image_t()
+{
+  fd = -1;
+  pathname = NULL;
+  l1_table = NULL;
+  refcount_table = NULL;
+  refcount_block = NULL;
+  cluster_buf = NULL;
+  l2_cache = NULL;
+  backing = NULL;
+  backing_path = NULL;
+}
+
+int qcow2_image_t::read_header(int fd, qcow2_header_t *header)
+{
+  Bit8u buf[QCOW2_HEADER_SIZE_V3];
+
+  memset(buf, 0, sizeof(buf));
+  if (bx_read_image(fd, 0, buf, QCOW2_HEADER_SIZE_V2) != QCOW2_HEADER_SIZE_V2) {
+    return HDIMAGE_READ_ERROR;
+  }
+  header->magic = qcow2_get_be32(buf);
+  header->version = qcow2_get_be32(buf + 4);
+  if (header->magic != QCOW2_MAGIC) {
+    return HDIMAGE_NO_SIGNATURE;
+  }
+  if ((header->version != 2) && (header->version != 3)) {
+    return HDIMAGE_VERSION_ERROR;
+  }
+  header->backing_file_offset = qcow2_get_be64(buf + 8);
+  header->backing_file_size = qcow2_get_be32(buf + 16);
+  header->cluster_bits = qcow2_get_be32(buf + 20);
+  header->size = qcow2_get_be64(buf + 24);
+  header->crypt_method = qcow2_get_be32(buf + 32);
+  header->l1_size = qcow2_get_be32(buf + 36);
+  header->l1_table_offset = qcow2_get_be64(buf + 40);
+  header->refcount_table_offset = qcow2_get_be64(buf + 48);
+  header->refcount_table_clusters = qcow2_get_be32(buf + 56);
+  header->nb_snapshots = qcow2_get_be32(buf + 60);
+  header->snapshots_offset = qcow2_get_be64(buf + 64);
+  if (header->version == 2) {
+    header->incompatible_features = 0;
+    header->compatible_features = 0;
+    header->autoclear_features = 0;
+    header->refcount_order = 4;
+    header->header_length = QCOW2_HEADER_SIZE_V2;
+  } else {
+    if (bx_read_image(fd, QCOW2_HEADER_SIZE_V2, buf + QCOW2_HEADER_SIZE_V2,
+                      QCOW2_HEADER_SIZE_V3 - QCOW2_HEADER_SIZE_V2) !=
+        (QCOW2_HEADER_SIZE_V3 - QCOW2_HEADER_SIZE_V2)) {
+      return HDIMAGE_READ_ERROR;
+    }
+    header->incompatible_features = qcow2_get_be64(buf + 72);
+    header->compatible_features = qcow2_get_be64(buf + 80);
+    header->autoclear_features = qcow2_get_be64(buf + 88);
+    header->refcount_order = qcow2_get_be32(buf + 96);
+    header->header_length = qcow2_get_be32(buf + 100);
+  }
+  return HDIMAGE_FORMAT_OK;
+}
+
+int qcow2_image_t::check_format(int fd, Bit64u imgsize)
+{
+  qcow2_header_t header;
+
+  if (imgsize < QCOW2_HEADER_SIZE_V2) {
+    return HDIMAGE_SIZE_ERROR;
+  }
+  return read_header(fd, &header);
+}
+
+int qcow2_image_t::open(const char* _pathname, int flags)
+{
+  Bit64u imgsize = 0;
+  bool valid = 1;
+  Bit32u i;
+
+  pathname = _pathname;
+  close();
+
+  fd = hdimage_open_file(pathname, flags, &imgsize, &mtime);
+  if (fd < 0) {
+    return -1;
+  }
+  read_only = ((flags & O_ACCMODE) == O_RDONLY);
+
+  switch (read_header(fd, &header)) {
+    case HDIMAGE_FORMAT_OK:
+      break;
+    case HDIMAGE_VERSION_ERROR:
+      BX_ERROR(("qcow2: unsupported format version %d", header.version));
+      bx_close_image(fd, pathname);
+      fd = -1;
+      return -1;
+    default:
+      BX_ERROR(("qcow2: cannot read image header of '%s'", pathname));
+      bx_close_image(fd, pathname);
+      fd = -1;
+      return -1;
+  }
+  if ((header.cluster_bits < QCOW2_MIN_CLUSTER_BITS) ||
+      (header.cluster_bits > QCOW2_MAX_CLUSTER_BITS)) {
+    BX_ERROR(("qcow2: invalid cluster size (%d bits)", header.cluster_bits));
+    valid = 0;
+  } else if (header.crypt_method != 0) {
+    BX_ERROR(("qcow2: encrypted images are not supported"));
+    valid = 0;
+  } else if (header.incompatible_features != 0) {
+    BX_ERROR(("qcow2: unsupported incompatible features 0x" FMT_LL "x",
+              header.incompatible_features));
+    valid = 0;
+  } else if (header.refcount_order != 4) {
+    BX_ERROR(("qcow2: only 16-bit refcounts are supported"));
+    valid = 0;
+  } else if ((header.l1_size > QCOW2_MAX_L1_SIZE) ||
+             (((Bit64u)header.l1_size << (2 * header.cluster_bits - 3)) < header.size)) {
+    BX_ERROR(("qcow2: invalid L1 table size %d", header.l1_size));
+    valid = 0;
+  } else if (((Bit64u)header.refcount_table_clusters << header.cluster_bits) > QCOW2_MAX_REFTABLE_SIZE) {
+    BX_ERROR(("qcow2: refcount table too large"));
+    valid = 0;
+  }
+  if (!valid) {
+    bx_close_image(fd, pathname);
+    fd = -1;
+    return -1;
+  }
+  cluster_size = 1 << header.cluster_bits;
+  l2_bits = header.cluster_bits - 3;
+
+  l1_table = new Bit64u[header.l1_size + 1];
+  if (bx_read_image(fd, header.l1_table_offset, l1_table, header.l1_size * 8) !=
+      (int)(header.l1_size * 8)) {
+    BX_ERROR(("qcow2: cannot read L1 table"));
+    close();
+    return -1;
+  }
+  for (i = 0; i < header.l1_size; i++) {
+    l1_table[i] = qcow2_be64(l1_table[i]);
+  }
+  refcount_table_size = (header.refcount_table_clusters << header.cluster_bits) / 8;
+  refcount_table = new Bit64u[refcount_table_size + 1];
+  if (bx_read_image(fd, header.refcount_table_offset, refcount_table, refcount_table_size * 8) !=
+      (int)(refcount_table_size * 8)) {
+    BX_ERROR(("qcow2: cannot read refcount table"));
+    close();
+    return -1;
+  }
+  for (i = 0; i < refcount_table_size; i++) {
+    refcount_table[i] = qcow2_be64(refcount_table[i]);
+  }
+  refcount_block = new Bit16u[cluster_size / 2];
+  refcount_block_offset = 0;
+  cluster_buf = new Bit8u[cluster_size];
+  l2_cache = new Bit64u[QCOW2_L2_CACHE_SIZE << l2_bits];
+  for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++) {
+    l2_cache_offsets[i] = 0;
+    l2_cache_counts[i] = 0;
+  }
+  next_cluster_offset = (imgsize + cluster_size - 1) & ~((Bit64u)cluster_size - 1);
+
+  // autoclear features become invalid when the image is modified
+  if (!read_only && (header.autoclear_features != 0)) {
+    header.autoclear_features = 0;
+    if (!write_entry(88, 0)) {
+      close();
+      return -1;
+    }
+  }
+
+  if (header.backing_file_offset != 0) {
+    if (!open_backing_file()) {
+      close();
+      return -1;
+    }
+  }
+
+  hd_size = header.size;
+  sect_size = 512;
+  cur_offset = 0;
+
+  BX_INFO(("'qcow2' disk image opened: path is '%s'", pathname));
+  BX_DEBUG(("   .version      = %d", header.version));
+  BX_DEBUG(("   .size         = " FMT_LL "d", header.size));
+  BX_DEBUG(("   .cluster_size = %d", cluster_size));
+  BX_DEBUG(("   .l1_size      = %d", header.l1_size));
+  BX_DEBUG(("   .snapshots    = %d", header.nb_snapshots));
+
+  return 0;
+}
+
+bool qcow2_image_t::open_backing_file()
+{
+  char name[QCOW2_MAX_NAME_LEN];
+  const char *image_mode = NULL;
+  const char *dirsep;
+  size_t dirlen = 0;
+
+  if (header.backing_file_size >= QCOW2_MAX_NAME_LEN) {
+    BX_ERROR(("qcow2: backing file name too long"));
+    return 0;
+  }
+  if (bx_read_image(fd, header.backing_file_offset, name, header.backing_file_size) !=
+      (int)header.backing_file_size) {
+    BX_ERROR(("qcow2: cannot read backing file name"));
+    return 0;
+  }
+  name[header.backing_file_size] = 0;
+  // a relative path is relative to the directory of the image
+#ifdef WIN32
+  if ((name[0] != '/') && (name[0] != '\\') && (name[1] != ':')) {
+    dirsep = strrchr(pathname, '\\');
+    if ((dirsep == NULL) || (strrchr(pathname, '/') > dirsep)) {
+      dirsep = strrchr(pathname, '/');
+    }
+#else
+  if (name[0] != '/') {
+    dirsep = strrchr(pathname, '/');
+#endif
+    if (dirsep != NULL) {
+      dirlen = dirsep - pathname + 1;
+    }
+  }
+  backing_path = new char[dirlen + strlen(name) + 1];
+  memcpy(backing_path, pathname, dirlen);
+  strcpy(backing_path + dirlen, name);
+
+  if (!hdimage_detect_image_mode(backing_path, &image_mode)) {
+    BX_ERROR(("qcow2: cannot detect format of backing file '%s'", backing_path));
+    return 0;
+  }
+  backing = DEV_hdimage_init_image(image_mode, 0, NULL);
+  if (backing == NULL) {
+    BX_ERROR(("qcow2: cannot create '%s' image for backing file", image_mode));
+    return 0;
+  }
+  if (backing->open(backing_path, O_RDONLY) < 0) {
+    BX_ERROR(("qcow2: cannot open backing file '%s'", backing_path));
+    delete backing;
+    backing = NULL;
+    return 0;
+  }
+  BX_INFO(("qcow2: using '%s' backing file '%s'", image_mode, backing_path));
+  return 1;
+}
+
+void qcow2_image_t::close()
+{
+  if (fd > -1) {
+    if (backing != NULL) {
+      backing->close();
+      delete backing;
+      backing = NULL;
+    }
+    delete [] backing_path;
+    delete [] l1_table;
+    delete [] refcount_table;
+    delete [] refcount_block;
+    delete [] cluster_buf;
+    delete [] l2_cache;
+    backing_path = NULL;
+    l1_table = NULL;
+    refcount_table = NULL;
+    refcount_block = NULL;
+    cluster_buf = NULL;
+    l2_cache = NULL;
+    bx_close_image(fd, pathname);
+    fd = -1;
+  }
+}
+
+Bit64s qcow2_image_t::lseek(Bit64s offset, int whence)
+{
+  if (whence == SEEK_SET) {
+    cur_offset = offset;
+  } else if (whence == SEEK_CUR) {
+    cur_offset += offset;
+  } else {
+    BX_ERROR(("lseek: mode not supported yet"));
+    return -1;
+  }
+  if ((cur_offset < 0) || ((Bit64u)cur_offset >= hd_size))
+    return -1;
+  return cur_offset;
+}
+
+Bit64u *qcow2_image_t::get_l2_table(Bit64u l2_offset, bool do_read)
+{
+  Bit32u i, j, min_index = 0, min_count = 0xffffffff;
+  Bit64u *table;
+
+  for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++) {
+    if (l2_cache_offsets[i] == l2_offset) {
+      if (++l2_cache_counts[i] == 0xffffffff) {
+        for (j = 0; j < QCOW2_L2_CACHE_SIZE; j++) {
+          l2_cache_counts[j] >>= 1;
+        }
+      }
+      return &l2_cache[i << l2_bits];
+    }
+    if (l2_cache_counts[i] < min_count) {
+      min_count = l2_cache_counts[i];
+      min_index = i;
+    }
+  }
+  // replace the least used table
+  table = &l2_cache[min_index << l2_bits];
+  l2_cache_offsets[min_index] = l2_offset;
+  l2_cache_counts[min_index] = 1;
+  if (do_read) {
+    if (bx_read_image(fd, l2_offset, table, cluster_size) != (int)cluster_size) {
+      BX_ERROR(("qcow2: cannot read L2 table at offset " FMT_LL "d", l2_offset));
+      l2_cache_offsets[min_index] = 0;
+      l2_cache_counts[min_index] = 0;
+      return NULL;
+    }
+    for (i = 0; i < (1U << l2_bits); i++) {
+      table[i] = qcow2_be64(table[i]);
+    }
+  }
+  return table;
+}
+
+bool qcow2_image_t::get_l2_entry(Bit64u offset, Bit64u *entry)
+{
+  Bit64u l1_index = offset >> (header.cluster_bits + l2_bits);
+  Bit64u l2_offset, *l2_table;
+
+  *entry = 0;
+  if (l1_index >= header.l1_size) {
+    return 1;
+  }
+  l2_offset = l1_table[l1_index] & QCOW2_OFFSET_MASK;
+  if (l2_offset == 0) {
+    return 1;
+  }
+  l2_table = get_l2_table(l2_offset, 1);
+  if (l2_table == NULL) {
+    return 0;
+  }
+  *entry = l2_table[(offset >> header.cluster_bits) & ((1 << l2_bits) - 1)];
+  if (*entry & QCOW2_OFLAG_COMPRESSED) {
+    BX_ERROR(("qcow2: compressed clusters are not supported"));
+    return 0;
+  }
+  if ((header.version < 3) && (*entry & QCOW2_OFLAG_ZERO)) {
+    *entry &= ~QCOW2_OFLAG_ZERO;
+  }
+  return 1;
+}
+
+ssize_t qcow2_image_t::read_backing(Bit64u offset, Bit8u *buf, size_t count)
+{
+  size_t n = 0;
+
+  if ((backing != NULL) && (offset < backing->hd_size)) {
+    n = count;
+    if ((offset + n) > backing->hd_size) {
+      n = (size_t)(backing->hd_size - offset);
+    }
+    if ((backing->lseek(offset, SEEK_SET) < 0) ||
+        (backing->read(buf, n) != (ssize_t)n)) {
+      BX_ERROR(("qcow2: cannot read from backing file"));
+      return -1;
+    }
+  }
+  if (n < count) {
+    memset(buf + n, 0, count - n);
+  }
+  return count;
+}
+
+ssize_t qcow2_image_t::read(void* buf, size_t count)
+{
+  Bit8u *cbuf = (Bit8u*)buf;
+  Bit64u entry, next, host;
+  size_t n, m, total = count;
+
+  if ((cur_offset < 0) || (((Bit64u)cur_offset + count) > hd_size)) {
+    return -1;
+  }
+  while (count > 0) {
+    host = cur_offset & (cluster_size - 1);
+    n = cluster_size - (size_t)host;
+    if (n > count) {
+      n = count;
+    }
+    if (!get_l2_entry(cur_offset, &entry)) {
+      return -1;
+    }
+    if (entry & QCOW2_OFLAG_ZERO) {
+      memset(cbuf, 0, n);
+    } else if ((entry & QCOW2_OFFSET_MASK) == 0) {
+      if (read_backing(cur_offset, cbuf, n) < 0) {
+        return -1;
+      }
+    } else {
+      host += entry & QCOW2_OFFSET_MASK;
+      // extend the request over clusters following in the image file
+      while (n < count) {
+        if (!get_l2_entry(cur_offset + n, &next)) {
+          return -1;
+        }
+        if ((next & QCOW2_OFLAG_ZERO) || ((next & QCOW2_OFFSET_MASK) != (host + n))) {
+          break;
+        }
+        m = count - n;
+        n += (m > cluster_size) ? cluster_size : m;
+      }
+      if (bx_read_image(fd, host, cbuf, (int)n) != (int)n) {
+        return -1;
+      }
+    }
+    cbuf += n;
+    cur_offset += n;
+    count -= n;
+  }
+  return total;
+}
+
+ssize_t qcow2_image_t::write(const void* buf, size_t count)
+{
+  Bit8u *cbuf = (Bit8u*)buf;
+  Bit64u next, host;
+  size_t n, m, total = count;
+
+  if ((cur_offset < 0) || (((Bit64u)cur_offset + count) > hd_size)) {
+    return -1;
+  }
+  while (count > 0) {
+    host = cur_offset & (cluster_size - 1);
+    n = cluster_size - (size_t)host;
+    if (n > count) {
+      n = count;
+    }
+    next = get_cluster_for_write(cur_offset, n < cluster_size);
+    if (next == 0) {
+      return -1;
+    }
+    host += next;
+    // extend the request over clusters following in the image file
+    while (n < count) {
+      m = count - n;
+      if (m > cluster_size) {
+        m = cluster_size;
+      }
+      next = get_cluster_for_write(cur_offset + n, m < cluster_size);
+      if (next == 0) {
+        return -1;
+      }
+      if (next != (host + n)) {
+        break;
+      }
+      n += m;
+    }
+    if (bx_write_image(fd, host, cbuf, (int)n) != (int)n) {
+      return -1;
+    }
+    cbuf += n;
+    cur_offset += n;
+    count -= n;
+  }
+  return total;
+}
+
+bool qcow2_image_t::fill_cluster(Bit64u offset, Bit64u l2_entry, Bit8u *buffer)
+{
+  Bit64u host = l2_entry & QCOW2_OFFSET_MASK;
+
+  if (l2_entry & QCOW2_OFLAG_ZERO) {
+    memset(buffer, 0, cluster_size);
+  } else if (host != 0) {
+    if (bx_read_image(fd, host, buffer, cluster_size) != (int)cluster_size) {
+      return 0;
+    }
+  } else if (read_backing(offset, buffer, cluster_size) < 0) {
+    return 0;
+  }
+  return 1;
+}
+
+// Returns the image file offset of the writable cluster containing 'offset'
+// or 0 on error. Shared L2 tables and data clusters are copied first. If
+// 'fill' is set, a new data cluster gets the previous contents.
+Bit64u qcow2_image_t::get_cluster_for_write(Bit64u offset, bool fill)
+{
+  Bit64u l1_index = offset >> (header.cluster_bits + l2_bits);
+  Bit32u l2_index = (Bit32u)(offset >> header.cluster_bits) & ((1 << l2_bits) - 1);
+  Bit64u l2_offset, entry, host, *l2_table;
+  Bit64s new_offset;
+  Bit32u i;
+
+  if (l1_index >= header.l1_size) {
+    BX_ERROR(("qcow2: offset " FMT_LL "d not covered by L1 table", offset));
+    return 0;
+  }
+  l2_offset = l1_table[l1_index] & QCOW2_OFFSET_MASK;
+  if ((l2_offset != 0) && (l1_table[l1_index] & QCOW2_OFLAG_COPIED)) {
+    l2_table = get_l2_table(l2_offset, 1);
+    if (l2_table == NULL) {
+      return 0;
+    }
+  } else {
+    // allocate a new L2 table or copy a shared one
+    new_offset = alloc_cluster();
+    if (new_offset < 0) {
+      return 0;
+    }
+    if (l2_offset != 0) {
+      l2_table = get_l2_table(l2_offset, 1);
+      if (l2_table == NULL) {
+        return 0;
+      }
+      memcpy(cluster_buf, l2_table, cluster_size);
+      l2_table = get_l2_table(new_offset, 0);
+      memcpy(l2_table, cluster_buf, cluster_size);
+    } else {
+      l2_table = get_l2_table(new_offset, 0);
+      memset(l2_table, 0, cluster_size);
+    }
+    for (i = 0; i < (1U << l2_bits); i++) {
+      ((Bit64u*)cluster_buf)[i] = qcow2_be64(l2_table[i]);
+    }
+    if (bx_write_image(fd, new_offset, cluster_buf, cluster_size) != (int)cluster_size) {
+      return 0;
+    }
+    l1_table[l1_index] = new_offset | QCOW2_OFLAG_COPIED;
+    if (!write_entry(header.l1_table_offset + l1_index * 8, l1_table[l1_index])) {
+      return 0;
+    }
+    if ((l2_offset != 0) && (update_refcount(l2_offset, -1) < 0)) {
+      return 0;
+    }
+    l2_offset = new_offset;
+  }
+
+  entry = l2_table[l2_index];
+  host = entry & QCOW2_OFFSET_MASK;
+  if (entry & QCOW2_OFLAG_COMPRESSED) {
+    BX_ERROR(("qcow2: compressed clusters are not supported"));
+    return 0;
+  }
+  if ((header.version < 3) && (entry & QCOW2_OFLAG_ZERO)) {
+    entry &= ~QCOW2_OFLAG_ZERO;
+  }
+  if ((host != 0) && (entry & QCOW2_OFLAG_COPIED) && !(entry & QCOW2_OFLAG_ZERO)) {
+    return host;
+  }
+  // allocate a new data cluster (copy-on-write)
+  new_offset = alloc_cluster();
+  if (new_offset < 0) {
+    return 0;
+  }
+  if (fill) {
+    if (!fill_cluster(offset & ~((Bit64u)cluster_size - 1), entry, cluster_buf) ||
+        (bx_write_image(fd, new_offset, cluster_buf, cluster_size) != (int)cluster_size)) {
+      return 0;
+    }
+  }
+  l2_table[l2_index] = new_offset | QCOW2_OFLAG_COPIED;
+  if (!write_entry(l2_offset + l2_index * 8, l2_table[l2_index])) {
+    return 0;
+  }
+  if ((host != 0) && (update_refcount(host, -1) < 0)) {
+    return 0;
+  }
+  return new_offset;
+}
+
+Bit64s qcow2_image_t::alloc_cluster()
+{
+  Bit64u offset = next_cluster_offset;
+
+  next_cluster_offset += cluster_size;
+  if (update_refcount(offset, 1) < 0) {
+    return -1;
+  }
+  return (Bit64s)offset;
+}
+
+// Returns the new reference count of the cluster at 'offset' or -1 on error
+int qcow2_image_t::update_refcount(Bit64u offset, int delta)
+{
+  Bit32u block_bits = header.cluster_bits - 1;
+  Bit64u cluster_index = offset >> header.cluster_bits;
+  Bit64u rt_index = cluster_index >> block_bits;
+  Bit32u index = (Bit32u)cluster_index & ((1 << block_bits) - 1);
+  Bit64u block_offset;
+  int refcount;
+
+  if (rt_index >= refcount_table_size) {
+    BX_ERROR(("qcow2: refcount table is full"));
+    return -1;
+  }
+  block_offset = refcount_table[rt_index] & QCOW2_OFFSET_MASK;
+  if (block_offset == 0) {
+    if (delta < 0) {
+      BX_ERROR(("qcow2: freeing unallocated cluster at offset " FMT_LL "d", offset));
+      return -1;
+    }
+    // allocate a new refcount block that also counts itself
+    block_offset = next_cluster_offset;
+    next_cluster_offset += cluster_size;
+    memset(refcount_block, 0, cluster_size);
+    refcount_block_offset = block_offset;
+    if (bx_write_image(fd, block_offset, refcount_block, cluster_size) != (int)cluster_size) {
+      return -1;
+    }
+    refcount_table[rt_index] = block_offset;
+    if (!write_entry(header.refcount_table_offset + rt_index * 8, block_offset) ||
+        (update_refcount(block_offset, 1) < 0)) {
+      return -1;
+    }
+  }
+  if (refcount_block_offset != block_offset) {
+    if (bx_read_image(fd, block_offset, refcount_block, cluster_size) != (int)cluster_size) {
+      BX_ERROR(("qcow2: cannot read refcount block"));
+      refcount_block_offset = 0;
+      return -1;
+    }
+    refcount_block_offset = block_offset;
+  }
+  refcount = (int)qcow2_be16(refcount_block[index]) + delta;
+  if ((refcount < 0) || (refcount > 0xffff)) {
+    BX_ERROR(("qcow2: invalid refcount for cluster at offset " FMT_LL "d", offset));
+    return -1;
+  }
+  refcount_block[index] = qcow2_be16((Bit16u)refcount);
+  if (bx_write_image(fd, block_offset + index * 2, &refcount_block[index], 2) != 2) {
+    return -1;
+  }
+  return refcount;
+}
+
+bool qcow2_image_t::write_entry(Bit64u offset, Bit64u value)
+{
+  Bit64u entry = qcow2_be64(value);
+
+  return (bx_write_image(fd, offset, &entry, 8) == 8);
+}
+
+#ifdef BXIMAGE
+int qcow2_image_t::create_image(const char *pathname, Bit64u size)
+{
+  Bit32u cluster_bits = QCOW2_DEF_CLUSTER_BITS;
+  Bit32u cluster_size = 1 << cluster_bits;
+  Bit32u l1_size, l1_clusters, i;
+  Bit8u *buf;
+
+  l1_size = (Bit32u)((size + ((Bit64u)cluster_size << (cluster_bits - 3)) - 1) >> (2 * cluster_bits - 3));
+  l1_clusters = (l1_size * 8 + cluster_size - 1) / cluster_size;
+  if (l1_clusters == 0) {
+    l1_clusters = 1;
+  }
+
+  int fd = bx_create_image_file(pathname);
+  if (fd < 0)
+    BX_FATAL(("ERROR: failed to create qcow2 image file"));
+
+  // header in cluster 0, refcount table in cluster 1, refcount block
+  // in cluster 2 and the L1 table starting at cluster 3
+  buf = new Bit8u[cluster_size];
+  memset(buf, 0, cluster_size);
+  qcow2_put_be32(buf, QCOW2_MAGIC);
+  qcow2_put_be32(buf + 4, 3);
+  qcow2_put_be32(buf + 20, cluster_bits);
+  qcow2_put_be64(buf + 24, size);
+  qcow2_put_be32(buf + 36, l1_size);
+  qcow2_put_be64(buf + 40, (Bit64u)cluster_size * 3);
+  qcow2_put_be64(buf + 48, cluster_size);
+  qcow2_put_be32(buf + 56, 1);
+  qcow2_put_be32(buf + 96, 4);
+  qcow2_put_be32(buf + 100, QCOW2_HEADER_SIZE_V3);
+  if (bx_write_image(fd, 0, buf, cluster_size) != (int)cluster_size) {
+    ::close(fd);
+    BX_FATAL(("ERROR: The disk image is not complete - could not write header!"));
+  }
+  memset(buf, 0, cluster_size);
+  qcow2_put_be64(buf, (Bit64u)cluster_size * 2);
+  if (bx_write_image(fd, cluster_size, buf, cluster_size) != (int)cluster_size) {
+    ::close(fd);
+    BX_FATAL(("ERROR: The disk image is not complete - could not write refcount table!"));
+  }
+  memset(buf, 0, cluster_size);
+  for (i = 0; i < (3 + l1_clusters); i++) {
+    buf[i * 2 + 1] = 1;
+  }
+  if (bx_write_image(fd, (Bit64u)cluster_size * 2, buf, cluster_size) != (int)cluster_size) {
+    ::close(fd);
+    BX_FATAL(("ERROR: The disk image is not complete - could not write refcount block!"));
+  }
+  memset(buf, 0, cluster_size);
+  for (i = 0; i < l1_clusters; i++) {
+    if (bx_write_image(fd, (Bit64u)cluster_size * (3 + i), buf, cluster_size) != (int)cluster_size) {
+      ::close(fd);
+      BX_FATAL(("ERROR: The disk image is not complete - could not write L1 table!"));
+    }
+  }
+  delete [] buf;
+  ::close(fd);
+  return 0;
+}
+#else
+bool qcow2_image_t::save_state(const char *backup_fname)
+{
+  return hdimage_backup_file(fd, backup_fname);
+}
+
+void qcow2_image_t::restore_state(const char *backup_fname)
+{
+  int temp_fd;
+  Bit64u imgsize;
+
+  if ((temp_fd = hdimage_open_file(backup_fname, O_RDONLY, &imgsize, NULL)) < 0) {
+    BX_PANIC(("Cannot open qcow2 image backup '%s'", backup_fname));
+    return;
+  }
+  if (check_format(temp_fd, imgsize) < HDIMAGE_FORMAT_OK) {
+    ::close(temp_fd);
+    BX_PANIC(("Cannot detect qcow2 image header"));
+    return;
+  }
+  ::close(temp_fd);
+  close();
+  if (!hdimage_copy_file(backup_fname, pathname)) {
+    BX_PANIC(("Failed to restore qcow2 image '%s'", pathname));
+    return;
+  }
+  device_image_t::open(pathname);
+}
+#endif
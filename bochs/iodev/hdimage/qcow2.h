@@ -0,0 +1,122 @@
+/////////////////////////////////////////////////////////////////////////
+// $Id$
+/////////////////////////////////////////////////////////////////////////
+//
+//  QEMU copy-on-write disk image format version 2 and 3 (qcow2)
+//
+//  Copyright (C) 2021  The Bochs Project
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+/////////////////////////////////////////////////////////////////////////
+
+#ifndef BX_QCOW2IMG_H
+#define BX_QCOW2IMG_H
+
+#define QCOW2_MAGIC            0x514649fb  // 'Q', 'F', 'I', 0xfb
+#define QCOW2_HEADER_SIZE_V2   72
+#define QCOW2_HEADER_SIZE_V3   104
+#define QCOW2_MIN_CLUSTER_BITS 9
+#define QCOW2_MAX_CLUSTER_BITS 21
+#define QCOW2_DEF_CLUSTER_BITS 16
+#define QCOW2_MAX_L1_SIZE      0x400000
+#define QCOW2_MAX_REFTABLE_SIZE 0x800000
+#define QCOW2_MAX_NAME_LEN     1024
+
+// L1 / L2 table entry flags
+#define QCOW2_OFLAG_COPIED     BX_CONST64(0x8000000000000000)
+#define QCOW2_OFLAG_COMPRESSED BX_CONST64(0x4000000000000000)
+#define QCOW2_OFLAG_ZERO       BX_CONST64(0x0000000000000001)
+#define QCOW2_OFFSET_MASK      BX_CONST64(0x00fffffffffffe00)
+
+// number of L2 tables kept in memory
+#define QCOW2_L2_CACHE_SIZE    16
+
+// header fields (all values are big-endian on disk)
+typedef struct {
+  Bit32u magic;
+  Bit32u version;
+  Bit64u backing_file_offset;
+  Bit32u backing_file_size;
+  Bit32u cluster_bits;
+  Bit64u size;
+  Bit32u crypt_method;
+  Bit32u l1_size;
+  Bit64u l1_table_offset;
+  Bit64u refcount_table_offset;
+  Bit32u refcount_table_clusters;
+  Bit32u nb_snapshots;
+  Bit64u snapshots_offset;
+  // version 3 only
+  Bit64u incompatible_features;
+  Bit64u compatible_features;
+  Bit64u autoclear_features;
+  Bit32u refcount_order;
+  Bit32u header_length;
+} qcow2_header_t;
+
+class qcow2_image_t : public device_image_t
+{
+  public:
+    qcow2_image_t();
+    int open(const char* pathname, int flags);
+    void close();
+    Bit64s lseek(Bit64s offset, int whence);
+    ssize_t read(void* buf, size_t count);
+    ssize_t write(const void* buf, size_t count);
+
+    static int check_format(int fd, Bit64u imgsize);
+
+#ifdef BXIMAGE
+    int create_image(const char *pathname, Bit64u size);
+#else
+    bool save_state(const char *backup_fname);
+    void restore_state(const char *backup_fname);
+#endif
+
+  private:
+    static int read_header(int fd, qcow2_header_t *header);
+    bool open_backing_file(void);
+    Bit64u *get_l2_table(Bit64u l2_offset, bool do_read);
+    bool get_l2_entry(Bit64u offset, Bit64u *entry);
+    Bit64u get_cluster_for_write(Bit64u offset, bool fill);
+    bool fill_cluster(Bit64u offset, Bit64u l2_entry, Bit8u *buffer);
+    ssize_t read_backing(Bit64u offset, Bit8u *buf, size_t count);
+    Bit64s alloc_cluster(void);
+    int update_refcount(Bit64u offset, int delta);
+    bool write_entry(Bit64u offset, Bit64u value);
+
+    int fd;
+    const char *pathname;
+    bool read_only;
+    qcow2_header_t header;
+    Bit32u cluster_size;
+    Bit32u l2_bits;
+    Bit64u *l1_table;
+    Bit64u *refcount_table;
+    Bit32u refcount_table_size;
+    Bit64u refcount_block_offset;
+    Bit16u *refcount_block;
+    Bit64u next_cluster_offset;
+    Bit8u *cluster_buf;
+    // L2 table cache (tables in host byte order)
+    Bit64u l2_cache_offsets[QCOW2_L2_CACHE_SIZE];
+    Bit32u l2_cache_counts[QCOW2_L2_CACHE_SIZE];
+    Bit64u *l2_cache;
+    Bit64s cur_offset;
+    device_image_t *backing;
+    char *backing_path;
+};
+
+#endif
@@ -357,16 +357,17 @@ off_t vbox_image_t::perform_seek()
   }
 }
 
-void vbox_image_t::flush()
+bool vbox_image_t::flush()
 {
   if (!is_dirty)
-    return;
+    return 1;
 
   //
   // Write dirty sectors to disk.
   //
   write_block(mtlb_sector);
   is_dirty = 0;
+  return 1;
 }
 
 void vbox_image_t::read_block(const Bit32u index)
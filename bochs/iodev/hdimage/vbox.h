@@ -86,6 +86,9 @@ class vbox_image_t : public device_image_t
         ssize_t read(void* buf, size_t count);
         ssize_t write(const void* buf, size_t count);
 
+        // Write the modified block buffer to the file.
+        bool flush();
+
         Bit32u get_capabilities();
         static int check_format(int fd, Bit64u imgsize);
 
@@ -102,7 +105,6 @@ class vbox_image_t : public device_image_t
 
         bool read_header();
         off_t perform_seek();
-        void flush();
         void read_block(const Bit32u index);
         void write_block(const Bit32u index);
 
@@ -354,17 +354,24 @@ off_t vmware4_image_t::perform_seek()
   return (header.tlb_size_sectors * SECTOR_SIZE) - (current_offset - tlb_offset);
 }
 
-void vmware4_image_t::flush()
+bool vmware4_image_t::flush()
 {
+  unsigned tlb_size = (unsigned)header.tlb_size_sectors * SECTOR_SIZE;
+
   if (!is_dirty)
-    return;
+    return 1;
 
   //
   // Write dirty sectors to disk first. Assume that the file is already at the
   // position for the current tlb.
   //
-  ::write(file_descriptor, tlb, (unsigned)header.tlb_size_sectors * SECTOR_SIZE);
+  if (::write(file_descriptor, tlb, tlb_size) != (ssize_t)tlb_size) {
+    return 0;
+  }
+  // the tlb may be modified and flushed again
+  ::lseek(file_descriptor, -(off_t)tlb_size, SEEK_CUR);
   is_dirty = 0;
+  return 1;
 }
 
 Bit32u vmware4_image_t::read_block_index(Bit64u sector, Bit32u index)
@@ -74,6 +74,9 @@ class vmware4_image_t : public device_image_t
         ssize_t read(void* buf, size_t count);
         ssize_t write(const void* buf, size_t count);
 
+        // Write the modified block buffer to the file.
+        bool flush();
+
         Bit32u get_capabilities();
         static int check_format(int fd, Bit64u imgsize);
 
@@ -92,7 +95,6 @@ class vmware4_image_t : public device_image_t
 
         bool read_header();
         off_t perform_seek();
-        void flush();
         Bit32u read_block_index(Bit64u sector, Bit32u index);
         void write_block_index(Bit64u sector, Bit32u index, Bit32u block_sector);
 
@@ -202,7 +202,7 @@ public:
   virtual bool bmdma_read_sector(Bit8u channel, Bit8u *buffer, Bit32u *sector_size) {
     STUBFUNC(HD, bmdma_read_sector); return 0;
   }
-  virtual bool bmdma_write_sector(Bit8u channel, Bit8u *buffer) {
+  virtual bool bmdma_write_sector(Bit8u channel, Bit8u *buffer, Bit32u *sector_size) {
     STUBFUNC(HD, bmdma_write_sector); return 0;
   }
   virtual void bmdma_complete(Bit8u channel) {
@@ -413,8 +413,14 @@ public:
   bool register_default_io_write_handler(void *this_ptr, bx_write_handler_t f, const char *name, Bit8u mask);
   bool register_irq(unsigned irq, const char *name);
   bool unregister_irq(unsigned irq, const char *name);
+#if BX_INSTRUMENTATION
   Bit32u inp(Bit16u addr, unsigned io_len) BX_CPP_AttrRegparmN(2);
   void   outp(Bit16u addr, Bit32u value, unsigned io_len) BX_CPP_AttrRegparmN(3);
+#else
+  // without instrumentation hooks the port handler is called inline
+  BX_CPP_INLINE Bit32u inp(Bit16u addr, unsigned io_len) { return port_read(addr, io_len); }
+  BX_CPP_INLINE void   outp(Bit16u addr, Bit32u value, unsigned io_len) { port_write(addr, value, io_len); }
+#endif
 
   void register_default_keyboard(void *dev, bx_kbd_gen_scancode_t kbd_gen_scancode,
                                  bx_kbd_get_elements_t kbd_get_elements);
@@ -521,8 +527,29 @@ private:
   struct io_handler_struct io_read_handlers;
   struct io_handler_struct io_write_handlers;
 #define PORTS 0x10000
-  struct io_handler_struct **read_port_to_handler;
-  struct io_handler_struct **write_port_to_handler;
+  // Flat per-port tables used by inp()/outp(). Each entry holds a copy of
+  // the handler function, device pointer and io_len mask, so the dispatch
+  // needs a single table lookup. The handler list entry is kept for the
+  // (un)registration bookkeeping.
+  struct io_read_port_t {
+    bx_read_handler_t funct;
+    void *this_ptr;
+    Bit8u mask;
+    struct io_handler_struct *handler;
+  } *io_read_port;
+  struct io_write_port_t {
+    bx_write_handler_t funct;
+    void *this_ptr;
+    Bit8u mask;
+    struct io_handler_struct *handler;
+  } *io_write_port;
+
+  void set_io_read_port(Bit32u addr, struct io_handler_struct *handler);
+  void set_io_write_port(Bit32u addr, struct io_handler_struct *handler);
+  BX_CPP_INLINE Bit32u port_read(Bit16u addr, unsigned io_len);
+  BX_CPP_INLINE void   port_write(Bit16u addr, Bit32u value, unsigned io_len);
+  Bit32u unmapped_inp(Bit16u addr, unsigned io_len) BX_CPP_AttrRegparmN(2);
+  void   unmapped_outp(Bit16u addr, unsigned io_len) BX_CPP_AttrRegparmN(2);
 
   // more for informative purposes, the names of the devices which
   // are use each of the IRQ 0..15 lines are stored here
@@ -669,6 +696,44 @@ BX_CPP_INLINE void DEV_MEM_WRITE_PHYSICAL_DMA(bx_phy_address phy_addr, unsigned
   }
 }
 
+/*
+ * Read a byte of data from the IO memory address space
+ */
+BX_CPP_INLINE Bit32u bx_devices_c::port_read(Bit16u addr, unsigned io_len)
+{
+  Bit32u ret;
+
+  io_read_port_t *port = &io_read_port[addr];
+  if (port->mask & io_len) {
+    bx_pc_system.smp_lock();
+    ret = port->funct(port->this_ptr, (Bit32u)addr, io_len);
+    bx_pc_system.smp_unlock();
+  } else {
+    ret = unmapped_inp(addr, io_len);
+  }
+
+  BX_DBG_IO_REPORT(addr, io_len, BX_READ, ret);
+
+  return(ret);
+}
+
+/*
+ * Write a byte of data to the IO memory address space.
+ */
+BX_CPP_INLINE void bx_devices_c::port_write(Bit16u addr, Bit32u value, unsigned io_len)
+{
+  BX_DBG_IO_REPORT(addr, io_len, BX_WRITE, value);
+
+  io_write_port_t *port = &io_write_port[addr];
+  if (port->mask & io_len) {
+    bx_pc_system.smp_lock();
+    port->funct(port->this_ptr, (Bit32u)addr, value, io_len);
+    bx_pc_system.smp_unlock();
+  } else {
+    unmapped_outp(addr, io_len);
+  }
+}
+
 BOCHSAPI extern bx_devices_c bx_devices;
 
 #endif /* IODEV_H */
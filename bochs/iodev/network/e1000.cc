@@ -39,6 +39,7 @@
 
 #include "pci.h"
 #include "netmod.h"
+#include "netcsum.h"
 #include "e1000.h"
 
 #define LOG_THIS E1000DevMain->
@@ -410,16 +411,7 @@ PLUGIN_ENTRY_FOR_MODULE(e1000)
 
 Bit32u net_checksum_add(Bit8u *buf, unsigned buf_len)
 {
-  Bit32u sum = 0;
-  unsigned i;
-
-  for (i = 0; i < buf_len; i++) {
-    if (i & 1)
-      sum += (Bit32u)buf[i];
-    else
-      sum += (Bit32u)buf[i] << 8;
-  }
-  return sum;
+  return net_checksum(buf, buf_len);
 }
 
 Bit16u net_checksum_finish(Bit32u sum)
@@ -510,6 +502,8 @@ bx_e1000_c::bx_e1000_c()
   memset(&s, 0, sizeof(bx_e1000_t));
   s.tx_timer_index = BX_NULL_TIMER_HANDLE;
   ethdev = NULL;
+  tx_batch_buf = NULL;
+  tx_batch_count = 0;
 }
 
 bx_e1000_c::~bx_e1000_c()
@@ -520,6 +514,9 @@ bx_e1000_c::~bx_e1000_c()
   if (s.tx.vlan != NULL) {
     delete [] s.tx.vlan;
   }
+  if (tx_batch_buf != NULL) {
+    delete [] tx_batch_buf;
+  }
   if (ethdev != NULL) {
     delete ethdev;
   }
@@ -554,6 +551,7 @@ void bx_e1000_c::init(Bit8u card)
   BX_E1000_THIS s.mac_reg = new Bit32u[0x8000];
   BX_E1000_THIS s.tx.vlan = new Bit8u[0x10004];
   BX_E1000_THIS s.tx.data = BX_E1000_THIS s.tx.vlan + 4;
+  BX_E1000_THIS tx_batch_buf = new Bit8u[BX_E1000_TX_BATCH * BX_E1000_TX_SLOT_SIZE];
 
   BX_E1000_THIS s.devfunc = 0x00;
   DEV_register_pci_handlers(this, &BX_E1000_THIS s.devfunc, BX_PLUGIN_E1000,
@@ -1128,14 +1126,94 @@ int bx_e1000_c::fcs_len()
   return (BX_E1000_THIS s.mac_reg[RCTL] & E1000_RCTL_SECRC) ? 0 : 4;
 }
 
+// TSO frame can be passed to the host as a single large frame
+bool bx_e1000_c::tso_offload()
+{
+  e1000_tx *tp = &BX_E1000_THIS s.tx;
+  Bit32u caps = BX_E1000_THIS ethdev->offload_caps();
+
+  return (tp->tcp && (tp->sum_needed & E1000_TXD_POPTS_TXSM) &&
+          (caps & (tp->ip ? BX_NETDEV_OFFLOAD_TSO4 : BX_NETDEV_OFFLOAD_TSO6)) &&
+          (tp->mss > 0) && (tp->tucso > tp->tucss) &&
+          (((Bit32u)tp->hdr_len + tp->paylen) < 0x10000));
+}
+
+// TCP/UDP checksum of the current frame can be left to the host
+bool bx_e1000_c::csum_offload()
+{
+  e1000_tx *tp = &BX_E1000_THIS s.tx;
+
+  return ((BX_E1000_THIS ethdev->offload_caps() & BX_NETDEV_OFFLOAD_CSUM) &&
+          (tp->tucso > tp->tucss) && ((unsigned)tp->tucso + 2 <= tp->size) &&
+          ((tp->tucse == 0) || ((unsigned)tp->tucse + 1 >= tp->size)));
+}
+
+void bx_e1000_c::queue_frame(Bit8u *buf, unsigned len, const eth_offload_t *offload)
+{
+  eth_txframe_t *frame;
+
+  if (len > BX_E1000_TX_SLOT_SIZE) {
+    // large frames are passed without copying them
+    eth_txframe_t large = {buf, len, offload};
+    flush_tx();
+    BX_E1000_THIS ethdev->sendpkts(&large, 1);
+    return;
+  }
+  if (BX_E1000_THIS tx_batch_count == BX_E1000_TX_BATCH) {
+    flush_tx();
+  }
+  frame = &BX_E1000_THIS tx_batch[BX_E1000_THIS tx_batch_count];
+  frame->buf = BX_E1000_THIS tx_batch_buf +
+               BX_E1000_THIS tx_batch_count * BX_E1000_TX_SLOT_SIZE;
+  memcpy(frame->buf, buf, len);
+  frame->len = len;
+  if (offload != NULL) {
+    BX_E1000_THIS tx_batch_offload[BX_E1000_THIS tx_batch_count] = *offload;
+    frame->offload = &BX_E1000_THIS tx_batch_offload[BX_E1000_THIS tx_batch_count];
+  } else {
+    frame->offload = NULL;
+  }
+  BX_E1000_THIS tx_batch_count++;
+}
+
+void bx_e1000_c::flush_tx()
+{
+  if (BX_E1000_THIS tx_batch_count > 0) {
+    BX_E1000_THIS ethdev->sendpkts(BX_E1000_THIS tx_batch, BX_E1000_THIS tx_batch_count);
+    BX_E1000_THIS tx_batch_count = 0;
+  }
+}
+
 void bx_e1000_c::xmit_seg()
 {
   Bit16u len;
   Bit8u *sp;
-  unsigned int frames = BX_E1000_THIS s.tx.tso_frames, css, sofar, n;
+  unsigned int frames = BX_E1000_THIS s.tx.tso_frames, css, sofar, n, segs = 1;
+  unsigned int phsum;
   e1000_tx *tp = &BX_E1000_THIS s.tx;
+  eth_offload_t offload, *op = NULL;
 
-  if (tp->tse && tp->cptse) {
+  if (tp->tse && tp->cptse && tso_offload()) {
+    // the host splits the frame, so the headers describe the whole payload
+    css = tp->ipcss;
+    if (tp->ip) { // IPv4
+      put_net2(tp->data+css+2, tp->size - css);
+    } else // IPv6
+      put_net2(tp->data+css+4, tp->size - css - 40);
+    len = tp->size - tp->tucss;
+    // add pseudo-header length before checksum calculation
+    sp = tp->data + tp->tucso;
+    phsum = get_net2(sp) + len;
+    phsum = (phsum >> 16) + (phsum & 0xffff);
+    put_net2(sp, phsum);
+    op = &offload;
+    offload.gso_type = tp->ip ? BX_NET_GSO_TCPV4 : BX_NET_GSO_TCPV6;
+    offload.hdr_len = tp->hdr_len;
+    offload.gso_size = tp->mss;
+    if (tp->size > tp->hdr_len)
+      segs = (tp->size - tp->hdr_len + tp->mss - 1) / tp->mss;
+    BX_DEBUG(("TSO frame size %d passed to host (%d segments)", tp->size, segs));
+  } else if (tp->tse && tp->cptse) {
     css = tp->ipcss;
     BX_DEBUG(("frames %d size %d ipcss %d", frames, tp->size, css));
     if (tp->ip) { // IPv4
@@ -1155,7 +1233,6 @@ void bx_e1000_c::xmit_seg()
     } else // UDP
       put_net2(tp->data+css+4, len);
     if (tp->sum_needed & E1000_TXD_POPTS_TXSM) {
-      unsigned int phsum;
       // add pseudo-header length before checksum calculation
       sp = tp->data + tp->tucso;
       phsum = get_net2(sp) + len;
@@ -1163,9 +1240,19 @@ void bx_e1000_c::xmit_seg()
       put_net2(sp, phsum);
     }
     tp->tso_frames++;
+  } else if ((tp->sum_needed & E1000_TXD_POPTS_TXSM) && csum_offload()) {
+    op = &offload;
+    offload.gso_type = BX_NET_GSO_NONE;
+    offload.hdr_len = 0;
+    offload.gso_size = 0;
   }
 
-  if (tp->sum_needed & E1000_TXD_POPTS_TXSM)
+  if (op != NULL) {
+    // the host completes the TCP/UDP checksum
+    offload.flags = BX_NET_CSUM_NEEDED;
+    offload.csum_start = tp->tucss;
+    offload.csum_offset = tp->tucso - tp->tucss;
+  } else if (tp->sum_needed & E1000_TXD_POPTS_TXSM)
     putsum(tp->data, tp->size, tp->tucso, tp->tucss, tp->tucse);
   if (tp->sum_needed & E1000_TXD_POPTS_IXSM)
     putsum(tp->data, tp->size, tp->ipcso, tp->ipcss, tp->ipcse);
@@ -1173,11 +1260,15 @@ void bx_e1000_c::xmit_seg()
     memmove(tp->vlan, tp->data, 4);
     memmove(tp->data, tp->data + 4, 8);
     memcpy(tp->data + 8, tp->vlan_header, 4);
-    BX_E1000_THIS ethdev->sendpkt(tp->vlan, tp->size + 4);
+    if (op != NULL) {
+      offload.csum_start += 4;
+      if (offload.hdr_len > 0) offload.hdr_len += 4;
+    }
+    queue_frame(tp->vlan, tp->size + 4, op);
   } else
-    BX_E1000_THIS ethdev->sendpkt(tp->data, tp->size);
-  BX_E1000_THIS s.mac_reg[TPT]++;
-  BX_E1000_THIS s.mac_reg[GPTC]++;
+    queue_frame(tp->data, tp->size, op);
+  BX_E1000_THIS s.mac_reg[TPT] += segs;
+  BX_E1000_THIS s.mac_reg[GPTC] += segs;
   n = BX_E1000_THIS s.mac_reg[TOTL];
   if ((BX_E1000_THIS s.mac_reg[TOTL] += BX_E1000_THIS s.tx.size) < n)
     BX_E1000_THIS s.mac_reg[TOTH]++;
@@ -1232,7 +1323,7 @@ void bx_e1000_c::process_tx_desc(struct e1000_tx_desc *dp)
   }
 
   addr = le64_to_cpu(dp->buffer_addr);
-  if (tp->tse && tp->cptse) {
+  if (tp->tse && tp->cptse && !tso_offload()) {
     hdr = tp->hdr_len;
     msh = hdr + tp->mss;
     do {
@@ -1254,6 +1345,10 @@ void bx_e1000_c::process_tx_desc(struct e1000_tx_desc *dp)
     // context descriptor TSE is not set, while data descriptor TSE is set
     BX_DEBUG(("TCP segmentaion Error"));
   } else {
+    // also used for TSO frames passed to the host in one piece
+    if ((tp->size + split_size) > 0xffff) {
+      split_size = 0xffff - tp->size;
+    }
     DEV_MEM_READ_PHYSICAL_DMA(addr, split_size, tp->data + tp->size);
     tp->size += split_size;
   }
@@ -1326,6 +1421,7 @@ void bx_e1000_c::start_xmit()
       break;
     }
   }
+  flush_tx();
   BX_E1000_THIS s.tx.int_cause = cause;
   bx_pc_system.activate_timer(BX_E1000_THIS s.tx_timer_index, 10, 0); // not continuous
   bx_gui->statusbar_setitem(BX_E1000_THIS s.statusbar_id, 1, 1);
@@ -34,6 +34,9 @@
 
 #define BX_E1000_MAX_DEVS 4
 
+#define BX_E1000_TX_BATCH     32   // frames passed to the pktmover at once
+#define BX_E1000_TX_SLOT_SIZE 1536 // full-sized frame with VLAN tag
+
 #define BX_E1000_THIS this->
 #define BX_E1000_THIS_PTR this
 
@@ -126,6 +129,12 @@ private:
 
   eth_pktmover_c *ethdev;
 
+  // frames collected by start_xmit() for a single sendpkts() call
+  eth_txframe_t tx_batch[BX_E1000_TX_BATCH];
+  eth_offload_t tx_batch_offload[BX_E1000_TX_BATCH];
+  Bit8u    *tx_batch_buf;
+  unsigned tx_batch_count;
+
   void    set_irq_level(bool level);
   void    set_interrupt_cause(Bit32u val);
   void    set_ics(Bit32u value);
@@ -141,6 +150,10 @@ private:
   bool    is_vlan_packet(const Bit8u *buf);
   bool    is_vlan_txd(Bit32u txd_lower);
   int     fcs_len(void);
+  bool    tso_offload(void);
+  bool    csum_offload(void);
+  void    queue_frame(Bit8u *buf, unsigned len, const eth_offload_t *offload);
+  void    flush_tx(void);
   void    xmit_seg(void);
   void    process_tx_desc(struct e1000_tx_desc *dp);
   Bit32u  txdesc_writeback(bx_phy_address base, struct e1000_tx_desc *dp);
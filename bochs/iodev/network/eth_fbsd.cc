@@ -80,8 +80,6 @@ extern "C" {
 #include <errno.h>
 };
 
-#define BX_BPF_POLL  1000    // Poll for a frame every 250 usecs
-
 #define BX_BPF_INSNSIZ  8    // number of bpf insns
 
 // template filter for a unicast mac address and all
@@ -119,13 +117,15 @@ public:
                      logfunctions *netdev, const char *script);
   virtual ~bx_fbsd_pktmover_c();
   void sendpkt(void *buf, unsigned io_len);
+  int rx_read(Bit8u *buf, unsigned size);
 
 private:
   char *fbsd_macaddr[6];
   int bpf_fd;
-  static void rx_timer_handler(void *);
-  void rx_timer(void);
-  int rx_timer_index;
+  bx_netio_client_t *netio;
+  // a single read() returns all frames captured since the last one
+  Bit8u bpf_buf[BX_PACKET_BUFSIZE];
+  int bpf_len, bpf_pos;
   struct bpf_insn filter[BX_BPF_INSNSIZ];
 #if BX_ETH_FBSD_LOGGING
   FILE *pktlog, *pktlog_txt;
@@ -175,6 +175,9 @@ bx_fbsd_pktmover_c::bx_fbsd_pktmover_c(const char *netif,
   u_int v;
 
   this->netdev = netdev;
+  this->netio = NULL;
+  this->bpf_len = 0;
+  this->bpf_pos = 0;
   BX_INFO(("freebsd network driver"));
   memcpy(fbsd_macaddr, macaddr, 6);
 
@@ -286,11 +289,6 @@ bx_fbsd_pktmover_c::bx_fbsd_pktmover_c(const char *netif,
     return;
   }
 
-  // Start the rx poll
-  this->rx_timer_index =
-    DEV_register_timer(this, this->rx_timer_handler, BX_BPF_POLL, 1, 1,
-                       "eth_fbsd"); // continuous, active
-
   this->rxh    = rxh;
   this->rxstat = rxstat;
 
@@ -309,10 +307,15 @@ bx_fbsd_pktmover_c::bx_fbsd_pktmover_c(const char *netif,
   fprintf(pktlog_txt, "\n--\n");
   fflush(pktlog_txt);
 #endif
+  // Start receiving frames on the network I/O thread
+  this->netio = bx_netio.add_reader(this, this->bpf_fd);
 }
 
 bx_fbsd_pktmover_c::~bx_fbsd_pktmover_c()
 {
+  if (netio != NULL) {
+    bx_netio.remove(netio);
+  }
 #if BX_ETH_FBSD_LOGGING
   fclose(pktlog);
   fclose(pktlog_txt);
@@ -339,30 +342,23 @@ void bx_fbsd_pktmover_c::sendpkt(void *buf, unsigned io_len)
     status = write(this->bpf_fd, buf, io_len);
 }
 
-// The receive poll process
-void
-bx_fbsd_pktmover_c::rx_timer_handler(void *this_ptr)
+// called on the network I/O thread, returns one frame of the bpf buffer
+int
+bx_fbsd_pktmover_c::rx_read(Bit8u *buf, unsigned size)
 {
-  bx_fbsd_pktmover_c *class_ptr = (bx_fbsd_pktmover_c *) this_ptr;
-
-  class_ptr->rx_timer();
-}
-
-
-void
-bx_fbsd_pktmover_c::rx_timer(void)
-{
-  int nbytes = 0;
-    unsigned char rxbuf[BX_PACKET_BUFSIZE];
   struct bpf_hdr *bhdr;
-    struct bpf_stat bstat;
-    static struct bpf_stat previous_bstat;
+  struct bpf_stat bstat;
+  static struct bpf_stat previous_bstat;
+  unsigned len;
 #define phdr ((unsigned char*)bhdr)
 
-  bhdr = (struct bpf_hdr *) rxbuf;
-  nbytes = read(this->bpf_fd, rxbuf, sizeof(rxbuf));
-
-  while (phdr < (rxbuf + nbytes)) {
+  if (this->bpf_pos >= this->bpf_len) {
+    this->bpf_pos = 0;
+    this->bpf_len = read(this->bpf_fd, this->bpf_buf, sizeof(this->bpf_buf));
+    if (this->bpf_len <= 0) {
+      this->bpf_len = 0;
+      return -1;
+    }
     if (ioctl(this->bpf_fd, BIOCGSTATS, &bstat) < 0) {
       BX_PANIC(("eth_freebsd: could not stat filter: %s", strerror(errno)));
     }
@@ -371,35 +367,38 @@ bx_fbsd_pktmover_c::rx_timer(void)
                bstat.bs_drop - previous_bstat.bs_drop));
     }
     previous_bstat = bstat;
-    if (bhdr->bh_caplen < 20 || bhdr->bh_caplen > 1514) {
-      BX_ERROR(("eth_freebsd: received too weird packet length: %d", bhdr->bh_caplen));
-    }
+  }
 
-    // filter out packets sourced from this node
-    if (memcmp(bhdr + bhdr->bh_hdrlen + 6, this->fbsd_macaddr, 6)) {
-      if (this->rxstat(this->netdev) & BX_NETDEV_RXREADY) {
-        this->rxh(this->netdev, phdr + bhdr->bh_hdrlen, bhdr->bh_caplen);
-      } else {
-        BX_ERROR(("device not ready to receive data"));
-      }
-    }
+  bhdr = (struct bpf_hdr *) (this->bpf_buf + this->bpf_pos);
+  // Advance to next packet
+  this->bpf_pos += BPF_WORDALIGN(bhdr->bh_hdrlen + bhdr->bh_caplen);
+
+  len = bhdr->bh_caplen;
+  if (len < 20 || len > 1514) {
+    BX_ERROR(("eth_freebsd: received too weird packet length: %d", len));
+  }
+  if (len > size) len = size;
 
 #if BX_ETH_FBSD_LOGGING
-    BX_DEBUG(("receive packet length %u", nbytes));
-    // dump raw bytes to a file, eventually dump in pcap format so that
-    // tcpdump -r FILE can interpret them for us.
-    if (1 != fwrite(bhdr, bhdr->bh_caplen, 1, pktlog)) {
-      BX_PANIC(("fwrite to pktlog failed: %s", strerror(errno)));
-    }
-    // dump packet in hex into an ascii log file
-    write_pktlog_txt(pktlog_txt, rxbuf, bhdr->bh_caplen, 1);
-    // flush log so that we see the packets as they arrive w/o buffering
-    fflush (this->pktlog);
+  BX_DEBUG(("receive packet length %u", len));
+  // dump raw bytes to a file, eventually dump in pcap format so that
+  // tcpdump -r FILE can interpret them for us.
+  if (1 != fwrite(phdr + bhdr->bh_hdrlen, len, 1, pktlog)) {
+    BX_PANIC(("fwrite to pktlog failed: %s", strerror(errno)));
+  }
+  // dump packet in hex into an ascii log file
+  write_pktlog_txt(pktlog_txt, phdr + bhdr->bh_hdrlen, len, 1);
+  // flush log so that we see the packets as they arrive w/o buffering
+  fflush (this->pktlog);
 #endif
 
-    // Advance bhdr and phdr pointers to next packet
-    bhdr = (struct bpf_hdr*) ((char*) bhdr + BPF_WORDALIGN(bhdr->bh_hdrlen + bhdr->bh_caplen));
+  // filter out packets sourced from this node
+  if (!memcmp(phdr + bhdr->bh_hdrlen + 6, this->fbsd_macaddr, 6)) {
+    return 0;
   }
+  memcpy(buf, phdr + bhdr->bh_hdrlen, len);
+  return len;
+#undef phdr
 }
 
 #endif /* if BX_NETWORKING && BX_NETMOD_FBSD */
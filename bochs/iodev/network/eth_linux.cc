@@ -75,8 +75,6 @@ extern "C" {
 #include <linux/filter.h>
 };
 
-#define BX_PACKET_POLL  1000    // Poll for a frame every 1000 usecs
-
 // template filter for a unicast mac address and all
 // multicast/broadcast frames
 static const struct sock_filter macfilter[] = {
@@ -109,15 +107,16 @@ public:
                       eth_rx_status_t rxstat,
                       logfunctions *netdev,
                       const char *script);
+  virtual ~bx_linux_pktmover_c();
   void sendpkt(void *buf, unsigned io_len);
+  void sendpkts(const eth_txframe_t *frames, unsigned count);
+  int rx_read(Bit8u *buf, unsigned size);
 
 private:
   unsigned char *linux_macaddr[6];
   int fd;
   int ifindex;
-  static void rx_timer_handler(void *);
-  void rx_timer(void);
-  int rx_timer_index;
+  bx_netio_client_t *netio;
   struct sock_filter filter[BX_LSF_ICNT];
 };
 
@@ -159,6 +158,7 @@ bx_linux_pktmover_c::bx_linux_pktmover_c(const char *netif,
   struct sock_fprog fp;
 
   this->netdev = netdev;
+  this->netio = NULL;
   memcpy(linux_macaddr, macaddr, 6);
 
   // Open packet socket
@@ -236,16 +236,23 @@ bx_linux_pktmover_c::bx_linux_pktmover_c(const char *netif,
     return;
   }
 
-  // Start the rx poll
-  this->rx_timer_index =
-    DEV_register_timer(this, this->rx_timer_handler, BX_PACKET_POLL, 1, 1,
-                       "eth_linux"); // continuous, active
-
   this->rxh    = rxh;
   this->rxstat = rxstat;
+  // Start receiving frames on the network I/O thread
+  this->netio = bx_netio.add_reader(this, this->fd);
   BX_INFO(("linux network driver initialized: using interface %s", netif));
 }
 
+bx_linux_pktmover_c::~bx_linux_pktmover_c()
+{
+  if (netio != NULL) {
+    bx_netio.remove(netio);
+  }
+  if (this->fd != -1) {
+    close(this->fd);
+  }
+}
+
 // the output routine - called with pre-formatted ethernet frame.
 void
 bx_linux_pktmover_c::sendpkt(void *buf, unsigned io_len)
@@ -259,47 +266,38 @@ bx_linux_pktmover_c::sendpkt(void *buf, unsigned io_len)
   }
 }
 
-// The receive poll process
+// send a batch of frames with a single system call
 void
-bx_linux_pktmover_c::rx_timer_handler(void *this_ptr)
+bx_linux_pktmover_c::sendpkts(const eth_txframe_t *frames, unsigned count)
 {
-  bx_linux_pktmover_c *class_ptr = (bx_linux_pktmover_c *) this_ptr;
-
-  class_ptr->rx_timer();
+  if (this->fd != -1) {
+    if (send_frames(this->fd, frames, count, NULL, 0, 0) < (int)count)
+      BX_INFO(("eth_linux: write failed: %s", strerror(errno)));
+  }
 }
 
-void
-bx_linux_pktmover_c::rx_timer(void)
+// called on the network I/O thread
+int
+bx_linux_pktmover_c::rx_read(Bit8u *buf, unsigned size)
 {
   int nbytes = 0;
-  Bit8u rxbuf[BX_PACKET_BUFSIZE];
   struct sockaddr_ll sll;
   socklen_t fromlen;
 
-  if (this->fd == -1)
-    return;
-
   fromlen = sizeof(sll);
-  nbytes = recvfrom(this->fd, rxbuf, sizeof(rxbuf), 0, (struct sockaddr *)&sll, &fromlen);
+  nbytes = recvfrom(this->fd, buf, size, 0, (struct sockaddr *)&sll, &fromlen);
 
-  if (nbytes == -1) {
-    if (errno != EAGAIN)
+  if (nbytes <= 0) {
+    if ((nbytes == -1) && (errno != EAGAIN))
       BX_INFO(("eth_linux: error receiving packet: %s\n", strerror(errno)));
-    return;
+    return -1;
   }
 
   // this should be done with LSF someday
   // filter out packets sourced by us
   if (memcmp(sll.sll_addr, this->linux_macaddr, 6) == 0)
-    return;
-  // let through broadcast, multicast, and our mac address
-//  if ((memcmp(rxbuf, broadcast_macaddr, 6) == 0) || (memcmp(rxbuf, this->linux_macaddr, 6) == 0) || rxbuf[0] & 0x01) {
-    BX_DEBUG(("eth_linux: got packet: %d bytes, dst=%x:%x:%x:%x:%x:%x, src=%x:%x:%x:%x:%x:%x\n", nbytes, rxbuf[0], rxbuf[1], rxbuf[2], rxbuf[3], rxbuf[4], rxbuf[5], rxbuf[6], rxbuf[7], rxbuf[8], rxbuf[9], rxbuf[10], rxbuf[11]));
-    if (this->rxstat(this->netdev) & BX_NETDEV_RXREADY) {
-      this->rxh(this->netdev, rxbuf, nbytes);
-    } else {
-      BX_ERROR(("device not ready to receive data"));
-    }
-//  }
+    return 0;
+  BX_DEBUG(("eth_linux: got packet: %d bytes, dst=%x:%x:%x:%x:%x:%x, src=%x:%x:%x:%x:%x:%x\n", nbytes, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf[8], buf[9], buf[10], buf[11]));
+  return nbytes;
 }
 #endif /* if BX_NETWORKING && BX_NETMOD_LINUX */
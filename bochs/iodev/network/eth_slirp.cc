@@ -56,7 +56,11 @@ PLUGIN_ENTRY_FOR_NET_MODULE(slirp)
 
 #define MAX_HOSTFWD 5
 
+#if BX_NETIO_THREAD
+static Bit64u slirp_next_poll = 0;
+#else
 static int rx_timer_index = BX_NULL_TIMER_HANDLE;
+#endif
 fd_set rfds, wfds, xfds;
 int nfds;
 
@@ -94,7 +98,12 @@ private:
   bool slirp_logging;
 
   bool parse_slirp_conf(const char *conf);
+#if BX_NETIO_THREAD
+  bx_netio_client_t *netio;
+  Bit32u rx_poll(bool ready);
+#else
   static void rx_timer_handler(void *);
+#endif
 };
 
 class bx_slirp_locator_c : public eth_locator_c {
@@ -111,6 +120,11 @@ protected:
 
 bx_slirp_pktmover_c::~bx_slirp_pktmover_c()
 {
+#if BX_NETIO_THREAD
+  if (netio != NULL) {
+    bx_netio.remove(netio);
+  }
+#endif
   if (slirp != NULL) {
     slirp_cleanup(slirp);
 #ifndef WIN32
@@ -133,7 +147,9 @@ bx_slirp_pktmover_c::~bx_slirp_pktmover_c()
       free(hostfwd[--n_hostfwd]);
     }
     if (--bx_slirp_instances == 0) {
+#if !BX_NETIO_THREAD
       bx_pc_system.deactivate_timer(rx_timer_index);
+#endif
 #ifndef WIN32
       signal(SIGPIPE, SIG_DFL);
 #endif
@@ -296,6 +312,9 @@ bx_slirp_pktmover_c::bx_slirp_pktmover_c(const char *netif,
 
   restricted = 0;
   slirp = NULL;
+#if BX_NETIO_THREAD
+  netio = NULL;
+#endif
   hostname = NULL;
   bootfile = NULL;
   dnssearch = NULL;
@@ -325,9 +344,11 @@ bx_slirp_pktmover_c::bx_slirp_pktmover_c(const char *netif,
   this->netdev_speed = (status == BX_NETDEV_1GBIT) ? 1000 :
                        (status == BX_NETDEV_100MBIT) ? 100 : 10;
   if (bx_slirp_instances == 0) {
+#if !BX_NETIO_THREAD
     rx_timer_index =
       DEV_register_timer(this, this->rx_timer_handler, 1000, 1, 1,
                          "eth_slirp");
+#endif
 #ifndef WIN32
     signal(SIGPIPE, SIG_IGN);
 #endif
@@ -378,6 +399,10 @@ bx_slirp_pktmover_c::bx_slirp_pktmover_c(const char *netif,
     slirp_logging = 0;
   }
   bx_slirp_instances++;
+#if BX_NETIO_THREAD
+  // the host sockets are watched by the network I/O thread
+  netio = bx_netio.add_poller(this);
+#endif
 }
 
 void bx_slirp_pktmover_c::sendpkt(void *buf, unsigned io_len)
@@ -386,8 +411,50 @@ void bx_slirp_pktmover_c::sendpkt(void *buf, unsigned io_len)
     write_pktlog_txt(pktlog_txt, (const Bit8u*)buf, io_len, 0);
   }
   slirp_input(slirp, (Bit8u*)buf, io_len);
+#if BX_NETIO_THREAD
+  // the guest may have opened a connection, update the watched sockets
+  slirp_next_poll = 0;
+  bx_netio.schedule_drain();
+#endif
 }
 
+#if BX_NETIO_THREAD
+// Called by the network I/O drain timer. The slirp stack runs on the
+// emulation thread only, the I/O thread just waits for the host sockets.
+Bit32u bx_slirp_pktmover_c::rx_poll(bool ready)
+{
+  Bit64u now = bx_pc_system.time_usec();
+  Bit32u timeout;
+  struct timeval tv;
+  int ret;
+
+  if (!ready && (now < slirp_next_poll))
+    return (Bit32u)(slirp_next_poll - now);
+  nfds = -1;
+  FD_ZERO(&rfds);
+  FD_ZERO(&wfds);
+  FD_ZERO(&xfds);
+  timeout = 1000;
+  slirp_select_fill(&nfds, &rfds, &wfds, &xfds, &timeout);
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+  slirp_select_poll(&rfds, &wfds, &xfds, (ret < 0));
+  // the socket list may have changed
+  nfds = -1;
+  FD_ZERO(&rfds);
+  FD_ZERO(&wfds);
+  FD_ZERO(&xfds);
+  timeout = 1000;
+  slirp_select_fill(&nfds, &rfds, &wfds, &xfds, &timeout);
+  if (timeout < 1) timeout = 1;
+  slirp_next_poll = now + (Bit64u)timeout * 1000;
+  bx_netio.watch_fds(netio, nfds, &rfds, &wfds, &xfds);
+  // slirp timers (retransmission, delayed ACK) need a poll after the timeout
+  return timeout * 1000;
+}
+#else
+
 void bx_slirp_pktmover_c::rx_timer_handler(void *this_ptr)
 {
   Bit32u timeout = 0;
@@ -408,6 +475,7 @@ void bx_slirp_pktmover_c::rx_timer_handler(void *this_ptr)
   ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
   slirp_select_poll(&rfds, &wfds, &xfds, (ret < 0));
 }
+#endif
 
 int slirp_can_output(void *this_ptr)
 {
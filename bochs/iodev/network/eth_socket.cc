@@ -43,6 +43,11 @@
 //
 // this module will bind to 127.0.0.1:<socknum> for RX packets
 // TX packets will be sent to 127.0.0.1:<socknum + 1>
+//
+// Bochs sessions on the same machine as a bxhub started with the '-shm'
+// option can use the shared memory file of a port instead of UDP:
+//
+// ne2k: ioaddr=0x280, irq=10, mac=00:a:b:c:1:2, ethmod=socket, ethdev=shm:/dev/shm/bxhub-40000
 
 // Extensions by Volker Ruppert (2017):
 // - Windows support
@@ -61,6 +66,7 @@
 #include "plugin.h"
 #include "pc_system.h"
 #include "netmod.h"
+#include "netshm.h"
 
 #if BX_NETWORKING && BX_NETMOD_SOCKET
 
@@ -92,6 +98,8 @@ extern "C" {
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <net/ethernet.h>
 #include <net/if.h>
@@ -116,7 +124,9 @@ typedef int SOCKET;
 #define MSG_DONTWAIT 0
 #endif
 
+#if !BX_NETIO_THREAD
 #define BX_PACKET_POLL  1000    // Poll for a frame every 1000 usecs
+#endif
 
 //
 //  Define the class. This is private to this module
@@ -130,14 +140,34 @@ public:
   virtual ~bx_socket_pktmover_c();
 
   void sendpkt(void *buf, unsigned io_len);
+#ifdef __linux__
+  void sendpkts(const eth_txframe_t *frames, unsigned count);
+#endif
+  int rx_read(Bit8u *buf, unsigned size);
+#if BX_NETSHM && BX_NETIO_THREAD
+  Bit32u rx_poll(bool ready);
+#endif
 
 private:
+  bool accept_frame(const Bit8u *buf, unsigned len);
+#if BX_NETSHM && BX_NETIO_THREAD
+  bool shm_open_port(const char *path);
+  void shm_doorbell(void);
+#endif
+
   unsigned char *socket_macaddr[6];
   SOCKET fd;                               // socket we listen on
   struct sockaddr_in sin, sout;            // target address for RX / TX
+#if BX_NETSHM && BX_NETIO_THREAD
+  bx_netshm_t *shm;                        // shared memory port of bxhub
+#endif
+#if BX_NETIO_THREAD
+  bx_netio_client_t *netio;
+#else
   static void rx_timer_handler(void *);
   void rx_timer(void);
   int rx_timer_index;
+#endif
 };
 
 
@@ -180,6 +210,12 @@ bx_socket_pktmover_c::bx_socket_pktmover_c(const char *netif,
   BX_INFO(("socket network driver"));
   memcpy(socket_macaddr, macaddr, 6);
   this->fd = INVALID_SOCKET;
+#if BX_NETIO_THREAD
+  this->netio = NULL;
+#endif
+#if BX_NETSHM && BX_NETIO_THREAD
+  this->shm = NULL;
+#endif
 
 #ifdef WIN32
   WORD wVersionRequested;
@@ -193,7 +229,19 @@ bx_socket_pktmover_c::bx_socket_pktmover_c(const char *netif,
   }
 #endif
 
-  if (isalpha(netif[0])) {
+  if (!strncmp(netif, "shm:", 4)) {
+#if BX_NETSHM && BX_NETIO_THREAD
+    if (!shm_open_port(netif + 4))
+      return;
+    this->rxh    = rxh;
+    this->rxstat = rxstat;
+    this->netio = bx_netio.add_poller(this);
+    BX_INFO(("socket network driver initialized: using shared memory '%s'", netif + 4));
+#else
+    BX_PANIC(("eth_socket: shared memory mode not supported on this platform"));
+#endif
+    return;
+  } else if (isalpha(netif[0])) {
     // Expecting format 'host:port', so split up 'netif' string.
     char *host = strdup(netif);
     char *substr = strtok(host, ":");
@@ -272,14 +320,18 @@ bx_socket_pktmover_c::bx_socket_pktmover_c(const char *netif,
   sout.sin_port = htons(port+1); // set TX to RX + 1
   memcpy((char*) &(sout.sin_addr), hp->h_addr, hp->h_length);
 
+  this->rxh    = rxh;
+  this->rxstat = rxstat;
+
   // Start the rx poll
   //
+#if BX_NETIO_THREAD
+  this->netio = bx_netio.add_reader(this, this->fd);
+#else
   this->rx_timer_index =
     DEV_register_timer(this, this->rx_timer_handler, BX_PACKET_POLL, 1, 1,
                        "eth_socket"); // continuous, active
-
-  this->rxh    = rxh;
-  this->rxstat = rxstat;
+#endif
   BX_INFO(("socket network driver initialized: using socket '%s'", netif));
 }
 
@@ -288,17 +340,95 @@ bx_socket_pktmover_c::bx_socket_pktmover_c(const char *netif,
 //
 bx_socket_pktmover_c::~bx_socket_pktmover_c()
 {
+#if BX_NETIO_THREAD
+  if (netio != NULL) {
+    bx_netio.remove(netio);
+  }
+#endif
+  if (this->fd != INVALID_SOCKET) {
+    closesocket(this->fd);
+  }
+#if BX_NETSHM && BX_NETIO_THREAD
+  if (shm != NULL) {
+    munmap(shm, sizeof(bx_netshm_t));
+  }
+#endif
 #ifdef WIN32
   WSACleanup();
 #endif
 }
 
+#if BX_NETSHM && BX_NETIO_THREAD
+// map the shared memory file of a bxhub port
+bool bx_socket_pktmover_c::shm_open_port(const char *path)
+{
+  struct stat st;
+  bx_netshm_t *map;
+  int shm_fd;
+
+  shm_fd = open(path, O_RDWR);
+  if (shm_fd < 0) {
+    BX_PANIC(("eth_socket: could not open shared memory file '%s': %s", path, strerror(errno)));
+    return 0;
+  }
+  if ((fstat(shm_fd, &st) < 0) || (st.st_size < (off_t)sizeof(bx_netshm_t))) {
+    BX_PANIC(("eth_socket: shared memory file '%s' has a wrong size", path));
+    close(shm_fd);
+    return 0;
+  }
+  map = (bx_netshm_t *)mmap(NULL, sizeof(bx_netshm_t), PROT_READ | PROT_WRITE,
+                            MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  if (map == MAP_FAILED) {
+    BX_PANIC(("eth_socket: could not map shared memory file '%s'", path));
+    return 0;
+  }
+  if ((bx_atomic_load32(&map->magic) != BX_NETSHM_MAGIC) ||
+      (map->version != BX_NETSHM_VERSION)) {
+    BX_PANIC(("eth_socket: '%s' is not a bxhub shared memory file", path));
+    munmap(map, sizeof(bx_netshm_t));
+    return 0;
+  }
+  // the socket is only used to wake up bxhub
+  if ((this->fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET) {
+    BX_PANIC(("eth_socket: could not open socket: %s", strerror(errno)));
+    munmap(map, sizeof(bx_netshm_t));
+    return 0;
+  }
+  sout.sin_family = AF_INET;
+  sout.sin_port = htons((Bit16u)map->doorbell_port);
+  sout.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  // drop frames queued before this session was started
+  bx_atomic_store32(&map->to_client.tail, bx_atomic_load32(&map->to_client.head));
+  this->shm = map;
+  return 1;
+}
+
+// wake up bxhub if it waits for frames from this session (see netshm.h)
+void bx_socket_pktmover_c::shm_doorbell(void)
+{
+  if (bx_atomic_xchg32(&shm->hub_waiting, 0) != 0) {
+    sendto(this->fd, "", 0, (MSG_NOSIGNAL | MSG_DONTWAIT),
+           (struct sockaddr*) &sout, sizeof(sout));
+  }
+}
+#endif
+
 
 // the output routine - called with pre-formatted ethernet frame.
 void bx_socket_pktmover_c::sendpkt(void *buf, unsigned io_len)
 {
   int status;
 
+#if BX_NETSHM && BX_NETIO_THREAD
+  if (shm != NULL) {
+    if (!netshm_put(&shm->to_hub, buf, io_len)) {
+      BX_DEBUG(("eth_socket: shared memory ring full, frame dropped"));
+    }
+    shm_doorbell();
+    return;
+  }
+#endif
   if (this->fd != INVALID_SOCKET) {
     status = sendto(this->fd, (char*)buf, io_len,
                     (MSG_NOSIGNAL | MSG_DONTWAIT),
@@ -309,9 +439,35 @@ void bx_socket_pktmover_c::sendpkt(void *buf, unsigned io_len)
   }
 }
 
+#ifdef __linux__
+// send a batch of frames with a single system call
+void bx_socket_pktmover_c::sendpkts(const eth_txframe_t *frames, unsigned count)
+{
+#if BX_NETSHM && BX_NETIO_THREAD
+  if (shm != NULL) {
+    // one doorbell for the whole batch
+    for (unsigned i = 0; i < count; i++) {
+      if (!netshm_put(&shm->to_hub, frames[i].buf, frames[i].len)) {
+        BX_DEBUG(("eth_socket: shared memory ring full, frame dropped"));
+      }
+    }
+    shm_doorbell();
+    return;
+  }
+#endif
+  if (this->fd != INVALID_SOCKET) {
+    if (send_frames(this->fd, frames, count, &sout, sizeof(sout),
+                    (MSG_NOSIGNAL | MSG_DONTWAIT)) < (int)count) {
+      BX_INFO(("eth_socket: write failed: %s", strerror(errno)));
+    }
+  }
+}
+#endif
+
 
 // The receive poll process
 //
+#if !BX_NETIO_THREAD
 void bx_socket_pktmover_c::rx_timer_handler(void *this_ptr)
 {
   bx_socket_pktmover_c *class_ptr = (bx_socket_pktmover_c *) this_ptr;
@@ -321,16 +477,31 @@ void bx_socket_pktmover_c::rx_timer_handler(void *this_ptr)
 
 void bx_socket_pktmover_c::rx_timer(void)
 {
-  int nbytes = 0;
-  socklen_t slen = sizeof(sin);
+  int nbytes;
   Bit8u rxbuf[BX_PACKET_BUFSIZE];
 
   // is socket open and bound?
   if (this->fd == INVALID_SOCKET)
     return;
 
+  nbytes = rx_read(rxbuf, sizeof(rxbuf));
+  if (nbytes <= 0)
+    return;
+
+  if (this->rxstat(this->netdev) & BX_NETDEV_RXREADY) {
+    this->rxh(this->netdev, rxbuf, nbytes);
+  }
+}
+#endif
+
+// receive a single packet (on the network I/O thread if present)
+int bx_socket_pktmover_c::rx_read(Bit8u *buf, unsigned size)
+{
+  int nbytes = 0;
+  socklen_t slen = sizeof(sin);
+
   // receive packet
-  nbytes = recvfrom(this->fd, (char*)rxbuf, sizeof(rxbuf), MSG_NOSIGNAL,
+  nbytes = recvfrom(this->fd, (char*)buf, size, MSG_NOSIGNAL,
                     (struct sockaddr*) &sin, &slen);
 
   if (nbytes == -1) {
@@ -341,18 +512,46 @@ void bx_socket_pktmover_c::rx_timer(void)
     if (errno != EAGAIN)
       BX_INFO(("eth_socket: error receiving packet: %s", strerror(errno)));
 #endif
-    return;
+    return -1;
+  }
+
+  if (!accept_frame(buf, nbytes)) {
+    return 0;
   }
+  return nbytes;
+}
 
+bool bx_socket_pktmover_c::accept_frame(const Bit8u *buf, unsigned len)
+{
   // let through broadcast and our mac address
-  if ((memcmp(rxbuf, this->socket_macaddr, 6) != 0) &&
-      (memcmp(rxbuf, broadcast_macaddr, 6) != 0)) {
-    return;
+  if ((len < 6) ||
+      ((memcmp(buf, this->socket_macaddr, 6) != 0) &&
+       (memcmp(buf, broadcast_macaddr, 6) != 0))) {
+    return 0;
   }
 
-  if (this->rxstat(this->netdev) & BX_NETDEV_RXREADY) {
-    BX_DEBUG(("eth_socket: got packet: %d bytes, dst=%x:%x:%x:%x:%x:%x, src=%x:%x:%x:%x:%x:%x", nbytes, rxbuf[0], rxbuf[1], rxbuf[2], rxbuf[3], rxbuf[4], rxbuf[5], rxbuf[6], rxbuf[7], rxbuf[8], rxbuf[9], rxbuf[10], rxbuf[11]));
-    this->rxh(this->netdev, rxbuf, nbytes);
+  BX_DEBUG(("eth_socket: got packet: %d bytes, dst=%x:%x:%x:%x:%x:%x, src=%x:%x:%x:%x:%x:%x", len, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf[8], buf[9], buf[10], buf[11]));
+  return 1;
+}
+
+#if BX_NETSHM && BX_NETIO_THREAD
+// pass the frames from bxhub straight out of the shared memory ring
+Bit32u bx_socket_pktmover_c::rx_poll(bool ready)
+{
+  bx_netshm_ring_t *ring = &shm->to_client;
+  const Bit8u *frame;
+  unsigned len;
+
+  while ((frame = netshm_front(ring, &len)) != NULL) {
+    if (accept_frame(frame, len)) {
+      if (!(this->rxstat(this->netdev) & BX_NETDEV_RXREADY))
+        break;
+      this->rxh(this->netdev, frame, len);
+    }
+    netshm_pop(ring);
   }
+  // bxhub doesn't signal new frames, keep polling the ring
+  return BX_NETIO_DRAIN_INTERVAL;
 }
+#endif
 #endif /* if BX_NETWORKING && BX_NETMOD_SOCKET */
@@ -143,11 +143,10 @@ public:
                     logfunctions *netdev, const char *script);
   virtual ~bx_tap_pktmover_c();
   void sendpkt(void *buf, unsigned io_len);
+  int rx_read(Bit8u *buf, unsigned size);
 private:
   int fd;
-  int rx_timer_index;
-  static void rx_timer_handler(void *);
-  void rx_timer ();
+  bx_netio_client_t *netio;
   Bit8u guest_macaddr[6];
 #if BX_ETH_TAP_LOGGING
   FILE *txlog, *txlog_txt, *rxlog, *rxlog_txt;
@@ -187,6 +186,7 @@ bx_tap_pktmover_c::bx_tap_pktmover_c(const char *netif,
   char filename[BX_PATHNAME_LEN];
 
   this->netdev = netdev;
+  this->netio = NULL;
   if (strncmp (netif, "tap", 3) != 0) {
     BX_PANIC(("eth_tap: interface name (%s) must be tap0..tap15", netif));
   }
@@ -277,10 +277,6 @@ bx_tap_pktmover_c::bx_tap_pktmover_c(const char *netif,
       BX_ERROR(("execute script '%s' on %s failed", script, intname));
   }
 
-  // Start the rx poll
-  this->rx_timer_index =
-    DEV_register_timer(this, this->rx_timer_handler, 1000, 1, 1,
-                       "eth_tap"); // continuous, active
   this->rxh    = rxh;
   this->rxstat = rxstat;
   memcpy(&guest_macaddr[0], macaddr, 6);
@@ -312,10 +308,15 @@ bx_tap_pktmover_c::bx_tap_pktmover_c(const char *netif,
   fflush(rxlog_txt);
 
 #endif
+  // Start receiving frames on the network I/O thread
+  this->netio = bx_netio.add_reader(this, fd);
 }
 
 bx_tap_pktmover_c::~bx_tap_pktmover_c()
 {
+  if (netio != NULL) {
+    bx_netio.remove(netio);
+  }
 #if BX_ETH_TAP_LOGGING
   fclose(txlog);
   fclose(txlog_txt);
@@ -371,75 +372,55 @@ void bx_tap_pktmover_c::sendpkt(void *buf, unsigned io_len)
 #endif
 }
 
-void bx_tap_pktmover_c::rx_timer_handler(void *this_ptr)
-{
-  bx_tap_pktmover_c *class_ptr = (bx_tap_pktmover_c *) this_ptr;
-  class_ptr->rx_timer();
-}
-
-void bx_tap_pktmover_c::rx_timer()
+// called on the network I/O thread
+int bx_tap_pktmover_c::rx_read(Bit8u *buf, unsigned size)
 {
   int nbytes;
-  Bit8u buf[BX_PACKET_BUFSIZE];
-  Bit8u *rxbuf;
-  if (fd<0) return;
 #if defined(__sun__)
   struct strbuf sbuf;
   int f = 0;
-  sbuf.maxlen = sizeof(buf);
+  sbuf.maxlen = size;
   sbuf.buf = (char *)buf;
   nbytes = getmsg(fd, NULL, &sbuf, &f) >=0 ? sbuf.len : -1;
 #else
-  nbytes = read (fd, buf, sizeof(buf));
+  nbytes = read (fd, buf, size);
 #endif
 
+  if (nbytes<=0) {
+    if ((nbytes<0) && (errno != EAGAIN))
+      BX_ERROR(("tap read error: %s", strerror(errno)));
+    return -1;
+  }
   // hack: discard first two bytes
-#if defined(__FreeBSD__) || defined(__FreeBSD_kernel__) || defined(__APPLE__) || defined(__sun__) // Should be fixed for other *BSD
-  rxbuf = buf;
-#else
-  rxbuf = buf+2;
+#if !defined(__FreeBSD__) && !defined(__FreeBSD_kernel__) && !defined(__APPLE__) && !defined(__sun__) // Should be fixed for other *BSD
   nbytes-=2;
+  if (nbytes <= 0) return 0;
+  memmove(buf, buf+2, nbytes);
 #endif
+  BX_DEBUG(("tap read returned %d bytes", nbytes));
 
 #if defined(__linux__)
   // hack: TAP device likes to create an ethernet header which has
   // the same source and destination address FE:FD:00:00:00:00.
   // Change the dest address to FE:FD:00:00:00:01.
-  if (!memcmp(&rxbuf[0], &rxbuf[6], 6)) {
-    rxbuf[5] = guest_macaddr[5];
+  if (!memcmp(&buf[0], &buf[6], 6)) {
+    buf[5] = guest_macaddr[5];
   }
 #endif
 
-  if (nbytes>0)
-    BX_DEBUG(("tap read returned %d bytes", nbytes));
-  if (nbytes<0) {
-    if (errno != EAGAIN)
-      BX_ERROR(("tap read error: %s", strerror(errno)));
-    return;
-  }
 #if BX_ETH_TAP_LOGGING
-  if (nbytes > 0) {
-    BX_DEBUG(("receive packet length %u", nbytes));
-    // dump raw bytes to a file, eventually dump in pcap format so that
-    // tcpdump -r FILE can interpret them for us.
-    int n = fwrite(rxbuf, nbytes, 1, rxlog);
-    if (n != 1) BX_ERROR(("fwrite to rxlog failed, nbytes = %d", nbytes));
-    // dump packet in hex into an ascii log file
-    write_pktlog_txt(rxlog_txt, rxbuf, nbytes, 1);
-    // flush log so that we see the packets as they arrive w/o buffering
-    fflush(rxlog);
-  }
+  BX_DEBUG(("receive packet length %u", nbytes));
+  // dump raw bytes to a file, eventually dump in pcap format so that
+  // tcpdump -r FILE can interpret them for us.
+  int n = fwrite(buf, nbytes, 1, rxlog);
+  if (n != 1) BX_ERROR(("fwrite to rxlog failed, nbytes = %d", nbytes));
+  // dump packet in hex into an ascii log file
+  write_pktlog_txt(rxlog_txt, buf, nbytes, 1);
+  // flush log so that we see the packets as they arrive w/o buffering
+  fflush(rxlog);
 #endif
-  BX_DEBUG(("eth_tap: got packet: %d bytes, dst=%x:%x:%x:%x:%x:%x, src=%x:%x:%x:%x:%x:%x\n", nbytes, rxbuf[0], rxbuf[1], rxbuf[2], rxbuf[3], rxbuf[4], rxbuf[5], rxbuf[6], rxbuf[7], rxbuf[8], rxbuf[9], rxbuf[10], rxbuf[11]));
-  if (nbytes < MIN_RX_PACKET_LEN) {
-    BX_INFO(("packet too short (%d), padding to %d", nbytes, MIN_RX_PACKET_LEN));
-    nbytes = MIN_RX_PACKET_LEN;
-  }
-  if (this->rxstat(this->netdev) & BX_NETDEV_RXREADY) {
-    this->rxh(this->netdev, rxbuf, nbytes);
-  } else {
-    BX_ERROR(("device not ready to receive data"));
-  }
+  BX_DEBUG(("eth_tap: got packet: %d bytes, dst=%x:%x:%x:%x:%x:%x, src=%x:%x:%x:%x:%x:%x\n", nbytes, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf[8], buf[9], buf[10], buf[11]));
+  return nbytes;
 }
 
 #endif /* if BX_NETWORKING && BX_NETMOD_TAP */
@@ -80,7 +80,24 @@ PLUGIN_ENTRY_FOR_NET_MODULE(tuntap)
 
 #define BX_ETH_TUNTAP_LOGGING 0
 
-int tun_alloc(char *dev);
+#ifdef __linux__
+// header of frames on a tap device with IFF_VNET_HDR (struct virtio_net_hdr,
+// <linux/virtio_net.h> can't be included from C++)
+typedef struct {
+  Bit8u  flags;
+  Bit8u  gso_type;
+  Bit16u hdr_len;
+  Bit16u gso_size;
+  Bit16u csum_start;
+  Bit16u csum_offset;
+} tun_vnet_hdr_t;
+
+#define VNET_HDR_F_NEEDS_CSUM 1
+#define VNET_HDR_GSO_TCPV4    1
+#define VNET_HDR_GSO_TCPV6    4
+#endif
+
+int tun_alloc(char *dev, bool *vnet_hdr);
 
 //
 //  Define the class. This is private to this module
@@ -92,11 +109,18 @@ public:
                        logfunctions *netdev, const char *script);
   virtual ~bx_tuntap_pktmover_c();
   void sendpkt(void *buf, unsigned io_len);
+  int rx_read(Bit8u *buf, unsigned size);
+#ifdef __linux__
+  void sendpkts(const eth_txframe_t *frames, unsigned count);
+  Bit32u offload_caps(void);
+#endif
 private:
   int fd;
-  int rx_timer_index;
-  static void rx_timer_handler(void *);
-  void rx_timer ();
+  bool vnet_hdr;
+#ifdef __linux__
+  int write_vnet(void *buf, unsigned io_len, const eth_offload_t *offload);
+#endif
+  bx_netio_client_t *netio;
   Bit8u guest_macaddr[6];
 #if BX_ETH_TUNTAP_LOGGING
   FILE *txlog, *txlog_txt, *rxlog, *rxlog_txt;
@@ -135,6 +159,8 @@ bx_tuntap_pktmover_c::bx_tuntap_pktmover_c(const char *netif,
   int flags;
 
   this->netdev = netdev;
+  this->netio = NULL;
+  this->vnet_hdr = 0;
 #ifdef NEVERDEF
   if (strncmp (netif, "tun", 3) != 0) {
     BX_PANIC(("eth_tuntap: interface name (%s) must be tun", netif));
@@ -177,7 +203,7 @@ bx_tuntap_pktmover_c::bx_tuntap_pktmover_c(const char *netif,
 #endif
   char intname[MAXPATHLEN];
   strcpy(intname,netif);
-  fd=tun_alloc(intname);
+  fd=tun_alloc(intname, &vnet_hdr);
   if (fd < 0) {
     BX_PANIC(("open failed on %s: %s", netif, strerror (errno)));
     return;
@@ -193,6 +219,9 @@ bx_tuntap_pktmover_c::bx_tuntap_pktmover_c(const char *netif,
   }
 
   BX_INFO(("tuntap network driver: opened %s device", netif));
+  if (vnet_hdr) {
+    BX_INFO(("tuntap: checksum and TCP segmentation offload enabled"));
+  }
 
   /* Execute the configuration script */
   if((script != NULL) && (strcmp(script, "") != 0) && (strcmp(script, "none") != 0))
@@ -201,10 +230,6 @@ bx_tuntap_pktmover_c::bx_tuntap_pktmover_c(const char *netif,
       BX_ERROR(("execute script '%s' on %s failed", script, intname));
   }
 
-  // Start the rx poll
-  this->rx_timer_index =
-    DEV_register_timer(this, this->rx_timer_handler, 1000, 1, 1,
-                       "eth_tuntap"); // continuous, active
   this->rxh    = rxh;
   this->rxstat = rxstat;
   memcpy(&guest_macaddr[0], macaddr, 6);
@@ -236,10 +261,15 @@ bx_tuntap_pktmover_c::bx_tuntap_pktmover_c(const char *netif,
   fflush(rxlog_txt);
 
 #endif
+  // Start receiving frames on the network I/O thread
+  this->netio = bx_netio.add_reader(this, fd);
 }
 
 bx_tuntap_pktmover_c::~bx_tuntap_pktmover_c()
 {
+  if (netio != NULL) {
+    bx_netio.remove(netio);
+  }
 #if BX_ETH_TUNTAP_LOGGING
   fclose(txlog);
   fclose(txlog_txt);
@@ -269,7 +299,13 @@ void bx_tuntap_pktmover_c::sendpkt(void *buf, unsigned io_len)
     BX_DEBUG(("wrote %d bytes + 2 byte pad on tuntap", io_len));
   }
 #else
-  unsigned int size = write (fd, buf, io_len);
+  unsigned int size;
+#ifdef __linux__
+  if (vnet_hdr) {
+    size = write_vnet(buf, io_len, NULL);
+  } else
+#endif
+  size = write (fd, buf, io_len);
   if (size != io_len) {
     BX_PANIC(("write on tuntap device: %s", strerror (errno)));
   } else {
@@ -289,18 +325,61 @@ void bx_tuntap_pktmover_c::sendpkt(void *buf, unsigned io_len)
 #endif
 }
 
-void bx_tuntap_pktmover_c::rx_timer_handler (void *this_ptr)
+#ifdef __linux__
+Bit32u bx_tuntap_pktmover_c::offload_caps(void)
+{
+  if (!vnet_hdr) return 0;
+  return BX_NETDEV_OFFLOAD_CSUM | BX_NETDEV_OFFLOAD_TSO4 | BX_NETDEV_OFFLOAD_TSO6;
+}
+
+// write a frame with the virtio-net header, returns the frame length written
+int bx_tuntap_pktmover_c::write_vnet(void *buf, unsigned io_len, const eth_offload_t *offload)
+{
+  tun_vnet_hdr_t hdr;
+  struct iovec iov[2];
+  int ret;
+
+  memset(&hdr, 0, sizeof(hdr));
+  if (offload != NULL) {
+    if (offload->flags & BX_NET_CSUM_NEEDED) {
+      hdr.flags = VNET_HDR_F_NEEDS_CSUM;
+      hdr.csum_start = offload->csum_start;
+      hdr.csum_offset = offload->csum_offset;
+    }
+    if (offload->gso_type == BX_NET_GSO_TCPV4) {
+      hdr.gso_type = VNET_HDR_GSO_TCPV4;
+    } else if (offload->gso_type == BX_NET_GSO_TCPV6) {
+      hdr.gso_type = VNET_HDR_GSO_TCPV6;
+    }
+    hdr.hdr_len = offload->hdr_len;
+    hdr.gso_size = offload->gso_size;
+  }
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = buf;
+  iov[1].iov_len = io_len;
+  ret = writev(fd, iov, 2);
+  return (ret < (int)sizeof(hdr)) ? ret : (ret - (int)sizeof(hdr));
+}
+
+void bx_tuntap_pktmover_c::sendpkts(const eth_txframe_t *frames, unsigned count)
 {
-  bx_tuntap_pktmover_c *class_ptr = (bx_tuntap_pktmover_c *) this_ptr;
-  class_ptr->rx_timer();
+  for (unsigned i = 0; i < count; i++) {
+    if (vnet_hdr && (frames[i].offload != NULL)) {
+      if (write_vnet(frames[i].buf, frames[i].len, frames[i].offload) != (int)frames[i].len) {
+        BX_ERROR(("write on tuntap device: %s", strerror(errno)));
+      }
+    } else {
+      sendpkt(frames[i].buf, frames[i].len);
+    }
+  }
 }
+#endif
 
-void bx_tuntap_pktmover_c::rx_timer()
+// called on the network I/O thread
+int bx_tuntap_pktmover_c::rx_read(Bit8u *buf, unsigned size)
 {
   int nbytes;
-  Bit8u buf[BX_PACKET_BUFSIZE];
-  Bit8u *rxbuf;
-  if (fd<0) return;
 
 #ifdef __APPLE__ //FIXME:hack
   nbytes = 14;
@@ -308,70 +387,75 @@ void bx_tuntap_pktmover_c::rx_timer()
   buf[0] = buf[6] = 0xFE;
   buf[1] = buf[7] = 0xFD;
   buf[12] = 8;
-  nbytes += read (fd, buf+nbytes, sizeof(buf)-nbytes);
-  rxbuf=buf;
+  nbytes += read (fd, buf+nbytes, size-nbytes);
 #elif NEVERDEF
-  nbytes = read (fd, buf, sizeof(buf));
+  nbytes = read (fd, buf, size);
   // hack: discard first two bytes
-  rxbuf = buf+2;
   nbytes-=2;
+  if (nbytes > 0) memmove(buf, buf+2, nbytes);
 #else
-  nbytes = read (fd, buf, sizeof(buf));
-  rxbuf=buf;
+#ifdef __linux__
+  if (vnet_hdr) {
+    // the host completes checksums and segments before passing frames
+    tun_vnet_hdr_t hdr;
+    struct iovec iov[2];
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = size;
+    nbytes = readv(fd, iov, 2);
+    if (nbytes >= (int)sizeof(hdr)) {
+      nbytes -= sizeof(hdr);
+      if (nbytes == 0) return 0;
+    }
+  } else
 #endif
-
-  // hack: TUN/TAP device likes to create an ethernet header which has
-  // the same source and destination address FE:FD:00:00:00:00.
-  // Change the dest address to FE:FD:00:00:00:01.
-  if (!memcmp(&rxbuf[0], &rxbuf[6], 6)) {
-    rxbuf[5] = guest_macaddr[5];
-  }
-
-#ifdef __APPLE__ //FIXME:hack
-  if (nbytes>14)
-#else
-  if (nbytes>0)
+  nbytes = read (fd, buf, size);
 #endif
-    BX_DEBUG(("tuntap read returned %d bytes", nbytes));
+
 #ifdef __APPLE__ //FIXME:hack
-  if (nbytes<14) {
+  if (nbytes<=14) {
 #else
-  if (nbytes<0) {
+  if (nbytes<=0) {
 #endif
-    if (errno != EAGAIN)
+    if ((nbytes<0) && (errno != EAGAIN))
       BX_ERROR(("tuntap read error: %s", strerror(errno)));
-    return;
+    return -1;
   }
-#if BX_ETH_TUNTAP_LOGGING
-  if (nbytes > 0) {
-    BX_DEBUG(("receive packet length %u", nbytes));
-    // dump raw bytes to a file, eventually dump in pcap format so that
-    // tcpdump -r FILE can interpret them for us.
-    int n = fwrite(rxbuf, nbytes, 1, rxlog);
-    if (n != 1) BX_ERROR (("fwrite to rxlog failed"));
-    // dump packet in hex into an ascii log file
-    write_pktlog_txt(rxlog_txt, rxbuf, nbytes, 1);
-    // flush log so that we see the packets as they arrive w/o buffering
-    fflush(rxlog);
+  BX_DEBUG(("tuntap read returned %d bytes", nbytes));
+
+  // hack: TUN/TAP device likes to create an ethernet header which has
+  // the same source and destination address FE:FD:00:00:00:00.
+  // Change the dest address to FE:FD:00:00:00:01.
+  if (!memcmp(&buf[0], &buf[6], 6)) {
+    buf[5] = guest_macaddr[5];
   }
+
+#if BX_ETH_TUNTAP_LOGGING
+  BX_DEBUG(("receive packet length %u", nbytes));
+  // dump raw bytes to a file, eventually dump in pcap format so that
+  // tcpdump -r FILE can interpret them for us.
+  int n = fwrite(buf, nbytes, 1, rxlog);
+  if (n != 1) BX_ERROR (("fwrite to rxlog failed"));
+  // dump packet in hex into an ascii log file
+  write_pktlog_txt(rxlog_txt, buf, nbytes, 1);
+  // flush log so that we see the packets as they arrive w/o buffering
+  fflush(rxlog);
 #endif
-  BX_DEBUG(("eth_tuntap: got packet: %d bytes, dst=%02x:%02x:%02x:%02x:%02x:%02x, src=%02x:%02x:%02x:%02x:%02x:%02x", nbytes, rxbuf[0], rxbuf[1], rxbuf[2], rxbuf[3], rxbuf[4], rxbuf[5], rxbuf[6], rxbuf[7], rxbuf[8], rxbuf[9], rxbuf[10], rxbuf[11]));
-  if (nbytes < MIN_RX_PACKET_LEN) {
-    BX_INFO(("packet too short (%d), padding to %d", nbytes, MIN_RX_PACKET_LEN));
-    nbytes = MIN_RX_PACKET_LEN;
-  }
-  if (this->rxstat(this->netdev) & BX_NETDEV_RXREADY) {
-    this->rxh(this->netdev, rxbuf, nbytes);
-  } else {
-    BX_ERROR(("device not ready to receive data"));
-  }
+  BX_DEBUG(("eth_tuntap: got packet: %d bytes, dst=%02x:%02x:%02x:%02x:%02x:%02x, src=%02x:%02x:%02x:%02x:%02x:%02x", nbytes, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf[8], buf[9], buf[10], buf[11]));
+  return nbytes;
 }
 
-int tun_alloc(char *dev)
+int tun_alloc(char *dev, bool *vnet_hdr)
 {
   struct ifreq ifr;
   char *ifname;
   int fd, err;
+#ifdef __linux__
+  unsigned int features = 0;
+#endif
+
+  *vnet_hdr = 0;
 
   // split name into device:ifname if applicable, to allow for opening
   // persistent tuntap devices
@@ -392,6 +476,12 @@ int tun_alloc(char *dev)
    *        IFF_NO_PI - Do not provide packet information
    */
   ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  /*        IFF_VNET_HDR - Frames start with a virtio-net header, so that
+   *                       checksum and segmentation can be left to the host
+   */
+  if ((ioctl(fd, TUNGETFEATURES, &features) == 0) && (features & IFF_VNET_HDR)) {
+    ifr.ifr_flags |= IFF_VNET_HDR;
+  }
   strncpy(ifr.ifr_name, ifname, IFNAMSIZ);
   if ((err = ioctl(fd, TUNSETIFF, (void *) &ifr)) < 0) {
     close(fd);
@@ -399,6 +489,7 @@ int tun_alloc(char *dev)
   }
   strncpy(dev, ifr.ifr_name, IFNAMSIZ);
   dev[IFNAMSIZ-1]=0;
+  *vnet_hdr = ((ifr.ifr_flags & IFF_VNET_HDR) != 0);
 
   ioctl(fd, TUNSETNOCSUM, 1);
 #endif
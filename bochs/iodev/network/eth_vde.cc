@@ -89,11 +89,13 @@ public:
                     logfunctions *netdev, const char *script);
   virtual ~bx_vde_pktmover_c();
   void sendpkt(void *buf, unsigned io_len);
+#if defined(__linux__) && !BX_ETH_VDE_LOGGING
+  void sendpkts(const eth_txframe_t *frames, unsigned count);
+#endif
+  int rx_read(Bit8u *buf, unsigned size);
 private:
   int fd;
-  int rx_timer_index;
-  static void rx_timer_handler(void *);
-  void rx_timer();
+  bx_netio_client_t *netio;
 #if BX_ETH_VDE_LOGGING
   FILE *txlog, *txlog_txt, *rxlog, *rxlog_txt;
 #endif
@@ -133,6 +135,7 @@ bx_vde_pktmover_c::bx_vde_pktmover_c(const char *netif,
   int flags;
 
   this->netdev = netdev;
+  this->netio = NULL;
   //if (strncmp (netif, "vde", 3) != 0) {
    // BX_PANIC (("eth_vde: interface name (%s) must be vde", netif));
   //}
@@ -165,10 +168,6 @@ bx_vde_pktmover_c::bx_vde_pktmover_c(const char *netif,
       BX_ERROR(("execute script '%s' on %s failed", script, intname));
   }
 
-  // Start the rx poll
-  this->rx_timer_index =
-    DEV_register_timer(this, this->rx_timer_handler, 1000, 1, 1,
-                       "eth_vde"); // continuous, active
   this->rxh    = rxh;
   this->rxstat = rxstat;
 #if BX_ETH_VDE_LOGGING
@@ -199,10 +198,15 @@ bx_vde_pktmover_c::bx_vde_pktmover_c(const char *netif,
   fflush(rxlog_txt);
 
 #endif
+  // Start receiving frames on the network I/O thread
+  this->netio = bx_netio.add_reader(this, fddata);
 }
 
 bx_vde_pktmover_c::~bx_vde_pktmover_c()
 {
+  if (netio != NULL) {
+    bx_netio.remove(netio);
+  }
 #if BX_ETH_VDE_LOGGING
   fclose(txlog);
   fclose(txlog_txt);
@@ -235,57 +239,44 @@ void bx_vde_pktmover_c::sendpkt(void *buf, unsigned io_len)
 #endif
 }
 
-void bx_vde_pktmover_c::rx_timer_handler(void *this_ptr)
+#if defined(__linux__) && !BX_ETH_VDE_LOGGING
+void bx_vde_pktmover_c::sendpkts(const eth_txframe_t *frames, unsigned count)
 {
-  bx_vde_pktmover_c *class_ptr = (bx_vde_pktmover_c *) this_ptr;
-  class_ptr->rx_timer();
+  if (send_frames(fddata, frames, count, &dataout, sizeof(struct sockaddr_un), 0) != (int)count) {
+    BX_PANIC(("write on vde device: %s", strerror (errno)));
+  }
 }
+#endif
 
-void bx_vde_pktmover_c::rx_timer()
+// called on the network I/O thread
+int bx_vde_pktmover_c::rx_read(Bit8u *buf, unsigned size)
 {
   int nbytes;
-  Bit8u buf[BX_PACKET_BUFSIZE];
-  Bit8u *rxbuf;
   struct sockaddr_un datain;
-  socklen_t datainsize;
+  socklen_t datainsize = sizeof(datain);
 
-  if (fd<0) return;
-  //nbytes = read (fd, buf, sizeof(buf));
-  nbytes=recvfrom(fddata,buf,sizeof(buf),MSG_DONTWAIT|MSG_WAITALL,(struct sockaddr *) &datain, &datainsize);
+  nbytes=recvfrom(fddata,buf,size,MSG_DONTWAIT|MSG_WAITALL,(struct sockaddr *) &datain, &datainsize);
 
-  rxbuf=buf;
-
-  if (nbytes>0)
-    BX_INFO(("vde read returned %d bytes", nbytes));
-  if (nbytes<0) {
-    if (errno != EAGAIN)
+  if (nbytes<=0) {
+    if ((nbytes<0) && (errno != EAGAIN))
       BX_ERROR(("vde read error: %s", strerror(errno)));
-    return;
+    return -1;
   }
+  BX_DEBUG(("vde read returned %d bytes", nbytes));
 #if BX_ETH_VDE_LOGGING
-  if (nbytes > 0) {
-    BX_DEBUG(("receive packet length %u", nbytes));
-    // dump raw bytes to a file, eventually dump in pcap format so that
-    // tcpdump -r FILE can interpret them for us.
-    int n = fwrite(rxbuf, nbytes, 1, rxlog);
-    if (n != 1) BX_ERROR(("fwrite to rxlog failed"));
-    // dump packet in hex into an ascii log file
-    write_pktlog_txt(rxlog_txt, rxbuf, nbytes, 1);
-
-    // flush log so that we see the packets as they arrive w/o buffering
-    fflush(rxlog);
-  }
+  BX_DEBUG(("receive packet length %u", nbytes));
+  // dump raw bytes to a file, eventually dump in pcap format so that
+  // tcpdump -r FILE can interpret them for us.
+  int n = fwrite(buf, nbytes, 1, rxlog);
+  if (n != 1) BX_ERROR(("fwrite to rxlog failed"));
+  // dump packet in hex into an ascii log file
+  write_pktlog_txt(rxlog_txt, buf, nbytes, 1);
+
+  // flush log so that we see the packets as they arrive w/o buffering
+  fflush(rxlog);
 #endif
-  BX_DEBUG(("eth_vde: got packet: %d bytes, dst=%x:%x:%x:%x:%x:%x, src=%x:%x:%x:%x:%x:%x\n", nbytes, rxbuf[0], rxbuf[1], rxbuf[2], rxbuf[3], rxbuf[4], rxbuf[5], rxbuf[6], rxbuf[7], rxbuf[8], rxbuf[9], rxbuf[10], rxbuf[11]));
-  if (nbytes < MIN_RX_PACKET_LEN) {
-    BX_INFO(("packet too short (%d), padding to %d", nbytes, MIN_RX_PACKET_LEN));
-    nbytes = MIN_RX_PACKET_LEN;
-  }
-  if (this->rxstat(this->netdev) & BX_NETDEV_RXREADY) {
-    this->rxh(this->netdev, rxbuf, nbytes);
-  } else {
-    BX_ERROR(("device not ready to receive data"));
-  }
+  BX_DEBUG(("eth_vde: got packet: %d bytes, dst=%x:%x:%x:%x:%x:%x, src=%x:%x:%x:%x:%x:%x\n", nbytes, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf[8], buf[9], buf[10], buf[11]));
+  return nbytes;
 }
 
 //enum request_type { REQ_NEW_CONTROL };
@@ -1656,11 +1656,23 @@ Bit32u bx_ne2k_c::rx_status_handler(void *arg)
 Bit32u bx_ne2k_c::rx_status()
 {
   Bit32u status = BX_NETDEV_10MBIT;
+  int avail;
+
   if ((BX_NE2K_THIS s.CR.stop == 0) &&
       (BX_NE2K_THIS s.page_start != 0) &&
       (BX_NE2K_THIS s.DCR.loop ||
        (BX_NE2K_THIS s.TCR.loop_cntl == 0))) {
-    status |= BX_NETDEV_RXREADY;
+    // only report ready if a full-sized frame fits into the ring, so that
+    // the network module holds back frames instead of losing them
+    if (BX_NE2K_THIS s.curr_page < BX_NE2K_THIS s.bound_ptr) {
+      avail = BX_NE2K_THIS s.bound_ptr - BX_NE2K_THIS s.curr_page;
+    } else {
+      avail = (BX_NE2K_THIS s.page_stop - BX_NE2K_THIS s.page_start) -
+        (BX_NE2K_THIS s.curr_page - BX_NE2K_THIS s.bound_ptr);
+    }
+    if (avail > ((BX_PACKET_BUFSIZE + 4 + 4 + 255) / 256)) {
+      status |= BX_NETDEV_RXREADY;
+    }
   }
   return status;
 }
@@ -0,0 +1,210 @@
+/////////////////////////////////////////////////////////////////////////
+// $Id$
+/////////////////////////////////////////////////////////////////////////
+//
+//  Copyright (C) 2021  The Bochs Project
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+//
+
+//  netcsum.h  - Internet checksum (RFC 1071) shared by the network
+//  devices, vnet / bxhub and slirp
+
+#ifndef BX_NETCSUM_H
+#define BX_NETCSUM_H
+
+#include <string.h>
+
+// The vector unit is selected at compile time (e.g. -mavx2 or -march=native)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BX_NET_CSUM_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define BX_NET_CSUM_SSE2 1
+#endif
+
+#if BX_NET_CSUM_AVX2 || BX_NET_CSUM_SSE2
+
+// shorter buffers (headers, small packets) are faster with the scalar loop
+#if BX_NET_CSUM_AVX2
+#define BX_NET_CSUM_MIN_LEN 64
+#else
+#define BX_NET_CSUM_MIN_LEN 256
+#endif
+
+// Vector part of net_csum_add_native() for 'len' bytes, a multiple of 64.
+// PMADDWD adds pairs of signed words, so the words are biased by -0x8000
+// and the bias is added back with the word count at the end. A 32-bit lane
+// changes by at most 0x10000 per 64 byte block.
+BX_CPP_INLINE Bit64u net_csum_add_blocks(const Bit8u *buf, unsigned len, Bit64u sum)
+{
+  Bit64u words = (Bit64u) len >> 1, lo;
+  unsigned blocks;
+
+#if BX_NET_CSUM_AVX2
+  const __m256i bias = _mm256_set1_epi16((short) 0x8000);
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i acc0, acc1;
+  __m128i lanes, sign;
+  __m128i half = _mm_setzero_si128();
+
+  while (len > 0) {
+    blocks = len >> 6;
+    if (blocks > 4096) blocks = 4096;
+    len -= blocks << 6;
+    acc0 = acc1 = _mm256_setzero_si256();
+    do {
+      acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_xor_si256(_mm256_loadu_si256((const __m256i*) buf), bias), ones));
+      acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(buf + 32)), bias), ones));
+      buf += 64;
+    } while (--blocks);
+    // sign extend the 32-bit lanes and add them as 64-bit values
+    acc0 = _mm256_add_epi32(acc0, acc1);
+    lanes = _mm_add_epi32(_mm256_castsi256_si128(acc0), _mm256_extracti128_si256(acc0, 1));
+    sign = _mm_srai_epi32(lanes, 31);
+    half = _mm_add_epi64(half, _mm_unpacklo_epi32(lanes, sign));
+    half = _mm_add_epi64(half, _mm_unpackhi_epi32(lanes, sign));
+  }
+#else
+  const __m128i bias = _mm_set1_epi16((short) 0x8000);
+  const __m128i ones = _mm_set1_epi16(1);
+  __m128i acc0, acc1, acc2, acc3, sign;
+  __m128i half = _mm_setzero_si128();
+
+  while (len > 0) {
+    blocks = len >> 6;
+    if (blocks > 8192) blocks = 8192;
+    len -= blocks << 6;
+    acc0 = acc1 = acc2 = acc3 = _mm_setzero_si128();
+    do {
+      acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_xor_si128(_mm_loadu_si128((const __m128i*) buf), bias), ones));
+      acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(buf + 16)), bias), ones));
+      acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(buf + 32)), bias), ones));
+      acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(buf + 48)), bias), ones));
+      buf += 64;
+    } while (--blocks);
+    // sign extend the 32-bit lanes and add them as 64-bit values
+    acc0 = _mm_add_epi32(_mm_add_epi32(acc0, acc1), _mm_add_epi32(acc2, acc3));
+    sign = _mm_srai_epi32(acc0, 31);
+    half = _mm_add_epi64(half, _mm_unpacklo_epi32(acc0, sign));
+    half = _mm_add_epi64(half, _mm_unpackhi_epi32(acc0, sign));
+  }
+#endif
+  half = _mm_add_epi64(half, _mm_unpackhi_epi64(half, half));
+  _mm_storel_epi64((__m128i*) &lo, half);
+  return (sum & 0xffffffff) + (sum >> 32) + lo + (words << 15);
+}
+
+#endif
+
+// Adds the 16-bit words of 'buf' to 'sum' without folding. The words are
+// read in host byte order and a trailing odd byte is padded with zero.
+// Since the ones' complement sum does not depend on the byte order, the
+// folded result only needs to be swapped to get the network order value.
+BX_CPP_INLINE Bit64u net_csum_add_native(const Bit8u *buf, unsigned len, Bit64u sum)
+{
+  Bit64u w0, w1, w2, w3, sum1;
+  Bit32u w32;
+  Bit16u w16;
+  Bit8u last[2];
+
+#if BX_NET_CSUM_AVX2 || BX_NET_CSUM_SSE2
+  if (len >= BX_NET_CSUM_MIN_LEN) {
+    unsigned done = len & ~63;
+    sum = net_csum_add_blocks(buf, done, sum);
+    buf += done;
+    len -= done;
+  }
+#endif
+  // scalar loop: 64-bit adds with end-around carry, two independent sums
+  // to halve the carry dependency chain
+  if (len >= 32) {
+    sum1 = 0;
+    do {
+      memcpy(&w0, buf, 8);
+      memcpy(&w1, buf + 8, 8);
+      memcpy(&w2, buf + 16, 8);
+      memcpy(&w3, buf + 24, 8);
+      sum += w0;
+      if (sum < w0) sum++;
+      sum1 += w1;
+      if (sum1 < w1) sum1++;
+      sum += w2;
+      if (sum < w2) sum++;
+      sum1 += w3;
+      if (sum1 < w3) sum1++;
+      buf += 32;
+      len -= 32;
+    } while (len >= 32);
+    sum += sum1;
+    if (sum < sum1) sum++;
+  }
+  // the remaining 0-31 bytes without loops
+  if (len & 16) {
+    memcpy(&w0, buf, 8);
+    memcpy(&w1, buf + 8, 8);
+    sum += w0;
+    if (sum < w0) sum++;
+    sum += w1;
+    if (sum < w1) sum++;
+    buf += 16;
+  }
+  if (len & 8) {
+    memcpy(&w0, buf, 8);
+    sum += w0;
+    if (sum < w0) sum++;
+    buf += 8;
+  }
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  if (len & 4) {
+    memcpy(&w32, buf, 4);
+    sum += w32;
+    buf += 4;
+  }
+  if (len & 2) {
+    memcpy(&w16, buf, 2);
+    sum += w16;
+    buf += 2;
+  }
+  if (len & 1) {
+    last[0] = *buf;
+    last[1] = 0;
+    memcpy(&w16, last, 2);
+    sum += w16;
+  }
+  return sum;
+}
+
+BX_CPP_INLINE Bit16u net_csum_fold(Bit64u sum)
+{
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return (Bit16u)sum;
+}
+
+// Returns the ones' complement sum (not inverted) of 'buf' in host order
+// as if the data was read as big-endian 16-bit words
+BX_CPP_INLINE Bit16u net_checksum(const Bit8u *buf, unsigned len)
+{
+  Bit16u sum = net_csum_fold(net_csum_add_native(buf, len, 0));
+
+#ifdef BX_LITTLE_ENDIAN
+  sum = (Bit16u)((sum >> 8) | (sum << 8));
+#endif
+  return sum;
+}
+
+#endif
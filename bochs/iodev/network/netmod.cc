@@ -26,6 +26,7 @@
 
 #include "bochs.h"
 #include "plugin.h"
+#include "pc_system.h"
 #include "gui/siminterface.h"
 
 #if BX_NETWORKING
@@ -97,6 +98,9 @@ void bx_netmod_ctl_c::list_modules(void)
 
 void bx_netmod_ctl_c::exit(void)
 {
+#if BX_NETIO_THREAD
+  bx_netio.exit();
+#endif
   free(net_module_names);
   eth_locator_c::cleanup();
 }
@@ -215,6 +219,494 @@ eth_locator_c::create(const char *type, const char *netif,
   return NULL;
 }
 
+#if BX_NETIO_THREAD
+
+#ifdef __linux__
+#define BX_NETIO_EPOLL 1
+#include <sys/epoll.h>
+#else
+#define BX_NETIO_EPOLL 0
+#endif
+#include <fcntl.h>
+
+#define BX_NETIO_MAX_EVENTS 16
+
+#undef LOG_THIS
+#define LOG_THIS bx_netio.
+
+bx_netio_c bx_netio;
+
+// ring of received frames
+
+bx_netio_ring_c::bx_netio_ring_c()
+{
+  frames = new Bit8u[BX_NETIO_RING_SIZE * BX_PACKET_BUFSIZE];
+  lengths = new Bit32u[BX_NETIO_RING_SIZE];
+  head = 0;
+  tail = 0;
+}
+
+bx_netio_ring_c::~bx_netio_ring_c()
+{
+  delete [] frames;
+  delete [] lengths;
+}
+
+bool bx_netio_ring_c::push(const void *buf, unsigned len)
+{
+  Bit32u slot = head;
+
+  if ((slot - bx_atomic_load32(&tail)) == BX_NETIO_RING_SIZE)
+    return 0;
+  Bit8u *frame = &frames[(slot % BX_NETIO_RING_SIZE) * BX_PACKET_BUFSIZE];
+  if (len > BX_PACKET_BUFSIZE) len = BX_PACKET_BUFSIZE;
+  memcpy(frame, buf, len);
+  if (len < MIN_RX_PACKET_LEN) {
+    memset(frame + len, 0, MIN_RX_PACKET_LEN - len);
+    len = MIN_RX_PACKET_LEN;
+  }
+  lengths[slot % BX_NETIO_RING_SIZE] = len;
+  bx_atomic_store32(&head, slot + 1);
+  return 1;
+}
+
+const Bit8u *bx_netio_ring_c::front(unsigned *len)
+{
+  Bit32u slot = tail;
+
+  if (bx_atomic_load32(&head) == slot)
+    return NULL;
+  *len = lengths[slot % BX_NETIO_RING_SIZE];
+  return &frames[(slot % BX_NETIO_RING_SIZE) * BX_PACKET_BUFSIZE];
+}
+
+void bx_netio_ring_c::pop(void)
+{
+  bx_atomic_store32(&tail, tail + 1);
+}
+
+// network I/O thread
+
+static BX_THREAD_FUNC(netio_thread, indata)
+{
+  ((bx_netio_c *) indata)->thread_loop();
+  BX_THREAD_EXIT;
+}
+
+bx_netio_c::bx_netio_c()
+{
+  put("netio", "NETIO");
+  clients = NULL;
+  next_id = 0;
+  running = 0;
+  stop = 0;
+  drain_timer = BX_NULL_TIMER_HANDLE;
+  wake_pipe[0] = -1;
+  wake_pipe[1] = -1;
+  epoll_fd = -1;
+  rxbuf = NULL;
+}
+
+void bx_netio_c::start(void)
+{
+  if (pipe(wake_pipe) < 0) {
+    BX_PANIC(("cannot create wakeup pipe: %s", strerror(errno)));
+    return;
+  }
+  fcntl(wake_pipe[0], F_SETFL, fcntl(wake_pipe[0], F_GETFL) | O_NONBLOCK);
+  fcntl(wake_pipe[1], F_SETFL, fcntl(wake_pipe[1], F_GETFL) | O_NONBLOCK);
+#if BX_NETIO_EPOLL
+  struct epoll_event ev;
+
+  epoll_fd = epoll_create(BX_NETIO_MAX_EVENTS);
+  if (epoll_fd < 0) {
+    BX_PANIC(("epoll_create failed: %s", strerror(errno)));
+    return;
+  }
+  ev.events = EPOLLIN;
+  ev.data.u64 = 0; // the client IDs start with 1
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_pipe[0], &ev);
+#endif
+  rxbuf = new Bit8u[BX_PACKET_BUFSIZE];
+  BX_INIT_MUTEX(lock);
+  stop = 0;
+  // the timer is kept when the thread is stopped and started again
+  if (drain_timer == BX_NULL_TIMER_HANDLE) {
+    drain_timer = DEV_register_timer(this, drain_timer_handler, BX_NETIO_DRAIN_INTERVAL,
+                                     0, 0, "netio");
+  }
+  BX_THREAD_CREATE(netio_thread, this, thread);
+  running = 1;
+  BX_INFO(("network I/O thread started"));
+}
+
+void bx_netio_c::stop_thread(void)
+{
+  bx_atomic_store32(&stop, 1);
+  wakeup();
+  BX_THREAD_JOIN(thread);
+  BX_FINI_MUTEX(lock);
+  close(wake_pipe[0]);
+  close(wake_pipe[1]);
+#if BX_NETIO_EPOLL
+  close(epoll_fd);
+  epoll_fd = -1;
+#endif
+  delete [] rxbuf;
+  rxbuf = NULL;
+  bx_pc_system.deactivate_timer(drain_timer);
+  running = 0;
+}
+
+void bx_netio_c::exit(void)
+{
+  if (running) {
+    stop_thread();
+  }
+  // the timer table is reset before the devices are removed at exit
+  drain_timer = BX_NULL_TIMER_HANDLE;
+}
+
+void bx_netio_c::wakeup(void)
+{
+  char c = 0;
+
+  if (write(wake_pipe[1], &c, 1) < 0) {
+    // pipe full, a wakeup is already pending
+  }
+}
+
+bx_netio_client_t *bx_netio_c::add_client(eth_pktmover_c *mover, int fd)
+{
+  bx_netio_client_t *client = new bx_netio_client_t;
+
+  if (!running) start();
+  memset(client, 0, sizeof(bx_netio_client_t));
+  client->mover = mover;
+  client->fd = fd;
+  client->id = ++next_id;
+  if (fd >= 0) {
+    client->ring = new bx_netio_ring_c();
+  }
+  BX_LOCK(lock);
+  client->next = clients;
+  clients = client;
+  set_polled(client, 1);
+  BX_UNLOCK(lock);
+  wakeup();
+  // pollers set up the watched descriptors on the first call
+  schedule_drain();
+  return client;
+}
+
+bx_netio_client_t *bx_netio_c::add_reader(eth_pktmover_c *mover, int fd)
+{
+  return add_client(mover, fd);
+}
+
+bx_netio_client_t *bx_netio_c::add_poller(eth_pktmover_c *mover)
+{
+  return add_client(mover, -1);
+}
+
+void bx_netio_c::remove(bx_netio_client_t *client)
+{
+  bx_netio_client_t **ptr;
+
+  // the I/O thread holds the lock while it calls the pktmovers
+  BX_LOCK(lock);
+  for (ptr = &clients; *ptr != NULL; ptr = &(*ptr)->next) {
+    if (*ptr == client) {
+      *ptr = client->next;
+      break;
+    }
+  }
+  set_polled(client, 0);
+  BX_UNLOCK(lock);
+  if (client->ring != NULL) {
+    delete client->ring;
+  }
+  delete client;
+  if (clients == NULL) {
+    stop_thread();
+  }
+}
+
+void bx_netio_c::watch_fds(bx_netio_client_t *client, int maxfd, fd_set *rfds,
+                           fd_set *wfds, fd_set *xfds)
+{
+  BX_LOCK(lock);
+  client->maxfd = maxfd;
+  client->rfds = *rfds;
+  client->wfds = *wfds;
+  client->xfds = *xfds;
+  client->watch = 1;
+  BX_UNLOCK(lock);
+  wakeup();
+}
+
+// called with the lock held
+void bx_netio_c::set_polled(bx_netio_client_t *client, bool enable)
+{
+#if BX_NETIO_EPOLL
+  struct epoll_event ev;
+
+  if (client->fd < 0) return;
+  ev.events = EPOLLIN;
+  ev.data.u64 = client->id;
+  if (enable) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &ev);
+  } else {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, &ev);
+  }
+#endif
+}
+
+// called with the lock held
+bx_netio_client_t *bx_netio_c::find_client(Bit32u id)
+{
+  bx_netio_client_t *client;
+
+  for (client = clients; client != NULL; client = client->next) {
+    if (client->id == id) break;
+  }
+  return client;
+}
+
+// called with the lock held, returns 1 if frames were queued
+bool bx_netio_c::read_client(bx_netio_client_t *client)
+{
+  bool queued = 0;
+  int len;
+
+  while (!client->ring->full()) {
+    len = client->mover->rx_read(rxbuf, BX_PACKET_BUFSIZE);
+    if (len < 0) return queued;
+    if (len > 0) {
+      client->ring->push(rxbuf, len);
+      queued = 1;
+    }
+  }
+  // stop polling the descriptor until the device took some frames
+  bx_atomic_store32(&client->throttled, 1);
+  set_polled(client, 0);
+  return queued;
+}
+
+static void merge_fds(int maxfd, fd_set *src, fd_set *dst)
+{
+  for (int fd = 0; fd <= maxfd; fd++) {
+    if (FD_ISSET(fd, src)) FD_SET(fd, dst);
+  }
+}
+
+static bool check_fds(int maxfd, fd_set *watched, fd_set *result)
+{
+  for (int fd = 0; fd <= maxfd; fd++) {
+    if (FD_ISSET(fd, watched) && FD_ISSET(fd, result)) return 1;
+  }
+  return 0;
+}
+
+void bx_netio_c::thread_loop(void)
+{
+  bx_netio_client_t *client;
+  fd_set rfds, wfds, xfds;
+  int maxfd, ret;
+  bool use_select, queued;
+  char c;
+#if BX_NETIO_EPOLL
+  struct epoll_event events[BX_NETIO_MAX_EVENTS];
+  int i, n;
+#endif
+
+  while (!bx_atomic_load32(&stop)) {
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&xfds);
+    BX_LOCK(lock);
+#if BX_NETIO_EPOLL
+    // the readers are served by epoll, the descriptors watched for the
+    // pollers need select() and the epoll descriptor is added to them
+    use_select = 0;
+    maxfd = epoll_fd;
+    FD_SET(epoll_fd, &rfds);
+#else
+    use_select = 1;
+    maxfd = wake_pipe[0];
+    FD_SET(wake_pipe[0], &rfds);
+#endif
+    for (client = clients; client != NULL; client = client->next) {
+      if (client->fd < 0) {
+        if (client->watch) {
+          merge_fds(client->maxfd, &client->rfds, &rfds);
+          merge_fds(client->maxfd, &client->wfds, &wfds);
+          merge_fds(client->maxfd, &client->xfds, &xfds);
+          if (client->maxfd > maxfd) maxfd = client->maxfd;
+          use_select = 1;
+        }
+      } else if (client->throttled && !client->ring->full()) {
+        // the device took frames out of the full ring
+        bx_atomic_store32(&client->throttled, 0);
+        set_polled(client, 1);
+      }
+#if !BX_NETIO_EPOLL
+      if ((client->fd >= 0) && !client->throttled) {
+        FD_SET(client->fd, &rfds);
+        if (client->fd > maxfd) maxfd = client->fd;
+      }
+#endif
+    }
+    BX_UNLOCK(lock);
+
+#if BX_NETIO_EPOLL
+    if (!use_select) {
+      n = epoll_wait(epoll_fd, events, BX_NETIO_MAX_EVENTS, -1);
+      ret = 0;
+    } else {
+      ret = select(maxfd + 1, &rfds, &wfds, &xfds, NULL);
+      n = 0;
+      if ((ret > 0) && FD_ISSET(epoll_fd, &rfds)) {
+        n = epoll_wait(epoll_fd, events, BX_NETIO_MAX_EVENTS, 0);
+      }
+    }
+#else
+    ret = select(maxfd + 1, &rfds, &wfds, &xfds, NULL);
+#endif
+    if ((ret < 0) && (errno == EINTR)) continue;
+    if (bx_atomic_load32(&stop)) break;
+
+    queued = 0;
+    BX_LOCK(lock);
+    if (use_select) {
+      // flag the pollers, they are called by the drain timer. An error
+      // (closed descriptor) is reported as ready, so they update the list.
+      for (client = clients; client != NULL; client = client->next) {
+        if ((client->fd < 0) && client->watch) {
+          if ((ret < 0) || check_fds(client->maxfd, &client->rfds, &rfds) ||
+              check_fds(client->maxfd, &client->wfds, &wfds) ||
+              check_fds(client->maxfd, &client->xfds, &xfds)) {
+            client->watch = 0;
+            bx_atomic_store32(&client->ready, 1);
+            queued = 1;
+          }
+        }
+      }
+    }
+#if BX_NETIO_EPOLL
+    for (i = 0; i < n; i++) {
+      if (events[i].data.u64 == 0) {
+        while (read(wake_pipe[0], &c, 1) > 0);
+      } else if ((client = find_client((Bit32u)events[i].data.u64)) != NULL) {
+        queued |= read_client(client);
+      }
+    }
+#else
+    if ((ret > 0) && FD_ISSET(wake_pipe[0], &rfds)) {
+      while (read(wake_pipe[0], &c, 1) > 0);
+    }
+    for (client = clients; client != NULL; client = client->next) {
+      if ((ret > 0) && (client->fd >= 0) && !client->throttled &&
+          FD_ISSET(client->fd, &rfds)) {
+        queued |= read_client(client);
+      }
+    }
+#endif
+    BX_UNLOCK(lock);
+    if (queued) {
+      bx_pc_system.request_timer(drain_timer, BX_NETIO_DRAIN_INTERVAL);
+    }
+  }
+}
+
+void bx_netio_c::schedule_drain(void)
+{
+  bx_pc_system.activate_timer_within(drain_timer, BX_NETIO_DRAIN_INTERVAL);
+}
+
+void bx_netio_c::drain_timer_handler(void *this_ptr)
+{
+  ((bx_netio_c *) this_ptr)->drain();
+}
+
+// Pass the received frames to the devices. Frames stay in the ring while
+// the device can't receive.
+void bx_netio_c::drain(void)
+{
+  bx_netio_client_t *client;
+  eth_pktmover_c *mover;
+  const Bit8u *frame;
+  unsigned len;
+  Bit32u usec, next = 0;
+
+  for (client = clients; client != NULL; client = client->next) {
+    mover = client->mover;
+    if (client->fd < 0) {
+      usec = mover->rx_poll(bx_atomic_xchg32(&client->ready, 0) != 0);
+    } else {
+      while ((frame = client->ring->front(&len)) != NULL) {
+        if (!(mover->rxstat(mover->netdev) & BX_NETDEV_RXREADY))
+          break;
+        mover->rxh(mover->netdev, frame, len);
+        client->ring->pop();
+      }
+      // frames left if the device can't receive now, try again later
+      usec = client->ring->empty() ? 0 : BX_NETIO_DRAIN_INTERVAL;
+      if (bx_atomic_load32(&client->throttled) && !client->ring->full()) {
+        wakeup();
+      }
+    }
+    if ((usec > 0) && ((next == 0) || (usec < next))) next = usec;
+  }
+  if (next > 0) {
+    bx_pc_system.activate_timer_within(drain_timer, next);
+  }
+}
+
+#undef LOG_THIS
+#define LOG_THIS bx_netmod_ctl.
+
+#endif
+
+#ifdef __linux__
+
+extern "C" {
+#include <sys/socket.h>
+#include <sys/uio.h>
+};
+
+int send_frames(int fd, const eth_txframe_t *frames, unsigned count,
+                const void *to, unsigned tolen, int flags)
+{
+  struct mmsghdr msgs[BX_NET_SEND_BATCH];
+  struct iovec iov[BX_NET_SEND_BATCH];
+  unsigned i, n, sent = 0;
+  int ret;
+
+  while (sent < count) {
+    n = count - sent;
+    if (n > BX_NET_SEND_BATCH) n = BX_NET_SEND_BATCH;
+    memset(msgs, 0, n * sizeof(struct mmsghdr));
+    for (i = 0; i < n; i++) {
+      iov[i].iov_base = frames[sent + i].buf;
+      iov[i].iov_len = frames[sent + i].len;
+      msgs[i].msg_hdr.msg_name = (void*)to;
+      msgs[i].msg_hdr.msg_namelen = tolen;
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    ret = sendmmsg(fd, msgs, n, flags);
+    if (ret < 0) {
+      return (sent > 0) ? (int)sent : -1;
+    }
+    sent += ret;
+    if ((unsigned)ret < n) break;
+  }
+  return sent;
+}
+
+#endif
+
 #if (BX_NETMOD_TAP==1) || (BX_NETMOD_TUNTAP==1) || (BX_NETMOD_VDE==1)
 
 extern "C" {
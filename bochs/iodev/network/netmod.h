@@ -64,6 +64,16 @@ BX_CPP_INLINE void put_net4(Bit8u *buf,Bit32u data)
 
 #ifndef BXHUB
 
+// The host side of the pktmovers is served by a network I/O thread on
+// platforms with POSIX threads and descriptors (see bx_netio_c)
+#if !defined(WIN32) && !defined(__CYGWIN__)
+#define BX_NETIO_THREAD 1
+#include <sys/select.h>
+#include "bxthread.h"
+#else
+#define BX_NETIO_THREAD 0
+#endif
+
 // Pseudo device that loads the lowlevel networking module
 class BOCHSAPI bx_netmod_ctl_c : public logfunctions {
 public:
@@ -88,6 +98,32 @@ BOCHSAPI extern bx_netmod_ctl_c bx_netmod_ctl;
 typedef void (*eth_rx_handler_t)(void *arg, const void *buf, unsigned len);
 typedef Bit32u (*eth_rx_status_t)(void *arg);
 
+// transmit offloads supported by a pktmover (see offload_caps())
+#define BX_NETDEV_OFFLOAD_CSUM 0x0001 // TCP/UDP checksum
+#define BX_NETDEV_OFFLOAD_TSO4 0x0002 // TCP segmentation (IPv4)
+#define BX_NETDEV_OFFLOAD_TSO6 0x0004 // TCP segmentation (IPv6)
+
+// offload request of a transmitted frame (same fields as virtio_net_hdr)
+#define BX_NET_CSUM_NEEDED 0x01
+#define BX_NET_GSO_NONE    0
+#define BX_NET_GSO_TCPV4   1
+#define BX_NET_GSO_TCPV6   4
+
+typedef struct {
+  Bit8u  flags;       // BX_NET_CSUM_NEEDED: checksum from csum_start to the end
+  Bit8u  gso_type;    // BX_NET_GSO_*: frame must be split into gso_size segments
+  Bit16u hdr_len;     // length of the headers repeated in each segment
+  Bit16u gso_size;
+  Bit16u csum_start;
+  Bit16u csum_offset; // position of the checksum field relative to csum_start
+} eth_offload_t;
+
+typedef struct {
+  void *buf;
+  unsigned len;
+  const eth_offload_t *offload; // NULL if the frame is complete
+} eth_txframe_t;
+
 int execute_script(logfunctions *netdev, const char *name, char* arg1);
 void BOCHSAPI_MSVCONLY write_pktlog_txt(FILE *pktlog_txt, const Bit8u *buf, unsigned len, bool host_to_guest);
 size_t BOCHSAPI_MSVCONLY strip_whitespace(char *s);
@@ -103,13 +139,137 @@ size_t BOCHSAPI_MSVCONLY strip_whitespace(char *s);
 class eth_pktmover_c {
 public:
   virtual void sendpkt(void *buf, unsigned io_len) = 0;
+  // Send a batch of frames. Frames with an offload request are only passed
+  // if offload_caps() reports support for it.
+  virtual void sendpkts(const eth_txframe_t *frames, unsigned count) {
+    for (unsigned i = 0; i < count; i++) {
+      sendpkt(frames[i].buf, frames[i].len);
+    }
+  }
+  virtual Bit32u offload_caps(void) { return 0; }
   virtual ~eth_pktmover_c () {}
+#if BX_NETIO_THREAD
+  // Called by the network I/O thread while the descriptor registered with
+  // bx_netio.add_reader() is readable. Returns the length of the frame
+  // stored in 'buf', 0 if the frame was dropped or -1 if no data is left.
+  virtual int rx_read(Bit8u *buf, unsigned size) { return -1; }
+  // Called on the emulation thread for pktmovers registered with
+  // bx_netio.add_poller() on each drain. 'ready' is set if one of the
+  // descriptors passed to bx_netio.watch_fds() became ready since then.
+  // Returns the usecs until the pktmover wants to be called again without
+  // ready descriptors or 0 if it can wait for them.
+  virtual Bit32u rx_poll(bool ready) { return 0; }
+#endif
 protected:
   logfunctions *netdev;
   eth_rx_handler_t  rxh;   // receive callback
   eth_rx_status_t  rxstat; // receive status callback
+
+  friend class bx_netio_c;
 };
 
+#ifdef __linux__
+#define BX_NET_SEND_BATCH 32
+
+// send frames to a datagram or packet socket with sendmmsg(), returns the
+// number of frames sent or -1 on error
+int send_frames(int fd, const eth_txframe_t *frames, unsigned count,
+                const void *to, unsigned tolen, int flags);
+#endif
+
+#if BX_NETIO_THREAD
+
+#define BX_NETIO_RING_SIZE      256  // frames buffered per pktmover
+#define BX_NETIO_DRAIN_INTERVAL 100  // usecs from queuing frames to the drain
+
+//
+//  Single producer / single consumer ring of received frames. The network
+// I/O thread stores the frames and the emulation thread takes them out, so
+// no lock is required.
+//
+class bx_netio_ring_c {
+public:
+  bx_netio_ring_c();
+  ~bx_netio_ring_c();
+  bool empty(void) { return bx_atomic_load32(&head) == bx_atomic_load32(&tail); }
+  bool full(void) { return (bx_atomic_load32(&head) - bx_atomic_load32(&tail)) == BX_NETIO_RING_SIZE; }
+  // producer side
+  bool push(const void *buf, unsigned len);
+  // consumer side: returns the oldest frame or NULL if the ring is empty
+  const Bit8u *front(unsigned *len);
+  void pop(void);
+private:
+  Bit8u *frames;
+  Bit32u *lengths;
+  volatile Bit32u head; // next slot to write, only changed by the producer
+  volatile Bit32u tail; // next slot to read, only changed by the consumer
+};
+
+typedef struct bx_netio_client {
+  eth_pktmover_c *mover;
+  int fd;                    // descriptor read by rx_read() or -1 (poller)
+  Bit32u id;
+  bx_netio_ring_c *ring;
+  volatile Bit32u throttled; // ring was full, the descriptor is not polled
+  volatile Bit32u ready;     // watched descriptor ready (poller)
+  int maxfd;                 // watched descriptors (poller)
+  fd_set rfds, wfds, xfds;
+  bool watch;
+  struct bx_netio_client *next;
+} bx_netio_client_t;
+
+//
+//  The network I/O thread waits for data on the host descriptors of the
+// pktmovers (epoll on Linux, select elsewhere). Frames read by a reader
+// are queued in its ring and passed to the network device by the drain
+// timer on the emulation thread, so the device models are never entered
+// from the I/O thread. Pollers (slirp) keep their state on the emulation
+// thread, the I/O thread only watches their descriptors and flags them.
+// The drain timer is a one-shot timer, it is requested by the I/O thread
+// when it queued frames or flagged a poller and re-armed by the drain only
+// while frames are left or a poller asks for it.
+//
+class bx_netio_c : public logfunctions {
+public:
+  bx_netio_c();
+  virtual ~bx_netio_c() {}
+  bx_netio_client_t *add_reader(eth_pktmover_c *mover, int fd);
+  bx_netio_client_t *add_poller(eth_pktmover_c *mover);
+  void remove(bx_netio_client_t *client);
+  // poller: watch the descriptors until they become ready once
+  void watch_fds(bx_netio_client_t *client, int maxfd, fd_set *rfds,
+                 fd_set *wfds, fd_set *xfds);
+  // emulation thread: drain the rings and call the pollers soon
+  void schedule_drain(void);
+  void exit(void);
+  void thread_loop(void);
+private:
+  bx_netio_client_t *add_client(eth_pktmover_c *mover, int fd);
+  void start(void);
+  void stop_thread(void);
+  void wakeup(void);
+  bool read_client(bx_netio_client_t *client);
+  bx_netio_client_t *find_client(Bit32u id);
+  void set_polled(bx_netio_client_t *client, bool enable);
+  static void drain_timer_handler(void *this_ptr);
+  void drain(void);
+
+  bx_netio_client_t *clients;
+  Bit32u next_id;
+  bool running;
+  volatile Bit32u stop;
+  int drain_timer;
+  int wake_pipe[2];
+  int epoll_fd;
+  Bit8u *rxbuf;
+  BX_MUTEX(lock);
+  BX_THREAD_VAR(thread);
+};
+
+BOCHSAPI extern bx_netio_c bx_netio;
+
+#endif
+
 
 //
 //  The eth_locator class is used by pktmover classes to register
@@ -0,0 +1,110 @@
+/////////////////////////////////////////////////////////////////////////
+// $Id$
+/////////////////////////////////////////////////////////////////////////
+//
+//  Copyright (C) 2021  The Bochs Project
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+//
+
+//  netshm.h  - shared memory transport between bxhub and eth_socket
+//
+//  bxhub creates one file per port and maps it. The Bochs session maps the
+//  same file (ethdev=shm:<file>) and both sides exchange frames through two
+//  single producer / single consumer rings. The client polls its receive
+//  ring from the network drain timer. bxhub sleeps on the UDP port of the
+//  client if its ring is empty and the client sends an empty datagram to
+//  that port ("doorbell") when it finds bxhub waiting.
+
+#ifndef BX_NETSHM_H
+#define BX_NETSHM_H
+
+#if !defined(WIN32)
+#define BX_NETSHM 1
+#else
+#define BX_NETSHM 0
+#endif
+
+#if BX_NETSHM
+
+#define BX_NETSHM_MAGIC     0x4d534842 // 'BHSM'
+#define BX_NETSHM_VERSION   1
+#define BX_NETSHM_SLOTS     256        // frames per direction (power of 2)
+#define BX_NETSHM_SLOT_SIZE 1536       // length and frame data
+
+// one direction of the link, each index is only written by one side
+typedef struct {
+  volatile Bit32u head;        // next slot to write (producer)
+  Bit8u  pad0[60];
+  volatile Bit32u tail;        // next slot to read (consumer)
+  Bit8u  pad1[60];
+  Bit8u  slots[BX_NETSHM_SLOTS][BX_NETSHM_SLOT_SIZE];
+} bx_netshm_ring_t;
+
+typedef struct {
+  Bit32u magic;
+  Bit32u version;
+  Bit32u doorbell_port;        // UDP port of bxhub for this client
+  volatile Bit32u hub_waiting; // bxhub waits for the doorbell
+  Bit8u  pad[48];
+  bx_netshm_ring_t to_hub;
+  bx_netshm_ring_t to_client;
+} bx_netshm_t;
+
+// producer side: returns false if the ring is full or the frame too big
+BX_CPP_INLINE bool netshm_put(bx_netshm_ring_t *ring, const void *buf, unsigned len)
+{
+  Bit32u head = ring->head, slen = len;
+  Bit8u *slot;
+
+  if ((len > (BX_NETSHM_SLOT_SIZE - 4)) ||
+      ((head - bx_atomic_load32(&ring->tail)) >= BX_NETSHM_SLOTS)) {
+    return false;
+  }
+  slot = ring->slots[head & (BX_NETSHM_SLOTS - 1)];
+  memcpy(slot, &slen, 4);
+  memcpy(slot + 4, buf, len);
+  bx_atomic_store32(&ring->head, head + 1);
+  return true;
+}
+
+// consumer side: returns the oldest frame or NULL if the ring is empty
+BX_CPP_INLINE const Bit8u *netshm_front(bx_netshm_ring_t *ring, unsigned *len)
+{
+  Bit32u tail = ring->tail;
+  const Bit8u *slot;
+  Bit32u slen;
+
+  if (tail == bx_atomic_load32(&ring->head)) {
+    return NULL;
+  }
+  slot = ring->slots[tail & (BX_NETSHM_SLOTS - 1)];
+  memcpy(&slen, slot, 4);
+  // the length was written by another process
+  if (slen > (BX_NETSHM_SLOT_SIZE - 4)) {
+    slen = BX_NETSHM_SLOT_SIZE - 4;
+  }
+  *len = slen;
+  return slot + 4;
+}
+
+BX_CPP_INLINE void netshm_pop(bx_netshm_ring_t *ring)
+{
+  bx_atomic_store32(&ring->tail, ring->tail + 1);
+}
+
+#endif
+
+#endif
@@ -35,6 +35,7 @@
 #if BX_NETWORKING
 
 #include "netmod.h"
+#include "netcsum.h"
 #include "netutil.h"
 
 #if !defined(WIN32) || defined(__CYGWIN__)
@@ -65,21 +66,7 @@ typedef struct ftp_session {
 
 Bit16u ip_checksum(const Bit8u *buf, unsigned buf_len)
 {
-  Bit32u sum = 0;
-  unsigned n;
-
-  for (n = 0; n < buf_len; n++) {
-    if (n & 1) {
-      sum += (Bit32u)(*buf++);
-    } else {
-      sum += (Bit32u)(*buf++) << 8;
-    }
-  }
-  while (sum > 0xffff) {
-    sum = (sum >> 16) + (sum & 0xffff);
-  }
-
-  return (Bit16u)sum;
+  return net_checksum(buf, buf_len);
 }
 
 // VNET server definitions
@@ -22,24 +22,39 @@
 
 #if BX_NETWORKING && BX_NETMOD_SLIRP
 
-#define MBUF_THRESH 30
-
 /*
  * Find a nice value for msize
  * XXX if_maxlinkhdr already in mtu
  */
 #define SLIRP_MSIZE (IF_MTU + IF_MAXLINKHDR + offsetof(struct mbuf, m_dat) + 6)
 
+/*
+ * mbufs are allocated in slabs of MBUF_SLAB_COUNT and never returned
+ * to the C library before m_cleanup(), so there is no malloc() / free()
+ * in the packet path once the pool has grown to the working set
+ */
+#define MBUF_SLAB_COUNT 32
+#define MBUF_SLOT_SIZE  ((SLIRP_MSIZE + 15) & ~15)
+
+struct mbuf_slab {
+    struct mbuf_slab *next;
+    /* keep the mbufs aligned */
+    uint64_t pad;
+};
+
 void
 m_init(Slirp *slirp)
 {
     slirp->m_freelist.m_next = slirp->m_freelist.m_prev = &slirp->m_freelist;
     slirp->m_usedlist.m_next = slirp->m_usedlist.m_prev = &slirp->m_usedlist;
+    slirp->m_slabs = NULL;
+    slirp->mbuf_alloced = 0;
 }
 
 void m_cleanup(Slirp *slirp)
 {
     struct mbuf *m, *next;
+    struct mbuf_slab *slab;
 
     m = slirp->m_usedlist.m_next;
     while (m != &slirp->m_usedlist) {
@@ -47,48 +62,62 @@ void m_cleanup(Slirp *slirp)
         if (m->m_flags & M_EXT) {
             free(m->m_ext);
         }
-        free(m);
         m = next;
     }
-    m = slirp->m_freelist.m_next;
-    while (m != &slirp->m_freelist) {
-        next = m->m_next;
-        free(m);
-        m = next;
+    while (slirp->m_slabs != NULL) {
+        slab = slirp->m_slabs;
+        slirp->m_slabs = slab->next;
+        free(slab);
     }
+    m_init(slirp);
+}
+
+/*
+ * Add a slab of mbufs to the free list
+ */
+static int
+m_grow(Slirp *slirp)
+{
+	struct mbuf_slab *slab;
+	struct mbuf *m;
+	int i;
+
+	slab = (struct mbuf_slab *)malloc(sizeof(struct mbuf_slab) +
+	                                  MBUF_SLAB_COUNT * MBUF_SLOT_SIZE);
+	if (slab == NULL)
+		return -1;
+	slab->next = slirp->m_slabs;
+	slirp->m_slabs = slab;
+	for (i = 0; i < MBUF_SLAB_COUNT; i++) {
+		m = (struct mbuf *)((char *)(slab + 1) + i * MBUF_SLOT_SIZE);
+		m->slirp = slirp;
+		m->m_flags = M_FREELIST;
+		insque(m, &slirp->m_freelist);
+	}
+	slirp->mbuf_alloced += MBUF_SLAB_COUNT;
+	return 0;
 }
 
 /*
  * Get an mbuf from the free list, if there are none
- * malloc one
- *
- * Because fragmentation can occur if we alloc new mbufs and
- * free old mbufs, we mark all mbufs above mbuf_thresh as M_DOFREE,
- * which tells m_free to actually free() it
+ * add a new slab to the pool
  */
 struct mbuf *
 m_get(Slirp *slirp)
 {
-	struct mbuf *m;
-	int flags = 0;
+	struct mbuf *m = NULL;
 
 	DEBUG_CALL("m_get");
 
-	if (slirp->m_freelist.m_next == &slirp->m_freelist) {
-		m = (struct mbuf *)malloc(SLIRP_MSIZE);
-		if (m == NULL) goto end_error;
-		slirp->mbuf_alloced++;
-		if (slirp->mbuf_alloced > MBUF_THRESH)
-			flags = M_DOFREE;
-		m->slirp = slirp;
-	} else {
-		m = slirp->m_freelist.m_next;
-		remque(m);
-	}
+	if ((slirp->m_freelist.m_next == &slirp->m_freelist) &&
+	    (m_grow(slirp) < 0))
+		goto end_error;
+	m = slirp->m_freelist.m_next;
+	remque(m);
 
 	/* Insert it in the used list */
 	insque(m,&slirp->m_usedlist);
-	m->m_flags = (flags | M_USEDLIST);
+	m->m_flags = M_USEDLIST;
 
 	/* Initialise it */
 	m->m_size = SLIRP_MSIZE - offsetof(struct mbuf, m_dat);
@@ -120,12 +149,9 @@ m_free(struct mbuf *m)
 	   free(m->m_ext);
 
 	/*
-	 * Either free() it or put it on the free list
+	 * Put it back on the free list of the pool
 	 */
-	if (m->m_flags & M_DOFREE) {
-		m->slirp->mbuf_alloced--;
-		free(m);
-	} else if ((m->m_flags & M_FREELIST) == 0) {
+	if ((m->m_flags & M_FREELIST) == 0) {
 		insque(m,&m->slirp->m_freelist);
 		m->m_flags = M_FREELIST; /* Clobber other flags */
 	}
@@ -64,6 +64,12 @@
  * How much free room there is
  */
 #define M_FREEROOM(m) (M_ROOM(m) - (m)->m_len)
+
+/*
+ * How much room there is in front of m_data
+ */
+#define M_LEADINGSPACE(m) ((m)->m_data - (((m)->m_flags & M_EXT) ? \
+			(m)->m_ext : (m)->m_dat))
 #define M_TRAILINGSPACE M_FREEROOM
 
 struct mbuf {
@@ -100,8 +106,6 @@ struct mbuf {
 #define M_EXT			0x01	/* m_ext points to more (malloced) data */
 #define M_FREELIST		0x02	/* mbuf is on free list */
 #define M_USEDLIST		0x04	/* XXX mbuf is on used list (for dtom()) */
-#define M_DOFREE		0x08	/* when m_free is called on the mbuf, free()
-					 * it rather than putting it on the free list */
 
 void m_init(Slirp *);
 void m_cleanup(Slirp *slirp);
@@ -283,6 +283,15 @@ static void slirp_update_timeout(uint32_t *timeout)
         return;
     }
 
+    /* Frames waiting for the guest are sent as soon as it can receive */
+    QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        if ((slirp->if_fastq.ifq_next != &slirp->if_fastq) ||
+            (slirp->next_m != &slirp->if_batchq)) {
+            *timeout = 0;
+            return;
+        }
+    }
+
     t = MIN(1000, *timeout);
 
     /* If we have tcp timeout with slirp, then we will fill @timeout with
@@ -756,7 +765,7 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
 int if_encap(Slirp *slirp, struct mbuf *ifm)
 {
     uint8_t buf[1600];
-    struct ethhdr *eh = (struct ethhdr *)buf;
+    struct ethhdr *eh;
     uint8_t ethaddr[ETH_ALEN];
     const struct ip *iph = (const struct ip *)ifm->m_data;
 
@@ -802,13 +811,23 @@ int if_encap(Slirp *slirp, struct mbuf *ifm)
         }
         return 0;
     } else {
+        /*
+         * Build the ethernet header in the room reserved in front of the
+         * IP packet (IF_MAXLINKHDR), so the NIC can take the frame directly
+         * from the mbuf. Copy it only if there is no room.
+         */
+        if (M_LEADINGSPACE(ifm) >= ETH_HLEN) {
+            eh = (struct ethhdr *)(ifm->m_data - ETH_HLEN);
+        } else {
+            eh = (struct ethhdr *)buf;
+            memcpy(buf + ETH_HLEN, ifm->m_data, ifm->m_len);
+        }
         memcpy(eh->h_dest, ethaddr, ETH_ALEN);
         memcpy(eh->h_source, special_ethaddr, ETH_ALEN - 4);
         /* XXX: not correct */
         memcpy(&eh->h_source[2], &slirp->vhost_addr, 4);
         eh->h_proto = htons(ETH_P_IP);
-        memcpy(buf + sizeof(struct ethhdr), ifm->m_data, ifm->m_len);
-        slirp_output(slirp->opaque, buf, ifm->m_len + ETH_HLEN);
+        slirp_output(slirp->opaque, (uint8_t *)eh, ifm->m_len + ETH_HLEN);
         return 1;
     }
 }
@@ -257,6 +257,7 @@ struct Slirp {
 
     /* mbuf states */
     struct mbuf m_freelist, m_usedlist;
+    struct mbuf_slab *m_slabs;
     int mbuf_alloced;
 
     /* if states */
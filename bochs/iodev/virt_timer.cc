@@ -62,6 +62,10 @@
 #include "param_names.h"
 #include "virt_timer.h"
 
+#if !defined(_MSC_VER)
+#include <unistd.h>
+#endif
+
 const Bit64u BX_MAX_VIRTUAL_TIME = BX_CONST64(0x7fffffff);
 
 //Important constant #defines:
@@ -144,38 +148,36 @@ void bx_virt_timer_c::periodic(Bit64u time_passed, bool mode)
 
   //Starting timer handler calls.
   in_timer_handler = 1;
-  //Otherwise, cause any events to occur that should.
+  //Otherwise, cause any events to occur that should. The expired timers
+  //  come out of the queue in the order of their IDs. A timer function
+  //  can change the behavior of another timer, so the head of the queue
+  //  is checked again after each call.
   unsigned i;
-  for (i=0;i<numTimers;i++) {
-    if (timer[i].inUse && timer[i].active) {
-      if (timer[i].realtime != mode) continue;
-      //Assert that we haven't skipped any timers.
-      BX_ASSERT(s[mode].current_timers_time <= timer[i].timeToFire);
-      if (timer[i].timeToFire == s[mode].current_timers_time) {
-        if (timer[i].continuous) {
-          timer[i].timeToFire += timer[i].period;
-        } else {
-          timer[i].active = 0;
-        }
-        //This function MUST return, or the timer mechanism
-        // will be broken.
-        timer[i].funct(timer[i].this_ptr);
-      }
+  while (!activeTimers[mode].empty() &&
+         (activeTimers[mode].topTimeToFire() <= s[mode].current_timers_time)) {
+    i = activeTimers[mode].topId();
+    //Assert that we haven't skipped any timers.
+    BX_ASSERT(s[mode].current_timers_time == timer[i].timeToFire);
+    if (timer[i].continuous) {
+      timer[i].timeToFire += timer[i].period;
+      activeTimers[mode].insert(i, timer[i].timeToFire);
+    } else {
+      timer[i].active = 0;
+      activeTimers[mode].remove(i);
     }
+    //This function MUST return, or the timer mechanism
+    // will be broken.
+    timer[i].funct(timer[i].this_ptr);
   }
   //Finished timer handler calls.
   in_timer_handler = 0;
-  //Use a second FOR loop so that a timer function call can
-  //  change the behavior of another timer.
   //s[mode].timers_next_event_time normally contains a cycle count, not a cycle time.
   //  here we use it as a temporary variable that IS a cycle time,
   //  but then convert it back to a cycle count afterwards.
   s[mode].timers_next_event_time = s[mode].current_timers_time + BX_MAX_VIRTUAL_TIME;
-  for (i=0;i<numTimers;i++) {
-    if (timer[i].inUse && timer[i].active && (timer[i].realtime == mode) &&
-        ((timer[i].timeToFire)<s[mode].timers_next_event_time)) {
-      s[mode].timers_next_event_time = timer[i].timeToFire;
-    }
+  if (!activeTimers[mode].empty() &&
+      (activeTimers[mode].topTimeToFire() < s[mode].timers_next_event_time)) {
+    s[mode].timers_next_event_time = activeTimers[mode].topTimeToFire();
   }
   s[mode].timers_next_event_time -= s[mode].current_timers_time;
   next_event_time_update(mode);
@@ -233,7 +235,7 @@ int bx_virt_timer_c::register_timer(void *this_ptr, bx_timer_handler_t handler,
   // If we didn't find a free slot, increment the bound, numTimers.
   if (i == numTimers)
     numTimers++; // One new timer installed.
-  BX_ASSERT(numTimers<BX_MAX_VIRTUAL_TIMERS);
+  timer.reserve(numTimers);
 
   timer[i].inUse = 1;
   timer[i].period = useconds;
@@ -245,6 +247,8 @@ int bx_virt_timer_c::register_timer(void *this_ptr, bx_timer_handler_t handler,
   timer[i].this_ptr = this_ptr;
   strncpy(timer[i].id, id, BxMaxTimerIDLen);
   timer[i].id[BxMaxTimerIDLen-1]=0; //I like null terminated strings.
+  if (active)
+    activeTimers[realtime].insert(i, timer[i].timeToFire);
 
   if (realtime) {
     BX_DEBUG(("Timer #%d ('%s') using realtime synchronisation mode", i, timer[i].id));
@@ -262,7 +266,7 @@ int bx_virt_timer_c::register_timer(void *this_ptr, bx_timer_handler_t handler,
 //unregister a previously registered timer.
 bool bx_virt_timer_c::unregisterTimer(unsigned timerID)
 {
-  BX_ASSERT(timerID < BX_MAX_VIRTUAL_TIMERS);
+  BX_ASSERT(timerID < numTimers);
 
   if (timer[timerID].active) {
     BX_PANIC(("unregisterTimer: timer '%s' is still active!", timer[timerID].id));
@@ -284,7 +288,7 @@ void bx_virt_timer_c::start_timers(void)
 void bx_virt_timer_c::activate_timer(unsigned timer_index, Bit32u useconds,
                                      bool continuous)
 {
-  BX_ASSERT(timer_index < BX_MAX_VIRTUAL_TIMERS);
+  BX_ASSERT(timer_index < numTimers);
 
   BX_ASSERT(timer[timer_index].inUse);
   BX_ASSERT(useconds>0);
@@ -294,6 +298,7 @@ void bx_virt_timer_c::activate_timer(unsigned timer_index, Bit32u useconds,
   timer[timer_index].timeToFire = s[realtime].current_timers_time + (Bit64u)useconds;
   timer[timer_index].active = 1;
   timer[timer_index].continuous = continuous;
+  activeTimers[realtime].insert(timer_index, timer[timer_index].timeToFire);
 
   if (useconds < s[realtime].timers_next_event_time) {
     s[realtime].timers_next_event_time = useconds;
@@ -305,10 +310,11 @@ void bx_virt_timer_c::activate_timer(unsigned timer_index, Bit32u useconds,
 //deactivate (but don't unregister) a currently registered timer.
 void bx_virt_timer_c::deactivate_timer(unsigned timer_index)
 {
-  BX_ASSERT(timer_index < BX_MAX_VIRTUAL_TIMERS);
+  BX_ASSERT(timer_index < numTimers);
 
   //No need to prevent doing this to unused/inactive timers.
   timer[timer_index].active = 0;
+  activeTimers[timer[timer_index].realtime].remove(timer_index);
 }
 
 void bx_virt_timer_c::advance_virtual_time(Bit64u time_passed, bool mode)
@@ -339,6 +345,8 @@ void bx_virt_timer_c::next_event_time_update(bool mode)
 void bx_virt_timer_c::setup(void)
 {
   numTimers = 0;
+  activeTimers[0].clear();
+  activeTimers[1].clear();
   in_timer_handler = 0;
   for (unsigned i = 0; i < 2; i++) {
     s[i].current_timers_time = 0;
@@ -354,6 +362,9 @@ void bx_virt_timer_c::init(void)
 {
   // Local copy of IPS value to avoid reading it frequently in timer handler
   ips = SIM->get_param_num(BXPN_IPS)->get();
+  int clock_sync = SIM->get_param_enum(BXPN_CLOCK_SYNC)->get();
+  realtime_sync = (clock_sync == BX_CLOCK_SYNC_REALTIME) || (clock_sync == BX_CLOCK_SYNC_BOTH);
+  slowdown_sync = (clock_sync == BX_CLOCK_SYNC_SLOWDOWN) || (clock_sync == BX_CLOCK_SYNC_BOTH);
 
   register_timer(this, nullTimer, (Bit32u)NullTimerInterval, 1, 1, 0, "Null Timer #1");
   register_timer(this, nullTimer, (Bit32u)NullTimerInterval, 1, 1, 1, "Null Timer #2");
@@ -387,12 +398,13 @@ void bx_virt_timer_c::init(void)
 void bx_virt_timer_c::register_state(void)
 {
   unsigned i;
-  char name[4];
+  char name[16];
 
   bx_list_c *list = new bx_list_c(SIM->get_bochs_root(), "virt_timer", "Virtual Timer State");
   bx_list_c *vtimers = new bx_list_c(list, "timer");
+  vtimers->set_restore_handler(this, timer_restore_handler);
   for (i = 0; i < numTimers; i++) {
-    sprintf(name, "%u", i);
+    snprintf(name, sizeof(name), "%u", i);
     bx_list_c *bxtimer = new bx_list_c(vtimers, name);
     BXRS_PARAM_BOOL(bxtimer, inUse, timer[i].inUse);
     BXRS_DEC_PARAM_FIELD(bxtimer, period, timer[i].period);
@@ -403,7 +415,7 @@ void bx_virt_timer_c::register_state(void)
   }
   bx_list_c *sys = new bx_list_c(list, "s");
   for (i = 0; i < 2; i++) {
-    sprintf(name, "%u", i);
+    snprintf(name, sizeof(name), "%u", i);
     bx_list_c *snum = new bx_list_c(sys, name);
     BXRS_DEC_PARAM_FIELD(snum, current_timers_time, s[i].current_timers_time);
     BXRS_DEC_PARAM_FIELD(snum, timers_next_event_time, s[i].timers_next_event_time);
@@ -424,6 +436,20 @@ void bx_virt_timer_c::register_state(void)
   BXRS_DEC_PARAM_SIMPLE(list, ticks_per_second);
 }
 
+void bx_virt_timer_c::timer_restore_handler(void *devptr, bx_list_c *list)
+{
+  bx_virt_timer_c *class_ptr = (bx_virt_timer_c *) devptr;
+
+  // rebuild the queues from the restored timer state
+  class_ptr->activeTimers[0].clear();
+  class_ptr->activeTimers[1].clear();
+  for (unsigned i = 0; i < class_ptr->numTimers; i++) {
+    if (class_ptr->timer[i].inUse && class_ptr->timer[i].active) {
+      class_ptr->activeTimers[class_ptr->timer[i].realtime].insert(i, class_ptr->timer[i].timeToFire);
+    }
+  }
+}
+
 void bx_virt_timer_c::timer_handler(bool mode)
 {
   if (!mode) {
@@ -548,3 +574,37 @@ void bx_virt_timer_c::set_realtime_delay()
 {
   real_time_delay = GET_VIRT_REALTIME64_USEC() - last_real_time;
 }
+
+void bx_virt_timer_c::realtime_idle_wait(unsigned next_system_timer, Bit32u max_usec)
+{
+#if BX_HAVE_REALTIME_USEC
+  if (!init_done || !realtime_sync ||
+      (next_system_timer != (unsigned) s[1].system_timer_id)) return;
+
+  // The realtime mode virtual time can't run ahead of the host clock, so
+  // emulating the time up to the next realtime event would only spin.
+  Bit64u real_time_delta = GET_VIRT_REALTIME64_USEC() - last_real_time - real_time_delay;
+  Bit64u real_time_total = total_real_usec + real_time_delta;
+  Bit64u next_event = total_ticks + s[1].virtual_next_event_time;
+  if (next_event <= real_time_total) return;
+
+  Bit64u usec = BX_MIN(next_event - real_time_total, (Bit64u) max_usec);
+#if BX_HAVE_USLEEP
+  usleep((Bit32u) usec);
+#elif BX_HAVE_MSLEEP
+  msleep((Bit32u) (usec / 1000));
+#elif BX_HAVE_SLEEP
+  if (usec >= 1000000) sleep(1);
+#endif
+#endif
+}
+
+void bx_virt_timer_c::realtime_idle_update(void)
+{
+  // With the slowdown timer the host sleeps while the emulated time advances,
+  // so the update of the realtime mode timers scheduled in emulated time
+  // would come too late after the idle jumps. Catch up with the host clock
+  // directly instead.
+  if (init_done && realtime_sync && slowdown_sync && !in_timer_handler)
+    timer_handler(1);
+}
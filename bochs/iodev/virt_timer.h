@@ -24,13 +24,10 @@
 
 #include "pc_system.h"
 
-// should be adjusted if want to support more SMP processors
-#define BX_MAX_VIRTUAL_TIMERS (32)
-
 class BOCHSAPI bx_virt_timer_c : public logfunctions {
 private:
 
-  struct {
+  struct timer_slot_t {
     bool inUse;         // Timer slot is in-use (currently registered).
     Bit64u  period;     // Timer periodocity in virtual useconds.
     Bit64u  timeToFire; // Time to fire next (in virtual useconds).
@@ -43,7 +40,9 @@ private:
     void *this_ptr;            // The this-> pointer for C++ callbacks
                                //   has to be stored as well.
     char id[BxMaxTimerIDLen]; // String ID of timer.
-  } timer[BX_MAX_VIRTUAL_TIMERS];
+  };
+  bx_timer_slots_c<timer_slot_t> timer;
+  bx_timer_queue_c activeTimers[2]; // active timers of each mode ordered by time to fire
 
   unsigned   numTimers;  // Number of currently allocated timers.
 
@@ -65,6 +64,11 @@ private:
   // Local copy of IPS value
   Bit64u ips;
 
+  // Realtime mode timers follow the host clock (clock: sync=realtime|both)
+  bool realtime_sync;
+  // The slowdown timer keeps the emulated time in line with the host clock
+  bool slowdown_sync;
+
   bool init_done;
 
   //Real time variables:
@@ -89,6 +93,7 @@ private:
   // counter can be used for the current countdown.
   static const Bit64u NullTimerInterval;
   static void nullTimer(void* this_ptr);
+  static void timer_restore_handler(void *devptr, bx_list_c *list);
 
   //Step the given number of cycles, optionally calling any timer handlers.
   void periodic(Bit64u time_passed, bool mode);
@@ -150,6 +155,14 @@ public:
   //Determine the real time elapsed during runtime config or between save and
   //restore.
   void set_realtime_delay(void);
+
+  //Called while all emulated CPUs are idle: if the next system timer to
+  //fire updates the realtime mode timers, sleep on the host until the next
+  //realtime mode timer is due, but not longer than max_usec.
+  void realtime_idle_wait(unsigned next_system_timer, Bit32u max_usec);
+  //Called after the idle CPUs skipped the emulated time to the next system
+  //timer event.
+  void realtime_idle_update(void);
 };
 
 BOCHSAPI extern bx_virt_timer_c bx_virt_timer;
@@ -24,6 +24,7 @@
 #include "cpu/cpu.h"
 #include "iodev/iodev.h"
 #include "iodev/hdimage/hdimage.h"
+#include "bxthread.h"
 #if BX_NETWORKING
 #include "iodev/network/netmod.h"
 #endif
@@ -971,6 +972,144 @@ bool load_and_init_display_lib(void)
   return (bx_gui != NULL);
 }
 
+#if BX_SUPPORT_SMP && BX_DEBUGGER == 0
+
+// Threaded SMP simulation: every emulated CPU runs on its own host thread.
+// The CPUs execute in lockstep rounds of at most thread_quantum instructions.
+// Between the rounds all CPU threads are parked and the main thread advances
+// the emulated time and processes the requests deferred by the CPU threads.
+
+struct bx_cpu_thread_t {
+  BX_THREAD_VAR(thread);
+  bx_thread_sem_t start;
+  bx_thread_sem_t done;
+  unsigned id;
+  Bit32u executed;
+};
+
+static bx_cpu_thread_t *bx_cpu_threads = NULL;
+static Bit32u bx_thread_quantum;
+
+static void bx_cpu_thread_run_round(bx_cpu_thread_t *t)
+{
+  BX_CPU_C *cpu = BX_CPU(t->id);
+  Bit64u prev_icount;
+
+  cpu->icount_last_sync = cpu->get_icount();
+
+  if (setjmp(BX_CPU_C::jmp_buf_env)) {
+    // can get here only from exception function or VMEXIT
+    cpu->icount++;
+  }
+
+  while (1) {
+    prev_icount = cpu->get_icount();
+    cpu->cpu_run_trace();
+
+    if (cpu->get_icount() == prev_icount) {
+      // the CPU was halted, let the others reach the end of the round
+      break;
+    }
+    if ((cpu->get_icount() - cpu->icount_last_sync) >= bx_thread_quantum)
+      break;
+    if (bx_pc_system.smp_sync_request || bx_pc_system.kill_bochs_request)
+      break;
+  }
+
+  t->executed = (Bit32u)(cpu->get_icount() - cpu->icount_last_sync);
+}
+
+BX_THREAD_FUNC(bx_cpu_thread_func, indata)
+{
+  bx_cpu_thread_t *t = (bx_cpu_thread_t *) indata;
+
+  bx_host_thread_cpu = BX_CPU(t->id);
+
+  while (1) {
+    bx_wait_sem(&t->start);
+    if (bx_pc_system.kill_bochs_request)
+      break;
+    bx_cpu_thread_run_round(t);
+    bx_set_sem(&t->done);
+  }
+
+  bx_host_thread_cpu = NULL;
+  bx_set_sem(&t->done);
+  BX_THREAD_EXIT;
+}
+
+static bool bx_smp_threads_init(void)
+{
+  Bit64u guest_mem = SIM->get_param_num(BXPN_MEM_SIZE)->get64();
+  Bit64u host_mem = SIM->get_param_num(BXPN_HOST_MEM_SIZE)->get64();
+  if (host_mem < guest_mem) {
+    // swapping of the guest memory blocks is not thread safe
+    BX_ERROR(("cpu: host_threads requires host memory size not less than guest memory size, using single host thread"));
+    return 0;
+  }
+
+  bx_thread_quantum = SIM->get_param_num(BXPN_SMP_THREAD_QUANTUM)->get();
+  bx_cpu_threads = new bx_cpu_thread_t[BX_SMP_PROCESSORS];
+  for (unsigned n=0; n<BX_SMP_PROCESSORS; n++) {
+    bx_cpu_thread_t *t = &bx_cpu_threads[n];
+    t->id = n;
+    t->executed = 0;
+    if (!bx_create_sem(&t->start) || !bx_create_sem(&t->done)) {
+      BX_PANIC(("cpu: failed to create semaphores for CPU thread %u", n));
+      return 0;
+    }
+    BX_THREAD_CREATE(bx_cpu_thread_func, t, t->thread);
+  }
+  BX_INFO(("cpu: running %u CPUs on host threads, thread_quantum=%u",
+    (unsigned) BX_SMP_PROCESSORS, bx_thread_quantum));
+  return 1;
+}
+
+static void bx_smp_threads_loop(void)
+{
+  unsigned n;
+
+  while (1) {
+    bx_pc_system.smp_parallel = 1;
+    for (n=0; n<BX_SMP_PROCESSORS; n++)
+      bx_set_sem(&bx_cpu_threads[n].start);
+    for (n=0; n<BX_SMP_PROCESSORS; n++)
+      bx_wait_sem(&bx_cpu_threads[n].done);
+    bx_pc_system.smp_parallel = 0;
+
+    bx_pc_system.smp_run_deferred();
+
+    // the emulated time follows the fastest CPU, skip the time up to the
+    // next timer event if all CPUs were halted
+    Bit32u executed = 0;
+    for (n=0; n<BX_SMP_PROCESSORS; n++) {
+      if (bx_cpu_threads[n].executed > executed)
+        executed = bx_cpu_threads[n].executed;
+    }
+    if (executed == 0 && !BX_HRQ)
+      bx_pc_system.idle_fast_forward();
+    else
+      BX_TICKN(executed ? executed : bx_thread_quantum);
+
+    if (bx_pc_system.kill_bochs_request)
+      break;
+  }
+
+  // release the CPU threads
+  for (n=0; n<BX_SMP_PROCESSORS; n++) {
+    bx_cpu_thread_t *t = &bx_cpu_threads[n];
+    bx_set_sem(&t->start);
+    bx_wait_sem(&t->done);
+    BX_THREAD_JOIN(t->thread);
+    bx_destroy_sem(&t->start);
+    bx_destroy_sem(&t->done);
+  }
+  delete [] bx_cpu_threads;
+  bx_cpu_threads = NULL;
+}
+
+#endif
+
 int bx_begin_simulation(int argc, char *argv[])
 {
   bx_user_quit = 0;
@@ -1055,6 +1194,9 @@ int bx_begin_simulation(int argc, char *argv[])
       // that kill_bochs_request was set by the GUI interface.
     }
 #if BX_SUPPORT_SMP
+    else if (SIM->get_param_bool(BXPN_SMP_HOST_THREADS)->get() && bx_smp_threads_init()) {
+      bx_smp_threads_loop();
+    }
     else {
       // SMP simulation: do a few instructions on each processor, then switch
       // to another.  Increasing quantum speeds up overall performance, but
@@ -1064,7 +1206,7 @@ int bx_begin_simulation(int argc, char *argv[])
       // the next processor.
 
       static int quantum = SIM->get_param_num(BXPN_SMP_QUANTUM)->get();
-      Bit32u executed = 0, processor = 0;
+      Bit32u executed = 0, processor = 0, halted = 0;
       bool run = true;
 
       if (setjmp(BX_CPU_C::jmp_buf_env)) {
@@ -1081,13 +1223,24 @@ int bx_begin_simulation(int argc, char *argv[])
 
          // see how many instruction it was able to run
          Bit32u n = (Bit32u)(BX_CPU(processor)->get_icount() - BX_CPU(processor)->icount_last_sync);
-         if (n == 0) n = quantum; // the CPU was halted
+         if (n == 0) { // the CPU was halted
+           n = quantum;
+           halted++;
+         }
          executed += n;
 
          if (++processor == BX_SMP_PROCESSORS) {
            processor = 0;
-           BX_TICKN(executed / BX_SMP_PROCESSORS);
-           executed %= BX_SMP_PROCESSORS;
+           if (halted == BX_SMP_PROCESSORS && !BX_HRQ) {
+             // all CPUs are idle, skip the time up to the next timer event
+             bx_pc_system.idle_fast_forward();
+             executed = 0;
+           }
+           else {
+             BX_TICKN(executed / BX_SMP_PROCESSORS);
+             executed %= BX_SMP_PROCESSORS;
+           }
+           halted = 0;
          }
 
          BX_CPU(processor)->icount_last_sync = BX_CPU(processor)->get_icount();
@@ -1189,7 +1342,8 @@ void bx_init_hardware()
   BX_INFO(("IPS is set to %d", (Bit32u) SIM->get_param_num(BXPN_IPS)->get()));
   BX_INFO(("CPU configuration"));
 #if BX_SUPPORT_SMP
-  BX_INFO(("  SMP support: yes, quantum=%d", SIM->get_param_num(BXPN_SMP_QUANTUM)->get()));
+  BX_INFO(("  SMP support: yes, quantum=%d, host_threads=%d", SIM->get_param_num(BXPN_SMP_QUANTUM)->get(),
+    SIM->get_param_bool(BXPN_SMP_HOST_THREADS)->get()));
 #else
   BX_INFO(("  SMP support: no"));
 #endif
@@ -1374,6 +1528,9 @@ void bx_init_hardware()
   }
 #endif
 
+  if (!SIM->get_param_string(BXPN_ICACHE_FILE)->isempty())
+    bx_trace_file.load(SIM->get_param_string(BXPN_ICACHE_FILE)->getptr());
+
   DEV_init_devices();
   // unload optional plugins which are unused and marked for removal
   SIM->opt_plugin_ctrl("*", 0);
@@ -1444,6 +1601,9 @@ int bx_atexit(void)
   }
 #endif
 
+  if (!SIM->get_param_string(BXPN_ICACHE_FILE)->isempty())
+    bx_trace_file.save(SIM->get_param_string(BXPN_ICACHE_FILE)->getptr());
+
   BX_MEM(0)->cleanup_memory();
 
   bx_pc_system.exit();
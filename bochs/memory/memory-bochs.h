@@ -69,12 +69,14 @@ typedef bool (*memory_handler_t)(bx_phy_address addr, unsigned len, void *data,
 // same format as getHostMemAddr method
 typedef Bit8u* (*memory_direct_access_handler_t)(bx_phy_address addr, unsigned rw, void *param);
 
+// number of 4K pages in the second level of the memory handler table
+#define BX_MEM_HANDLER_PAGES 256
+
 struct memory_handler_struct {
-  struct memory_handler_struct *next;
+  struct memory_handler_struct *next; // list of all registered handlers
   void *param;
   bx_phy_address begin;
   bx_phy_address end;
-  Bit16u bitmap;
   memory_handler_t read_handler;
   memory_handler_t write_handler;
   memory_direct_access_handler_t da_handler;
@@ -85,7 +87,10 @@ struct memory_handler_struct {
 
 class BOCHSAPI BX_MEM_C : public logfunctions {
 private:
-  struct memory_handler_struct **memory_handlers;
+  // two level lookup table: one entry per megabyte pointing to the handlers
+  // of its 4K pages (NULL if no handler is registered in that megabyte)
+  struct memory_handler_struct ***memory_handlers;
+  struct memory_handler_struct *memory_handler_list;
   bool pci_enabled;
   bool bios_write_enabled;
   bool smram_available;
@@ -96,6 +101,10 @@ private:
   Bit32u  block_size;      // individual block size, must be power of 2
   Bit8u   *actual_vector;
   Bit8u   *vector;   // aligned correctly
+  Bit64u   vector_mapped; // size of host mapping, 0 if allocated from heap
+  unsigned vector_backing;
+  bool     ram_file_created; // RAM backing file created by Bochs, removed at exit
+  bool     ram_restored;  // RAM image mapped by restore, blocks need no reload
   Bit8u  **blocks;
   Bit8u   *rom;      // 512k BIOS rom space + 128k expansion rom space
   Bit8u   *bogus;    // 4k for unexisting memory
@@ -110,21 +119,26 @@ private:
   Bit32u used_blocks;
 #if BX_LARGE_RAMFILE
   static Bit8u * const swapped_out; // NULL; // (NULL - sizeof(Bit8u));
-  Bit32u  next_swapout_idx;
+  Bit32u  next_swapout_idx; // clock hand of the block replacement
   FILE    *overflow_file;
+  Bit8u   *block_referenced; // block accessed since last visited by the clock hand
+  Bit8u   *block_dirty;      // block modified since loaded from the overflow file
 
   BX_MEM_SMF void   read_block(Bit32u block);
+  BX_MEM_SMF void   write_block(Bit32u block);
 #endif
   BX_MEM_SMF Bit8u flash_read(Bit32u addr);
   BX_MEM_SMF void  flash_write(Bit32u addr, Bit8u data);
 
+  BX_MEM_SMF BX_CPP_INLINE struct memory_handler_struct *get_memory_handler(bx_phy_address a20addr);
+
 public:
   BX_MEM_C();
  ~BX_MEM_C();
 
   BX_MEM_SMF void    init_memory(Bit64u guest, Bit64u host, Bit32u block_size);
   BX_MEM_SMF void    cleanup_memory(void);
-  BX_MEM_SMF Bit8u*  get_vector(bx_phy_address addr);
+  BX_MEM_SMF Bit8u*  get_vector(bx_phy_address addr, bool write = false);
 
   BX_MEM_SMF void    enable_smram(bool enable, bool restricted);
   BX_MEM_SMF void    disable_smram(void);
@@ -168,6 +182,9 @@ public:
   BX_MEM_SMF Bit64u  get_memory_len(void);
   BX_MEM_SMF void allocate_block(Bit32u index);
   BX_MEM_SMF Bit8u* alloc_vector_aligned(Bit64u bytes, Bit64u alignment);
+  BX_MEM_SMF Bit8u* alloc_vector_mapped(Bit64u bytes, unsigned backing);
+  BX_MEM_SMF void   free_vector(void);
+  BX_MEM_SMF bool   map_ram_file(const char *path, Bit64u bytes, bool shared);
 
 #if BX_SUPPORT_MONITOR_MWAIT
   BX_MEM_SMF bool is_monitor(bx_phy_address begin_addr, unsigned len);
@@ -177,6 +194,8 @@ public:
   void register_state(void);
 
   friend void ramfile_save_handler(void *devptr, FILE *fp);
+  friend bool ram_mapped_save_handler(void *devptr, const char *path);
+  friend bool ram_mapped_restore_handler(void *devptr, const char *path);
   friend Bit64s memory_param_save_handler(void *devptr, bx_param_c *param);
   friend void memory_param_restore_handler(void *devptr, bx_param_c *param, Bit64s val);
 };
@@ -195,4 +214,10 @@ BX_CPP_INLINE Bit64u BX_MEM_C::get_memory_len(void)
   return (BX_MEM_THIS len);
 }
 
+BX_CPP_INLINE struct memory_handler_struct *BX_MEM_C::get_memory_handler(bx_phy_address a20addr)
+{
+  struct memory_handler_struct **pages = BX_MEM_THIS memory_handlers[a20addr >> 20];
+  return pages ? pages[(a20addr >> 12) & (BX_MEM_HANDLER_PAGES-1)] : NULL;
+}
+
 #endif
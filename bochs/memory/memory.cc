@@ -69,17 +69,15 @@ void BX_MEM_C::writePhysicalPage(BX_CPU_C *cpu, bx_phy_address addr, unsigned le
     }
   }
 
-  memory_handler = BX_MEM_THIS memory_handlers[a20addr >> 20];
-  while (memory_handler) {
-    if (memory_handler->write_handler != NULL) {
-      if (memory_handler->begin <= a20addr &&
-          memory_handler->end >= a20addr &&
-          memory_handler->write_handler(a20addr, len, data, memory_handler->param))
-      {
-        return;
-      }
-    }
-    memory_handler = memory_handler->next;
+  memory_handler = BX_MEM_THIS get_memory_handler(a20addr);
+  if (memory_handler && memory_handler->write_handler != NULL &&
+      memory_handler->begin <= a20addr && memory_handler->end >= a20addr)
+  {
+    // device memory handlers are not thread safe
+    bx_pc_system.smp_lock();
+    bool handled = memory_handler->write_handler(a20addr, len, data, memory_handler->param);
+    bx_pc_system.smp_unlock();
+    if (handled) return;
   }
 
 mem_write:
@@ -91,22 +89,22 @@ mem_write:
     {
       if (len == 8) {
         pageWriteStampTable.decWriteStamp(a20addr, 8);
-        WriteHostQWordToLittleEndian((Bit64u*) BX_MEM_THIS get_vector(a20addr), *(Bit64u*)data);
+        WriteHostQWordToLittleEndian((Bit64u*) BX_MEM_THIS get_vector(a20addr, true), *(Bit64u*)data);
         return;
       }
       if (len == 4) {
         pageWriteStampTable.decWriteStamp(a20addr, 4);
-        WriteHostDWordToLittleEndian((Bit32u*) BX_MEM_THIS get_vector(a20addr), *(Bit32u*)data);
+        WriteHostDWordToLittleEndian((Bit32u*) BX_MEM_THIS get_vector(a20addr, true), *(Bit32u*)data);
         return;
       }
       if (len == 2) {
         pageWriteStampTable.decWriteStamp(a20addr, 2);
-        WriteHostWordToLittleEndian((Bit16u*) BX_MEM_THIS get_vector(a20addr), *(Bit16u*)data);
+        WriteHostWordToLittleEndian((Bit16u*) BX_MEM_THIS get_vector(a20addr, true), *(Bit16u*)data);
         return;
       }
       if (len == 1) {
         pageWriteStampTable.decWriteStamp(a20addr, 1);
-        * (BX_MEM_THIS get_vector(a20addr)) = * (Bit8u *) data;
+        * (BX_MEM_THIS get_vector(a20addr, true)) = * (Bit8u *) data;
         return;
       }
       // len == other, just fall thru to special cases handling
@@ -125,7 +123,7 @@ mem_write:
         // Write in chunks of 8 bytes if we can
         if ((len & 7) == 0) {
           pageWriteStampTable.decWriteStamp(a20addr, 8);
-          WriteHostQWordToLittleEndian((Bit64u*) BX_MEM_THIS get_vector(a20addr), *(Bit64u*)data_ptr);
+          WriteHostQWordToLittleEndian((Bit64u*) BX_MEM_THIS get_vector(a20addr, true), *(Bit64u*)data_ptr);
           len -= 8;
           a20addr += 8;
           #ifdef BX_LITTLE_ENDIAN
@@ -137,7 +135,7 @@ mem_write:
           if (len == 0) return;
         } else {
           pageWriteStampTable.decWriteStamp(a20addr, 1);
-          *(BX_MEM_THIS get_vector(a20addr)) = *data_ptr;
+          *(BX_MEM_THIS get_vector(a20addr, true)) = *data_ptr;
           if (len == 1) return;
           len--;
           a20addr++;
@@ -160,7 +158,7 @@ mem_write:
       if (a20addr < 0x000c0000) {
         // devices are not allowed to access SMMRAM under VGA memory
         if (cpu) {
-          *(BX_MEM_THIS get_vector(a20addr)) = *data_ptr;
+          *(BX_MEM_THIS get_vector(a20addr, true)) = *data_ptr;
         }
         goto inc_one;
       }
@@ -177,7 +175,7 @@ mem_write:
         if (BX_MEM_THIS memory_type[area][1] == 1) {
           // Writes to ShadowRAM
           BX_DEBUG(("Writing to ShadowRAM: address 0x" FMT_PHY_ADDRX ", data %02x", a20addr, *data_ptr));
-          *(BX_MEM_THIS get_vector(a20addr)) = *data_ptr;
+          *(BX_MEM_THIS get_vector(a20addr, true)) = *data_ptr;
         } else if ((area >= BX_MEM_AREA_E0000) && BX_MEM_THIS bios_write_enabled) {
           // volatile BIOS write support
           if (BX_MEM_THIS flash_type > 0) {
@@ -256,15 +254,14 @@ void BX_MEM_C::readPhysicalPage(BX_CPU_C *cpu, bx_phy_address addr, unsigned len
     }
   }
 
-  memory_handler = BX_MEM_THIS memory_handlers[a20addr >> 20];
-  while (memory_handler) {
-    if (memory_handler->begin <= a20addr &&
-          memory_handler->end >= a20addr &&
-          memory_handler->read_handler(a20addr, len, data, memory_handler->param))
-    {
-      return;
-    }
-    memory_handler = memory_handler->next;
+  memory_handler = BX_MEM_THIS get_memory_handler(a20addr);
+  if (memory_handler && memory_handler->begin <= a20addr && memory_handler->end >= a20addr)
+  {
+    // device memory handlers are not thread safe
+    bx_pc_system.smp_lock();
+    bool handled = memory_handler->read_handler(a20addr, len, data, memory_handler->param);
+    bx_pc_system.smp_unlock();
+    if (handled) return;
   }
 
 mem_read:
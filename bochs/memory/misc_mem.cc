@@ -26,6 +26,13 @@
 #include "param_names.h"
 #include "cpu/cpu.h"
 #include "iodev/iodev.h"
+#if BX_HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef linux
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
 #define LOG_THIS BX_MEM(0)->
 
 // block size must be power of two
@@ -37,6 +44,8 @@ BX_CPP_INLINE bool is_power_of_2(Bit64u x)
 // alignment of memory vector, must be a power of 2
 #define BX_MEM_VECTOR_ALIGN 4096
 #define BX_MEM_HANDLERS   ((BX_CONST64(1) << BX_PHY_ADDRESS_WIDTH) >> 20) /* one per megabyte */
+// host huge page size, mapped memory vector is rounded and aligned to it
+#define BX_MEM_HUGE_PAGE_SIZE (2*1024*1024)
 
 #if BX_LARGE_RAMFILE
 Bit8u* const BX_MEM_C::swapped_out = ((Bit8u*)NULL - sizeof(Bit8u));
@@ -57,15 +66,21 @@ BX_MEM_C::BX_MEM_C()
 
   vector = NULL;
   actual_vector = NULL;
+  vector_mapped = 0;
+  vector_backing = BX_MEM_BACKING_HEAP;
+  ram_file_created = 0;
   blocks = NULL;
   len    = 0;
   used_blocks = 0;
 
   memory_handlers = NULL;
+  memory_handler_list = NULL;
 
 #if BX_LARGE_RAMFILE
   next_swapout_idx = 0;
   overflow_file = NULL;
+  block_referenced = NULL;
+  block_dirty = NULL;
 #endif
 }
 
@@ -88,6 +103,158 @@ Bit8u* BX_MEM_C::alloc_vector_aligned(Bit64u bytes, Bit64u alignment)
   return vector;
 }
 
+// Map the memory vector from anonymous host memory. The host kernel provides
+// zero filled pages on demand and places them on the NUMA node of the thread
+// touching them first. Returns NULL if the mapping is not possible.
+Bit8u* BX_MEM_C::alloc_vector_mapped(Bit64u bytes, unsigned backing)
+{
+#if BX_HAVE_SYS_MMAN_H
+  Bit64u size = (bytes + BX_MEM_HUGE_PAGE_SIZE - 1) & ~BX_CONST64(BX_MEM_HUGE_PAGE_SIZE - 1);
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+  if (backing == BX_MEM_BACKING_HUGETLB) {
+#ifdef MAP_HUGETLB
+    // huge pages are reserved at mapping time, the mapping fails instead of
+    // SIGBUS on first touch when the hugetlbfs pool is too small
+    flags |= MAP_HUGETLB;
+#else
+    BX_ERROR(("hugetlb memory backing is not supported by the host"));
+    return NULL;
+#endif
+  }
+  else {
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    if (backing == BX_MEM_BACKING_THP)
+      size += BX_MEM_HUGE_PAGE_SIZE; // room for huge page alignment
+  }
+
+  void *ptr = mmap(NULL, (size_t) size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (ptr == MAP_FAILED) {
+    BX_ERROR(("alloc_vector_mapped: unable to map %uMB of host RAM", (unsigned)(size >> 20)));
+    return NULL;
+  }
+  BX_MEM_THIS actual_vector = (Bit8u*) ptr;
+  BX_MEM_THIS vector_mapped = size;
+  BX_MEM_THIS vector_backing = backing;
+
+  Bit8u *vector = (Bit8u*) ptr;
+  if (backing == BX_MEM_BACKING_THP) {
+    vector = (Bit8u*)(((bx_ptr_equiv_t) ptr + BX_MEM_HUGE_PAGE_SIZE - 1) & ~(bx_ptr_equiv_t)(BX_MEM_HUGE_PAGE_SIZE - 1));
+#ifdef MADV_HUGEPAGE
+    if (madvise(vector, (size_t)(size - BX_MEM_HUGE_PAGE_SIZE), MADV_HUGEPAGE) != 0)
+      BX_ERROR(("alloc_vector_mapped: transparent huge pages are not available"));
+#else
+    BX_ERROR(("alloc_vector_mapped: transparent huge pages are not supported by the host"));
+#endif
+  }
+  return vector;
+#else
+  BX_ERROR(("alloc_vector_mapped: mapped memory backing is not supported by the host"));
+  return NULL;
+#endif
+}
+
+void BX_MEM_C::free_vector(void)
+{
+#if BX_HAVE_SYS_MMAN_H
+  if (BX_MEM_THIS vector_mapped) {
+    munmap(BX_MEM_THIS actual_vector, (size_t) BX_MEM_THIS vector_mapped);
+    BX_MEM_THIS vector_mapped = 0;
+    if (BX_MEM_THIS ram_file_created) {
+      unlink(SIM->get_param_string(BXPN_MEM_FILE)->getptr());
+      BX_MEM_THIS ram_file_created = 0;
+    }
+  }
+  else
+#endif
+    delete [] BX_MEM_THIS actual_vector;
+
+  BX_MEM_THIS actual_vector = NULL;
+  BX_MEM_THIS vector = NULL;
+  BX_MEM_THIS vector_backing = BX_MEM_BACKING_HEAP;
+}
+
+#if BX_HAVE_SYS_MMAN_H
+// Map 'bytes' of guest RAM from the file at 'path' over the memory vector.
+// A shared mapping keeps the file in sync with guest RAM, a private mapping
+// leaves the file untouched. Pages are read from the file on first access.
+bool BX_MEM_C::map_ram_file(const char *path, Bit64u bytes, bool shared)
+{
+  int fd = open(path, shared ? (O_RDWR | O_CREAT) : O_RDONLY, 0600);
+  if (fd < 0) {
+    BX_ERROR(("map_ram_file: cannot open '%s'", path));
+    return 0;
+  }
+
+  struct stat stat_buf;
+  if (fstat(fd, &stat_buf) || ((Bit64u) stat_buf.st_size < bytes)) {
+    if (!shared || ftruncate(fd, (off_t) bytes) < 0) {
+      BX_ERROR(("map_ram_file: '%s' is smaller than guest RAM", path));
+      close(fd);
+      return 0;
+    }
+  }
+
+  void *ptr = mmap(BX_MEM_THIS vector, (size_t) bytes, PROT_READ | PROT_WRITE,
+                   (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    BX_PANIC(("map_ram_file: unable to map '%s' as guest RAM", path));
+    return 0;
+  }
+  return 1;
+}
+
+// Copy RAM image file, using a copy-on-write clone of the file if the host
+// filesystem supports it. Zero filled areas are left as holes in the copy.
+static bool copy_ram_file(const char *src, const char *dst)
+{
+  int in = open(src, O_RDONLY);
+  if (in < 0)
+    return 0;
+  int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (out < 0) {
+    close(in);
+    return 0;
+  }
+
+  bool ok = 1;
+#if defined(linux) && defined(FICLONE)
+  if (ioctl(out, FICLONE, in) == 0) {
+    close(in);
+    close(out);
+    return 1;
+  }
+#endif
+
+  const size_t chunk = 1024 * 1024;
+  Bit8u *buffer = new Bit8u[chunk];
+  Bit64u offset = 0;
+  ssize_t ret;
+  while ((ret = read(in, buffer, chunk)) > 0) {
+    size_t n = 0;
+    while (n < (size_t) ret && buffer[n] == 0) n++;
+    if (n == (size_t) ret) {
+      // keep zero filled chunk as hole
+      lseek(out, (off_t) ret, SEEK_CUR);
+    }
+    else if (write(out, buffer, ret) != ret) {
+      ok = 0;
+      break;
+    }
+    offset += ret;
+  }
+  if (ret < 0 || ftruncate(out, (off_t) offset) < 0)
+    ok = 0;
+  delete [] buffer;
+  close(in);
+  close(out);
+  return ok;
+}
+#endif
+
 BX_MEM_C::~BX_MEM_C()
 {
 #if BX_LARGE_RAMFILE
@@ -112,17 +279,43 @@ void BX_MEM_C::init_memory(Bit64u guest, Bit64u host, Bit32u block_size)
 
   if (BX_MEM_THIS actual_vector != NULL) {
     BX_INFO(("freeing existing memory vector"));
-    delete [] BX_MEM_THIS actual_vector;
-    BX_MEM_THIS actual_vector = NULL;
-    BX_MEM_THIS vector = NULL;
+    free_vector();
     BX_MEM_THIS blocks = NULL;
   }
-  BX_MEM_THIS vector = alloc_vector_aligned(host + BIOSROMSZ + EXROMSIZE + 4096, BX_MEM_VECTOR_ALIGN);
+  unsigned backing = SIM->get_param_enum(BXPN_MEM_BACKING)->get();
+  if (backing != BX_MEM_BACKING_HEAP) {
+    BX_MEM_THIS vector = alloc_vector_mapped(host + BIOSROMSZ + EXROMSIZE + 4096, backing);
+    if (BX_MEM_THIS vector == NULL)
+      BX_INFO(("falling back to heap allocated memory"));
+  }
+#if BX_HAVE_SYS_MMAN_H
+  if (BX_MEM_THIS vector != NULL && backing == BX_MEM_BACKING_FILE) {
+    // start with zero filled guest RAM, the file is kept sparse. Never
+    // overwrite existing data, the path might be a file of the user or the
+    // RAM file left by a crashed session.
+    const char *path = SIM->get_param_string(BXPN_MEM_FILE)->getptr();
+    struct stat stat_buf;
+    if (stat(path, &stat_buf) == 0 && stat_buf.st_size > 0) {
+      BX_ERROR(("guest RAM file '%s' exists and is not empty, remove it to use it", path));
+      free_vector();
+      BX_INFO(("falling back to heap allocated memory"));
+    } else if (!map_ram_file(path, host, 1)) {
+      free_vector();
+      BX_INFO(("falling back to heap allocated memory"));
+    } else {
+      BX_INFO(("guest RAM mapped from file '%s', it is removed at exit", path));
+      BX_MEM_THIS ram_file_created = 1;
+    }
+  }
+#endif
+  if (BX_MEM_THIS vector == NULL)
+    BX_MEM_THIS vector = alloc_vector_aligned(host + BIOSROMSZ + EXROMSIZE + 4096, BX_MEM_VECTOR_ALIGN);
   BX_INFO(("allocated memory at %p. after alignment, vector=%p, block_size = %dK",
         BX_MEM_THIS actual_vector, BX_MEM_THIS vector, block_size/1024));
 
   BX_MEM_THIS len = guest;
   BX_MEM_THIS allocated = host;
+  BX_MEM_THIS ram_restored = false;
   BX_MEM_THIS rom = &BX_MEM_THIS vector[host];
   BX_MEM_THIS bogus = &BX_MEM_THIS vector[host + BIOSROMSZ + EXROMSIZE];
   memset(BX_MEM_THIS rom, 0xff, BIOSROMSZ + EXROMSIZE + 4096);
@@ -135,8 +328,21 @@ void BX_MEM_C::init_memory(Bit64u guest, Bit64u host, Bit32u block_size)
   BX_INFO(("%.2fMB", (float)(BX_MEM_THIS len / (1024.0*1024.0))));
   BX_INFO(("mem block size = 0x%08x, blocks=%u", BX_MEM_THIS block_size, num_blocks));
   BX_MEM_THIS blocks = new Bit8u* [num_blocks];
-  if (0) {
-    // all guest memory is allocated, just map it
+#if BX_LARGE_RAMFILE
+  delete [] BX_MEM_THIS block_referenced;
+  delete [] BX_MEM_THIS block_dirty;
+  BX_MEM_THIS block_referenced = NULL;
+  BX_MEM_THIS block_dirty = NULL;
+  if (host < guest) {
+    // state of the block replacement, only required if blocks are swapped out
+    BX_MEM_THIS block_referenced = new Bit8u [num_blocks];
+    BX_MEM_THIS block_dirty = new Bit8u [num_blocks];
+    memset(BX_MEM_THIS block_referenced, 0, num_blocks);
+    memset(BX_MEM_THIS block_dirty, 0, num_blocks);
+  }
+#endif
+  if (BX_MEM_THIS vector_mapped && host >= guest) {
+    // all guest memory is allocated and zero filled on demand by the host, just map it
     for (idx = 0; idx < num_blocks; idx++) {
       BX_MEM_THIS blocks[idx] = BX_MEM_THIS vector + (idx * BX_MEM_THIS block_size);
     }
@@ -150,9 +356,10 @@ void BX_MEM_C::init_memory(Bit64u guest, Bit64u host, Bit32u block_size)
     BX_MEM_THIS used_blocks = 0;
   }
 
-  BX_MEM_THIS memory_handlers = new struct memory_handler_struct *[BX_MEM_HANDLERS];
+  BX_MEM_THIS memory_handlers = new struct memory_handler_struct **[BX_MEM_HANDLERS];
   for (idx = 0; idx < BX_MEM_HANDLERS; idx++)
     BX_MEM_THIS memory_handlers[idx] = NULL;
+  BX_MEM_THIS memory_handler_list = NULL;
 
   BX_MEM_THIS pci_enabled = SIM->get_param_bool(BXPN_PCI_ENABLED)->get();
   BX_MEM_THIS bios_write_enabled = false;
@@ -175,7 +382,7 @@ void BX_MEM_C::init_memory(Bit64u guest, Bit64u host, Bit32u block_size)
   BX_MEM_THIS register_state();
 }
 
-Bit8u* BX_MEM_C::get_vector(bx_phy_address addr)
+Bit8u* BX_MEM_C::get_vector(bx_phy_address addr, bool write)
 {
   Bit32u block = (Bit32u)(addr / BX_MEM_THIS block_size);
 #if (BX_LARGE_RAMFILE)
@@ -183,23 +390,105 @@ Bit8u* BX_MEM_C::get_vector(bx_phy_address addr)
 #else
   if (!BX_MEM_THIS blocks[block])
 #endif
-    allocate_block(block);
+  {
+    bx_pc_system.smp_lock();
+    // the block could be allocated by another CPU thread meanwhile
+#if (BX_LARGE_RAMFILE)
+    if (!BX_MEM_THIS blocks[block] || (BX_MEM_THIS blocks[block] == BX_MEM_THIS swapped_out))
+#else
+    if (!BX_MEM_THIS blocks[block])
+#endif
+      allocate_block(block);
+    bx_pc_system.smp_unlock();
+  }
+
+#if BX_LARGE_RAMFILE
+  if (BX_MEM_THIS block_referenced) {
+    BX_MEM_THIS block_referenced[block] = 1;
+    if (write)
+      BX_MEM_THIS block_dirty[block] = 1;
+  }
+#endif
 
   return BX_MEM_THIS blocks[block] + (Bit32u)(addr & (BX_MEM_THIS block_size-1));
 }
 
 #if BX_LARGE_RAMFILE
+// Load a block from the overflow file. The parts of the file never written
+// read as zero, the block is clean afterwards.
 void BX_MEM_C::read_block(Bit32u block)
 {
   const Bit64u block_address = Bit64u(block) * BX_MEM_THIS block_size;
+  Bit8u *buffer = BX_MEM_THIS blocks[block];
+  Bit32u done = 0;
 
-  if (fseeko64(BX_MEM_THIS overflow_file, block_address, SEEK_SET))
-    BX_PANIC(("FATAL ERROR: Could not seek to 0x" FMT_LL "x in memory overflow file!", block_address));
+  if (!BX_MEM_THIS overflow_file) {
+    // nothing swapped out yet
+  }
+#ifndef WIN32
+  else {
+    int fd = fileno(BX_MEM_THIS overflow_file);
+    while (done < BX_MEM_THIS block_size) {
+      ssize_t ret = pread(fd, buffer + done, BX_MEM_THIS block_size - done, (off_t)(block_address + done));
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        BX_PANIC(("FATAL ERROR: Could not read from 0x" FMT_LL "x in memory overflow file!", block_address));
+        break;
+      }
+      // We could legitimately get an EOF condition if we are reading the last bit of memory.ram
+      if (ret == 0) break;
+      done += (Bit32u) ret;
+    }
+  }
+#else
+  else {
+    if (fseeko64(BX_MEM_THIS overflow_file, block_address, SEEK_SET))
+      BX_PANIC(("FATAL ERROR: Could not seek to 0x" FMT_LL "x in memory overflow file!", block_address));
 
-  // We could legitimately get an EOF condition if we are reading the last bit of memory.ram
-  if ((fread(BX_MEM_THIS blocks[block], BX_MEM_THIS block_size, 1, BX_MEM_THIS overflow_file) != 1) &&
-      (!feof(BX_MEM_THIS overflow_file)))
-    BX_PANIC(("FATAL ERROR: Could not read from 0x" FMT_LL "x in memory overflow file!", block_address));
+    // We could legitimately get an EOF condition if we are reading the last bit of memory.ram
+    done = (Bit32u) fread(buffer, 1, BX_MEM_THIS block_size, BX_MEM_THIS overflow_file);
+    if ((done < BX_MEM_THIS block_size) && ferror(BX_MEM_THIS overflow_file))
+      BX_PANIC(("FATAL ERROR: Could not read from 0x" FMT_LL "x in memory overflow file!", block_address));
+  }
+#endif
+  if (done < BX_MEM_THIS block_size)
+    memset(buffer + done, 0, BX_MEM_THIS block_size - done);
+  if (BX_MEM_THIS block_dirty)
+    BX_MEM_THIS block_dirty[block] = 0;
+}
+
+// Write back a block to the overflow file, the block is clean afterwards.
+void BX_MEM_C::write_block(Bit32u block)
+{
+  const Bit64u block_address = Bit64u(block) * BX_MEM_THIS block_size;
+  const Bit8u *buffer = BX_MEM_THIS blocks[block];
+
+  // Create overflow file if it does not currently exist.
+  if (!BX_MEM_THIS overflow_file) {
+    BX_MEM_THIS overflow_file = tmpfile64();
+    if (!BX_MEM_THIS overflow_file)
+      BX_PANIC(("Unable to allocate memory overflow file"));
+  }
+#ifndef WIN32
+  int fd = fileno(BX_MEM_THIS overflow_file);
+  Bit32u done = 0;
+  while (done < BX_MEM_THIS block_size) {
+    ssize_t ret = pwrite(fd, buffer + done, BX_MEM_THIS block_size - done, (off_t)(block_address + done));
+    if (ret <= 0) {
+      if (ret < 0 && errno == EINTR) continue;
+      BX_PANIC(("FATAL ERROR: Could not write at 0x" FMT_LL "x in overflow file!", block_address));
+      break;
+    }
+    done += (Bit32u) ret;
+  }
+#else
+  if (fseeko64(BX_MEM_THIS overflow_file, block_address, SEEK_SET))
+    BX_PANIC(("FATAL ERROR: Could not seek to 0x" FMT_LL "x in overflow file!", block_address));
+  if (1 != fwrite(buffer, BX_MEM_THIS block_size, 1, BX_MEM_THIS overflow_file))
+    BX_PANIC(("FATAL ERROR: Could not write at 0x" FMT_LL "x in overflow file!", block_address));
+#endif
+  if (BX_MEM_THIS block_dirty)
+    BX_MEM_THIS block_dirty[block] = 0;
 }
 #endif
 
@@ -213,48 +502,51 @@ void BX_MEM_C::allocate_block(Bit32u block)
    * First, see if there is any spare host memory blocks we can still freely allocate
    */
   if (BX_MEM_THIS used_blocks >= max_blocks) {
-    Bit32u original_replacement_block = BX_MEM_THIS next_swapout_idx;
-    // Find a block to replace
-    bool used_for_tlb;
+    const Bit32u num_blocks = (Bit32u)(BX_MEM_THIS len / BX_MEM_THIS block_size);
+    Bit64u scanned = 0;
+    Bit32u victim;
     Bit8u *buffer;
-    do {
-      do {
-        // Wrap if necessary
-        if (++(BX_MEM_THIS next_swapout_idx)==((BX_MEM_THIS len)/BX_MEM_THIS block_size))
-          BX_MEM_THIS next_swapout_idx = 0;
-        if (BX_MEM_THIS next_swapout_idx == original_replacement_block)
-          BX_PANIC(("FATAL ERROR: Insufficient working RAM, all blocks are currently used for TLB entries!"));
-        buffer = BX_MEM_THIS blocks[BX_MEM_THIS next_swapout_idx];
-      } while ((!buffer) || (buffer == BX_MEM_C::swapped_out));
-
-      used_for_tlb = false;
+    // Find a block to replace using the clock algorithm. Blocks accessed since
+    // the last visit of the clock hand get a second chance, the second sweep
+    // ignores the referenced bits to make sure the search terminates.
+    for (;;) {
+      // Wrap if necessary
+      if (++(BX_MEM_THIS next_swapout_idx) == num_blocks)
+        BX_MEM_THIS next_swapout_idx = 0;
+      if (++scanned > 2 * (Bit64u) num_blocks)
+        BX_PANIC(("FATAL ERROR: Insufficient working RAM, all blocks are currently used for TLB entries!"));
+      victim = BX_MEM_THIS next_swapout_idx;
+      buffer = BX_MEM_THIS blocks[victim];
+      if ((!buffer) || (buffer == BX_MEM_C::swapped_out))
+        continue;
+      if (BX_MEM_THIS block_referenced[victim] && scanned <= num_blocks) {
+        BX_MEM_THIS block_referenced[victim] = 0;
+        continue;
+      }
+
+      bool used_for_tlb = false;
       // tlb buffer check loop
       const Bit8u* buffer_end = buffer+BX_MEM_THIS block_size;
       // Don't replace it if any CPU is using it as a TLB entry
       for (int i=0; i<BX_SMP_PROCESSORS && !used_for_tlb;i++)
         used_for_tlb = BX_CPU(i)->check_addr_in_tlb_buffers(buffer, buffer_end);
-    } while (used_for_tlb);
-    // Flush the block to be replaced
-    bx_phy_address address = bx_phy_address(BX_MEM_THIS next_swapout_idx) * BX_MEM_THIS block_size;
-    // Create overflow file if it does not currently exist.
-    if (!BX_MEM_THIS overflow_file) {
-      BX_MEM_THIS overflow_file = tmpfile64();
-      if (!BX_MEM_THIS overflow_file)
-        BX_PANIC(("Unable to allocate memory overflow file"));
+      if (! used_for_tlb) break;
     }
-    // Write swapped out block
-    if (fseeko64(BX_MEM_THIS overflow_file, address, SEEK_SET))
-      BX_PANIC(("FATAL ERROR: Could not seek to 0x" FMT_PHY_ADDRX " in overflow file!", address));
-    if (1 != fwrite (BX_MEM_THIS blocks[BX_MEM_THIS next_swapout_idx], BX_MEM_THIS block_size, 1, BX_MEM_THIS overflow_file))
-      BX_PANIC(("FATAL ERROR: Could not write at 0x" FMT_PHY_ADDRX " in overflow file!", address));
+    // Flush the block to be replaced, a clean block is unchanged in the overflow file
+    bool dirty = BX_MEM_THIS block_dirty[victim] != 0;
+    if (dirty)
+      write_block(victim);
     // Mark swapped out block
-    BX_MEM_THIS blocks[BX_MEM_THIS next_swapout_idx] = BX_MEM_C::swapped_out;
+    BX_MEM_THIS blocks[victim] = BX_MEM_C::swapped_out;
     BX_MEM_THIS blocks[block] = buffer;
     read_block(block);
-    BX_DEBUG(("allocate_block: block=0x%x, replaced 0x%x", block, BX_MEM_THIS next_swapout_idx));
+    BX_DEBUG(("allocate_block: block=0x%x, replaced 0x%x%s", block, victim, dirty ? " (written back)" : ""));
   }
   else {
     BX_MEM_THIS blocks[block] = BX_MEM_THIS vector + (BX_MEM_THIS used_blocks++ * BX_MEM_THIS block_size);
+    // not in the overflow file yet
+    if (BX_MEM_THIS block_dirty)
+      BX_MEM_THIS block_dirty[block] = 1;
     BX_DEBUG(("allocate_block: block=0x%x used 0x%x of 0x%x",
           block, BX_MEM_THIS used_blocks, max_blocks));
   }
@@ -272,11 +564,13 @@ void BX_MEM_C::allocate_block(Bit32u block)
 }
 
 #if BX_LARGE_RAMFILE
-// The blocks in RAM must also be flushed to the save file.
+// The blocks in RAM must also be flushed to the save file. The save file
+// is a copy of the overflow file, clean blocks are already up to date.
 void ramfile_save_handler(void *devptr, FILE *fp)
 {
   for (Bit32u idx = 0; idx < (BX_MEM(0)->len / BX_MEM_THIS block_size); idx++) {
-    if ((BX_MEM(0)->blocks[idx]) && (BX_MEM(0)->blocks[idx] != BX_MEM(0)->swapped_out))
+    if ((BX_MEM(0)->blocks[idx]) && (BX_MEM(0)->blocks[idx] != BX_MEM(0)->swapped_out) &&
+        (!BX_MEM(0)->block_dirty || BX_MEM(0)->block_dirty[idx]))
     {
       bx_phy_address address = bx_phy_address(idx) * BX_MEM_THIS block_size;
       if (fseeko64(fp, address, SEEK_SET))
@@ -288,6 +582,54 @@ void ramfile_save_handler(void *devptr, FILE *fp)
 }
 #endif
 
+#if BX_HAVE_SYS_MMAN_H
+// The RAM image in the save file is in guest physical order, mapping it
+// requires guest memory blocks to be assigned in order to the vector.
+#define RAM_DIRECTLY_MAPPED \
+  (BX_MEM(0)->vector_mapped && (BX_MEM(0)->allocated >= BX_MEM(0)->len))
+
+// Save guest RAM by flushing the shared file mapping and copying the file.
+bool ram_mapped_save_handler(void *devptr, const char *path)
+{
+  if (BX_MEM(0)->vector_backing != BX_MEM_BACKING_FILE || !RAM_DIRECTLY_MAPPED)
+    return 0;
+
+  if (msync(BX_MEM(0)->vector, (size_t) BX_MEM(0)->allocated, MS_SYNC) < 0) {
+    BX_ERROR(("ram_mapped_save_handler: msync failed"));
+    return 0;
+  }
+  if (! copy_ram_file(SIM->get_param_string(BXPN_MEM_FILE)->getptr(), path)) {
+    BX_ERROR(("ram_mapped_save_handler: failed to copy RAM file to '%s'", path));
+    return 0;
+  }
+  return 1;
+}
+
+// Restore guest RAM by mapping the saved RAM image, the pages are loaded on demand.
+bool ram_mapped_restore_handler(void *devptr, const char *path)
+{
+  if (! RAM_DIRECTLY_MAPPED || BX_MEM(0)->vector_backing == BX_MEM_BACKING_HUGETLB)
+    return 0;
+
+  if (BX_MEM(0)->vector_backing == BX_MEM_BACKING_FILE) {
+    // replace the RAM file by a copy of the saved image and map it shared
+    char tmppath[BX_PATHNAME_LEN];
+    const char *ram_file = SIM->get_param_string(BXPN_MEM_FILE)->getptr();
+    snprintf(tmppath, BX_PATHNAME_LEN, "%s.tmp", ram_file);
+    if (! copy_ram_file(path, tmppath) || rename(tmppath, ram_file) < 0) {
+      BX_ERROR(("ram_mapped_restore_handler: failed to copy '%s' to RAM file", path));
+      return 0;
+    }
+    BX_MEM(0)->ram_restored = BX_MEM(0)->map_ram_file(ram_file, BX_MEM(0)->allocated, 1);
+  }
+  else {
+    // anonymous mapping: copy-on-write mapping of the saved image
+    BX_MEM(0)->ram_restored = BX_MEM(0)->map_ram_file(path, BX_MEM(0)->allocated, 0);
+  }
+  return BX_MEM(0)->ram_restored;
+}
+#endif
+
 // Note: This must be called before the memory file save handler is called.
 Bit64s memory_param_save_handler(void *devptr, bx_param_c *param)
 {
@@ -326,7 +668,8 @@ void memory_param_restore_handler(void *devptr, bx_param_c *param, Bit64s val)
       }
       BX_MEM(0)->blocks[blk_index] = BX_MEM(0)->vector + val * BX_MEM_THIS block_size;
 #if BX_LARGE_RAMFILE
-      BX_MEM(0)->read_block(blk_index);
+      if (! BX_MEM(0)->ram_restored)
+        BX_MEM(0)->read_block(blk_index);
 #endif
   }
 }
@@ -340,9 +683,15 @@ void BX_MEM_C::register_state()
 #if BX_LARGE_RAMFILE
   bx_shadow_filedata_c *ramfile = new bx_shadow_filedata_c(list, "ram", &(BX_MEM_THIS overflow_file));
   ramfile->set_sr_handlers(this, ramfile_save_handler, (filedata_restore_handler)NULL);
+#if BX_HAVE_SYS_MMAN_H
+  ramfile->set_sr_path_handlers(ram_mapped_save_handler, ram_mapped_restore_handler);
+#endif
   BXRS_DEC_PARAM_FIELD(list, next_swapout_idx, BX_MEM_THIS next_swapout_idx);
 #else
-  new bx_shadow_data_c(list, "ram", BX_MEM_THIS vector, BX_MEM_THIS allocated);
+  bx_shadow_data_c *ramdata = new bx_shadow_data_c(list, "ram", BX_MEM_THIS vector, BX_MEM_THIS allocated);
+#if BX_HAVE_SYS_MMAN_H
+  ramdata->set_sr_handlers(this, ram_mapped_save_handler, ram_mapped_restore_handler);
+#endif
 #endif
   BXRS_DEC_PARAM_FIELD(list, used_blocks, BX_MEM_THIS used_blocks);
 
@@ -369,27 +718,30 @@ void BX_MEM_C::cleanup_memory()
   unsigned idx;
 
   if (BX_MEM_THIS vector != NULL) {
-    delete [] BX_MEM_THIS actual_vector;
-    BX_MEM_THIS actual_vector = NULL;
-    BX_MEM_THIS vector = NULL;
+    free_vector();
     BX_MEM_THIS rom = NULL;
     BX_MEM_THIS bogus = NULL;
     delete [] BX_MEM_THIS blocks;
     BX_MEM_THIS blocks = 0;
     BX_MEM_THIS used_blocks = 0;
+#if BX_LARGE_RAMFILE
+    delete [] BX_MEM_THIS block_referenced;
+    delete [] BX_MEM_THIS block_dirty;
+    BX_MEM_THIS block_referenced = NULL;
+    BX_MEM_THIS block_dirty = NULL;
+#endif
     if (BX_MEM_THIS memory_handlers != NULL) {
       for (idx = 0; idx < BX_MEM_HANDLERS; idx++) {
-        struct memory_handler_struct *memory_handler = BX_MEM_THIS memory_handlers[idx];
-        struct memory_handler_struct *prev = NULL;
-        while (memory_handler) {
-          prev = memory_handler;
-          memory_handler = memory_handler->next;
-          delete prev;
-        }
+        delete [] BX_MEM_THIS memory_handlers[idx];
       }
       delete [] BX_MEM_THIS memory_handlers;
       BX_MEM_THIS memory_handlers = NULL;
     }
+    while (BX_MEM_THIS memory_handler_list) {
+      struct memory_handler_struct *memory_handler = BX_MEM_THIS memory_handler_list;
+      BX_MEM_THIS memory_handler_list = memory_handler->next;
+      delete memory_handler;
+    }
   }
 }
 
@@ -582,7 +934,7 @@ void BX_MEM_C::load_RAM(const char *path, bx_phy_address ramaddress)
 
   offset = (unsigned long)ramaddress;
   while (size > 0) {
-    ret = read(fd, (bx_ptr_t) BX_MEM_THIS get_vector(offset), size);
+    ret = read(fd, (bx_ptr_t) BX_MEM_THIS get_vector(offset, true), size);
     if (ret <= 0) {
       BX_PANIC(("RAM: read failed on RAM image: '%s'",path));
     }
@@ -614,16 +966,11 @@ bool BX_MEM_C::dbg_fetch_mem(BX_CPU_C *cpu, bx_phy_address addr, unsigned len, B
       use_smram = true;
   }
 
-  memory_handler = BX_MEM_THIS memory_handlers[a20addr >> 20];
-  while (memory_handler) {
-    if (memory_handler->begin <= a20addr && memory_handler->end >= a20addr)
-    {
-      if (!use_smram) {
-        use_memory_handler = true;
-        break;
-      }
-    }
-    memory_handler = memory_handler->next;
+  memory_handler = BX_MEM_THIS get_memory_handler(a20addr);
+  if (memory_handler && !use_smram &&
+      memory_handler->begin <= a20addr && memory_handler->end >= a20addr)
+  {
+    use_memory_handler = true;
   }
 
   for (; len>0; len--) {
@@ -713,16 +1060,11 @@ bool BX_MEM_C::dbg_set_mem(BX_CPU_C *cpu, bx_phy_address addr, unsigned len, Bit
       use_smram = true;
   }
 
-  memory_handler = BX_MEM_THIS memory_handlers[a20addr >> 20];
-  while (memory_handler) {
-    if (memory_handler->begin <= a20addr && memory_handler->end >= a20addr)
-    {
-      if (!use_smram) {
-        use_memory_handler = true;
-        break;
-      }
-    }
-    memory_handler = memory_handler->next;
+  memory_handler = BX_MEM_THIS get_memory_handler(a20addr);
+  if (memory_handler && !use_smram &&
+      memory_handler->begin <= a20addr && memory_handler->end >= a20addr)
+  {
+    use_memory_handler = true;
   }
 
   for (; len>0; len--) {
@@ -735,7 +1077,7 @@ bool BX_MEM_C::dbg_set_mem(BX_CPU_C *cpu, bx_phy_address addr, unsigned len, Bit
       if (area > BX_MEM_AREA_F0000) area = BX_MEM_AREA_F0000;
       if (BX_MEM_THIS memory_type[area][1] == true) {
         // Write to ShadowRAM
-        *(BX_MEM_THIS get_vector(a20addr)) = *buf;
+        *(BX_MEM_THIS get_vector(a20addr, true)) = *buf;
       } else {
         // Ignore write to ROM
       }
@@ -743,7 +1085,7 @@ bool BX_MEM_C::dbg_set_mem(BX_CPU_C *cpu, bx_phy_address addr, unsigned len, Bit
 #endif  // #if BX_SUPPORT_PCI
     else if ((a20addr < 0x000c0000 || a20addr >= 0x00100000) && !is_bios)
     {
-      *(BX_MEM_THIS get_vector(a20addr)) = *buf;
+      *(BX_MEM_THIS get_vector(a20addr, true)) = *buf;
     }
     buf++;
     a20addr++;
@@ -825,16 +1167,19 @@ Bit8u *BX_MEM_C::getHostMemAddr(BX_CPU_C *cpu, bx_phy_address addr, unsigned rw)
   }
 #endif
 
-  struct memory_handler_struct *memory_handler = BX_MEM_THIS memory_handlers[a20addr >> 20];
-  while (memory_handler) {
-    if (memory_handler->begin <= a20addr &&
+  struct memory_handler_struct *memory_handler = BX_MEM_THIS get_memory_handler(a20addr);
+  if (memory_handler) {
+    // the handler owns the whole 4K page, direct access is not possible
+    // unless the device provides it
+    if (memory_handler->da_handler && memory_handler->begin <= a20addr &&
         memory_handler->end >= a20addr) {
-      if (memory_handler->da_handler)
-        return memory_handler->da_handler(a20addr, rw, memory_handler->param);
-      else
-        return(NULL); // Vetoed! memory handler for i/o apic, vram, mmio and PCI PnP
+      bx_pc_system.smp_lock();
+      Bit8u *ptr = memory_handler->da_handler(a20addr, rw, memory_handler->param);
+      bx_pc_system.smp_unlock();
+      return ptr;
     }
-    memory_handler = memory_handler->next;
+    else
+      return(NULL); // Vetoed! memory handler for i/o apic, vram, mmio and PCI PnP
   }
 
   if (! write) {
@@ -906,7 +1251,7 @@ Bit8u *BX_MEM_C::getHostMemAddr(BX_CPU_C *cpu, bx_phy_address addr, unsigned rw)
     else
     {
       if (a20addr < 0x000c0000 || a20addr >= 0x00100000) {
-        return BX_MEM_THIS get_vector(a20addr);
+        return BX_MEM_THIS get_vector(a20addr, true);
       }
       else {
         return(NULL);  // Vetoed!  ROMs
@@ -923,75 +1268,70 @@ BX_MEM_C::registerMemoryHandlers(void *param, memory_handler_t read_handler,
                 memory_handler_t write_handler, memory_direct_access_handler_t da_handler,
                 bx_phy_address begin_addr, bx_phy_address end_addr)
 {
+  bx_phy_address page;
+
   if (end_addr < begin_addr)
     return 0;
   if (!read_handler) // allow NULL write and fetch handler
     return 0;
   BX_INFO(("Register memory access handlers: 0x" FMT_PHY_ADDRX " - 0x" FMT_PHY_ADDRX, begin_addr, end_addr));
-  for (Bit32u page_idx = (Bit32u)(begin_addr >> 20); page_idx <= (Bit32u)(end_addr >> 20); page_idx++) {
-    Bit16u bitmap = 0xffff;
-    if (begin_addr > (page_idx << 20)) {
-      bitmap &= (0xffff << ((begin_addr >> 16) & 0xf));
+  // a 4K page can only be owned by a single handler
+  for (page = begin_addr >> 12; page <= (end_addr >> 12); page++) {
+    if (BX_MEM_THIS get_memory_handler(page << 12) != NULL) {
+      BX_ERROR(("Register failed: overlapping memory handlers!"));
+      return 0;
     }
-    if (end_addr < ((page_idx + 1) << 20)) {
-      bitmap &= (0xffff >> (0x0f - ((end_addr >> 16) & 0xf)));
-    }
-    if (BX_MEM_THIS memory_handlers[page_idx] != NULL) {
-      if ((bitmap & BX_MEM_THIS memory_handlers[page_idx]->bitmap) != 0) {
-        BX_ERROR(("Register failed: overlapping memory handlers!"));
-        return 0;
-      } else {
-        bitmap |= BX_MEM_THIS memory_handlers[page_idx]->bitmap;
-      }
+  }
+  struct memory_handler_struct *memory_handler = new struct memory_handler_struct;
+  memory_handler->next = BX_MEM_THIS memory_handler_list;
+  BX_MEM_THIS memory_handler_list = memory_handler;
+  memory_handler->read_handler = read_handler;
+  memory_handler->write_handler = write_handler;
+  memory_handler->da_handler = da_handler;
+  memory_handler->param = param;
+  memory_handler->begin = begin_addr;
+  memory_handler->end = end_addr;
+  for (page = begin_addr >> 12; page <= (end_addr >> 12); page++) {
+    struct memory_handler_struct **pages = BX_MEM_THIS memory_handlers[page >> 8];
+    if (pages == NULL) {
+      pages = new struct memory_handler_struct *[BX_MEM_HANDLER_PAGES];
+      for (unsigned n = 0; n < BX_MEM_HANDLER_PAGES; n++)
+        pages[n] = NULL;
+      BX_MEM_THIS memory_handlers[page >> 8] = pages;
     }
-    struct memory_handler_struct *memory_handler = new struct memory_handler_struct;
-    memory_handler->next = BX_MEM_THIS memory_handlers[page_idx];
-    BX_MEM_THIS memory_handlers[page_idx] = memory_handler;
-    memory_handler->read_handler = read_handler;
-    memory_handler->write_handler = write_handler;
-    memory_handler->da_handler = da_handler;
-    memory_handler->param = param;
-    memory_handler->begin = begin_addr;
-    memory_handler->end = end_addr;
-    memory_handler->bitmap = bitmap;
+    pages[page & (BX_MEM_HANDLER_PAGES-1)] = memory_handler;
   }
   return 1;
 }
 
 bool BX_MEM_C::unregisterMemoryHandlers(void *param, bx_phy_address begin_addr, bx_phy_address end_addr)
 {
-  bool ret = true;
+  bx_phy_address page;
+
   BX_INFO(("Memory access handlers unregistered: 0x" FMT_PHY_ADDRX " - 0x" FMT_PHY_ADDRX, begin_addr, end_addr));
-  for (Bit32u page_idx = (Bit32u)(begin_addr >> 20); page_idx <= (Bit32u)(end_addr >> 20); page_idx++) {
-    Bit16u bitmap = 0xffff;
-    if (begin_addr > (page_idx << 20)) {
-      bitmap &= (0xffff << ((begin_addr >> 16) & 0xf));
-    }
-    if (end_addr < ((page_idx + 1) << 20)) {
-      bitmap &= (0xffff >> (0x0f - ((end_addr >> 16) & 0xf)));
-    }
-    struct memory_handler_struct *memory_handler = BX_MEM_THIS memory_handlers[page_idx];
-    struct memory_handler_struct *prev = NULL;
-    while (memory_handler &&
-         memory_handler->param != param &&
-         memory_handler->begin != begin_addr &&
-         memory_handler->end != end_addr)
-    {
-      memory_handler->bitmap &= ~bitmap;
-      prev = memory_handler;
-      memory_handler = memory_handler->next;
-    }
-    if (!memory_handler) {
-      ret = false;  // we should have found it
-      continue; // anyway, try the other pages
-    }
-    if (prev)
-      prev->next = memory_handler->next;
-    else
-      BX_MEM_THIS memory_handlers[page_idx] = memory_handler->next;
-    delete memory_handler;
+  struct memory_handler_struct *memory_handler = BX_MEM_THIS memory_handler_list;
+  struct memory_handler_struct *prev = NULL;
+  while (memory_handler &&
+         (memory_handler->param != param ||
+          memory_handler->begin != begin_addr ||
+          memory_handler->end != end_addr))
+  {
+    prev = memory_handler;
+    memory_handler = memory_handler->next;
   }
-  return ret;
+  if (!memory_handler)
+    return false;  // we should have found it
+  if (prev)
+    prev->next = memory_handler->next;
+  else
+    BX_MEM_THIS memory_handler_list = memory_handler->next;
+  for (page = begin_addr >> 12; page <= (end_addr >> 12); page++) {
+    struct memory_handler_struct **pages = BX_MEM_THIS memory_handlers[page >> 8];
+    if (pages[page & (BX_MEM_HANDLER_PAGES-1)] == memory_handler)
+      pages[page & (BX_MEM_HANDLER_PAGES-1)] = NULL;
+  }
+  delete memory_handler;
+  return true;
 }
 
 void BX_MEM_C::enable_smram(bool enable, bool restricted)
@@ -1142,6 +1482,9 @@ bool BX_MEM_C::is_monitor(bx_phy_address begin_addr, unsigned len)
 
 void BX_MEM_C::check_monitor(bx_phy_address begin_addr, unsigned len)
 {
+  // MWAIT never sleeps when CPUs run on host threads, nothing to wake up
+  if (bx_pc_system.smp_parallel) return;
+
   for (int i=0; i<BX_SMP_PROCESSORS;i++) {
     BX_CPU(i)->check_monitor(begin_addr, len);
   }
@@ -45,7 +45,9 @@ extern "C" {
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
+#include <fcntl.h>
 #define closesocket(s)    close(s)
 typedef int SOCKET;
 #endif
@@ -67,10 +69,13 @@ typedef int SOCKET;
 
 #include "misc/bxcompat.h"
 #include "osdep.h"
+#include "bxthread.h"
 #include "iodev/network/netmod.h"
 #include "iodev/network/netutil.h"
+#include "iodev/network/netshm.h"
 
 #define BXHUB_MAX_CLIENTS 6
+#define BXHUB_MAC_TABLE_SIZE 256 // power of 2
 
 typedef struct {
   Bit8u      id;
@@ -81,8 +86,20 @@ typedef struct {
   Bit8u      default_ipv4addr[4];
   Bit8u      *reply_buffer;
   unsigned   pending_reply_size;
+#if BX_NETSHM
+  bx_netshm_t *shm;
+  BX_MUTEX(shm_lock);     // more than one thread may send to this client
+#endif
+  BX_THREAD_VAR(thread);  // receives the frames of this client
 } hub_client_t;
 
+// learned MAC addresses (open addressing)
+typedef struct {
+  Bit8u macaddr[6];
+  Bit8u valid;
+  Bit8u client;
+} hub_mac_entry_t;
+
 const Bit8u default_host_macaddr[6] = {0xb0, 0xc4, 0x20, 0x00, 0x00, 0x0f};
 const Bit8u default_net_ipv4addr[4] = {10, 0, 2, 0};
 const Bit8u default_host_ipv4addr[4] = {10, 0, 2, 2};
@@ -102,15 +119,40 @@ static dhcp_cfg_t dhcp;
 static vnet_server_c vnet_server;
 int bx_loglev;
 static char bx_logfname[BX_PATHNAME_LEN];
+static char shm_dir[BX_PATHNAME_LEN];
+static hub_mac_entry_t mac_table[BXHUB_MAC_TABLE_SIZE];
+static unsigned mac_entries;
+static BX_MUTEX(mac_lock);
+static BX_MUTEX(vnet_lock);  // the builtin server is not thread-safe
 
 
+void send_packet(hub_client_t *client, const Bit8u *buf, unsigned len)
+{
+#if BX_NETSHM
+  if (client->shm != NULL) {
+    // frames are dropped if the client does not keep up
+    BX_LOCK(client->shm_lock);
+    netshm_put(&client->shm->to_client, buf, len);
+    BX_UNLOCK(client->shm_lock);
+    return;
+  }
+#endif
+  sendto(client->so, (const char*)buf, len, (MSG_NOSIGNAL|MSG_DONTWAIT),
+         (struct sockaddr*) &client->sout, sizeof(client->sout));
+}
+
+// handle a frame for the builtin server and send its replies to the client
 bool handle_packet(hub_client_t *client, Bit8u *buf, unsigned len)
 {
   ethernet_header_t *ethhdr = (ethernet_header_t *)buf;
+  bool reply;
 
+  BX_LOCK(vnet_lock);
   if (!client->init) {
     if (memcmp(ethhdr->src_mac_addr, host_macaddr, 6) == 0) {
       client->init = -1;
+      BX_UNLOCK(vnet_lock);
+      fprintf(stderr, "bxhub - wrong MAC address configuration\n");
       return 0;
     } else {
       client->sout.sin_addr.s_addr = client->sin.sin_addr.s_addr;
@@ -120,17 +162,21 @@ bool handle_packet(hub_client_t *client, Bit8u *buf, unsigned len)
       client->reply_buffer = new Bit8u[BX_PACKET_BUFSIZE];
       client->init = 1;
     }
+  } else if (client->init < 0) {
+    BX_UNLOCK(vnet_lock);
+    return 0;
   }
 
   vnet_server.handle_packet(buf, len);
   client->pending_reply_size = vnet_server.get_packet(client->reply_buffer);
-  return (client->pending_reply_size > 0);
-}
-
-void send_packet(hub_client_t *client, Bit8u *buf, unsigned len)
-{
-  sendto(client->so, (char*)buf, len, (MSG_NOSIGNAL|MSG_DONTWAIT),
-         (struct sockaddr*) &client->sout, sizeof(client->sout));
+  reply = (client->pending_reply_size > 0);
+  while (client->pending_reply_size > 0) {
+    send_packet(client, client->reply_buffer, client->pending_reply_size);
+    // check for another pending packet
+    client->pending_reply_size = vnet_server.get_packet(client->reply_buffer);
+  }
+  BX_UNLOCK(vnet_lock);
+  return reply;
 }
 
 void broadcast_packet(int clientid, Bit8u *buf, unsigned len)
@@ -144,18 +190,161 @@ void broadcast_packet(int clientid, Bit8u *buf, unsigned len)
   }
 }
 
-bool find_client(Bit8u *dst_mac_addr, int *clientid)
+BX_CPP_INLINE unsigned mac_hash(const Bit8u *macaddr)
 {
-  *clientid = -1;
-  for (int i = 0; i < client_max; i++) {
-    if (hclient[i].init) {
-      if (memcmp(dst_mac_addr, hclient[i].macaddr, ETHERNET_MAC_ADDR_LEN) == 0) {
-        *clientid = i;
-        break;
+  unsigned hash = 0;
+
+  for (int i = 0; i < ETHERNET_MAC_ADDR_LEN; i++) {
+    hash = (hash * 31) + macaddr[i];
+  }
+  return hash & (BXHUB_MAC_TABLE_SIZE - 1);
+}
+
+// returns the entry of the MAC address or the free entry to use for it
+hub_mac_entry_t *mac_table_slot(const Bit8u *macaddr)
+{
+  unsigned i = mac_hash(macaddr);
+
+  while (mac_table[i].valid) {
+    if (memcmp(mac_table[i].macaddr, macaddr, ETHERNET_MAC_ADDR_LEN) == 0)
+      break;
+    i = (i + 1) & (BXHUB_MAC_TABLE_SIZE - 1);
+  }
+  return &mac_table[i];
+}
+
+// remember the port of a source MAC address
+void learn_client(const Bit8u *src_mac_addr, int clientid)
+{
+  hub_mac_entry_t *entry;
+
+  if (src_mac_addr[0] & 0x01) // multicast
+    return;
+  BX_LOCK(mac_lock);
+  entry = mac_table_slot(src_mac_addr);
+  if (entry->valid) {
+    entry->client = (Bit8u)clientid;
+  } else if (mac_entries < (BXHUB_MAC_TABLE_SIZE / 2)) {
+    memcpy(entry->macaddr, src_mac_addr, ETHERNET_MAC_ADDR_LEN);
+    entry->client = (Bit8u)clientid;
+    entry->valid = 1;
+    mac_entries++;
+  }
+  BX_UNLOCK(mac_lock);
+}
+
+bool find_client(const Bit8u *dst_mac_addr, int *clientid)
+{
+  hub_mac_entry_t *entry;
+
+  BX_LOCK(mac_lock);
+  entry = mac_table_slot(dst_mac_addr);
+  *clientid = entry->valid ? entry->client : -1;
+  BX_UNLOCK(mac_lock);
+  return (*clientid >= 0);
+}
+
+// forward a frame received from a client
+void hub_packet(int clientid, Bit8u *buf, unsigned len)
+{
+  ethernet_header_t *ethhdr = (ethernet_header_t *)buf;
+  int c;
+
+  if (len < sizeof(ethernet_header_t))
+    return;
+  if (memcmp(ethhdr->src_mac_addr, host_macaddr, ETHERNET_MAC_ADDR_LEN) != 0) {
+    learn_client(ethhdr->src_mac_addr, clientid);
+  }
+  if (memcmp(ethhdr->dst_mac_addr, broadcast_macaddr, ETHERNET_MAC_ADDR_LEN) == 0) {
+    broadcast_packet(clientid, buf, len);
+  } else if (memcmp(ethhdr->dst_mac_addr, host_macaddr, ETHERNET_MAC_ADDR_LEN) == 0) {
+    handle_packet(&hclient[clientid], buf, len);
+  } else if (find_client(ethhdr->dst_mac_addr, &c) && (c != clientid)) {
+    send_packet(&hclient[c], buf, len);
+  }
+}
+
+#if BX_NETSHM
+// create and map the shared memory file of a client
+bool shm_init_client(hub_client_t *client)
+{
+  char path[BX_PATHNAME_LEN];
+  bx_netshm_t *shm;
+  int fd, n;
+
+  n = snprintf(path, sizeof(path), "%s/bxhub-%d", shm_dir, ntohs(client->sout.sin_port));
+  if ((n < 0) || (n >= (int)sizeof(path))) {
+    fprintf(stderr, "bxhub - shared memory file path too long\n");
+    return 0;
+  }
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    perror("bxhub - cannot create shared memory file");
+    return 0;
+  }
+  if (ftruncate(fd, sizeof(bx_netshm_t)) < 0) {
+    perror("bxhub - cannot set size of shared memory file");
+    close(fd);
+    return 0;
+  }
+  shm = (bx_netshm_t *)mmap(NULL, sizeof(bx_netshm_t), PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED) {
+    perror("bxhub - cannot map shared memory file");
+    return 0;
+  }
+  shm->version = BX_NETSHM_VERSION;
+  shm->doorbell_port = ntohs(client->sin.sin_port);
+  bx_atomic_store32(&shm->magic, BX_NETSHM_MAGIC);
+  BX_INIT_MUTEX(client->shm_lock);
+  client->shm = shm;
+  printf("Shared memory port #%d: %s\n", (int)(client - hclient) + 1, path);
+  return 1;
+}
+#endif
+
+// receive thread of one client
+BX_THREAD_FUNC(client_thread, indata)
+{
+  hub_client_t *client = (hub_client_t *)indata;
+  int clientid = (int)(client - hclient);
+  Bit8u buf[BX_PACKET_BUFSIZE];
+  socklen_t slen;
+  int n;
+
+  while (1) {
+#if BX_NETSHM
+    if (client->shm != NULL) {
+      bx_netshm_ring_t *ring = &client->shm->to_hub;
+      const Bit8u *frame;
+      unsigned len;
+
+      while ((frame = netshm_front(ring, &len)) != NULL) {
+        if (len > sizeof(buf)) len = sizeof(buf);
+        memcpy(buf, frame, len);
+        netshm_pop(ring);
+        hub_packet(clientid, buf, len);
+      }
+      // announce the wait before checking the ring again (see netshm.h)
+      bx_atomic_xchg32(&client->shm->hub_waiting, 1);
+      if (netshm_front(ring, &len) != NULL) {
+        bx_atomic_store32(&client->shm->hub_waiting, 0);
+        continue;
       }
+      // sleep until the client sends the doorbell
+      recv(client->so, (char*)buf, sizeof(buf), 0);
+      continue;
+    }
+#endif
+    slen = sizeof(client->sin);
+    n = recvfrom(client->so, (char*)buf, sizeof(buf), 0,
+                 (struct sockaddr*) &client->sin, &slen);
+    if (n > 0) {
+      hub_packet(clientid, buf, n);
     }
   }
-  return (*clientid >= 0);
+  BX_THREAD_EXIT;
 }
 
 void print_usage()
@@ -170,6 +359,9 @@ void print_usage()
     "  -bootfile=... network bootfile reported by DHCP - located on TFTP server\n"
     "  -loglev=...   set log level (0 - 3, default 1)\n"
     "  -logfile=...  send log output to file\n"
+#if BX_NETSHM
+    "  -shm=...      use shared memory files in specified directory for all ports\n"
+#endif
     "  --help        display this help and exit\n\n");
 }
 
@@ -186,6 +378,7 @@ int parse_cmdline(int argc, char *argv[])
   tftp_root[0] = 0;
   dhcp_bootfile[0] = 0;
   bx_logfname[0] = 0;
+  shm_dir[0] = 0;
   memcpy(host_macaddr, default_host_macaddr, ETHERNET_MAC_ADDR_LEN);
   while ((arg < argc) && (ret == 1)) {
     // parse next arg
@@ -239,6 +432,18 @@ int parse_cmdline(int argc, char *argv[])
     else if (!strncmp("-logfile=", argv[arg], 9)) {
       strcpy(bx_logfname, &argv[arg][9]);
     }
+#if BX_NETSHM
+    else if (!strncmp("-shm=", argv[arg], 5)) {
+      // leave room for the "/bxhub-<port>" file name
+      if (strlen(&argv[arg][5]) < (sizeof(shm_dir) - 16)) {
+        strncpy(shm_dir, &argv[arg][5], sizeof(shm_dir) - 1);
+        shm_dir[sizeof(shm_dir) - 1] = 0;
+      } else {
+        printf("Shared memory directory path too long\n\n");
+        ret = 0;
+      }
+    }
+#endif
     else if (argv[arg][0] == '-') {
       printf("Unknown option: %s\n\n", argv[arg]);
       ret = 0;
@@ -268,11 +473,7 @@ void CDECL intHandler(int sig)
 
 int CDECL main(int argc, char **argv)
 {
-  int c, i, n;
-  socklen_t slen;
-  fd_set rfds;
-  Bit8u buf[BX_PACKET_BUFSIZE];
-  ethernet_header_t *ethhdr = (ethernet_header_t *)buf;
+  int i;
 
   if (!parse_cmdline(argc, argv))
     exit(0);
@@ -346,51 +547,25 @@ int CDECL main(int argc, char **argv)
     vnet_server.init_log(bx_logfname);
     printf("Using log file '%s'\n", bx_logfname);
   }
-  printf("Press CTRL+C to quit bxhub\n");
-
-  while (1) {
-
-    /* wait for input */
-
-    FD_ZERO(&rfds);
+#if BX_NETSHM
+  if (strlen(shm_dir) > 0) {
     for (i = 0; i < client_max; i++) {
-      FD_SET(hclient[i].so, &rfds);
+      if (!shm_init_client(&hclient[i]))
+        exit(3);
     }
+  }
+#endif
+  printf("Press CTRL+C to quit bxhub\n");
 
-    n = select(hclient[client_max-1].so+1, &rfds, NULL, NULL, NULL);
-
-    /* data is available somewhere */
-
-    for (i = 0; i < client_max; i++) {
-      // check input
-      if (FD_ISSET(hclient[i].so, &rfds)) {
-        slen = sizeof(hclient[i].sin);
-        n = recvfrom(hclient[i].so, (char*)buf, sizeof(buf), 0,
-                     (struct sockaddr*) &hclient[i].sin, &slen);
-        if (n > 0) {
-          if (memcmp(ethhdr->dst_mac_addr, broadcast_macaddr, ETHERNET_MAC_ADDR_LEN) == 0) {
-            broadcast_packet(i, buf, n);
-          } else if (memcmp(ethhdr->dst_mac_addr, host_macaddr, ETHERNET_MAC_ADDR_LEN) == 0) {
-            handle_packet(&hclient[i], buf, n);
-          } else if (find_client(ethhdr->dst_mac_addr, &c)) {
-            send_packet(&hclient[c], buf, n);
-          }
-        }
-      }
-      // send reply from builtin service
-      while (hclient[i].pending_reply_size > 0) {
-        send_packet(&hclient[i], hclient[i].reply_buffer, hclient[i].pending_reply_size);
-        // check for another pending packet
-        hclient[i].pending_reply_size = vnet_server.get_packet(hclient[i].reply_buffer);
-      }
-      // check MAC address of new client
-      if (hclient[i].init != 0) {
-        if (hclient[i].init < 0) {
-          fprintf(stderr, "bxhub - wrong MAC address configuration\n");
-          break;
-        }
-      }
-    }
+  // each port is served by its own thread
+  BX_INIT_MUTEX(mac_lock);
+  BX_INIT_MUTEX(vnet_lock);
+  mac_entries = 0;
+  for (i = 0; i < client_max; i++) {
+    BX_THREAD_CREATE(client_thread, &hclient[i], hclient[i].thread);
+  }
+  while (1) {
+    BX_MSLEEP(500);
   }
   return 0;
 }
@@ -36,14 +36,19 @@
 #  include <winioctl.h>
 #endif
 #include <ctype.h>
+#ifndef WIN32
+#include <sys/time.h>
+#endif
 
 #include "osdep.h"
 #include "bswap.h"
+#include "bxthread.h"
 
 #include "iodev/hdimage/hdimage.h"
 #include "iodev/hdimage/vmware3.h"
 #include "iodev/hdimage/vmware4.h"
 #include "iodev/hdimage/vpc.h"
+#include "iodev/hdimage/qcow2.h"
 #include "iodev/hdimage/vbox.h"
 
 #define BXIMAGE_FUNC_NULL            0
@@ -55,6 +60,12 @@
 
 #define BX_MAX_CYL_BITS 24 // 8 TB
 
+#define BXIMAGE_COPY_CHUNK       (1 << 20)
+#define BXIMAGE_COPY_BUFFERS     (64 << 20)
+#define BXIMAGE_COPY_MAX_SLOTS   16
+#define BXIMAGE_MAX_WRITERS      16
+#define BXIMAGE_DEF_WRITERS      4
+
 const int bx_max_hd_megs = (int)(((1 << BX_MAX_CYL_BITS) - 1) * 16.0 * 63.0 / 2048.0);
 
 int  bximage_func;
@@ -67,6 +78,7 @@ int  bx_backup;
 int  bx_interactive;
 int  bx_sectsize_idx;
 Bit16u bx_sectsize_val;
+int  bx_writers;
 char bx_filename_1[512];
 char bx_filename_2[522];
 
@@ -97,9 +109,9 @@ const unsigned fdsize_sectors[] = { 320, 360, 640, 720, 1440, 2400, 2880, 3360,
 int fdsize_n_choices = 10;
 
 // menu data for choosing disk mode
-const char *hdmode_menu = "\nWhat kind of image should I create?\nPlease type flat, sparse, growing, vpc or vmware4. ";
-const char *hdmode_choices[] = {"flat", "sparse", "growing", "vpc", "vmware4" };
-int hdmode_n_choices = 5;
+const char *hdmode_menu = "\nWhat kind of image should I create?\nPlease type flat, sparse, growing, vpc, vmware4 or qcow2. ";
+const char *hdmode_choices[] = {"flat", "sparse", "growing", "vpc", "vmware4", "qcow2" };
+int hdmode_n_choices = 6;
 
 // menu data for choosing hard disk sector size
 const char *sectsize_menu = "\nChoose the size of hard disk sectors.\nPlease type 512, 1024 or 4096. ";
@@ -331,6 +343,8 @@ device_image_t* init_image(const char *imgmode)
     hdimage = new vpc_image_t();
   } else if (!strcmp(imgmode, "vbox")) {
     hdimage = new vbox_image_t();
+  } else if (!strcmp(imgmode, "qcow2")) {
+    hdimage = new qcow2_image_t();
   } else {
     fatal("unsupported disk image mode");
   }
@@ -413,22 +427,339 @@ device_image_t* create_hard_disk_image(const char *filename, const char *imgmode
     hdimage->create_image(filename, size);
   } else if(!strcmp(imgmode, "vmware4")) {
     hdimage->create_image(filename, size);
+  } else if(!strcmp(imgmode, "qcow2")) {
+    hdimage->create_image(filename, size);
   } else {
     fatal("image mode not implemented yet");
   }
   return hdimage;
 }
 
+// PIPELINED IMAGE COPY
+// The reader thread fills a ring of chunk buffers from the source image or
+// redolog and marks the sectors to write (zero sectors of an image and
+// sectors not present in a redolog are skipped). The writer threads write
+// the runs of marked sectors in chunk order. Images with fixed layout (flat)
+// can use several writers, each with its own image handle.
+
+#define COPY_SLOT_FREE  0
+#define COPY_SLOT_BUSY  1
+#define COPY_SLOT_FULL  2
+
+struct {
+  device_image_t *source;
+  redolog_t *redolog;
+  device_image_t *dest[BXIMAGE_MAX_WRITERS];
+  int n_writers;
+  int n_slots;
+  Bit32u chunk_size;
+  Bit64u n_chunks;
+  Bit64u total_size;
+  Bit8u *buffer[BXIMAGE_COPY_MAX_SLOTS];
+  Bit8u *sector_map[BXIMAGE_COPY_MAX_SLOTS];
+  Bit64u slot_chunk[BXIMAGE_COPY_MAX_SLOTS];
+  int slot_state[BXIMAGE_COPY_MAX_SLOTS];
+  Bit64u write_next;
+  Bit64u chunks_done;
+  Bit64u bytes_written;
+  int threads_active;
+  bool error;
+  BX_MUTEX(lock);
+  bx_thread_sem_t reader_sem;
+  bx_thread_sem_t writer_sem[BXIMAGE_MAX_WRITERS];
+} copy;
+
+int copy_writer_index[BXIMAGE_MAX_WRITERS];
+
+Bit64u get_msec()
+{
+#ifdef WIN32
+  return (Bit64u)GetTickCount();
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (Bit64u)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+bool is_zero_sector(const Bit8u *buffer)
+{
+  const Bit64u *ptr = (const Bit64u*)buffer;
+
+  for (int i = 0; i < 64; i++) {
+    if (ptr[i] != 0) return false;
+  }
+  return true;
+}
+
+// only image modes with a fixed layout accept writes from several handles
+bool parallel_write_supported(const char *imgmode)
+{
+  return !strcmp(imgmode, "flat");
+}
+
+void copy_wakeup_all()
+{
+  bx_set_sem(&copy.reader_sem);
+  for (int i = 0; i < copy.n_writers; i++) {
+    bx_set_sem(&copy.writer_sem[i]);
+  }
+}
+
+bool copy_read_chunk(Bit64u chunk, Bit8u *buffer, Bit8u *sector_map)
+{
+  Bit64u offset = chunk * copy.chunk_size;
+  Bit32u i, len, sectors;
+
+  if (copy.redolog != NULL) {
+    return (copy.redolog->read_extent((Bit32u)chunk, buffer, sector_map) >= 0);
+  }
+  len = copy.chunk_size;
+  if ((offset + len) > copy.total_size) {
+    len = (Bit32u)(copy.total_size - offset);
+  }
+  sectors = len / 512;
+  memset(sector_map, 0, copy.chunk_size / 512);
+  if ((copy.source->lseek(offset, SEEK_SET) >= 0) &&
+      (copy.source->read(buffer, len) == (ssize_t)len)) {
+    for (i = 0; i < sectors; i++) {
+      sector_map[i] = !is_zero_sector(buffer + i * 512);
+    }
+  } else {
+    // retry sector by sector, unreadable sectors are skipped
+    for (i = 0; i < sectors; i++) {
+      if ((copy.source->lseek(offset + i * 512, SEEK_SET) >= 0) &&
+          (copy.source->read(buffer + i * 512, 512) == 512)) {
+        sector_map[i] = !is_zero_sector(buffer + i * 512);
+      }
+    }
+  }
+  return true;
+}
+
+bool copy_write_chunk(device_image_t *dest, Bit64u chunk, Bit8u *buffer,
+                      const Bit8u *sector_map, Bit64u *written)
+{
+  Bit64u offset = chunk * copy.chunk_size;
+  Bit32u i, n, sectors = copy.chunk_size / 512;
+
+  *written = 0;
+  for (i = 0; i < sectors; i += n) {
+    for (n = 0; ((i + n) < sectors) && (sector_map[i + n] == sector_map[i]); n++);
+    if (sector_map[i]) {
+      if (dest->lseek(offset + i * 512, SEEK_SET) < 0) {
+        return false;
+      }
+      if (dest->write(buffer + i * 512, n * 512) < 0) {
+        return false;
+      }
+      *written += n * 512;
+    }
+  }
+  return true;
+}
+
+BX_THREAD_FUNC(copy_reader_thread, indata)
+{
+  Bit64u chunk;
+  bool ok;
+  int slot;
+
+  for (chunk = 0; chunk < copy.n_chunks; chunk++) {
+    slot = (int)(chunk % copy.n_slots);
+    BX_LOCK(copy.lock);
+    while ((copy.slot_state[slot] != COPY_SLOT_FREE) && !copy.error) {
+      BX_UNLOCK(copy.lock);
+      bx_wait_sem(&copy.reader_sem);
+      BX_LOCK(copy.lock);
+    }
+    if (copy.error) {
+      BX_UNLOCK(copy.lock);
+      break;
+    }
+    copy.slot_state[slot] = COPY_SLOT_BUSY;
+    BX_UNLOCK(copy.lock);
+    ok = copy_read_chunk(chunk, copy.buffer[slot], copy.sector_map[slot]);
+    BX_LOCK(copy.lock);
+    copy.slot_chunk[slot] = chunk;
+    copy.slot_state[slot] = COPY_SLOT_FULL;
+    if (!ok) copy.error = true;
+    BX_UNLOCK(copy.lock);
+    copy_wakeup_all();
+  }
+  BX_LOCK(copy.lock);
+  copy.threads_active--;
+  BX_UNLOCK(copy.lock);
+  BX_THREAD_EXIT;
+}
+
+BX_THREAD_FUNC(copy_writer_thread, indata)
+{
+  int index = *(int*)indata;
+  Bit64u chunk, written;
+  bool ok;
+  int slot;
+
+  while (1) {
+    BX_LOCK(copy.lock);
+    while (!copy.error && (copy.write_next < copy.n_chunks)) {
+      slot = (int)(copy.write_next % copy.n_slots);
+      if ((copy.slot_state[slot] == COPY_SLOT_FULL) &&
+          (copy.slot_chunk[slot] == copy.write_next)) {
+        break;
+      }
+      BX_UNLOCK(copy.lock);
+      bx_wait_sem(&copy.writer_sem[index]);
+      BX_LOCK(copy.lock);
+    }
+    if (copy.error || (copy.write_next >= copy.n_chunks)) {
+      BX_UNLOCK(copy.lock);
+      break;
+    }
+    chunk = copy.write_next++;
+    slot = (int)(chunk % copy.n_slots);
+    copy.slot_state[slot] = COPY_SLOT_BUSY;
+    BX_UNLOCK(copy.lock);
+    // another writer can take the next chunk now
+    for (int i = 0; i < copy.n_writers; i++) {
+      if (i != index) bx_set_sem(&copy.writer_sem[i]);
+    }
+    ok = copy_write_chunk(copy.dest[index], chunk, copy.buffer[slot],
+                          copy.sector_map[slot], &written);
+    BX_LOCK(copy.lock);
+    copy.slot_state[slot] = COPY_SLOT_FREE;
+    copy.chunks_done++;
+    copy.bytes_written += written;
+    if (!ok) copy.error = true;
+    BX_UNLOCK(copy.lock);
+    if (ok) {
+      bx_set_sem(&copy.reader_sem);
+    } else {
+      copy_wakeup_all();
+    }
+  }
+  BX_LOCK(copy.lock);
+  copy.threads_active--;
+  BX_UNLOCK(copy.lock);
+  copy_wakeup_all();
+  BX_THREAD_EXIT;
+}
+
+void print_copy_progress(const char *what, Bit64u done, Bit64u written, Bit64u msec)
+{
+  int percent = (copy.n_chunks > 0) ? (int)(done * 100 / copy.n_chunks) : 100;
+  Bit64u scanned = done * copy.chunk_size;
+  double rate;
+
+  if (scanned > copy.total_size) {
+    scanned = copy.total_size;
+  }
+  rate = (msec > 0) ? ((double)scanned / 1048576.0 * 1000.0 / (double)msec) : 0.0;
+  printf("\r%s: [%3d%%] " FMT_LL "u MB read, " FMT_LL "u MB written, %.1f MB/s ",
+         what, percent, scanned >> 20, written >> 20, rate);
+  fflush(stdout);
+}
+
+// Copy the data of 'copy.source' or 'copy.redolog' to the 'copy.dest' images.
+// Returns false on error.
+bool copy_image_data(const char *what)
+{
+  BX_THREAD_VAR(reader_thread);
+  BX_THREAD_VAR(writer_thread[BXIMAGE_MAX_WRITERS]);
+  Bit64u start, done, written;
+  bool error;
+  int i;
+
+  copy.n_slots = BXIMAGE_COPY_BUFFERS / copy.chunk_size;
+  if (copy.n_slots > BXIMAGE_COPY_MAX_SLOTS) {
+    copy.n_slots = BXIMAGE_COPY_MAX_SLOTS;
+  } else if (copy.n_slots < 2) {
+    copy.n_slots = 2;
+  }
+  for (i = 0; i < copy.n_slots; i++) {
+    copy.buffer[i] = new Bit8u[copy.chunk_size];
+    copy.sector_map[i] = new Bit8u[copy.chunk_size / 512];
+    copy.slot_state[i] = COPY_SLOT_FREE;
+  }
+  copy.write_next = 0;
+  copy.chunks_done = 0;
+  copy.bytes_written = 0;
+  copy.error = false;
+  copy.threads_active = copy.n_writers + 1;
+  BX_INIT_MUTEX(copy.lock);
+  bx_create_sem(&copy.reader_sem);
+  for (i = 0; i < copy.n_writers; i++) {
+    bx_create_sem(&copy.writer_sem[i]);
+  }
+
+  start = get_msec();
+  BX_THREAD_CREATE(copy_reader_thread, NULL, reader_thread);
+  for (i = 0; i < copy.n_writers; i++) {
+    copy_writer_index[i] = i;
+    BX_THREAD_CREATE(copy_writer_thread, &copy_writer_index[i], writer_thread[i]);
+  }
+  do {
+    BX_MSLEEP(200);
+    BX_LOCK(copy.lock);
+    done = copy.chunks_done;
+    written = copy.bytes_written;
+    i = copy.threads_active;
+    BX_UNLOCK(copy.lock);
+    print_copy_progress(what, done, written, get_msec() - start);
+  } while (i > 0);
+  printf("\n");
+  BX_THREAD_JOIN(reader_thread);
+  for (i = 0; i < copy.n_writers; i++) {
+    BX_THREAD_JOIN(writer_thread[i]);
+  }
+  error = copy.error;
+
+  for (i = 0; i < copy.n_writers; i++) {
+    bx_destroy_sem(&copy.writer_sem[i]);
+  }
+  bx_destroy_sem(&copy.reader_sem);
+  BX_FINI_MUTEX(copy.lock);
+  for (i = 0; i < copy.n_slots; i++) {
+    delete [] copy.buffer[i];
+    delete [] copy.sector_map[i];
+  }
+  return !error;
+}
+
+// open additional handles of the destination image for parallel writes
+void open_copy_writers(const char *imgmode, const char *filename, device_image_t *dest)
+{
+  copy.dest[0] = dest;
+  copy.n_writers = 1;
+  if (parallel_write_supported(imgmode)) {
+    while (copy.n_writers < bx_writers) {
+      device_image_t *image = init_image(imgmode);
+      if (image->open(filename) < 0) {
+        delete image;
+        break;
+      }
+      copy.dest[copy.n_writers++] = image;
+    }
+  }
+}
+
+void close_copy_writers()
+{
+  for (int i = 1; i < copy.n_writers; i++) {
+    copy.dest[i]->close();
+    delete copy.dest[i];
+  }
+  copy.n_writers = 1;
+}
+
 void convert_image(const char *newimgmode, Bit64u newsize)
 {
   device_image_t *source_image, *dest_image;
-  Bit64u i, sc, s;
-  char buffer[512], null_sector[512];
   const char *imgmode = NULL;
-  bool error = false;
+  bool ok;
 
   printf("\n");
-  memset(null_sector, 0, 512);
   if (newsize == 0) {
     if (!strncmp(bx_filename_1, "concat:", 7)) {
       imgmode = "concat";
@@ -464,40 +795,25 @@ void convert_image(const char *newimgmode, Bit64u newsize)
   if (dest_image->open(bx_filename_2) < 0)
     fatal("cannot open destination disk image");
 
-  printf("\nConverting image file: [  0%%]");
-
-  sc = source_image->hd_size / 512;
-  s = 0;
-  for (i = 0; i < source_image->hd_size; i+=512) {
-    printf("\x8\x8\x8\x8\x8%3d%%]", (int)((s+1)*100/sc));
-    fflush(stdout);
-    if (source_image->lseek(i, SEEK_SET) < 0) {
-      error = true;
-      break;
-    }
-    if ((source_image->read(buffer, 512) == 512) &&
-        (memcmp(buffer, null_sector, 512) != 0)) {
-      if (dest_image->lseek(i, SEEK_SET) < 0) {
-        error = true;
-        break;
-      }
-      if (dest_image->write(buffer, 512) < 0) {
-        error = true;
-        break;
-      }
-    }
-    s++;
-  }
+  printf("\n");
+  copy.source = source_image;
+  copy.redolog = NULL;
+  copy.chunk_size = BXIMAGE_COPY_CHUNK;
+  copy.total_size = source_image->hd_size;
+  copy.n_chunks = (copy.total_size + copy.chunk_size - 1) / copy.chunk_size;
+  open_copy_writers(newimgmode, bx_filename_2, dest_image);
+  ok = copy_image_data("Converting image file");
+  close_copy_writers();
 
   source_image->close();
   dest_image->close();
   delete dest_image;
   delete source_image;
 
-  if (error) {
+  if (!ok) {
     fatal("image conversion failed");
   } else {
-    printf(" Done.\n");
+    printf("Done.\n");
   }
 }
 
@@ -505,8 +821,8 @@ void commit_redolog()
 {
   device_image_t *base_image;
   redolog_t *redolog;
-  int ret;
   const char *imgmode = NULL;
+  bool ok;
 
   printf("\n");
   if (access(bx_filename_1, F_OK) < 0) {
@@ -525,17 +841,25 @@ void commit_redolog()
   if (!coherency_check(base_image, redolog))
     fatal("coherency check failed");
 
-  ret = redolog->commit(base_image);
+  printf("\n");
+  copy.source = NULL;
+  copy.redolog = redolog;
+  copy.chunk_size = redolog->get_extent_size();
+  copy.n_chunks = redolog->get_extent_count();
+  copy.total_size = copy.n_chunks * copy.chunk_size;
+  open_copy_writers(imgmode, bx_filename_1, base_image);
+  ok = copy_image_data("Committing changes to base image file");
+  close_copy_writers();
 
   base_image->close();
   redolog->close();
   delete base_image;
   delete redolog;
 
-  if (ret < 0) {
+  if (!ok) {
     fatal("redolog commit failed");
   } else {
-    printf(" Done.\n\n");
+    printf("Done.\n\n");
   }
 }
 
@@ -550,6 +874,7 @@ void print_usage()
     "                or gigabytes (G)\n"
     "  -imgmode=...  create/convert: hard disk image mode\n"
     "  -sectsize=... create: hard disk sector size\n"
+    "  -threads=...  convert/commit: number of writer threads for flat images\n"
     "  -b            convert/resize: create a backup of the source image\n"
     "                commit: create backups of the base image and redolog file\n"
     "  -q            quiet mode (don't prompt for user input)\n"
@@ -613,6 +938,7 @@ int parse_cmdline(int argc, char *argv[])
   bx_interactive = 1;
   bx_sectsize_idx = 0;
   bx_sectsize_val = 512;
+  bx_writers = BXIMAGE_DEF_WRITERS;
   bx_filename_1[0] = 0;
   bx_filename_2[0] = 0;
   while ((arg < argc) && (ret == 1)) {
@@ -682,6 +1008,13 @@ int parse_cmdline(int argc, char *argv[])
         bx_sectsize_val = atoi(sectsize_choices[bx_sectsize_idx]);
       }
     }
+    else if (!strncmp("-threads=", argv[arg], 9)) {
+      bx_writers = atoi(&argv[arg][9]);
+      if ((bx_writers < 1) || (bx_writers > BXIMAGE_MAX_WRITERS)) {
+        printf("Number of threads out of range (1 - %d)\n\n", BXIMAGE_MAX_WRITERS);
+        ret = 0;
+      }
+    }
     else if (!strcmp("-b", argv[arg])) {
       bx_backup = 1;
     }
@@ -0,0 +1,282 @@
+/////////////////////////////////////////////////////////////////////////
+// $Id$
+/////////////////////////////////////////////////////////////////////////
+//
+//  Copyright (C) 2021  The Bochs Project
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+//
+/////////////////////////////////////////////////////////////////////////
+//
+// test-net-checksum.cc
+//
+// Compares the shared Internet checksum routine (iodev/network/netcsum.h)
+// with the byte / word loops previously used by vnet, e1000 and slirp and
+// measures their throughput.
+//
+// Build with "make test-net-checksum" and run it. The program returns 1 if
+// a mismatch is found. The optional argument sets the amount of data used
+// for each benchmark in units of 64K (default 2000, 0 skips the benchmark).
+//
+/////////////////////////////////////////////////////////////////////////
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "iodev/network/netcsum.h"
+
+// ip_checksum() from netutil.cc
+Bit16u ref_ip_checksum(const Bit8u *buf, unsigned buf_len)
+{
+  Bit32u sum = 0;
+  unsigned n;
+
+  for (n = 0; n < buf_len; n++) {
+    if (n & 1) {
+      sum += (Bit32u)(*buf++);
+    } else {
+      sum += (Bit32u)(*buf++) << 8;
+    }
+  }
+  while (sum > 0xffff) {
+    sum = (sum >> 16) + (sum & 0xffff);
+  }
+
+  return (Bit16u)sum;
+}
+
+// net_checksum_add() and net_checksum_finish() from e1000.cc
+Bit32u ref_net_checksum_add(const Bit8u *buf, unsigned buf_len)
+{
+  Bit32u sum = 0;
+  unsigned i;
+
+  for (i = 0; i < buf_len; i++) {
+    if (i & 1)
+      sum += (Bit32u)buf[i];
+    else
+      sum += (Bit32u)buf[i] << 8;
+  }
+  return sum;
+}
+
+Bit16u ref_net_checksum_finish(Bit32u sum)
+{
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return ~sum;
+}
+
+// cksum() from slirp/cksum.cc (BSD in_cksum) for a single buffer
+#define ADDCARRY(x)  (x > 65535 ? x -= 65535 : x)
+#define REDUCE {l_util.l = sum; sum = l_util.s[0] + l_util.s[1];        \
+        (void)ADDCARRY(sum);}
+
+int ref_cksum(const Bit8u *buf, int len)
+{
+  const Bit16u *w = (const Bit16u *)buf;
+  int sum = 0;
+  int mlen = len;
+  int byte_swapped = 0;
+
+  union {
+    Bit8u  c[2];
+    Bit16u s;
+  } s_util;
+  union {
+    Bit16u s[2];
+    Bit32u l;
+  } l_util;
+
+  if (mlen == 0)
+    goto cont;
+  if ((1 & (bx_ptr_equiv_t)w) && (mlen > 0)) {
+    REDUCE;
+    sum <<= 8;
+    s_util.c[0] = *(const Bit8u *)w;
+    w = (const Bit16u *)((const Bit8u *)w + 1);
+    mlen--;
+    byte_swapped = 1;
+  }
+  while ((mlen -= 32) >= 0) {
+    sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
+    sum += w[4]; sum += w[5]; sum += w[6]; sum += w[7];
+    sum += w[8]; sum += w[9]; sum += w[10]; sum += w[11];
+    sum += w[12]; sum += w[13]; sum += w[14]; sum += w[15];
+    w += 16;
+  }
+  mlen += 32;
+  while ((mlen -= 8) >= 0) {
+    sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
+    w += 4;
+  }
+  mlen += 8;
+  if (mlen == 0 && byte_swapped == 0)
+    goto cont;
+  REDUCE;
+  while ((mlen -= 2) >= 0) {
+    sum += *w++;
+  }
+  if (byte_swapped) {
+    REDUCE;
+    sum <<= 8;
+    if (mlen == -1) {
+      s_util.c[1] = *(const Bit8u *)w;
+      sum += s_util.s;
+      mlen = 0;
+    } else
+      mlen = -1;
+  } else if (mlen == -1)
+    s_util.c[0] = *(const Bit8u *)w;
+
+cont:
+  if (mlen == -1) {
+    s_util.c[1] = 0;
+    sum += s_util.s;
+  }
+  REDUCE;
+  return (~sum & 0xffff);
+}
+
+// new routine in the form used by each caller
+int new_cksum(const Bit8u *buf, int len)
+{
+  return (~net_csum_fold(net_csum_add_native(buf, len, 0)) & 0xffff);
+}
+
+#define TEST_BUF_SIZE (4 << 20)
+
+// plain 64-bit sum for buffers the old routines cannot handle
+Bit16u ref_sum64(const Bit8u *buf, unsigned len)
+{
+  Bit64u sum = 0;
+  unsigned i;
+
+  for (i = 0; i < len; i++) {
+    sum += (i & 1) ? (Bit64u)buf[i] : ((Bit64u)buf[i] << 8);
+  }
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return (Bit16u)sum;
+}
+
+unsigned check(const Bit8u *buf, unsigned len)
+{
+  unsigned errors = 0;
+
+  // the old routines overflow with 64K of data or more
+  if (len >= 0x10000) {
+    if (net_checksum(buf, len) != ref_sum64(buf, len)) {
+      printf("checksum mismatch: len %u\n", len);
+      errors++;
+    }
+    return errors;
+  }
+  if (net_checksum(buf, len) != ref_ip_checksum(buf, len)) {
+    printf("ip_checksum mismatch: len %u\n", len);
+    errors++;
+  }
+  if (ref_net_checksum_finish(net_checksum(buf, len)) !=
+      ref_net_checksum_finish(ref_net_checksum_add(buf, len))) {
+    printf("net_checksum_add mismatch: len %u\n", len);
+    errors++;
+  }
+  if (new_cksum(buf, len) != ref_cksum(buf, len)) {
+    printf("cksum mismatch: len %u\n", len);
+    errors++;
+  }
+  return errors;
+}
+
+double elapsed(clock_t start)
+{
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+void bench(const Bit8u *buf, unsigned len, unsigned rounds)
+{
+  unsigned count = (unsigned)((Bit64u)rounds * 0x10000 / len), n;
+  volatile Bit32u sink = 0;
+  double t_ip, t_e1000, t_slirp, t_new;
+  clock_t start;
+
+  if (count == 0) count = 1;
+  start = clock();
+  for (n = 0; n < count; n++) sink += ref_ip_checksum(buf, len);
+  t_ip = elapsed(start);
+  start = clock();
+  for (n = 0; n < count; n++) sink += ref_net_checksum_add(buf, len);
+  t_e1000 = elapsed(start);
+  start = clock();
+  for (n = 0; n < count; n++) sink += ref_cksum(buf, len);
+  t_slirp = elapsed(start);
+  start = clock();
+  for (n = 0; n < count; n++) sink += net_checksum(buf, len);
+  t_new = elapsed(start);
+  double mb = (double)len * count / (1 << 20);
+  printf("%6u bytes: ip_checksum %8.0f MB/s, e1000 %8.0f MB/s, slirp %8.0f MB/s, new %8.0f MB/s\n",
+         len, mb / t_ip, mb / t_e1000, mb / t_slirp, mb / t_new);
+}
+
+int main(int argc, char *argv[])
+{
+  static const unsigned sizes[] = { 20, 64, 576, 1500, 9000, 65535 };
+  unsigned rounds = 2000, errors = 0, off, len, i;
+  Bit8u *buf;
+
+  if (argc > 1) rounds = atoi(argv[1]);
+  buf = new Bit8u[TEST_BUF_SIZE + 64];
+  srand(1);
+  for (i = 0; i < TEST_BUF_SIZE + 64; i++) {
+    buf[i] = (Bit8u)rand();
+  }
+#if BX_NET_CSUM_AVX2
+  printf("vector unit: AVX2\n");
+#elif BX_NET_CSUM_SSE2
+  printf("vector unit: SSE2\n");
+#else
+  printf("vector unit: none (scalar)\n");
+#endif
+  // all lengths up to 2K at every alignment
+  for (off = 0; off < 64; off++) {
+    for (len = 0; len <= 2048; len++) {
+      errors += check(buf + off, len);
+    }
+  }
+  // worst case data for carries and large buffers
+  memset(buf, 0xff, TEST_BUF_SIZE + 64);
+  for (off = 0; off < 4; off++) {
+    errors += check(buf + off, 65535);
+    errors += check(buf + off, TEST_BUF_SIZE - off);
+  }
+  memset(buf, 0, TEST_BUF_SIZE + 64);
+  errors += check(buf, 1500);
+  printf("%u mismatches\n", errors);
+
+  for (i = 0; i < TEST_BUF_SIZE + 64; i++) {
+    buf[i] = (Bit8u)rand();
+  }
+  if (rounds > 0) {
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      bench(buf + 2, sizes[i], rounds);
+    }
+  }
+  delete [] buf;
+  return (errors > 0) ? 1 : 0;
+}
@@ -0,0 +1,182 @@
+/////////////////////////////////////////////////////////////////////////
+// $Id$
+/////////////////////////////////////////////////////////////////////////
+//
+//  Copyright (C) 2021  The Bochs Project
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+//
+/////////////////////////////////////////////////////////////////////////
+//
+// test-timer-queue.cc
+//
+// Compares the timer queue used by the system and virtual timers (timerq.h)
+// with the linear scan of all timer slots previously done on each expiry
+// and measures the expiry throughput of both.
+//
+// Build with "make test-timer-queue" and run it. The program returns 1 if
+// the timers fire in a different order. The optional argument sets the
+// number of expiries for each benchmark in units of 1000 (default 2000,
+// 0 skips the benchmark).
+//
+/////////////////////////////////////////////////////////////////////////
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "timerq.h"
+
+struct test_timer_t {
+  bool   active;
+  Bit64u period;
+  Bit64u timeToFire;
+};
+
+void init_timers(test_timer_t *t, unsigned n)
+{
+  srand(1);
+  for (unsigned i = 0; i < n; i++) {
+    t[i].active = 1;
+    t[i].period = 1000 + (rand() % 100000);
+    t[i].timeToFire = t[i].period;
+  }
+}
+
+// expiry handling of countdownEvent() before the timer queue: find the next
+// deadline, then fire all timers with that deadline in slot order. Returns
+// the ID of the last timer fired.
+unsigned linear_expire(test_timer_t *t, unsigned n, Bit64u *ticks)
+{
+  Bit64u min = (Bit64u) -1;
+  unsigned i, last = 0;
+
+  for (i = 0; i < n; i++) {
+    if (t[i].active && t[i].timeToFire < min) min = t[i].timeToFire;
+  }
+  *ticks = min;
+  for (i = 0; i < n; i++) {
+    if (t[i].active && t[i].timeToFire == min) {
+      t[i].timeToFire += t[i].period;
+      last = i;
+    }
+  }
+  return last;
+}
+
+unsigned queue_expire(test_timer_t *t, bx_timer_queue_c *q, Bit64u *ticks)
+{
+  unsigned last = 0;
+
+  *ticks = q->topTimeToFire();
+  while (! q->empty() && q->topTimeToFire() == *ticks) {
+    unsigned i = q->topId();
+    t[i].timeToFire += t[i].period;
+    q->insert(i, t[i].timeToFire);
+    last = i;
+  }
+  return last;
+}
+
+// fire both implementations side by side and compare the results, also
+// with timers deactivated and reactivated in between
+unsigned check(unsigned n, unsigned expiries)
+{
+  test_timer_t *t1 = new test_timer_t[n], *t2 = new test_timer_t[n];
+  bx_timer_queue_c q;
+  unsigned errors = 0, e, i;
+  Bit64u ticks1, ticks2;
+
+  init_timers(t1, n);
+  init_timers(t2, n);
+  for (i = 0; i < n; i++) q.insert(i, t2[i].timeToFire);
+
+  for (e = 0; e < expiries && errors == 0; e++) {
+    unsigned last1 = linear_expire(t1, n, &ticks1);
+    unsigned last2 = queue_expire(t2, &q, &ticks2);
+    if (ticks1 != ticks2 || last1 != last2) {
+      printf("%u timers: expiry %u differs\n", n, e);
+      errors++;
+    }
+    // timer 0 stays active like the null timer
+    if ((e % 7) == 0 && n > 1) {
+      i = 1 + (rand() % (n - 1));
+      if (t1[i].active) {
+        t1[i].active = t2[i].active = 0;
+        q.remove(i);
+      } else {
+        t1[i].active = t2[i].active = 1;
+        t1[i].timeToFire = t2[i].timeToFire = ticks1 + t1[i].period;
+        q.insert(i, t2[i].timeToFire);
+      }
+    }
+  }
+  delete [] t1;
+  delete [] t2;
+  return errors;
+}
+
+double elapsed(clock_t start)
+{
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+void bench(unsigned n, unsigned expiries)
+{
+  test_timer_t *t = new test_timer_t[n];
+  bx_timer_queue_c q;
+  volatile unsigned sink = 0;
+  double t_linear, t_queue;
+  clock_t start;
+  Bit64u ticks;
+  unsigned e, i;
+
+  init_timers(t, n);
+  start = clock();
+  for (e = 0; e < expiries; e++) sink += linear_expire(t, n, &ticks);
+  t_linear = elapsed(start);
+
+  init_timers(t, n);
+  for (i = 0; i < n; i++) q.insert(i, t[i].timeToFire);
+  start = clock();
+  for (e = 0; e < expiries; e++) sink += queue_expire(t, &q, &ticks);
+  t_queue = elapsed(start);
+
+  printf("%5u timers: linear scan %6.1f M/s, queue %6.1f M/s\n", n,
+         expiries / t_linear / 1e6, expiries / t_queue / 1e6);
+  delete [] t;
+}
+
+int main(int argc, char *argv[])
+{
+  static const unsigned counts[] = { 1, 2, 16, 64, 256, 1024 };
+  unsigned rounds = 2000, errors = 0, i;
+
+  if (argc > 1) rounds = atoi(argv[1]);
+  for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    errors += check(counts[i], 100000);
+  }
+  printf("%u mismatches\n", errors);
+
+  if (rounds > 0) {
+    for (i = 2; i < sizeof(counts) / sizeof(counts[0]); i++) {
+      bench(counts[i], rounds * 1000);
+    }
+  }
+  return (errors > 0) ? 1 : 0;
+}
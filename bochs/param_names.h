@@ -41,11 +41,17 @@
 #define BXPN_CPU_MODEL                   "cpu.model"
 #define BXPN_IPS                         "cpu.ips"
 #define BXPN_SMP_QUANTUM                 "cpu.quantum"
+#define BXPN_SMP_HOST_THREADS            "cpu.host_threads"
+#define BXPN_SMP_THREAD_QUANTUM          "cpu.thread_quantum"
 #define BXPN_RESET_ON_TRIPLE_FAULT       "cpu.reset_on_triple_fault"
 #define BXPN_IGNORE_BAD_MSRS             "cpu.ignore_bad_msrs"
 #define BXPN_CONFIGURABLE_MSRS_PATH      "cpu.msrs"
 #define BXPN_CPUID_LIMIT_WINNT           "cpu.cpuid_limit_winnt"
 #define BXPN_MWAIT_IS_NOP                "cpu.mwait_is_nop"
+#define BXPN_ICACHE_ENTRIES              "cpu.icache_entries"
+#define BXPN_ICACHE_WAYS                 "cpu.icache_ways"
+#define BXPN_ICACHE_POOL                 "cpu.icache_pool"
+#define BXPN_ICACHE_FILE                 "cpu.icache_file"
 #define BXPN_VENDOR_STRING               "cpuid.vendor_string"
 #define BXPN_BRAND_STRING                "cpuid.brand_string"
 #define BXPN_CPUID_LEVEL                 "cpuid.level"
@@ -82,6 +88,8 @@
 #define BXPN_MEM_SIZE                    "memory.standard.ram.size"
 #define BXPN_HOST_MEM_SIZE               "memory.standard.ram.host_size"
 #define BXPN_MEM_BLOCK_SIZE              "memory.standard.ram.block_size"
+#define BXPN_MEM_BACKING                 "memory.standard.ram.backing"
+#define BXPN_MEM_FILE                    "memory.standard.ram.file"
 #define BXPN_ROMIMAGE                    "memory.standard.rom"
 #define BXPN_ROM_PATH                    "memory.standard.rom.file"
 #define BXPN_ROM_ADDRESS                 "memory.standard.rom.address"
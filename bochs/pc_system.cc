@@ -23,6 +23,7 @@
 #include "bochs.h"
 #include "cpu/cpu.h"
 #include "iodev/iodev.h"
+#include "iodev/virt_timer.h"
 #define LOG_THIS bx_pc_system.
 
 #if defined(PROVIDE_M_IPS)
@@ -35,8 +36,42 @@ double     m_ips; // Millions of Instructions Per Second
 #define SpewPeriodicTimerInfo 0
 #define MinAllowableTimerPeriod 1
 
+// Longest host sleep at once while all CPUs are idle
+#define BX_IDLE_WAIT_MAX_USEC 10000
+
 const Bit64u bx_pc_system_c::NullTimerInterval = 0xffffffff;
 
+#include "bxthread.h"
+
+// timer activations requested by other host threads (request_timer)
+#define BX_MAX_TIMER_REQUESTS 16
+
+struct bx_timer_request_t {
+  unsigned index;
+  Bit32u useconds;
+};
+
+static BX_MUTEX(timer_request_mutex);
+static bx_timer_request_t timer_requests[BX_MAX_TIMER_REQUESTS];
+static unsigned num_timer_requests = 0;
+
+#if BX_SUPPORT_SMP
+
+thread_local BX_CPU_C *bx_host_thread_cpu = NULL;
+
+struct bx_smp_request_t {
+  bx_smp_request_handler_t handler;
+  void *this_ptr;
+  Bit64u param1;
+  Bit64u param2;
+};
+
+static BX_MUTEX(smp_mutex);
+static bx_smp_request_t *smp_requests = NULL;
+static unsigned smp_num_requests = 0, smp_max_requests = 0;
+
+#endif
+
   // constructor
 bx_pc_system_c::bx_pc_system_c()
 {
@@ -44,6 +79,10 @@ bx_pc_system_c::bx_pc_system_c()
 
   BX_ASSERT(numTimers == 0);
 
+  timer.reserve(BX_TIMER_SLOTS_PER_CHUNK);
+  firedTimersSize = BX_TIMER_SLOTS_PER_CHUNK;
+  firedTimers = new unsigned [firedTimersSize];
+
   // Timer[0] is the null timer.  It is initialized as a special
   // case here.  It should never be turned off or modified, and its
   // duration should always remain the same.
@@ -55,12 +94,22 @@ bx_pc_system_c::bx_pc_system_c()
   timer[0].funct      = nullTimer;
   timer[0].this_ptr   = this;
   numTimers = 1; // So far, only the nullTimer.
+  timerRequests = 0;
+  BX_INIT_MUTEX(timer_request_mutex);
+
+#if BX_SUPPORT_SMP
+  smp_parallel = 0;
+  smp_sync_request = 0;
+  INTR_level = 0;
+  BX_INIT_RECURSIVE_MUTEX(smp_mutex);
+#endif
 }
 
 void bx_pc_system_c::initialize(Bit32u ips)
 {
   ticksTotal = 0;
   timer[0].timeToFire = NullTimerInterval;
+  activeTimers.insert(0, NullTimerInterval);
   currCountdown       = NullTimerInterval;
   currCountdownPeriod = NullTimerInterval;
   lastTimeUsec = 0;
@@ -78,8 +127,15 @@ void bx_pc_system_c::initialize(Bit32u ips)
 void bx_pc_system_c::set_HRQ(bool val)
 {
   HRQ = val;
-  if (val)
+  if (val) {
+#if BX_SUPPORT_SMP
+    if (smp_cpu_is_remote(BX_CPU(0))) {
+      smp_defer(smp_kick_cpu_handler, BX_CPU(0), 0, 0);
+      return;
+    }
+#endif
     BX_CPU(0)->async_event = 1;
+  }
 }
 
 void bx_pc_system_c::raise_INTR(void)
@@ -87,6 +143,14 @@ void bx_pc_system_c::raise_INTR(void)
   if (bx_dbg.interrupts)
     BX_INFO(("pc_system: Setting INTR=1 on bootstrap processor %d", BX_BOOTSTRAP_PROCESSOR));
 
+#if BX_SUPPORT_SMP
+  INTR_level = 1;
+  if (smp_cpu_is_remote(BX_CPU(BX_BOOTSTRAP_PROCESSOR))) {
+    smp_defer(smp_set_intr_handler, this, 0, 0);
+    return;
+  }
+#endif
+
   BX_CPU(BX_BOOTSTRAP_PROCESSOR)->raise_INTR();
 }
 
@@ -95,6 +159,14 @@ void bx_pc_system_c::clear_INTR(void)
   if (bx_dbg.interrupts)
     BX_INFO(("pc_system: Setting INTR=0 on bootstrap processor %d", BX_BOOTSTRAP_PROCESSOR));
 
+#if BX_SUPPORT_SMP
+  INTR_level = 0;
+  if (smp_cpu_is_remote(BX_CPU(BX_BOOTSTRAP_PROCESSOR))) {
+    smp_defer(smp_set_intr_handler, this, 0, 0);
+    return;
+  }
+#endif
+
   BX_CPU(BX_BOOTSTRAP_PROCESSOR)->clear_INTR();
 }
 
@@ -173,18 +245,40 @@ bool bx_pc_system_c::get_enable_a20(void)
 
 void bx_pc_system_c::MemoryMappingChanged(void)
 {
-  for (unsigned i=0; i<BX_SMP_PROCESSORS; i++)
+  for (unsigned i=0; i<BX_SMP_PROCESSORS; i++) {
+#if BX_SUPPORT_SMP
+    if (smp_cpu_is_remote(BX_CPU(i))) {
+      smp_defer(smp_tlb_flush_handler, BX_CPU(i), 0, 0);
+      continue;
+    }
+#endif
     BX_CPU(i)->TLB_flush();
+  }
 }
 
 void bx_pc_system_c::invlpg(bx_address addr)
 {
-  for (unsigned i=0; i<BX_SMP_PROCESSORS; i++)
+  for (unsigned i=0; i<BX_SMP_PROCESSORS; i++) {
+#if BX_SUPPORT_SMP
+    if (smp_cpu_is_remote(BX_CPU(i))) {
+      smp_defer(smp_tlb_invlpg_handler, BX_CPU(i), addr, 0);
+      continue;
+    }
+#endif
     BX_CPU(i)->TLB_invlpg(addr);
+  }
 }
 
 int bx_pc_system_c::Reset(unsigned type)
 {
+#if BX_SUPPORT_SMP
+  if (smp_parallel) {
+    // reset all CPUs and devices once the CPU threads are stopped
+    smp_defer(smp_reset_handler, this, type, 0);
+    return(0);
+  }
+#endif
+
   // type is BX_RESET_HARDWARE or BX_RESET_SOFTWARE
   BX_INFO(("bx_pc_system_c::Reset(%s) called",type==BX_RESET_HARDWARE?"HARDWARE":"SOFTWARE"));
 
@@ -208,9 +302,90 @@ Bit8u bx_pc_system_c::IAC(void)
   return DEV_pic_iac();
 }
 
+#if BX_SUPPORT_SMP
+
+void bx_pc_system_c::smp_lock_mutex(void)
+{
+  BX_LOCK(smp_mutex);
+}
+
+void bx_pc_system_c::smp_unlock_mutex(void)
+{
+  BX_UNLOCK(smp_mutex);
+}
+
+void bx_pc_system_c::smp_defer(bx_smp_request_handler_t handler, void *this_ptr, Bit64u param1, Bit64u param2)
+{
+  BX_LOCK(smp_mutex);
+  if (smp_num_requests == smp_max_requests) {
+    smp_max_requests = smp_max_requests ? (smp_max_requests * 2) : 64;
+    smp_requests = (bx_smp_request_t *) realloc(smp_requests, smp_max_requests * sizeof(bx_smp_request_t));
+    if (smp_requests == NULL)
+      BX_PANIC(("smp_defer: out of memory"));
+  }
+  bx_smp_request_t *req = &smp_requests[smp_num_requests++];
+  req->handler  = handler;
+  req->this_ptr = this_ptr;
+  req->param1   = param1;
+  req->param2   = param2;
+  smp_sync_request = 1;
+  BX_UNLOCK(smp_mutex);
+}
+
+void bx_pc_system_c::smp_run_deferred(void)
+{
+  // called by the main thread while all CPU threads are parked, so the
+  // requests are executed directly and can't be deferred again
+  BX_ASSERT(! smp_parallel);
+
+  for (unsigned n=0; n < smp_num_requests; n++) {
+    bx_smp_request_t *req = &smp_requests[n];
+    req->handler(req->this_ptr, req->param1, req->param2);
+  }
+  smp_num_requests = 0;
+  smp_sync_request = 0;
+}
+
+void bx_pc_system_c::smp_set_intr_handler(void *this_ptr, Bit64u param1, Bit64u param2)
+{
+  // apply the most recent INTR line state, requests might arrive out of order
+  bx_pc_system_c *class_ptr = (bx_pc_system_c *) this_ptr;
+  if (class_ptr->INTR_level)
+    BX_CPU(BX_BOOTSTRAP_PROCESSOR)->raise_INTR();
+  else
+    BX_CPU(BX_BOOTSTRAP_PROCESSOR)->clear_INTR();
+}
+
+void bx_pc_system_c::smp_kick_cpu_handler(void *this_ptr, Bit64u param1, Bit64u param2)
+{
+  ((BX_CPU_C *) this_ptr)->async_event = 1;
+}
+
+void bx_pc_system_c::smp_tlb_flush_handler(void *this_ptr, Bit64u param1, Bit64u param2)
+{
+  ((BX_CPU_C *) this_ptr)->TLB_flush();
+}
+
+void bx_pc_system_c::smp_tlb_invlpg_handler(void *this_ptr, Bit64u param1, Bit64u param2)
+{
+  ((BX_CPU_C *) this_ptr)->TLB_invlpg((bx_address) param1);
+}
+
+void bx_pc_system_c::smp_reset_handler(void *this_ptr, Bit64u param1, Bit64u param2)
+{
+  ((bx_pc_system_c *) this_ptr)->Reset((unsigned) param1);
+}
+
+#endif
+
 void bx_pc_system_c::exit(void)
 {
   // delete all registered timers (exception: null timer and APIC timer)
+  for (unsigned i = 1 + BX_SUPPORT_APIC; i < numTimers; i++) {
+    activeTimers.remove(i);
+    timer[i].inUse  = 0;
+    timer[i].active = 0;
+  }
   numTimers = 1 + BX_SUPPORT_APIC;
   bx_devices.exit();
   if (bx_gui) {
@@ -232,9 +407,10 @@ void bx_pc_system_c::register_state(void)
   BXRS_PARAM_BOOL(list, HRQ, HRQ);
 
   bx_list_c *timers = new bx_list_c(list, "timer");
+  timers->set_restore_handler(this, timer_restore_handler);
   for (unsigned i = 0; i < numTimers; i++) {
-    char name[4];
-    sprintf(name, "%u", i);
+    char name[16];
+    snprintf(name, sizeof(name), "%u", i);
     bx_list_c *bxtimer = new bx_list_c(timers, name);
     BXRS_PARAM_BOOL(bxtimer, inUse, timer[i].inUse);
     BXRS_DEC_PARAM_FIELD(bxtimer, period, timer[i].period);
@@ -245,6 +421,18 @@ void bx_pc_system_c::register_state(void)
   }
 }
 
+void bx_pc_system_c::timer_restore_handler(void *devptr, bx_list_c *list)
+{
+  bx_pc_system_c *class_ptr = (bx_pc_system_c *) devptr;
+
+  // rebuild the queue from the restored timer state
+  class_ptr->activeTimers.clear();
+  for (unsigned i = 0; i < class_ptr->numTimers; i++) {
+    if (class_ptr->timer[i].inUse && class_ptr->timer[i].active)
+      class_ptr->activeTimers.insert(i, class_ptr->timer[i].timeToFire);
+  }
+}
+
 // ================================================
 // Bochs internal timer delivery framework features
 // ================================================
@@ -277,10 +465,11 @@ int bx_pc_system_c::register_timer_ticks(void* this_ptr, bx_timer_handler_t func
       break;
   }
 
-  if (numTimers >= BX_MAX_TIMERS) {
+  if (i >= BX_NULL_TIMER_HANDLE) {
     BX_PANIC(("register_timer: too many registered timers"));
     return -1;
   }
+  timer.reserve(i + 1);
 #if BX_TIMER_DEBUG
   if (this_ptr == NULL)
     BX_PANIC(("register_timer_ticks: this_ptr is NULL!"));
@@ -300,6 +489,7 @@ int bx_pc_system_c::register_timer_ticks(void* this_ptr, bx_timer_handler_t func
   timer[i].param      = 0;
 
   if (active) {
+    activeTimers.insert(i, timer[i].timeToFire);
     if (ticks < Bit64u(currCountdown)) {
       // This new timer needs to fire before the current countdown.
       // Skew the current countdown and countdown period to be smaller
@@ -320,9 +510,7 @@ int bx_pc_system_c::register_timer_ticks(void* this_ptr, bx_timer_handler_t func
 
 void bx_pc_system_c::countdownEvent(void)
 {
-  unsigned i, first = numTimers, last = 0;
-  Bit64u   minTimeToFire;
-  bool  triggered[BX_MAX_TIMERS];
+  unsigned i, n, numFired = 0;
 
   // The countdown decremented to 0.  We need to service all the active
   // timers, and invoke callbacks from those timers which have fired.
@@ -334,36 +522,33 @@ void bx_pc_system_c::countdownEvent(void)
   // Increment global ticks counter by number of ticks which have
   // elapsed since the last update.
   ticksTotal += Bit64u(currCountdownPeriod);
-  minTimeToFire = (Bit64u) -1;
 
-  for (i = 0; i < numTimers; i++) {
-    triggered[i] = 0; // Reset triggered flag.
-    if (timer[i].active) {
+  // Take the expired timers from the head of the queue, they come out
+  // ordered by timer ID.
+  while (activeTimers.topTimeToFire() <= ticksTotal) {
+    i = activeTimers.topId();
 #if BX_TIMER_DEBUG
-      if (ticksTotal > timer[i].timeToFire)
-        BX_PANIC(("countdownEvent: ticksTotal > timeToFire[%u], D " FMT_LL "u", i,
-                  timer[i].timeToFire-ticksTotal));
+    if (ticksTotal > timer[i].timeToFire)
+      BX_PANIC(("countdownEvent: ticksTotal > timeToFire[%u], D " FMT_LL "u", i,
+                timer[i].timeToFire-ticksTotal));
 #endif
-      if (ticksTotal == timer[i].timeToFire) {
-        // This timer is ready to fire.
-        triggered[i] = 1;
-
-        if (timer[i].continuous==0) {
-          // If triggered timer is one-shot, deactive.
-          timer[i].active = 0;
-        } else {
-          // Continuous timer, increment time-to-fire by period.
-          timer[i].timeToFire += timer[i].period;
-          if (timer[i].timeToFire < minTimeToFire)
-            minTimeToFire = timer[i].timeToFire;
-        }
-        if (i < first) first = i;
-        last = i;
-      } else {
-        // This timer is not ready to fire yet.
-        if (timer[i].timeToFire < minTimeToFire)
-          minTimeToFire = timer[i].timeToFire;
-      }
+    if (numFired == firedTimersSize) {
+      unsigned *newFired = new unsigned [firedTimersSize * 2];
+      memcpy(newFired, firedTimers, firedTimersSize * sizeof(unsigned));
+      delete [] firedTimers;
+      firedTimers = newFired;
+      firedTimersSize *= 2;
+    }
+    firedTimers[numFired++] = i;
+
+    if (timer[i].continuous==0) {
+      // If triggered timer is one-shot, deactive.
+      timer[i].active = 0;
+      activeTimers.remove(i);
+    } else {
+      // Continuous timer, increment time-to-fire by period.
+      timer[i].timeToFire += timer[i].period;
+      activeTimers.insert(i, timer[i].timeToFire);
     }
   }
 
@@ -371,17 +556,51 @@ void bx_pc_system_c::countdownEvent(void)
   // any of the callbacks, as they may call timer features, which need
   // to be advanced to the next countdown cycle.
   currCountdown = currCountdownPeriod =
-      Bit32u(minTimeToFire - ticksTotal);
+      Bit32u(activeTimers.topTimeToFire() - ticksTotal);
 
-  for (i = first; i <= last; i++) {
+  for (n = 0; n < numFired; n++) {
     // Call requested timer function.  It may request a different
     // timer period or deactivate etc.
-    if (triggered[i] && (timer[i].funct != NULL)) {
+    i = firedTimers[n];
+    if (timer[i].funct != NULL) {
       triggeredTimer = i;
       timer[i].funct(timer[i].this_ptr);
       triggeredTimer = 0;
     }
   }
+
+  if (timerRequests)
+    serve_timer_requests();
+}
+
+void bx_pc_system_c::serve_timer_requests(void)
+{
+  bx_timer_request_t requests[BX_MAX_TIMER_REQUESTS];
+  unsigned n, count;
+
+  BX_LOCK(timer_request_mutex);
+  bx_atomic_store32(&timerRequests, 0);
+  count = num_timer_requests;
+  memcpy(requests, timer_requests, count * sizeof(bx_timer_request_t));
+  num_timer_requests = 0;
+  BX_UNLOCK(timer_request_mutex);
+
+  for (n = 0; n < count; n++) {
+    if (timer[requests[n].index].inUse)
+      activate_timer_within(requests[n].index, requests[n].useconds);
+  }
+}
+
+void bx_pc_system_c::idle_fast_forward(void)
+{
+  // a host thread might want a timer before the next event
+  if (timerRequests)
+    serve_timer_requests();
+  // with realtime synchronization the host sleeps until the next realtime
+  // event is due, the wait is limited to keep the GUI responsive
+  bx_virt_timer.realtime_idle_wait(activeTimers.topId(), BX_IDLE_WAIT_MAX_USEC);
+  tickn(currCountdown);
+  bx_virt_timer.realtime_idle_update();
 }
 
 void bx_pc_system_c::nullTimer(void* this_ptr)
@@ -490,10 +709,13 @@ void bx_pc_system_c::activate_timer_ticks(unsigned i, Bit64u ticks, bool continu
     ticks = MinAllowableTimerPeriod;
   }
 
+  smp_lock();
+
   timer[i].period = ticks;
   timer[i].timeToFire = (ticksTotal + Bit64u(currCountdownPeriod-currCountdown)) + ticks;
   timer[i].active     = 1;
   timer[i].continuous = continuous;
+  activeTimers.insert(i, timer[i].timeToFire);
 
   if (ticks < Bit64u(currCountdown)) {
     // This new timer needs to fire before the current countdown.
@@ -502,6 +724,8 @@ void bx_pc_system_c::activate_timer_ticks(unsigned i, Bit64u ticks, bool continu
     currCountdownPeriod -= (currCountdown - Bit32u(ticks));
     currCountdown = Bit32u(ticks);
   }
+
+  smp_unlock();
 }
 
 void bx_pc_system_c::activate_timer(unsigned i, Bit32u useconds, bool continuous)
@@ -515,6 +739,8 @@ void bx_pc_system_c::activate_timer(unsigned i, Bit32u useconds, bool continuous
     BX_PANIC(("activate_timer: timer 0 is the nullTimer!"));
 #endif
 
+  smp_lock();
+
   // if useconds = 0, use default stored in period field
   // else set new period from useconds
   if (useconds==0) {
@@ -533,12 +759,16 @@ void bx_pc_system_c::activate_timer(unsigned i, Bit32u useconds, bool continuous
   }
 
   activate_timer_ticks(i, ticks, continuous);
+
+  smp_unlock();
 }
 
 void bx_pc_system_c::activate_timer_nsec(unsigned i, Bit64u nseconds, bool continuous)
 {
   Bit64u ticks;
 
+  smp_lock();
+
   // if nseconds = 0, use default stored in period field
   // else set new period from useconds
   if (nseconds==0) {
@@ -557,6 +787,8 @@ void bx_pc_system_c::activate_timer_nsec(unsigned i, Bit64u nseconds, bool conti
   }
 
   activate_timer_ticks(i, ticks, continuous);
+
+  smp_unlock();
 }
 
 void bx_pc_system_c::deactivate_timer(unsigned i)
@@ -568,7 +800,44 @@ void bx_pc_system_c::deactivate_timer(unsigned i)
     BX_PANIC(("deactivate_timer: timer 0 is the nullTimer!"));
 #endif
 
+  smp_lock();
   timer[i].active = 0;
+  activeTimers.remove(i);
+  smp_unlock();
+}
+
+void bx_pc_system_c::activate_timer_within(unsigned i, Bit32u useconds)
+{
+  Bit64u ticks = (Bit64u) (double(useconds) * m_ips);
+
+  if (timer[i].active && (timer[i].timeToFire <= (time_ticks() + ticks)))
+    return;
+  activate_timer(i, useconds, 0);
+}
+
+// called by other host threads, the timer functions are not thread safe
+void bx_pc_system_c::request_timer(unsigned i, Bit32u useconds)
+{
+  unsigned n;
+
+  BX_LOCK(timer_request_mutex);
+  for (n = 0; n < num_timer_requests; n++) {
+    if (timer_requests[n].index == i) break;
+  }
+  if (n == num_timer_requests) {
+    if (n == BX_MAX_TIMER_REQUESTS) {
+      BX_UNLOCK(timer_request_mutex);
+      BX_PANIC(("request_timer: too many pending timer requests"));
+      return;
+    }
+    timer_requests[n].index = i;
+    timer_requests[n].useconds = useconds;
+    num_timer_requests++;
+  } else if (useconds < timer_requests[n].useconds) {
+    timer_requests[n].useconds = useconds;
+  }
+  bx_atomic_store32(&timerRequests, 1);
+  BX_UNLOCK(timer_request_mutex);
 }
 
 bool bx_pc_system_c::unregisterTimer(unsigned timerIndex)
@@ -23,11 +23,55 @@
 #ifndef BX_PCSYS_H
 #define BX_PCSYS_H
 
-#define BX_MAX_TIMERS 64
+#include "timerq.h"
+
 #define BX_NULL_TIMER_HANDLE 10000
 
 typedef void (*bx_timer_handler_t)(void *);
 
+// Storage for timer slots growing on demand. The slots are allocated in
+// chunks which never move, so their fields can be registered as save/restore
+// parameters while more timers are added.
+#define BX_TIMER_SLOTS_PER_CHUNK 64
+
+template <class T> class bx_timer_slots_c {
+  T **chunks;
+  unsigned numChunks;
+public:
+  bx_timer_slots_c(): chunks(NULL), numChunks(0) {}
+ ~bx_timer_slots_c() {
+    for (unsigned n = 0; n < numChunks; n++)
+      delete [] chunks[n];
+    delete [] chunks;
+  }
+  BX_CPP_INLINE T& operator[](unsigned i) {
+    return chunks[i / BX_TIMER_SLOTS_PER_CHUNK][i % BX_TIMER_SLOTS_PER_CHUNK];
+  }
+  BX_CPP_INLINE unsigned capacity(void) const {
+    return numChunks * BX_TIMER_SLOTS_PER_CHUNK;
+  }
+  // make sure slots 0 .. n-1 exist, new slots are zero filled
+  void reserve(unsigned n) {
+    if (n <= capacity()) return;
+    unsigned newChunks = (n + BX_TIMER_SLOTS_PER_CHUNK - 1) / BX_TIMER_SLOTS_PER_CHUNK;
+    T **newptr = new T* [newChunks];
+    for (unsigned i = 0; i < newChunks; i++)
+      newptr[i] = (i < numChunks) ? chunks[i] : new T[BX_TIMER_SLOTS_PER_CHUNK]();
+    delete [] chunks;
+    chunks = newptr;
+    numChunks = newChunks;
+  }
+};
+
+
+#if BX_SUPPORT_SMP
+typedef void (*bx_smp_request_handler_t)(void *this_ptr, Bit64u param1, Bit64u param2);
+
+class BX_CPU_C;
+// CPU owned by the current host thread in threaded SMP simulation, NULL otherwise
+extern thread_local BX_CPU_C *bx_host_thread_cpu;
+#endif
+
 BOCHSAPI extern class bx_pc_system_c bx_pc_system;
 
 #ifdef PROVIDE_M_IPS
@@ -41,7 +85,7 @@ private:
   // Timer oriented private features
   // ===============================
 
-  struct {
+  struct timer_slot_t {
     bool inUse;      // Timer slot is in-use (currently registered).
     Bit64u  period;     // Timer periodocity in cpu ticks.
     Bit64u  timeToFire; // Time to fire next (in absolute ticks).
@@ -54,15 +98,20 @@ private:
 #define BxMaxTimerIDLen 32
     char id[BxMaxTimerIDLen];  // String ID of timer.
     Bit32u param;              // Device-specific value assigned to timer (optional)
-  } timer[BX_MAX_TIMERS];
+  };
+  bx_timer_slots_c<timer_slot_t> timer;
+  bx_timer_queue_c activeTimers; // active timers ordered by time to fire
 
   unsigned   numTimers;  // Number of currently allocated timers.
   unsigned   triggeredTimer;  // ID of the actually triggered timer.
+  unsigned  *firedTimers;     // IDs of the timers expired in countdownEvent()
+  unsigned   firedTimersSize;
   Bit32u     currCountdown; // Current countdown ticks value (decrements to 0).
   Bit32u     currCountdownPeriod; // Length of current countdown period.
   Bit64u     ticksTotal; // Num ticks total since start of emulator execution.
   Bit64u     lastTimeUsec; // Last sequentially read time in usec.
   Bit64u     usecSinceLast; // Number of useconds claimed since then.
+  volatile Bit32u timerRequests; // request_timer() called since the last check
 
   // A special null timer is always inserted in the timer[0] slot.  This
   // make sure that at least one timer is always active, and that the
@@ -70,6 +119,7 @@ private:
   // counter can be used for the current countdown.
   static const Bit64u NullTimerInterval;
   static void nullTimer(void* this_ptr);
+  static void timer_restore_handler(void *devptr, bx_list_c *list);
 
 #if !defined(PROVIDE_M_IPS)
   // This is the emulator speed, as measured in millions of
@@ -81,6 +131,7 @@ private:
   // This handler is called when the function which decrements the clock
   // ticks finds that an event has occurred.
   void   countdownEvent(void);
+  void   serve_timer_requests(void);
 
 public:
 
@@ -97,6 +148,13 @@ public:
   void   activate_timer(unsigned timer_index, Bit32u useconds, bool continuous);
   void   activate_timer_nsec(unsigned timer_index, Bit64u nseconds, bool continuous);
   void   deactivate_timer(unsigned timer_index);
+  // Activate the timer as one-shot timer firing in 'useconds', unless it is
+  // already active and fires earlier
+  void   activate_timer_within(unsigned timer_index, Bit32u useconds);
+  // Same for host threads other than the emulation thread (e.g. the network
+  // I/O thread). The request is served at the next timer event or when the
+  // idle CPUs skip to the next event.
+  void   request_timer(unsigned timer_index, Bit32u useconds);
   unsigned triggeredTimerID(void) {
     return triggeredTimer;
   }
@@ -109,6 +167,11 @@ public:
     }
   }
   static BX_CPP_INLINE void tickn(Bit32u n) {
+#if BX_SUPPORT_SMP
+    // when the CPUs run on their own host threads the emulated time is
+    // advanced only by the main thread between the synchronization points
+    if (bx_pc_system.smp_parallel) return;
+#endif
     while (n >= bx_pc_system.currCountdown) {
       n -= bx_pc_system.currCountdown;
       bx_pc_system.currCountdown = 0;
@@ -119,6 +182,9 @@ public:
     // the remaining requested ticks and continue.
     bx_pc_system.currCountdown -= n;
   }
+  // Called when all CPUs are idle: advance the emulated time straight to the
+  // next timer deadline, nothing can happen in between.
+  void idle_fast_forward(void);
 
   int register_timer_ticks(void* this_ptr, bx_timer_handler_t, Bit64u ticks,
                            bool continuous, bool active, const char *id);
@@ -186,6 +252,48 @@ public:
   void    invlpg(bx_address addr);    // flush TLB page in all CPUs
   void    exit(void);
   void    register_state(void);
+
+  // ===========================
+  // Threaded SMP support
+  // ===========================
+
+#if BX_SUPPORT_SMP
+  // Set while the CPUs run concurrently on their own host threads. Changed
+  // only by the main thread while all CPU threads are parked.
+  volatile bool smp_parallel;
+  // Set by a CPU thread to stop all CPUs at the end of their current trace,
+  // so the deferred requests are processed by the main thread.
+  volatile bool smp_sync_request;
+
+  // Serializes device, timer and memory handler accesses between CPU threads
+  BX_CPP_INLINE void smp_lock(void) { if (smp_parallel) smp_lock_mutex(); }
+  BX_CPP_INLINE void smp_unlock(void) { if (smp_parallel) smp_unlock_mutex(); }
+  void smp_lock_mutex(void);
+  void smp_unlock_mutex(void);
+
+  // The CPU runs on another host thread and its state can't be touched now
+  BX_CPP_INLINE bool smp_cpu_is_remote(BX_CPU_C *cpu) const {
+    return smp_parallel && cpu != bx_host_thread_cpu;
+  }
+
+  // Queue a request for the main thread to run once all CPUs are stopped
+  void smp_defer(bx_smp_request_handler_t handler, void *this_ptr, Bit64u param1, Bit64u param2);
+  void smp_run_deferred(void);
+#else
+  BX_CPP_INLINE void smp_lock(void) {}
+  BX_CPP_INLINE void smp_unlock(void) {}
+#endif
+
+private:
+#if BX_SUPPORT_SMP
+  bool INTR_level; // last INTR line state requested for the bootstrap processor
+
+  static void smp_set_intr_handler(void *this_ptr, Bit64u param1, Bit64u param2);
+  static void smp_kick_cpu_handler(void *this_ptr, Bit64u param1, Bit64u param2);
+  static void smp_tlb_flush_handler(void *this_ptr, Bit64u param1, Bit64u param2);
+  static void smp_tlb_invlpg_handler(void *this_ptr, Bit64u param1, Bit64u param2);
+  static void smp_reset_handler(void *this_ptr, Bit64u param1, Bit64u param2);
+#endif
 };
 
 #define BX_TICK1()                  bx_pc_system.tick1()
@@ -181,7 +181,7 @@ extern "C" {
 #define DEV_hd_write_handler(a, b, c, d) \
     (bx_devices.pluginHardDrive->virt_write_handler(b, c, d))
 #define DEV_hd_bmdma_read_sector(a,b,c) bx_devices.pluginHardDrive->bmdma_read_sector(a,b,c)
-#define DEV_hd_bmdma_write_sector(a,b) bx_devices.pluginHardDrive->bmdma_write_sector(a,b)
+#define DEV_hd_bmdma_write_sector(a,b,c) bx_devices.pluginHardDrive->bmdma_write_sector(a,b,c)
 #define DEV_hd_bmdma_complete(a) bx_devices.pluginHardDrive->bmdma_complete(a)
 
 #define DEV_bulk_io_quantum_requested() (bx_devices.bulkIOQuantumsRequested)
@@ -487,6 +487,7 @@ PLUGIN_ENTRY_FOR_IMG_MODULE(vmware3);
 PLUGIN_ENTRY_FOR_IMG_MODULE(vmware4);
 PLUGIN_ENTRY_FOR_IMG_MODULE(vbox);
 PLUGIN_ENTRY_FOR_IMG_MODULE(vpc);
+PLUGIN_ENTRY_FOR_IMG_MODULE(qcow2);
 PLUGIN_ENTRY_FOR_IMG_MODULE(vvfat);
 
 #endif
@@ -0,0 +1,161 @@
+/////////////////////////////////////////////////////////////////////////
+// $Id$
+/////////////////////////////////////////////////////////////////////////
+//
+//  Copyright (C) 2021  The Bochs Project
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+//
+/////////////////////////////////////////////////////////////////////////
+
+//  timerq.h  - time ordered queue of the active system / virtual timers
+//  (also used by misc/test-timer-queue.cc)
+
+#ifndef BX_TIMERQ_H
+#define BX_TIMERQ_H
+
+#include <string.h>
+
+// Queue of the active timers ordered by time to fire, implemented as binary
+// min-heap. Timers expiring at the same time are ordered by their IDs, so
+// they fire in the same order as with a linear scan of the timer slots.
+class bx_timer_queue_c {
+public:
+  bx_timer_queue_c(): heap(NULL), size(0), heapSize(0), pos(NULL), maxId(0) {}
+ ~bx_timer_queue_c() {
+    delete [] heap;
+    delete [] pos;
+  }
+
+  // insert the timer or move it to the new position if already queued
+  void   insert(unsigned id, Bit64u timeToFire);
+  void   remove(unsigned id);
+  void   clear(void);
+
+  BX_CPP_INLINE bool contains(unsigned id) const {
+    return (id < maxId) && (pos[id] != 0);
+  }
+  BX_CPP_INLINE bool empty(void) const { return size == 0; }
+  BX_CPP_INLINE unsigned topId(void) const { return heap[0].id; }
+  BX_CPP_INLINE Bit64u topTimeToFire(void) const { return heap[0].timeToFire; }
+
+private:
+  struct entry_t {
+    Bit64u timeToFire;
+    unsigned id;
+  } *heap;
+  unsigned size, heapSize;
+  unsigned *pos;  // heap index + 1 of the timer, 0 if not queued
+  unsigned maxId;
+
+  static BX_CPP_INLINE bool before(const entry_t &a, const entry_t &b) {
+    return (a.timeToFire < b.timeToFire) ||
+           (a.timeToFire == b.timeToFire && a.id < b.id);
+  }
+  BX_CPP_INLINE void place(unsigned n, const entry_t &e) {
+    heap[n] = e;
+    pos[e.id] = n + 1;
+  }
+  void sift_up(unsigned n, entry_t e);
+  void sift_down(unsigned n, entry_t e);
+};
+
+BX_CPP_INLINE void bx_timer_queue_c::insert(unsigned id, Bit64u timeToFire)
+{
+  entry_t e;
+  e.timeToFire = timeToFire;
+  e.id = id;
+
+  if (id >= maxId) {
+    unsigned newMaxId = (id + 1 > maxId * 2) ? (id + 1) : (maxId * 2);
+    unsigned *newPos = new unsigned [newMaxId];
+    memset(newPos, 0, newMaxId * sizeof(unsigned));
+    if (pos != NULL)
+      memcpy(newPos, pos, maxId * sizeof(unsigned));
+    delete [] pos;
+    pos = newPos;
+    maxId = newMaxId;
+  }
+
+  if (pos[id]) {
+    // already queued, move it up or down to the new position
+    unsigned n = pos[id] - 1;
+    if (before(e, heap[n]))
+      sift_up(n, e);
+    else
+      sift_down(n, e);
+    return;
+  }
+
+  if (size == heapSize) {
+    unsigned newHeapSize = heapSize ? (heapSize * 2) : 64;
+    entry_t *newHeap = new entry_t [newHeapSize];
+    if (heap != NULL)
+      memcpy(newHeap, heap, size * sizeof(entry_t));
+    delete [] heap;
+    heap = newHeap;
+    heapSize = newHeapSize;
+  }
+  sift_up(size++, e);
+}
+
+BX_CPP_INLINE void bx_timer_queue_c::remove(unsigned id)
+{
+  if (! contains(id)) return;
+
+  unsigned n = pos[id] - 1;
+  pos[id] = 0;
+  entry_t last = heap[--size];
+  if (n == size) return;
+  // fill the hole with the last entry
+  if (before(last, heap[n]))
+    sift_up(n, last);
+  else
+    sift_down(n, last);
+}
+
+BX_CPP_INLINE void bx_timer_queue_c::clear(void)
+{
+  for (unsigned n = 0; n < size; n++)
+    pos[heap[n].id] = 0;
+  size = 0;
+}
+
+BX_CPP_INLINE void bx_timer_queue_c::sift_up(unsigned n, entry_t e)
+{
+  while (n > 0) {
+    unsigned parent = (n - 1) / 2;
+    if (! before(e, heap[parent])) break;
+    place(n, heap[parent]);
+    n = parent;
+  }
+  place(n, e);
+}
+
+BX_CPP_INLINE void bx_timer_queue_c::sift_down(unsigned n, entry_t e)
+{
+  for (;;) {
+    unsigned child = 2 * n + 1;
+    if (child >= size) break;
+    if ((child + 1) < size && before(heap[child + 1], heap[child]))
+      child++;
+    if (! before(heap[child], e)) break;
+    place(n, heap[child]);
+    n = child;
+  }
+  place(n, e);
+}
+
+#endif